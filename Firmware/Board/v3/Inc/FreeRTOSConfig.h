@@ -107,6 +107,7 @@
 #define configUSE_MUTEXES                        1
 #define configQUEUE_REGISTRY_SIZE                8
 #define configCHECK_FOR_STACK_OVERFLOW           1
+#define configUSE_MALLOC_FAILED_HOOK             1
 #define configUSE_PORT_OPTIMISED_TASK_SELECTION  1
 #define configRECORD_STACK_HIGH_ADDRESS          1
 
@@ -125,6 +126,7 @@ to exclude the API function. */
 #define INCLUDE_vTaskDelay                  1
 #define INCLUDE_xTaskGetSchedulerState      1
 #define INCLUDE_uxTaskGetStackHighWaterMark 1
+#define INCLUDE_xTaskGetIdleTaskHandle      1
 
 /* Cortex-M specific definitions. */
 #ifdef __NVIC_PRIO_BITS
@@ -169,6 +171,17 @@ standard names. */
 /* USER CODE BEGIN Defines */   	      
 /* Section where parameter definitions can be added (for instance, to override default ones in FreeRTOS.h) */
 #define configAPPLICATION_ALLOCATED_HEAP 1 // ucHeap allocated in freertos.c
+
+/* Run-time stats are counted in CPU cycles by the DWT cycle counter, which is
+   also used by the motor timing log. The counters wrap after 2^32 cycles (25s),
+   so only differences over shorter intervals are meaningful. */
+#define configUSE_TRACE_FACILITY                 1
+#define configGENERATE_RUN_TIME_STATS            1
+#define portCONFIGURE_TIMER_FOR_RUN_TIME_STATS() do { \
+        (*(volatile uint32_t*)0xE000EDFC) |= (1UL << 24); /* CoreDebug->DEMCR |= TRCENA */ \
+        (*(volatile uint32_t*)0xE0001000) |= 1UL;         /* DWT->CTRL |= CYCCNTENA */ \
+    } while (0)
+#define portGET_RUN_TIME_COUNTER_VALUE()         (*(volatile uint32_t*)0xE0001004) /* DWT->CYCCNT */
 /* USER CODE END Defines */ 
 
 #endif /* FREERTOS_CONFIG_H */
@@ -5,8 +5,10 @@
 // List of semaphores
 extern osSemaphoreId sem_usb_irq;
 extern osSemaphoreId sem_uart_dma;
-extern osSemaphoreId sem_usb_rx;
-extern osSemaphoreId sem_usb_tx;
+extern osSemaphoreId sem_usb_rx_cdc;
+extern osSemaphoreId sem_usb_rx_native;
+extern osSemaphoreId sem_usb_tx_cdc;
+extern osSemaphoreId sem_usb_tx_native;
 
 extern osThreadId defaultTaskHandle;
 extern osThreadId usb_irq_thread;
@@ -121,6 +121,10 @@
 extern USBD_CDC_ItfTypeDef USBD_Interface_fops_FS;
 
 /* USER CODE BEGIN EXPORTED_VARIABLES */
+/* Each OUT endpoint has two receive buffers, such that the next packet can be
+   received while the previous one is still being processed. */
+extern uint8_t CDCRxBufferFS[2][APP_RX_DATA_SIZE];
+extern uint8_t ODRIVERxBufferFS[2][APP_RX_DATA_SIZE];
 /* USER CODE END EXPORTED_VARIABLES */
 
 /**
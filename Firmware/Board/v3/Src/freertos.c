@@ -83,8 +83,10 @@ int load_configuration(void);
 // List of semaphores
 osSemaphoreId sem_usb_irq;
 osSemaphoreId sem_uart_dma;
-osSemaphoreId sem_usb_rx;
-osSemaphoreId sem_usb_tx;
+osSemaphoreId sem_usb_rx_cdc;
+osSemaphoreId sem_usb_rx_native;
+osSemaphoreId sem_usb_tx_cdc;
+osSemaphoreId sem_usb_tx_native;
 
 osThreadId usb_irq_thread;
 
@@ -178,14 +180,19 @@ void MX_FREERTOS_Init(void) {
   osSemaphoreDef(sem_uart_dma);
   sem_uart_dma = osSemaphoreCreate(osSemaphore(sem_uart_dma), 1);
 
-  // Create a semaphore for USB RX
-  osSemaphoreDef(sem_usb_rx);
-  sem_usb_rx = osSemaphoreCreate(osSemaphore(sem_usb_rx), 1);
-  osSemaphoreWait(sem_usb_rx, 0);  // Remove a token.
-
-  // Create a semaphore for USB TX
-  osSemaphoreDef(sem_usb_tx);
-  sem_usb_tx = osSemaphoreCreate(osSemaphore(sem_usb_tx), 1);
+  // Create the USB RX semaphores, one per interface
+  osSemaphoreDef(sem_usb_rx_cdc);
+  sem_usb_rx_cdc = osSemaphoreCreate(osSemaphore(sem_usb_rx_cdc), 1);
+  osSemaphoreWait(sem_usb_rx_cdc, 0);  // Remove a token.
+  osSemaphoreDef(sem_usb_rx_native);
+  sem_usb_rx_native = osSemaphoreCreate(osSemaphore(sem_usb_rx_native), 1);
+  osSemaphoreWait(sem_usb_rx_native, 0);  // Remove a token.
+
+  // Create the USB TX semaphores, one per interface
+  osSemaphoreDef(sem_usb_tx_cdc);
+  sem_usb_tx_cdc = osSemaphoreCreate(osSemaphore(sem_usb_tx_cdc), 1);
+  osSemaphoreDef(sem_usb_tx_native);
+  sem_usb_tx_native = osSemaphoreCreate(osSemaphore(sem_usb_tx_native), 1);
 
   init_deferred_interrupts();
 
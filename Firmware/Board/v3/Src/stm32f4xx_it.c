@@ -38,6 +38,7 @@
 
 /* USER CODE BEGIN 0 */
 #include "freertos_vars.h"
+#include <communication/interface_uart.h>
 #include <stdbool.h>
 
 typedef void (*ADC_handler_t)(ADC_HandleTypeDef* hadc, bool injected);
@@ -55,6 +56,10 @@ void pwm_in_cb(int channel, uint32_t timestamp);
 extern TIM_HandleTypeDef htim1;
 extern I2C_HandleTypeDef hi2c1;
 
+// [CPU cycles] time spent in the control related interrupts, wraps around
+volatile uint32_t adc_isr_cycles = 0;
+volatile uint32_t tim_update_isr_cycles = 0;
+
 /* USER CODE END 0 */
 
 /* External variables --------------------------------------------------------*/
@@ -271,6 +276,7 @@ void DMA1_Stream5_IRQHandler(void)
 void ADC_IRQHandler(void)
 {
   /* USER CODE BEGIN ADC_IRQn 0 */
+  uint32_t start_cycles = DWT->CYCCNT;
 
   // The HAL's ADC handling mechanism adds many clock cycles of overhead
   // So we bypass it and handle the logic ourselves.
@@ -279,6 +285,8 @@ void ADC_IRQHandler(void)
   ADC_IRQ_Dispatch(&hadc2, &pwm_trig_adc_cb);
   ADC_IRQ_Dispatch(&hadc3, &pwm_trig_adc_cb);
 
+  adc_isr_cycles += DWT->CYCCNT - start_cycles;
+
   // Bypass HAL
   return;
 
@@ -399,7 +407,10 @@ void SPI3_IRQHandler(void)
 void UART4_IRQHandler(void)
 {
   /* USER CODE BEGIN UART4_IRQn 0 */
-
+  if (__HAL_UART_GET_FLAG(&huart4, UART_FLAG_IDLE) && __HAL_UART_GET_IT_SOURCE(&huart4, UART_IT_IDLE)) {
+    __HAL_UART_CLEAR_IDLEFLAG(&huart4);
+    uart4_idle_line_callback();
+  }
   /* USER CODE END UART4_IRQn 0 */
   HAL_UART_IRQHandler(&huart4);
   /* USER CODE BEGIN UART4_IRQn 1 */
@@ -472,8 +483,10 @@ void decode_tim_capture(TIM_HandleTypeDef *htim, TIM_capture_callback_t callback
 */
 void TIM1_UP_TIM10_IRQHandler(void)
 {
+  uint32_t start_cycles = DWT->CYCCNT;
   __HAL_TIM_CLEAR_IT(&htim1, TIM_IT_UPDATE);
   tim_update_cb(&htim1);
+  tim_update_isr_cycles += DWT->CYCCNT - start_cycles;
 }
 
 /**
@@ -481,8 +494,10 @@ void TIM1_UP_TIM10_IRQHandler(void)
 */
 void TIM8_UP_TIM13_IRQHandler(void)
 {
+  uint32_t start_cycles = DWT->CYCCNT;
   __HAL_TIM_CLEAR_IT(&htim8, TIM_IT_UPDATE);
   tim_update_cb(&htim8);
+  tim_update_isr_cycles += DWT->CYCCNT - start_cycles;
 }
 
 
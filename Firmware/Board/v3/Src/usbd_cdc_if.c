@@ -117,8 +117,8 @@
 /* Create buffer for reception and transmission           */
 /* It's up to user to redefine and/or remove those define */
 /** Received data over USB are stored in this buffer      */
-uint8_t CDCRxBufferFS[APP_RX_DATA_SIZE];
-uint8_t ODRIVERxBufferFS[APP_RX_DATA_SIZE];
+uint8_t CDCRxBufferFS[2][APP_RX_DATA_SIZE];
+uint8_t ODRIVERxBufferFS[2][APP_RX_DATA_SIZE];
 
 /** Data to send over USB CDC are stored in this buffer   */
 uint8_t CDCTxBufferFS[APP_TX_DATA_SIZE];
@@ -180,9 +180,9 @@ static int8_t CDC_Init_FS(void)
   /* USER CODE BEGIN 3 */
   /* Set Application Buffers */
   USBD_CDC_SetTxBuffer(&hUsbDeviceFS, CDCTxBufferFS, 0, CDC_OUT_EP);
-  USBD_CDC_SetRxBuffer(&hUsbDeviceFS, CDCRxBufferFS, CDC_OUT_EP);
+  USBD_CDC_SetRxBuffer(&hUsbDeviceFS, CDCRxBufferFS[0], CDC_OUT_EP);
   USBD_CDC_SetTxBuffer(&hUsbDeviceFS, ODRIVETxBufferFS, 0, ODRIVE_OUT_EP);
-  USBD_CDC_SetRxBuffer(&hUsbDeviceFS, ODRIVERxBufferFS, ODRIVE_OUT_EP);
+  USBD_CDC_SetRxBuffer(&hUsbDeviceFS, ODRIVERxBufferFS[0], ODRIVE_OUT_EP);
   return (USBD_OK);
   /* USER CODE END 3 */
 }
@@ -5,6 +5,7 @@
 
 #include "utils.h"
 #include "odrive_main.h"
+#include <communication/interface_can.hpp>
 
 Axis::Axis(int axis_num,
            const AxisHardwareConfig_t& hw_config,
@@ -157,6 +158,13 @@ void Axis::set_step_dir_active(bool active) {
     }
 }
 
+// @brief Applies the setpoints and commands that interrupt handlers received
+// since the last control loop iteration. Doing this on the axis thread keeps
+// them from changing the controller state in the middle of an iteration.
+void Axis::apply_received_commands() {
+    can_apply_received(*this);
+}
+
 // @brief Do axis level checks and call subcomponent do_checks
 // Returns true if everything is ok.
 bool Axis::do_checks() {
@@ -187,6 +195,16 @@ bool Axis::do_updates() {
     return check_for_errors();
 }
 
+// @brief Records the errors of the axis and its components in the event log.
+void Axis::log_errors() {
+    logged_error_ = error_;
+    event_log.log(axis_num_, EventLog::EVENT_AXIS_ERROR, error_, motor_.error_);
+    if (encoder_.error_ != Encoder::ERROR_NONE || sensorless_estimator_.error_ != SensorlessEstimator::ERROR_NONE)
+        event_log.log(axis_num_, EventLog::EVENT_ENCODER_ERROR, encoder_.error_, sensorless_estimator_.error_);
+    if (controller_.error_ != Controller::ERROR_NONE)
+        event_log.log(axis_num_, EventLog::EVENT_CONTROLLER_ERROR, controller_.error_);
+}
+
 // @brief Feed the watchdog to prevent watchdog timeouts.
 void Axis::watchdog_feed() {
     watchdog_current_value_ = watchdog_reset_value_;
@@ -331,7 +349,8 @@ void Axis::run_state_machine_loop() {
 
     // arm!
     motor_.arm();
-    
+
+    State_t logged_state = AXIS_STATE_UNDEFINED;
     for (;;) {
         // Load the task chain if a specific request is pending
         if (requested_state_ != AXIS_STATE_UNDEFINED) {
@@ -366,6 +385,11 @@ void Axis::run_state_machine_loop() {
 
         // Note that current_state is a reference to task_chain_[0]
 
+        if (current_state_ != logged_state) {
+            event_log.log(axis_num_, EventLog::EVENT_STATE_CHANGE, current_state_, logged_state);
+            logged_state = current_state_;
+        }
+
         // Run the specified state
         // Handlers should exit if requested_state != AXIS_STATE_UNDEFINED
         bool status;
@@ -422,6 +446,22 @@ void Axis::run_state_machine_loop() {
                 status = run_closed_loop_control_loop();
             } break;
 
+            case AXIS_STATE_AUTOTUNE: {
+                if (!motor_.is_calibrated_ || motor_.config_.direction==0)
+                    goto invalid_state_label;
+                if (!encoder_.is_ready_)
+                    goto invalid_state_label;
+                status = controller_.run_autotune();
+            } break;
+
+            case AXIS_STATE_MECHANICAL_IDENTIFICATION: {
+                if (!motor_.is_calibrated_ || motor_.config_.direction==0)
+                    goto invalid_state_label;
+                if (!encoder_.is_ready_)
+                    goto invalid_state_label;
+                status = controller_.run_mechanical_identification();
+            } break;
+
             case AXIS_STATE_IDLE: {
                 run_idle_loop();
                 status = motor_.arm(); // done with idling - try to arm the motor
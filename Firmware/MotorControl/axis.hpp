@@ -35,6 +35,8 @@ public:
         AXIS_STATE_CLOSED_LOOP_CONTROL = 8,  //<! run closed loop control
         AXIS_STATE_LOCKIN_SPIN = 9,       //<! run lockin spin
         AXIS_STATE_ENCODER_DIR_FIND = 10,
+        AXIS_STATE_AUTOTUNE = 11,           //<! identify the mechanics and tune the controller gains
+        AXIS_STATE_MECHANICAL_IDENTIFICATION = 12, //<! identify inertia and friction for the feed-forward
     };
 
     struct LockinConfig_t {
@@ -113,14 +115,23 @@ public:
     bool check_PSU_brownout();
     bool do_checks();
     bool do_updates();
+    void apply_received_commands();
 
     void watchdog_feed();
     bool watchdog_check();
 
+    void log_errors();
 
     // True if there are no errors
     bool inline check_for_errors() {
-        return error_ == ERROR_NONE;
+        if (error_ != ERROR_NONE) {
+            flight_recorder_.freeze();
+            if (error_ & ~logged_error_)
+                log_errors();
+            return false;
+        }
+        logged_error_ = ERROR_NONE;
+        return true;
     }
 
     // @brief Runs the specified update handler at the frequency of the current measurements.
@@ -146,6 +157,8 @@ public:
     template<typename T>
     void run_control_loop(const T& update_handler) {
         while (requested_state_ == AXIS_STATE_UNDEFINED) {
+            apply_received_commands();
+
             // look for errors at axis level and also all subcomponents
             bool checks_ok = do_checks();
             // Update all estimators
@@ -176,8 +189,10 @@ public:
                 safety_critical_disarm_motor_pwm(motor_);
                 update_brake_current();
                 error_ |= ERROR_CURRENT_MEASUREMENT_TIMEOUT;
+                flight_recorder_.freeze();
                 break;
             }
+            flight_recorder_.on_thread_wake();
 
             if (!main_continue)
                 break;
@@ -210,6 +225,7 @@ public:
 
     // variables exposed on protocol
     Error_t error_ = ERROR_NONE;
+    Error_t logged_error_ = ERROR_NONE; // errors already recorded in the event log
     bool step_dir_active_ = false; // auto enabled after calibration, based on config.enable_step_dir
 
     // updated from config in constructor, and on protocol hook
@@ -222,6 +238,7 @@ public:
     State_t task_chain_[10] = { AXIS_STATE_UNDEFINED };
     State_t& current_state_ = task_chain_[0];
     uint32_t loop_counter_ = 0;
+    FlightRecorder flight_recorder_;
     LockinState_t lockin_state_ = LOCKIN_STATE_INACTIVE;
 
     // watchdog
@@ -286,6 +303,7 @@ public:
             make_protocol_object("encoder", encoder_.make_protocol_definitions()),
             make_protocol_object("sensorless_estimator", sensorless_estimator_.make_protocol_definitions()),
             make_protocol_object("trap_traj", trap_.make_protocol_definitions()),
+            make_protocol_object("flight_recorder", flight_recorder_.make_protocol_definitions()),
             make_protocol_function("watchdog_feed", *this, &Axis::watchdog_feed)
         );
     }
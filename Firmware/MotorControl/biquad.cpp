@@ -0,0 +1,60 @@
+
+#include <algorithm>
+
+#include "odrive_main.h"
+
+// @brief Computes the filter coefficients from the given config.
+// Invalid configs (frequency at or above Nyquist, non-positive Q) bypass the filter.
+// Coefficients are based on the bilinear transform formulas from the
+// Audio EQ Cookbook by R. Bristow-Johnson.
+void Biquad::configure(const Config_t& config, float sample_rate) {
+    bool valid = (config.frequency > 0.0f)
+              && (config.frequency < 0.5f * sample_rate)
+              && (config.q > 0.0f);
+    if (config.type == FILTER_TYPE_NONE || !valid) {
+        enabled_ = false;
+        return;
+    }
+
+    float w0 = 2.0f * M_PI * config.frequency / sample_rate;
+    float cos_w0 = cosf(w0);
+    float alpha = sinf(w0) / (2.0f * config.q);
+
+    float b0, b1, b2;
+    float a0 = 1.0f + alpha;
+    float a1 = -2.0f * cos_w0;
+    float a2 = 1.0f - alpha;
+    switch (config.type) {
+        case FILTER_TYPE_LOWPASS: {
+            b1 = 1.0f - cos_w0;
+            b0 = 0.5f * b1;
+            b2 = b0;
+        } break;
+
+        case FILTER_TYPE_NOTCH: {
+            // The zeros are damped by the depth factor, such that the
+            // gain at the center frequency equals depth
+            float depth = std::max(0.0f, std::min(config.depth, 1.0f));
+            b0 = 1.0f + alpha * depth;
+            b1 = -2.0f * cos_w0;
+            b2 = 1.0f - alpha * depth;
+        } break;
+
+        default: {
+            enabled_ = false;
+            return;
+        }
+    }
+
+    b0_ = b0 / a0;
+    b1_ = b1 / a0;
+    b2_ = b2 / a0;
+    a1_ = a1 / a0;
+    a2_ = a2 / a0;
+    enabled_ = true;
+}
+
+void Biquad::reset() {
+    z1_ = 0.0f;
+    z2_ = 0.0f;
+}
@@ -0,0 +1,49 @@
+#ifndef __BIQUAD_HPP
+#define __BIQUAD_HPP
+
+#ifndef __ODRIVE_MAIN_H
+#error "This file should not be included directly. Include odrive_main.h instead."
+#endif
+
+// @brief Second order IIR filter section (transposed direct form II).
+// The coefficients are derived from the filter config by configure(), which
+// should be called whenever the config changes. update() runs once per
+// control loop iteration.
+class Biquad {
+public:
+    enum FilterType_t {
+        FILTER_TYPE_NONE = 0,     //<! filter bypassed
+        FILTER_TYPE_LOWPASS = 1,  //<! second order low-pass
+        FILTER_TYPE_NOTCH = 2,    //<! notch with configurable depth
+    };
+
+    struct Config_t {
+        FilterType_t type = FILTER_TYPE_NONE;
+        float frequency = 500.0f; // [Hz] cutoff frequency (low-pass) or center frequency (notch)
+        float q = 0.707f;         // quality factor
+        float depth = 0.0f;       // notch gain at the center frequency (0 = full notch, 1 = no attenuation)
+    };
+
+    void configure(const Config_t& config, float sample_rate);
+    void reset();
+
+    inline float update(float input) {
+        if (!enabled_)
+            return input;
+        float output = b0_ * input + z1_;
+        z1_ = b1_ * input - a1_ * output + z2_;
+        z2_ = b2_ * input - a2_ * output;
+        return output;
+    }
+
+    bool enabled_ = false;
+    float b0_ = 1.0f;
+    float b1_ = 0.0f;
+    float b2_ = 0.0f;
+    float a1_ = 0.0f;
+    float a2_ = 0.0f;
+    float z1_ = 0.0f;
+    float z2_ = 0.0f;
+};
+
+#endif // __BIQUAD_HPP
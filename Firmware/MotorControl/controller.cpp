@@ -1,16 +1,27 @@
 
+#include <algorithm>
+
 #include "odrive_main.h"
 
 
 Controller::Controller(Config_t& config) :
     config_(config)
-{}
+{
+    update_filter_coefficients();
+    update_input_shaper();
+    select_update_fn();
+}
 
 void Controller::reset() {
     pos_setpoint_ = 0.0f;
     vel_setpoint_ = 0.0f;
     vel_integrator_current_ = 0.0f;
     current_setpoint_ = 0.0f;
+    for (size_t i = 0; i < NUM_FILTER_SECTIONS; ++i) {
+        vel_filters_[i].reset();
+        torque_filters_[i].reset();
+    }
+    input_shaper_primed_ = false;
 }
 
 void Controller::set_error(Error_t error) {
@@ -18,6 +29,128 @@ void Controller::set_error(Error_t error) {
     axis_->error_ |= Axis::ERROR_CONTROLLER_FAILED;
 }
 
+// @brief Recomputes the biquad coefficients from the filter configs.
+// This should be invoked whenever one of the filter configs changes.
+void Controller::update_filter_coefficients() {
+    for (size_t i = 0; i < NUM_FILTER_SECTIONS; ++i) {
+        vel_filters_[i].configure(config_.vel_filter[i], (float)current_meas_hz);
+        torque_filters_[i].configure(config_.torque_filter[i], (float)current_meas_hz);
+    }
+}
+
+// @brief Recomputes the input shaper impulses from the shaper config.
+// This should be invoked whenever one of the input shaper settings changes.
+// Invalid settings disable the shaper.
+void Controller::update_input_shaper() {
+    float zeta = config_.input_shaper_damping;
+    float f = config_.input_shaper_frequency;
+    size_t num_impulses = 0;
+
+    if (config_.input_shaper != INPUT_SHAPER_NONE && f > 0.0f && zeta >= 0.0f && zeta < 1.0f) {
+        float sqrt_one_minus_zeta_sq = sqrtf(1.0f - zeta * zeta);
+        float T_d = (float)current_meas_hz / (f * sqrt_one_minus_zeta_sq); // damped period [control cycles]
+        float K = expf(-zeta * M_PI / sqrt_one_minus_zeta_sq);
+
+        switch (config_.input_shaper) {
+            case INPUT_SHAPER_ZV: {
+                input_shaper_amplitudes_[0] = 1.0f / (1.0f + K);
+                input_shaper_amplitudes_[1] = K / (1.0f + K);
+                input_shaper_delays_[0] = 0.0f;
+                input_shaper_delays_[1] = 0.5f * T_d;
+                num_impulses = 2;
+            } break;
+
+            case INPUT_SHAPER_ZVD: {
+                float norm = 1.0f / SQ(1.0f + K);
+                input_shaper_amplitudes_[0] = norm;
+                input_shaper_amplitudes_[1] = 2.0f * K * norm;
+                input_shaper_amplitudes_[2] = K * K * norm;
+                input_shaper_delays_[0] = 0.0f;
+                input_shaper_delays_[1] = 0.5f * T_d;
+                input_shaper_delays_[2] = T_d;
+                num_impulses = 3;
+            } break;
+
+            case INPUT_SHAPER_EI: {
+                // Curve fit for the damped EI shaper (Singhose et al.) with V = 5% tolerance
+                static const float V = 0.05f;
+                float A1 = 0.24968f + 0.24961f * V + 0.80008f * zeta + 1.23328f * V * zeta
+                         + 0.49599f * zeta * zeta + 3.17316f * V * zeta * zeta;
+                float A3 = 0.25149f + 0.21474f * V - 0.83249f * zeta + 1.41498f * V * zeta
+                         + 0.85181f * zeta * zeta - 4.90094f * V * zeta * zeta;
+                input_shaper_amplitudes_[0] = A1;
+                input_shaper_amplitudes_[1] = 1.0f - A1 - A3;
+                input_shaper_amplitudes_[2] = A3;
+                input_shaper_delays_[0] = 0.0f;
+                input_shaper_delays_[1] = (0.49890f + 0.16270f * V - 0.54262f * zeta + 6.16180f * V * zeta) * T_d;
+                input_shaper_delays_[2] = T_d;
+                num_impulses = 3;
+            } break;
+
+            default: break;
+        }
+    }
+
+    // Choose the decimation such that the longest delay fits in the buffer.
+    // The last buffer entry is reserved for interpolation.
+    float max_delay = num_impulses ? input_shaper_delays_[num_impulses - 1] : 0.0f;
+    input_shaper_decimation_ = std::max<uint32_t>(1, (uint32_t)ceilf(max_delay / (float)(INPUT_SHAPER_BUFFER_SIZE - 2)));
+    input_shaper_num_impulses_ = num_impulses;
+    input_shaper_primed_ = false;
+}
+
+// @brief Returns the unshaped setpoints from delay control cycles ago.
+// Values are linearly interpolated between the decimated buffer entries.
+Controller::InputShaperSample_t Controller::get_input_shaper_sample(const InputShaperSample_t& input, float delay) {
+    auto lerp = [](const InputShaperSample_t& a, const InputShaperSample_t& b, float t) -> InputShaperSample_t {
+        return { a.pos + t * (b.pos - a.pos), a.vel + t * (b.vel - a.vel), a.current + t * (b.current - a.current) };
+    };
+
+    // Between the current input and the newest buffer entry
+    float age = (float)input_shaper_decimation_counter_;
+    if (delay <= age)
+        return lerp(input, input_shaper_buffer_[input_shaper_head_], age > 0.0f ? delay / age : 0.0f);
+
+    // Between two buffer entries
+    float back = (delay - age) / (float)input_shaper_decimation_;
+    size_t i = (size_t)back;
+    float frac = back - (float)i;
+    if (i >= INPUT_SHAPER_BUFFER_SIZE - 1) {
+        i = INPUT_SHAPER_BUFFER_SIZE - 2;
+        frac = 1.0f;
+    }
+    size_t newer = (input_shaper_head_ + INPUT_SHAPER_BUFFER_SIZE - i) % INPUT_SHAPER_BUFFER_SIZE;
+    size_t older = (newer + INPUT_SHAPER_BUFFER_SIZE - 1) % INPUT_SHAPER_BUFFER_SIZE;
+    return lerp(input_shaper_buffer_[newer], input_shaper_buffer_[older], frac);
+}
+
+// @brief Convolves the setpoints with the input shaper impulses.
+// Must be called exactly once per control cycle while the shaper is in use.
+Controller::InputShaperSample_t Controller::apply_input_shaper(const InputShaperSample_t& input) {
+    // Start from a steady state history to avoid transients
+    if (!input_shaper_primed_) {
+        for (size_t i = 0; i < INPUT_SHAPER_BUFFER_SIZE; ++i)
+            input_shaper_buffer_[i] = input;
+        input_shaper_decimation_counter_ = 0;
+        input_shaper_primed_ = true;
+    }
+
+    if (++input_shaper_decimation_counter_ >= input_shaper_decimation_) {
+        input_shaper_head_ = (input_shaper_head_ + 1) % INPUT_SHAPER_BUFFER_SIZE;
+        input_shaper_buffer_[input_shaper_head_] = input;
+        input_shaper_decimation_counter_ = 0;
+    }
+
+    InputShaperSample_t output = { 0.0f, 0.0f, 0.0f };
+    for (size_t i = 0; i < input_shaper_num_impulses_; ++i) {
+        InputShaperSample_t sample = get_input_shaper_sample(input, input_shaper_delays_[i]);
+        output.pos += input_shaper_amplitudes_[i] * sample.pos;
+        output.vel += input_shaper_amplitudes_[i] * sample.vel;
+        output.current += input_shaper_amplitudes_[i] * sample.current;
+    }
+    return output;
+}
+
 //--------------------------------
 // Command Handling
 //--------------------------------
@@ -27,6 +160,7 @@ void Controller::set_pos_setpoint(float pos_setpoint, float vel_feed_forward, fl
     vel_setpoint_ = vel_feed_forward;
     current_setpoint_ = current_feed_forward;
     config_.control_mode = CTRL_MODE_POSITION_CONTROL;
+    select_update_fn();
 #ifdef DEBUG_PRINT
     printf("POSITION_CONTROL %6.0f %3.3f %3.3f\n", pos_setpoint, vel_setpoint_, current_setpoint_);
 #endif
@@ -36,6 +170,7 @@ void Controller::set_vel_setpoint(float vel_setpoint, float current_feed_forward
     vel_setpoint_ = vel_setpoint;
     current_setpoint_ = current_feed_forward;
     config_.control_mode = CTRL_MODE_VELOCITY_CONTROL;
+    select_update_fn();
 #ifdef DEBUG_PRINT
     printf("VELOCITY_CONTROL %3.3f %3.3f\n", vel_setpoint_, motor->current_setpoint_);
 #endif
@@ -44,18 +179,28 @@ void Controller::set_vel_setpoint(float vel_setpoint, float current_feed_forward
 void Controller::set_current_setpoint(float current_setpoint) {
     current_setpoint_ = current_setpoint;
     config_.control_mode = CTRL_MODE_CURRENT_CONTROL;
+    select_update_fn();
 #ifdef DEBUG_PRINT
     printf("CURRENT_CONTROL %3.3f\n", current_setpoint_);
 #endif
 }
 
 void Controller::move_to_pos(float goal_point) {
+    move_to_pos_at(goal_point, axis_->loop_counter_, 0.0f);
+}
+
+// @brief Plans a trajectory to goal_point that starts start_offset seconds
+// after the start of control loop iteration start_loop_count, which may be in
+// the future. Until then the trajectory holds its initial position.
+void Controller::move_to_pos_at(float goal_point, uint32_t start_loop_count, float start_offset) {
     axis_->trap_.planTrapezoidal(goal_point, pos_setpoint_, vel_setpoint_,
                                  axis_->trap_.config_.vel_limit,
                                  axis_->trap_.config_.accel_limit,
                                  axis_->trap_.config_.decel_limit);
-    traj_start_loop_count_ = axis_->loop_counter_;
+    traj_start_loop_count_ = start_loop_count;
+    traj_start_offset_ = start_offset;
     config_.control_mode = CTRL_MODE_TRAJECTORY_CONTROL;
+    select_update_fn();
     goal_point_ = goal_point;
 }
 
@@ -71,6 +216,7 @@ void Controller::start_anticogging_calibration() {
     // Ensure the cogging map was correctly allocated earlier and that the motor is capable of calibrating
     if (anticogging_.cogging_map != NULL && axis_->error_ == Axis::ERROR_NONE) {
         anticogging_.calib_anticogging = true;
+        select_update_fn();
     }
 }
 
@@ -96,25 +242,396 @@ bool Controller::anticogging_calibration(float pos_estimate, float vel_estimate)
             set_pos_setpoint(0.0f, 0.0f, 0.0f);  // Send the motor home
             anticogging_.use_anticogging = true;  // We're good to go, enable anti-cogging
             anticogging_.calib_anticogging = false;
+            select_update_fn();
             return true;
         }
     }
     return false;
 }
 
-bool Controller::update(float pos_estimate, float vel_estimate, float* current_setpoint_output) {
-    // Only runs if anticogging_.calib_anticogging is true; non-blocking
+/*
+ * Automatic tuning of the velocity and position loop gains.
+ *
+ * 1. Relay feedback: A constant current is applied and its sign is flipped
+ *    whenever the velocity exceeds +/- relay_vel. The inertia follows from the
+ *    average acceleration during the positive and negative relay phases.
+ *    Coulomb friction affects both phases equally and cancels out.
+ * 2. Stepped sine sweep: With a soft velocity loop holding the axis in place,
+ *    a sinusoidal current is added to the current command. At each frequency
+ *    the velocity response is compared to the response of a rigid body with
+ *    the identified inertia. The largest ratio above resonance_threshold is
+ *    taken as the dominant mechanical resonance.
+ * 3. The gains are derived from the inertia and the target bandwidth.
+ *    The resonance is either notched out with the last torque filter section
+ *    or limits the bandwidth.
+ */
+bool Controller::run_autotune() {
+    const AutotuneConfig_t& cfg = config_.autotune;
+    Encoder& encoder = axis_->encoder_;
+    Motor& motor = axis_->motor_;
+    ControlMode_t prev_control_mode = config_.control_mode;
+    bool prev_vel_ramp_enable = vel_ramp_enable_;
+
+    if (!(cfg.relay_current > 0.0f && cfg.relay_vel > 0.0f && cfg.relay_duration > 0.0f
+            && cfg.excitation_current > 0.0f && cfg.sweep_min_freq > 0.0f
+            && cfg.sweep_max_freq > cfg.sweep_min_freq
+            && cfg.sweep_max_freq < 0.25f * (float)current_meas_hz)) {
+        set_error(ERROR_AUTOTUNE_FAILED);
+        return false;
+    }
+
+    auto get_phase_vel = [&]() {
+        return 2*M_PI * encoder.vel_estimate_ / (float)encoder.config_.cpr * motor.config_.pole_pairs;
+    };
+
+    // Relay feedback for the inertia identification
+    float relay_current = cfg.relay_current;
+    float vel_at_switch = encoder.vel_estimate_;
+    uint32_t num_switches = 0;
+    uint32_t phase_cycles = 0;
+    float dv_pos = 0.0f, t_pos = 0.0f; // accumulated velocity change and time during positive relay phases
+    float dv_neg = 0.0f, t_neg = 0.0f;
+    const uint32_t relay_cycles = (uint32_t)(cfg.relay_duration * (float)current_meas_hz);
+    uint32_t i = 0;
+    axis_->run_control_loop([&](){
+        float vel = encoder.vel_estimate_;
+        if ((relay_current > 0.0f && vel > cfg.relay_vel) || (relay_current < 0.0f && vel < -cfg.relay_vel)) {
+            // The first phase starts at rest and is therefore not used
+            if (num_switches > 0) {
+                if (relay_current > 0.0f) {
+                    dv_pos += vel - vel_at_switch;
+                    t_pos += (float)phase_cycles * current_meas_period;
+                } else {
+                    dv_neg += vel - vel_at_switch;
+                    t_neg += (float)phase_cycles * current_meas_period;
+                }
+            }
+            ++num_switches;
+            relay_current = -relay_current;
+            vel_at_switch = vel;
+            phase_cycles = 0;
+        }
+        ++phase_cycles;
+
+        if (!motor.update(relay_current, encoder.phase_, get_phase_vel()))
+            return false; // set_error should update axis.error_
+        return ++i < relay_cycles;
+    });
+    if (axis_->error_ != Axis::ERROR_NONE || axis_->requested_state_ != Axis::AXIS_STATE_UNDEFINED)
+        return false;
+
+    float accel_pos = t_pos > 0.0f ? dv_pos / t_pos : 0.0f; // [counts/s^2]
+    float accel_neg = t_neg > 0.0f ? dv_neg / t_neg : 0.0f; // [counts/s^2]
+    float inertia = 2.0f * cfg.relay_current / (accel_pos - accel_neg); // [A/(counts/s^2)]
+    if (t_pos <= 0.0f || t_neg <= 0.0f || !(inertia > 0.0f)) {
+        set_error(ERROR_AUTOTUNE_FAILED);
+        return false;
+    }
+    autotune_inertia_ = inertia;
+
+    // Hold the axis with a soft velocity loop during the sweep. The
+    // feed-forward terms would add to the excitation, so they are disabled
+    // and restored afterwards.
+    float prev_vel_gain = config_.vel_gain;
+    float prev_vel_integrator_gain = config_.vel_integrator_gain;
+    float prev_inertia = config_.inertia;
+    float prev_friction_coulomb = config_.friction_coulomb;
+    float prev_friction_viscous = config_.friction_viscous;
+    auto restore_feedforward = [&]() {
+        config_.inertia = prev_inertia;
+        config_.friction_coulomb = prev_friction_coulomb;
+        config_.friction_viscous = prev_friction_viscous;
+    };
+    static const float hold_bandwidth = 2.0f * M_PI * 2.0f; // [rad/s]
+    config_.vel_gain = inertia * hold_bandwidth;
+    config_.inertia = 0.0f;
+    config_.friction_coulomb = 0.0f;
+    config_.friction_viscous = 0.0f;
+    config_.vel_integrator_gain = 0.0f;
+    vel_ramp_enable_ = false;
+    reset();
+    set_vel_setpoint(0.0f, 0.0f);
+
+    // Stepped sine sweep for the resonance search
+    float freq_step = powf(cfg.sweep_max_freq / cfg.sweep_min_freq, 1.0f / (float)(AUTOTUNE_NUM_FREQUENCIES - 1));
+    float freq = cfg.sweep_min_freq;
+    float peak_ratio = cfg.resonance_threshold;
+    float resonance_freq = 0.0f;
+    for (size_t k = 0; k < AUTOTUNE_NUM_FREQUENCIES; ++k, freq *= freq_step) {
+        float omega = 2.0f * M_PI * freq;
+        // Settle for 2 periods, then measure over an integer number of periods (at least 50ms)
+        uint32_t cycles_per_period = (uint32_t)((float)current_meas_hz / freq);
+        uint32_t settle_cycles = 2 * cycles_per_period;
+        uint32_t meas_cycles = std::max<uint32_t>(4, (uint32_t)ceilf(0.05f * freq)) * cycles_per_period;
+        float I_sin = 0.0f, I_cos = 0.0f, vel_sin = 0.0f, vel_cos = 0.0f;
+        float phase = 0.0f;
+        i = 0;
+        axis_->run_control_loop([&](){
+            float s = our_arm_sin_f32(phase);
+            float c = our_arm_cos_f32(phase);
+            phase = wrap_pm_pi(phase + omega * current_meas_period);
+
+            current_setpoint_ = cfg.excitation_current * s;
+            float Iq;
+            if (!update(encoder.pos_estimate_, encoder.vel_estimate_, &Iq))
+                return false; // set_error should update axis.error_
+            if (i >= settle_cycles) {
+                I_sin += Iq * s;
+                I_cos += Iq * c;
+                vel_sin += encoder.vel_estimate_ * s;
+                vel_cos += encoder.vel_estimate_ * c;
+            }
+            if (!motor.update(Iq, encoder.phase_, get_phase_vel()))
+                return false; // set_error should update axis.error_
+            return ++i < settle_cycles + meas_cycles;
+        });
+        if (axis_->error_ != Axis::ERROR_NONE || axis_->requested_state_ != Axis::AXIS_STATE_UNDEFINED) {
+            config_.vel_gain = prev_vel_gain;
+            config_.vel_integrator_gain = prev_vel_integrator_gain;
+            restore_feedforward();
+            vel_ramp_enable_ = prev_vel_ramp_enable;
+            config_.control_mode = prev_control_mode;
+            select_update_fn();
+            return false;
+        }
+
+        // Ratio of the measured velocity response to that of a rigid body (1 / (J * omega))
+        float I_mag_sq = SQ(I_sin) + SQ(I_cos);
+        float ratio = I_mag_sq > 0.0f ? inertia * omega * sqrtf((SQ(vel_sin) + SQ(vel_cos)) / I_mag_sq) : 0.0f;
+        if (ratio > peak_ratio) {
+            peak_ratio = ratio;
+            resonance_freq = freq;
+        }
+    }
+    autotune_resonance_frequency_ = resonance_freq;
+
+    // Write back the gains
+    float bandwidth = std::min(cfg.vel_bandwidth, 0.25f * motor.config_.current_control_bandwidth);
+    if (resonance_freq > 0.0f) {
+        if (cfg.enable_notch) {
+            Biquad::Config_t& notch = config_.torque_filter[NUM_FILTER_SECTIONS - 1];
+            notch.type = Biquad::FILTER_TYPE_NOTCH;
+            notch.frequency = resonance_freq;
+            notch.q = 2.0f;
+            notch.depth = 0.0f;
+            update_filter_coefficients();
+        } else {
+            bandwidth = std::min(bandwidth, 0.25f * 2.0f * M_PI * resonance_freq);
+        }
+    }
+    config_.vel_gain = inertia * bandwidth;
+    config_.vel_integrator_gain = 0.25f * bandwidth * config_.vel_gain;
+    config_.pos_gain = 0.25f * bandwidth;
+
+    restore_feedforward();
+    vel_ramp_enable_ = prev_vel_ramp_enable;
+    reset();
+    config_.control_mode = prev_control_mode;
+    select_update_fn();
+    return true;
+}
+
+/*
+ * Identification of the inertia and friction for the model based feed-forward.
+ *
+ * The axis follows a velocity profile made of two sines at the base frequency
+ * and three times the base frequency under velocity control. The current
+ * command, velocity and acceleration are averaged over windows of 10ms and the
+ * model current = J * accel + Fc * sign(vel) + B * vel is fitted by least squares.
+ * Windows slower than min_vel are excluded, since static friction dominates there.
+ * The velocity loop gains must be tuned beforehand.
+ */
+bool Controller::run_mechanical_identification() {
+    const IdentificationConfig_t& cfg = config_.identification;
+    Encoder& encoder = axis_->encoder_;
+    Motor& motor = axis_->motor_;
+    ControlMode_t prev_control_mode = config_.control_mode;
+    bool prev_vel_ramp_enable = vel_ramp_enable_;
+
+    if (!(cfg.vel_amplitude > 0.0f && cfg.vel_amplitude <= config_.vel_limit
+            && cfg.frequency > 0.0f && cfg.duration > 0.0f && cfg.min_vel >= 0.0f)) {
+        set_error(ERROR_IDENTIFICATION_FAILED);
+        return false;
+    }
+
+    // Identify without the previous feed-forward terms. They are restored if
+    // the identification fails.
+    float prev_inertia = config_.inertia;
+    float prev_friction_coulomb = config_.friction_coulomb;
+    float prev_friction_viscous = config_.friction_viscous;
+    auto restore_feedforward = [&]() {
+        config_.inertia = prev_inertia;
+        config_.friction_coulomb = prev_friction_coulomb;
+        config_.friction_viscous = prev_friction_viscous;
+    };
+    config_.inertia = 0.0f;
+    config_.friction_coulomb = 0.0f;
+    config_.friction_viscous = 0.0f;
+    vel_ramp_enable_ = false;
+    reset();
+    set_vel_setpoint(0.0f, 0.0f);
+
+    // Normal equations of the least squares fit, regressors are [accel, sign(vel), vel]
+    float XtX[3][3] = { { 0.0f } };
+    float Xty[3] = { 0.0f };
+    const uint32_t window_cycles = std::max<uint32_t>(1, current_meas_hz / 100);
+    const float window_period = (float)window_cycles * current_meas_period;
+    const uint32_t total_cycles = (uint32_t)(cfg.duration * (float)current_meas_hz);
+    const float omega = 2.0f * M_PI * cfg.frequency;
+    float phase = 0.0f;
+    float I_sum = 0.0f, vel_sum = 0.0f;
+    float vel_start = encoder.vel_estimate_;
+    uint32_t i = 0;
+    axis_->run_control_loop([&](){
+        vel_setpoint_ = 0.5f * cfg.vel_amplitude * (our_arm_sin_f32(phase) + our_arm_sin_f32(wrap_pm_pi(3.0f * phase)));
+        phase = wrap_pm_pi(phase + omega * current_meas_period);
+
+        float Iq;
+        if (!update(encoder.pos_estimate_, encoder.vel_estimate_, &Iq))
+            return false; // set_error should update axis.error_
+        if (!motor.update(Iq, encoder.phase_, 2*M_PI * encoder.vel_estimate_ / (float)encoder.config_.cpr * motor.config_.pole_pairs))
+            return false; // set_error should update axis.error_
+
+        I_sum += Iq;
+        vel_sum += encoder.vel_estimate_;
+        if (++i % window_cycles == 0) {
+            float x[3];
+            float vel = vel_sum / (float)window_cycles;
+            x[0] = (encoder.vel_estimate_ - vel_start) / window_period;
+            x[1] = (float)((vel > 0.0f) - (vel < 0.0f));
+            x[2] = vel;
+            float y = I_sum / (float)window_cycles;
+            if (fabsf(vel) >= cfg.min_vel) {
+                for (size_t row = 0; row < 3; ++row) {
+                    for (size_t col = 0; col < 3; ++col)
+                        XtX[row][col] += x[row] * x[col];
+                    Xty[row] += x[row] * y;
+                }
+            }
+            I_sum = 0.0f;
+            vel_sum = 0.0f;
+            vel_start = encoder.vel_estimate_;
+        }
+        return i < total_cycles;
+    });
+
+    vel_setpoint_ = 0.0f;
+    vel_ramp_enable_ = prev_vel_ramp_enable;
+    reset();
+    config_.control_mode = prev_control_mode;
+    select_update_fn();
+    if (axis_->error_ != Axis::ERROR_NONE || axis_->requested_state_ != Axis::AXIS_STATE_UNDEFINED) {
+        restore_feedforward();
+        return false;
+    }
+
+    // Solve by Gaussian elimination with partial pivoting
+    for (size_t col = 0; col < 3; ++col) {
+        size_t pivot = col;
+        for (size_t row = col + 1; row < 3; ++row)
+            if (fabsf(XtX[row][col]) > fabsf(XtX[pivot][col]))
+                pivot = row;
+        if (!(fabsf(XtX[pivot][col]) > 1e-20f)) {
+            restore_feedforward();
+            set_error(ERROR_IDENTIFICATION_FAILED); // not enough excitation
+            return false;
+        }
+        for (size_t k = 0; k < 3; ++k)
+            std::swap(XtX[col][k], XtX[pivot][k]);
+        std::swap(Xty[col], Xty[pivot]);
+        for (size_t row = col + 1; row < 3; ++row) {
+            float factor = XtX[row][col] / XtX[col][col];
+            for (size_t k = col; k < 3; ++k)
+                XtX[row][k] -= factor * XtX[col][k];
+            Xty[row] -= factor * Xty[col];
+        }
+    }
+    float theta[3];
+    for (size_t row = 3; row-- > 0;) {
+        float sum = Xty[row];
+        for (size_t k = row + 1; k < 3; ++k)
+            sum -= XtX[row][k] * theta[k];
+        theta[row] = sum / XtX[row][row];
+    }
+
+    if (!(theta[0] > 0.0f)) {
+        restore_feedforward();
+        set_error(ERROR_IDENTIFICATION_FAILED);
+        return false;
+    }
+    config_.inertia = theta[0];
+    // Negative friction is not physical and would destabilize the feed-forward
+    config_.friction_coulomb = std::max(0.0f, theta[1]);
+    config_.friction_viscous = std::max(0.0f, theta[2]);
+    return true;
+}
+
+// @brief Selects the specialization of the control loop that matches the
+// current control mode and config. This must be called whenever one of
+// control_mode, vel_ramp_enable, setpoints_in_cpr or the anticogging state changes.
+void Controller::select_update_fn() {
+    update_fn_ = anticogging_.calib_anticogging
+        ? &Controller::update_anticogging_calibration
+        : get_update_fn();
+}
+
+template<Controller::ControlMode_t mode, bool vel_ramp, bool setpoints_in_cpr>
+Controller::update_fn_t Controller::get_update_fn(bool anticogging) {
+    return anticogging
+        ? &Controller::update_specialized<mode, vel_ramp, setpoints_in_cpr, true>
+        : &Controller::update_specialized<mode, vel_ramp, setpoints_in_cpr, false>;
+}
+
+// @brief Returns the update specialization for the current control mode and config.
+// Flags that have no effect in a given control mode are not part of the specialization.
+Controller::update_fn_t Controller::get_update_fn() {
+    bool anticogging = anticogging_.use_anticogging;
+    switch (config_.control_mode) {
+        case CTRL_MODE_VOLTAGE_CONTROL:
+        case CTRL_MODE_CURRENT_CONTROL:
+            return get_update_fn<CTRL_MODE_CURRENT_CONTROL, false, false>(anticogging);
+        case CTRL_MODE_VELOCITY_CONTROL:
+            return vel_ramp_enable_
+                ? get_update_fn<CTRL_MODE_VELOCITY_CONTROL, true, false>(anticogging)
+                : get_update_fn<CTRL_MODE_VELOCITY_CONTROL, false, false>(anticogging);
+        case CTRL_MODE_TRAJECTORY_CONTROL:
+            return config_.setpoints_in_cpr
+                ? get_update_fn<CTRL_MODE_TRAJECTORY_CONTROL, false, true>(anticogging)
+                : get_update_fn<CTRL_MODE_TRAJECTORY_CONTROL, false, false>(anticogging);
+        case CTRL_MODE_POSITION_CONTROL:
+        default:
+            return config_.setpoints_in_cpr
+                ? get_update_fn<CTRL_MODE_POSITION_CONTROL, false, true>(anticogging)
+                : get_update_fn<CTRL_MODE_POSITION_CONTROL, false, false>(anticogging);
+    }
+}
+
+// @brief Control loop used while the anticogging calibration is running.
+// The calibration changes the setpoints and eventually the anticogging state,
+// so the specialization is looked up on every iteration.
+bool Controller::update_anticogging_calibration(float pos_estimate, float vel_estimate, float* current_setpoint_output) {
     anticogging_calibration(pos_estimate, vel_estimate);
+    return (this->*get_update_fn())(pos_estimate, vel_estimate, current_setpoint_output);
+}
+
+// @brief Runs one iteration of the position/velocity control loop.
+// The control mode and the feature flags are template parameters, such that
+// disabled features are compiled out of the selected specialization.
+template<Controller::ControlMode_t mode, bool vel_ramp, bool setpoints_in_cpr, bool anticogging>
+bool Controller::update_specialized(float pos_estimate, float vel_estimate, float* current_setpoint_output) {
     float anticogging_pos = pos_estimate;
+    float accel_des = 0.0f; // [counts/s^2] acceleration not already fed forward through current_setpoint_
 
     // Trajectory control
-    if (config_.control_mode == CTRL_MODE_TRAJECTORY_CONTROL) {
-        // Note: uint32_t loop count delta is OK across overflow
-        // Beware of negative deltas, as they will not be well behaved due to uint!
-        float t = (axis_->loop_counter_ - traj_start_loop_count_) * current_meas_period;
+    if (mode == CTRL_MODE_TRAJECTORY_CONTROL) {
+        // Note: the loop count delta is OK across overflow. It is negative while
+        // the start of the trajectory is scheduled in the future.
+        int32_t loops = (int32_t)(axis_->loop_counter_ - traj_start_loop_count_);
+        float t = std::max((float)loops * current_meas_period - traj_start_offset_, 0.0f);
         if (t > axis_->trap_.Tf_) {
             // Drop into position control mode when done to avoid problems on loop counter delta overflow
             config_.control_mode = CTRL_MODE_POSITION_CONTROL;
+            select_update_fn();
             // pos_setpoint already set by trajectory
             vel_setpoint_ = 0.0f;
             current_setpoint_ = 0.0f;
@@ -122,13 +639,14 @@ bool Controller::update(float pos_estimate, float vel_estimate, float* current_s
             TrapezoidalTrajectory::Step_t traj_step = axis_->trap_.eval(t);
             pos_setpoint_ = traj_step.Y;
             vel_setpoint_ = traj_step.Yd;
-            current_setpoint_ = traj_step.Ydd * axis_->trap_.config_.A_per_css;
+            // Passed through current_setpoint_ so that it is shaped together with the position and velocity
+            current_setpoint_ = traj_step.Ydd * (axis_->trap_.config_.A_per_css + config_.inertia);
         }
         anticogging_pos = pos_setpoint_; // FF the position setpoint instead of the pos_estimate
     }
 
     // Ramp rate limited velocity setpoint
-    if (config_.control_mode == CTRL_MODE_VELOCITY_CONTROL && vel_ramp_enable_) {
+    if (mode == CTRL_MODE_VELOCITY_CONTROL && vel_ramp) {
         float max_step_size = current_meas_period * config_.vel_ramp_rate;
         float full_step = vel_ramp_target_ - vel_setpoint_;
         float step;
@@ -138,14 +656,29 @@ bool Controller::update(float pos_estimate, float vel_estimate, float* current_s
             step = full_step;
         }
         vel_setpoint_ += step;
+        accel_des = step * current_meas_hz;
+    }
+
+    // Input shaping of the position, velocity and current setpoints.
+    // This covers trajectory, position and step/dir setpoints alike.
+    // With setpoints_in_cpr the position setpoint wraps around, and shaping
+    // the jump at the wrap point would command a move across the whole
+    // revolution, so the shaper is bypassed (see docs/control.md).
+    InputShaperSample_t setpoint = { pos_setpoint_, vel_setpoint_, current_setpoint_ };
+    if (mode >= CTRL_MODE_POSITION_CONTROL && !setpoints_in_cpr && input_shaper_num_impulses_) {
+        setpoint = apply_input_shaper(setpoint);
+        if (mode == CTRL_MODE_TRAJECTORY_CONTROL)
+            anticogging_pos = setpoint.pos;
+    } else {
+        input_shaper_primed_ = false;
     }
 
     // Position control
     // TODO Decide if we want to use encoder or pll position here
-    float vel_des = vel_setpoint_;
-    if (config_.control_mode >= CTRL_MODE_POSITION_CONTROL) {
+    float vel_des = setpoint.vel;
+    if (mode >= CTRL_MODE_POSITION_CONTROL) {
         float pos_err;
-        if (config_.setpoints_in_cpr) {
+        if (setpoints_in_cpr) {
             // TODO this breaks the semantics that estimates come in on the arguments.
             // It's probably better to call a get_estimate that will arbitrate (enc vs sensorless) instead.
             float cpr = (float)(axis_->encoder_.config_.cpr);
@@ -155,7 +688,7 @@ bool Controller::update(float pos_estimate, float vel_estimate, float* current_s
             pos_err = pos_setpoint_ - axis_->encoder_.pos_cpr_;
             pos_err = wrap_pm(pos_err, 0.5f * cpr);
         } else {
-            pos_err = pos_setpoint_ - pos_estimate;
+            pos_err = setpoint.pos - pos_estimate;
         }
         vel_des += config_.pos_gain * pos_err;
     }
@@ -174,23 +707,42 @@ bool Controller::update(float pos_estimate, float vel_estimate, float* current_s
     }
 
     // Velocity control
-    float Iq = current_setpoint_;
+    float Iq = setpoint.current;
+
+    // Inertia and friction feed-forward
+    if (mode >= CTRL_MODE_VELOCITY_CONTROL) {
+        float vel_sign = (config_.friction_deadband > 0.0f)
+                ? std::max(-1.0f, std::min(setpoint.vel / config_.friction_deadband, 1.0f))
+                : (float)((setpoint.vel > 0.0f) - (setpoint.vel < 0.0f));
+        Iq += config_.inertia * accel_des
+            + config_.friction_coulomb * vel_sign
+            + config_.friction_viscous * setpoint.vel;
+    }
 
     // Anti-cogging is enabled after calibration
     // We get the current position and apply a current feed-forward
     // ensuring that we handle negative encoder positions properly (-1 == motor->encoder.encoder_cpr - 1)
-    if (anticogging_.use_anticogging) {
+    if (anticogging) {
         Iq += anticogging_.cogging_map[mod(static_cast<int>(anticogging_pos), axis_->encoder_.config_.cpr)];
     }
 
-    float v_err = vel_des - vel_estimate;
-    if (config_.control_mode >= CTRL_MODE_VELOCITY_CONTROL) {
+    // Filter the velocity feedback (e.g. to suppress mechanical resonances)
+    float vel_feedback = vel_estimate;
+    for (size_t i = 0; i < NUM_FILTER_SECTIONS; ++i)
+        vel_feedback = vel_filters_[i].update(vel_feedback);
+
+    float v_err = vel_des - vel_feedback;
+    if (mode >= CTRL_MODE_VELOCITY_CONTROL) {
         Iq += config_.vel_gain * v_err;
     }
 
     // Velocity integral action before limiting
     Iq += vel_integrator_current_;
 
+    // Filter the torque command
+    for (size_t i = 0; i < NUM_FILTER_SECTIONS; ++i)
+        Iq = torque_filters_[i].update(Iq);
+
     // Current limiting
     bool limited = false;
     float Ilim = axis_->motor_.effective_current_lim();
@@ -204,7 +756,7 @@ bool Controller::update(float pos_estimate, float vel_estimate, float* current_s
     }
 
     // Velocity integrator (behaviour dependent on limiting)
-    if (config_.control_mode < CTRL_MODE_VELOCITY_CONTROL) {
+    if (mode < CTRL_MODE_VELOCITY_CONTROL) {
         // reset integral if not in use
         vel_integrator_current_ = 0.0f;
     } else {
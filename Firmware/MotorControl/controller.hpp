@@ -10,6 +10,8 @@ public:
     enum Error_t {
         ERROR_NONE = 0,
         ERROR_OVERSPEED = 0x01,
+        ERROR_AUTOTUNE_FAILED = 0x02,
+        ERROR_IDENTIFICATION_FAILED = 0x04,
     };
 
     // Note: these should be sorted from lowest level of control to
@@ -22,6 +24,37 @@ public:
         CTRL_MODE_TRAJECTORY_CONTROL = 4
     };
 
+    enum InputShaper_t {
+        INPUT_SHAPER_NONE = 0,
+        INPUT_SHAPER_ZV = 1,   // zero vibration, 2 impulses, shortest delay
+        INPUT_SHAPER_ZVD = 2,  // zero vibration and derivative, 3 impulses, robust to frequency errors
+        INPUT_SHAPER_EI = 3,   // extra insensitive, 3 impulses, 5% residual vibration tolerance
+    };
+
+    struct AutotuneConfig_t {
+        float relay_current = 2.0f;         // [A] current of the relay excitation for the inertia identification
+        float relay_vel = 2000.0f;          // [counts/s] velocity at which the relay switches
+        float relay_duration = 2.0f;        // [s]
+        float excitation_current = 1.0f;    // [A] amplitude of the sine sweep for the resonance search
+        float sweep_min_freq = 10.0f;       // [Hz]
+        float sweep_max_freq = 200.0f;      // [Hz]
+        float resonance_threshold = 2.0f;   // minimum ratio of measured response to rigid body response
+        float vel_bandwidth = 125.0f;       // [rad/s] target velocity loop bandwidth
+        bool enable_notch = false;          // overwrite the last torque filter section with a notch at the resonance
+    };
+
+    struct IdentificationConfig_t {
+        float vel_amplitude = 10000.0f;  // [counts/s] peak velocity of the excitation
+        float frequency = 0.5f;          // [Hz] base frequency of the excitation
+        float duration = 10.0f;          // [s]
+        float min_vel = 500.0f;          // [counts/s] slower samples are excluded from the fit
+    };
+
+    static constexpr size_t NUM_FILTER_SECTIONS = 2;
+    static constexpr size_t AUTOTUNE_NUM_FREQUENCIES = 24;
+    static constexpr size_t INPUT_SHAPER_MAX_IMPULSES = 3;
+    static constexpr size_t INPUT_SHAPER_BUFFER_SIZE = 256;
+
     struct Config_t {
         ControlMode_t control_mode = CTRL_MODE_POSITION_CONTROL;  //see: Motor_control_mode_t
         float pos_gain = 20.0f;  // [(counts/s) / counts]
@@ -32,11 +65,34 @@ public:
         float vel_limit_tolerance = 1.2f;  // ratio to vel_lim. 0.0f to disable
         float vel_ramp_rate = 10000.0f;  // [(counts/s) / s]
         bool setpoints_in_cpr = false;
+        Biquad::Config_t vel_filter[NUM_FILTER_SECTIONS];     // applied to the velocity feedback
+        Biquad::Config_t torque_filter[NUM_FILTER_SECTIONS];  // applied to the current command
+        InputShaper_t input_shaper = INPUT_SHAPER_NONE;  // applied to the setpoints in position and trajectory control, bypassed if setpoints_in_cpr is set
+        float input_shaper_frequency = 10.0f;  // [Hz] natural frequency of the vibration to be cancelled
+        float input_shaper_damping = 0.0f;     // damping ratio of the vibration to be cancelled
+        AutotuneConfig_t autotune;
+        // Model based feed-forward: inertia * accel + friction_coulomb * sign(vel) + friction_viscous * vel
+        // applied in velocity, position and trajectory control
+        float inertia = 0.0f;            // [A/(counts/s^2)]
+        float friction_coulomb = 0.0f;   // [A]
+        float friction_viscous = 0.0f;   // [A/(counts/s)]
+        float friction_deadband = 100.0f;  // [counts/s] the Coulomb term is ramped in linearly up to this velocity
+        IdentificationConfig_t identification;
+    };
+
+    struct InputShaperSample_t {
+        float pos;
+        float vel;
+        float current;
     };
 
     explicit Controller(Config_t& config);
     void reset();
     void set_error(Error_t error);
+    void update_filter_coefficients();
+    void update_input_shaper();
+    InputShaperSample_t apply_input_shaper(const InputShaperSample_t& input);
+    InputShaperSample_t get_input_shaper_sample(const InputShaperSample_t& input, float delay);
 
     void set_pos_setpoint(float pos_setpoint, float vel_feed_forward, float current_feed_forward);
     void set_vel_setpoint(float vel_setpoint, float current_feed_forward);
@@ -44,17 +100,40 @@ public:
 
     // Trajectory-Planned control
     void move_to_pos(float goal_point);
+    void move_to_pos_at(float goal_point, uint32_t start_loop_count, float start_offset);
     void move_incremental(float displacement, bool from_goal_point);
     
     // TODO: make this more similar to other calibration loops
     void start_anticogging_calibration();
     bool anticogging_calibration(float pos_estimate, float vel_estimate);
 
-    bool update(float pos_estimate, float vel_estimate, float* current_setpoint);
+    bool run_autotune();
+    bool run_mechanical_identification();
+
+    // @brief Runs one iteration of the control loop, using the specialization
+    // selected by select_update_fn()
+    bool update(float pos_estimate, float vel_estimate, float* current_setpoint) {
+        return (this->*update_fn_)(pos_estimate, vel_estimate, current_setpoint);
+    }
+    void select_update_fn();
 
     Config_t& config_;
     Axis* axis_ = nullptr; // set by Axis constructor
 
+private:
+    using update_fn_t = bool (Controller::*)(float pos_estimate, float vel_estimate, float* current_setpoint);
+
+    template<ControlMode_t mode, bool vel_ramp, bool setpoints_in_cpr, bool anticogging>
+    bool update_specialized(float pos_estimate, float vel_estimate, float* current_setpoint);
+    bool update_anticogging_calibration(float pos_estimate, float vel_estimate, float* current_setpoint);
+    template<ControlMode_t mode, bool vel_ramp, bool setpoints_in_cpr>
+    update_fn_t get_update_fn(bool anticogging);
+    update_fn_t get_update_fn();
+
+    update_fn_t update_fn_ = nullptr; // set by select_update_fn
+
+public:
+
     // TODO: anticogging overhaul:
     // - expose selected (all?) variables on protocol
     // - make calibration user experience similar to motor & encoder calibration
@@ -89,9 +168,42 @@ public:
     bool vel_ramp_enable_ = false;
 
     uint32_t traj_start_loop_count_ = 0;
+    float traj_start_offset_ = 0.0f; // [s] start of the trajectory after the start of loop traj_start_loop_count_
 
     float goal_point_ = 0.0f;
 
+    // Results of the last autotune run
+    float autotune_inertia_ = 0.0f;              // [A/(counts/s^2)]
+    float autotune_resonance_frequency_ = 0.0f;  // [Hz] 0 if no resonance was found
+
+    Biquad vel_filters_[NUM_FILTER_SECTIONS];
+    Biquad torque_filters_[NUM_FILTER_SECTIONS];
+
+    // Input shaper state. The history of the unshaped setpoints is stored
+    // every input_shaper_decimation_ control cycles, such that the longest
+    // impulse delay always fits in the buffer.
+    size_t input_shaper_num_impulses_ = 0;
+    float input_shaper_amplitudes_[INPUT_SHAPER_MAX_IMPULSES] = { 0.0f };
+    float input_shaper_delays_[INPUT_SHAPER_MAX_IMPULSES] = { 0.0f };  // [control cycles]
+    uint32_t input_shaper_decimation_ = 1;
+    uint32_t input_shaper_decimation_counter_ = 0;
+    size_t input_shaper_head_ = 0;
+    bool input_shaper_primed_ = false;
+    InputShaperSample_t input_shaper_buffer_[INPUT_SHAPER_BUFFER_SIZE];
+
+    auto make_filter_definitions(Biquad::Config_t& filter_config) {
+        return make_protocol_member_list(
+            make_protocol_property("type", &filter_config.type,
+                [](void* ctx) { static_cast<Controller*>(ctx)->update_filter_coefficients(); }, this),
+            make_protocol_property("frequency", &filter_config.frequency,
+                [](void* ctx) { static_cast<Controller*>(ctx)->update_filter_coefficients(); }, this),
+            make_protocol_property("q", &filter_config.q,
+                [](void* ctx) { static_cast<Controller*>(ctx)->update_filter_coefficients(); }, this),
+            make_protocol_property("depth", &filter_config.depth,
+                [](void* ctx) { static_cast<Controller*>(ctx)->update_filter_coefficients(); }, this)
+        );
+    }
+
     // Communication protocol definitions
     auto make_protocol_definitions() {
         return make_protocol_member_list(
@@ -101,16 +213,52 @@ public:
             make_protocol_property("vel_integrator_current", &vel_integrator_current_),
             make_protocol_property("current_setpoint", &current_setpoint_),
             make_protocol_property("vel_ramp_target", &vel_ramp_target_),
-            make_protocol_property("vel_ramp_enable", &vel_ramp_enable_),
+            make_protocol_ro_property("autotune_inertia", &autotune_inertia_),
+            make_protocol_ro_property("autotune_resonance_frequency", &autotune_resonance_frequency_),
+            make_protocol_property("vel_ramp_enable", &vel_ramp_enable_,
+                [](void* ctx) { static_cast<Controller*>(ctx)->select_update_fn(); }, this),
             make_protocol_object("config",
-                make_protocol_property("control_mode", &config_.control_mode),
+                make_protocol_property("control_mode", &config_.control_mode,
+                    [](void* ctx) { static_cast<Controller*>(ctx)->select_update_fn(); }, this),
                 make_protocol_property("pos_gain", &config_.pos_gain),
                 make_protocol_property("vel_gain", &config_.vel_gain),
                 make_protocol_property("vel_integrator_gain", &config_.vel_integrator_gain),
                 make_protocol_property("vel_limit", &config_.vel_limit),
                 make_protocol_property("vel_limit_tolerance", &config_.vel_limit_tolerance),
                 make_protocol_property("vel_ramp_rate", &config_.vel_ramp_rate),
-                make_protocol_property("setpoints_in_cpr", &config_.setpoints_in_cpr)
+                make_protocol_property("setpoints_in_cpr", &config_.setpoints_in_cpr,
+                    [](void* ctx) { static_cast<Controller*>(ctx)->select_update_fn(); }, this),
+                make_protocol_object("vel_filter0", make_filter_definitions(config_.vel_filter[0])),
+                make_protocol_object("vel_filter1", make_filter_definitions(config_.vel_filter[1])),
+                make_protocol_object("torque_filter0", make_filter_definitions(config_.torque_filter[0])),
+                make_protocol_object("torque_filter1", make_filter_definitions(config_.torque_filter[1])),
+                make_protocol_property("input_shaper", &config_.input_shaper,
+                    [](void* ctx) { static_cast<Controller*>(ctx)->update_input_shaper(); }, this),
+                make_protocol_property("input_shaper_frequency", &config_.input_shaper_frequency,
+                    [](void* ctx) { static_cast<Controller*>(ctx)->update_input_shaper(); }, this),
+                make_protocol_property("input_shaper_damping", &config_.input_shaper_damping,
+                    [](void* ctx) { static_cast<Controller*>(ctx)->update_input_shaper(); }, this),
+                make_protocol_object("autotune",
+                    make_protocol_property("relay_current", &config_.autotune.relay_current),
+                    make_protocol_property("relay_vel", &config_.autotune.relay_vel),
+                    make_protocol_property("relay_duration", &config_.autotune.relay_duration),
+                    make_protocol_property("excitation_current", &config_.autotune.excitation_current),
+                    make_protocol_property("sweep_min_freq", &config_.autotune.sweep_min_freq),
+                    make_protocol_property("sweep_max_freq", &config_.autotune.sweep_max_freq),
+                    make_protocol_property("resonance_threshold", &config_.autotune.resonance_threshold),
+                    make_protocol_property("vel_bandwidth", &config_.autotune.vel_bandwidth),
+                    make_protocol_property("enable_notch", &config_.autotune.enable_notch)
+                ),
+                make_protocol_property("inertia", &config_.inertia),
+                make_protocol_property("friction_coulomb", &config_.friction_coulomb),
+                make_protocol_property("friction_viscous", &config_.friction_viscous),
+                make_protocol_property("friction_deadband", &config_.friction_deadband),
+                make_protocol_object("identification",
+                    make_protocol_property("vel_amplitude", &config_.identification.vel_amplitude),
+                    make_protocol_property("frequency", &config_.identification.frequency),
+                    make_protocol_property("duration", &config_.identification.duration),
+                    make_protocol_property("min_vel", &config_.identification.min_vel)
+                )
             ),
             make_protocol_function("set_pos_setpoint", *this, &Controller::set_pos_setpoint,
                 "pos_setpoint", "vel_feed_forward", "current_feed_forward"),
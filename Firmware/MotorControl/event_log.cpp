@@ -0,0 +1,150 @@
+
+#include "odrive_main.h"
+
+#define EVENT_LOG_MAGIC 0x4C4F4745UL // "EGOL"
+
+#define HAL_FLASH_ClearError() __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGSERR | FLASH_FLAG_PGPERR)
+
+static EventLog::Ring_t event_log_ring __attribute__((section(".noinit")));
+EventLog event_log(&event_log_ring);
+
+static inline const EventLog::Event_t* flash_events() {
+    return reinterpret_cast<const EventLog::Event_t*>(EVENT_LOG_FLASH_BASE);
+}
+
+static bool is_erased(const EventLog::Event_t& event) {
+    const uint32_t* words = reinterpret_cast<const uint32_t*>(&event);
+    for (size_t i = 0; i < sizeof(event) / sizeof(uint32_t); ++i)
+        if (words[i] != 0xffffffff)
+            return false;
+    return true;
+}
+
+// @brief Restores the state of the log and records the boot event.
+// Must be called once at startup, before any other event is logged.
+void EventLog::init() {
+    // Keep the RAM ring if it survived a reset, so that events which were not
+    // flushed yet are not lost
+    if (ring_->magic != EVENT_LOG_MAGIC || ring_->head - ring_->flushed > RAM_SIZE) {
+        ring_->magic = EVENT_LOG_MAGIC;
+        ring_->head = 0;
+        ring_->flushed = 0;
+    }
+
+    // Find the first free entry and the last boot count. An entry that was
+    // interrupted while being written is neither free nor valid.
+    uint16_t last_boot = 0;
+    num_flushed_ = 0;
+    for (size_t i = 0; i < FLASH_CAPACITY; ++i) {
+        const Event_t& event = flash_events()[i];
+        if (is_erased(event))
+            break;
+        if (event.code != EVENT_NONE)
+            last_boot = event.boot_count;
+        num_flushed_ = i + 1;
+    }
+    for (uint32_t i = ring_->flushed; i != ring_->head; ++i)
+        last_boot = ring_->events[i & (RAM_SIZE - 1)].boot_count;
+    boot_count_ = last_boot + 1;
+
+    log(NO_AXIS, EVENT_BOOT, RCC->CSR);
+    __HAL_RCC_CLEAR_RESET_FLAGS();
+}
+
+// @brief Appends an event to the RAM ring. If the ring is full of events
+// that were not flushed yet, the new event is dropped, such that the first
+// event of a cascade is kept.
+void EventLog::log(uint8_t axis, EventCode_t code, uint32_t data0, uint32_t data1) {
+    uint32_t mask = cpu_enter_critical();
+    if (ring_->head - ring_->flushed < RAM_SIZE) {
+        ring_->events[ring_->head & (RAM_SIZE - 1)] = {
+            HAL_GetTick(), boot_count_, axis, (uint8_t)code, { data0, data1 }
+        };
+        ++ring_->head;
+    } else {
+        ++num_dropped_;
+    }
+    cpu_exit_critical(mask);
+}
+
+// @brief Writes at most one pending event to flash. Called from the idle task.
+// Programming an entry takes less than 100us. The flash is never erased
+// here: once it is full, events stay in the RAM ring until the log is
+// cleared explicitly.
+void EventLog::flush() {
+    if (ring_->flushed == ring_->head || num_flushed_ >= FLASH_CAPACITY)
+        return;
+
+    // This is only a shortcut, the check that counts is repeated with the
+    // scheduler suspended.
+    if (is_any_motor_armed())
+        return;
+
+    // The scheduler is suspended during flash operations, such that the
+    // configuration storage (nvm.c) can't interleave its own operations and
+    // clear() can't run in between. Once the scheduler is suspended no axis
+    // can be armed until the operation is done (see is_any_motor_armed()).
+    vTaskSuspendAll();
+    if (!is_any_motor_armed() && ring_->flushed != ring_->head && num_flushed_ < FLASH_CAPACITY) {
+        Event_t event = ring_->events[ring_->flushed & (RAM_SIZE - 1)];
+        bool success = program_flash(num_flushed_, event);
+        ++num_flushed_; // an entry that failed to program is left behind as invalid
+        if (success)
+            ++ring_->flushed;
+    }
+    xTaskResumeAll();
+}
+
+// @brief Erases the flash and discards the events that were not written yet.
+// Erasing stalls the CPU for one to two seconds, so this is only done on
+// request and only while all motors are disarmed.
+// @returns false if a motor is armed or the erase failed
+bool EventLog::clear() {
+    vTaskSuspendAll();
+    bool success = !is_any_motor_armed() && erase_flash();
+    if (success) {
+        num_flushed_ = 0;
+        ring_->flushed = ring_->head;
+    }
+    xTaskResumeAll();
+    return success;
+}
+
+// Both must be called with the scheduler suspended.
+
+bool EventLog::erase_flash() {
+    FLASH_EraseInitTypeDef erase_struct = {
+        .TypeErase = FLASH_TYPEERASE_SECTORS,
+        .Banks = 0, // only used for mass erase
+        .Sector = EVENT_LOG_FLASH_SECTOR,
+        .NbSectors = 1,
+        .VoltageRange = FLASH_VOLTAGE_RANGE_3
+    };
+    uint32_t sector_error;
+
+    HAL_FLASH_Unlock();
+    HAL_FLASH_ClearError();
+    bool success = HAL_FLASHEx_Erase(&erase_struct, &sector_error) == HAL_OK;
+    HAL_FLASH_Lock();
+    return success;
+}
+
+// @brief Programs one entry. The word holding the event code is written
+// last, so an interrupted write leaves an entry with code EVENT_NONE.
+bool EventLog::program_flash(size_t index, const Event_t& event) {
+    uintptr_t addr = EVENT_LOG_FLASH_BASE + index * sizeof(Event_t);
+    const uint32_t* words = reinterpret_cast<const uint32_t*>(&event);
+    const size_t order[] = { 2, 3, 0, 1 };
+
+    HAL_FLASH_Unlock();
+    HAL_FLASH_ClearError();
+    bool success = true;
+    for (size_t i : order) {
+        if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, addr + i * sizeof(uint32_t), words[i]) != HAL_OK) {
+            success = false;
+            break;
+        }
+    }
+    HAL_FLASH_Lock();
+    return success;
+}
@@ -0,0 +1,90 @@
+#ifndef __EVENT_LOG_HPP
+#define __EVENT_LOG_HPP
+
+#ifndef __ODRIVE_MAIN_H
+#error "This file should not be included directly. Include odrive_main.h instead."
+#endif
+
+// Flash sector reserved for the event log (see STM32F405RGTx_FLASH.ld)
+#define EVENT_LOG_FLASH_SECTOR FLASH_SECTOR_9
+#define EVENT_LOG_FLASH_BASE   0x080A0000UL
+#define EVENT_LOG_FLASH_SIZE   0x20000UL
+
+// @brief Log of timestamped events (errors, state changes, resets) that
+// survives reboots.
+//
+// Events are first written to a RAM ring, which sits in the .noinit section
+// and therefore also survives soft and watchdog resets. The idle task copies
+// them to the reserved flash sector one at a time. Since flash operations
+// stall the CPU, this only happens while all motors are disarmed; any error
+// disarms the motor, so errors are persisted right after they occur.
+//
+// The sector is only erased by clear(). When it is full, new events are kept
+// in the RAM ring until that is full too, then they are dropped.
+class EventLog {
+public:
+    enum EventCode_t {
+        EVENT_BOOT = 0,             //<! data0: RCC reset flags (RCC->CSR)
+        EVENT_STATE_CHANGE = 1,     //<! data0: new axis state, data1: previous axis state
+        EVENT_AXIS_ERROR = 2,       //<! data0: axis error, data1: motor error
+        EVENT_ENCODER_ERROR = 3,    //<! data0: encoder error, data1: sensorless estimator error
+        EVENT_CONTROLLER_ERROR = 4, //<! data0: controller error
+        EVENT_NONE = 0xff,          //<! erased or incompletely written flash entry
+    };
+
+    static constexpr uint8_t NO_AXIS = 0xff;
+    static constexpr size_t RAM_SIZE = 32; // [events] must be a power of 2
+
+    struct Event_t {
+        uint32_t timestamp;   // [ms] since boot
+        uint16_t boot_count;  // incremented on every reset
+        uint8_t axis;         // axis number or NO_AXIS
+        uint8_t code;         // EventCode_t
+        uint32_t data[2];
+    };
+    static_assert(sizeof(Event_t) == 16, "flash layout changed");
+
+    static constexpr size_t FLASH_CAPACITY = EVENT_LOG_FLASH_SIZE / sizeof(Event_t);
+
+    // The indices count events since the RAM ring was (re)initialized and
+    // are only ever incremented, so head - flushed is the number of pending
+    // events. The slot of an event is its index modulo RAM_SIZE.
+    struct Ring_t {
+        uint32_t magic;
+        uint32_t head;
+        uint32_t flushed;
+        Event_t events[RAM_SIZE];
+    };
+
+    EventLog(Ring_t* ring) : ring_(ring) {}
+
+    void init();
+    void log(uint8_t axis, EventCode_t code, uint32_t data0, uint32_t data1 = 0);
+    void flush();
+    bool clear();
+
+    Ring_t* const ring_;
+    uint32_t num_flushed_ = 0; // number of used entries in flash
+    uint32_t num_dropped_ = 0; // events lost because the RAM ring was full
+    uint16_t boot_count_ = 0;
+
+    // Communication protocol definitions
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_ro_property("boot_count", &boot_count_),
+            make_protocol_ro_property("num_flushed", &num_flushed_),
+            make_protocol_ro_property("num_dropped", &num_dropped_),
+            make_protocol_ro_property("head", &ring_->head),
+            make_protocol_ro_property("flushed", &ring_->flushed),
+            make_protocol_buffer("flash", reinterpret_cast<const Event_t*>(EVENT_LOG_FLASH_BASE), FLASH_CAPACITY),
+            make_protocol_buffer("ram", ring_->events, RAM_SIZE),
+            make_protocol_function("clear", *this, &EventLog::clear)
+        );
+    }
+
+private:
+    bool erase_flash();
+    bool program_flash(size_t index, const Event_t& event);
+};
+
+#endif // __EVENT_LOG_HPP
@@ -0,0 +1,70 @@
+#ifndef __FLIGHT_RECORDER_HPP
+#define __FLIGHT_RECORDER_HPP
+
+#ifndef __ODRIVE_MAIN_H
+#error "This file should not be included directly. Include odrive_main.h instead."
+#endif
+
+// @brief Records a compact snapshot of every control cycle into a ring buffer,
+// such that the cycles leading up to a fault can be inspected afterwards.
+//
+// The current measurement interrupt opens a new sample on every cycle and is
+// the only writer of head_. The control thread fills in the remaining fields
+// of the sample at head_. Recording stops as soon as freeze() is called
+// (on any axis error) and resumes on rearm().
+class FlightRecorder {
+public:
+    static constexpr size_t NUM_SAMPLES = 128; // must be a power of 2
+
+    struct Sample_t {
+        uint32_t loop_counter;    // axis loop counter at the time of the interrupt
+        uint32_t isr_entry;       // [CPU cycles] entry of the current measurement interrupt
+        uint32_t thread_wake;     // [CPU cycles] control thread resumed, 0 if it did not run
+        uint32_t enqueue;         // [CPU cycles] PWM timings enqueued, 0 if none were enqueued
+        uint8_t state;            // axis state
+        uint8_t armed_state;      // motor armed state
+        uint16_t motor_error;     // lower 16 bits of the motor error
+        float pos_setpoint;       // [counts]
+        float vel_setpoint;       // [counts/s]
+        float current_setpoint;   // [A] Iq setpoint of the current controller
+    } __attribute__((packed));
+
+    // @brief Opens a new sample. Called from the current measurement interrupt.
+    inline void on_isr_entry(uint32_t loop_counter) {
+        if (frozen_)
+            return;
+        size_t head = (head_ + 1) & (NUM_SAMPLES - 1);
+        samples_[head] = { loop_counter, DWT->CYCCNT, 0, 0, 0, 0, 0, 0.0f, 0.0f, 0.0f };
+        head_ = head;
+    }
+
+    inline void on_thread_wake() {
+        if (!frozen_)
+            samples_[head_].thread_wake = DWT->CYCCNT;
+    }
+
+    // @brief Returns the sample of the current cycle for the control thread
+    // to fill in, or nullptr when frozen.
+    inline Sample_t* current() {
+        return frozen_ ? nullptr : &samples_[head_];
+    }
+
+    void freeze() { frozen_ = true; }
+    void rearm() { frozen_ = false; }
+
+    bool frozen_ = false;
+    uint32_t head_ = 0; // index of the newest sample
+    Sample_t samples_[NUM_SAMPLES] = {};
+
+    // Communication protocol definitions
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_ro_property("frozen", &frozen_),
+            make_protocol_ro_property("head", &head_),
+            make_protocol_buffer("samples", samples_, NUM_SAMPLES),
+            make_protocol_function("rearm", *this, &FlightRecorder::rearm)
+        );
+    }
+};
+
+#endif // __FLIGHT_RECORDER_HPP
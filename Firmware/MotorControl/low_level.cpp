@@ -117,6 +117,17 @@ bool safety_critical_disarm_motor_pwm(Motor& motor) {
     return was_armed;
 }
 
+// @brief Flash operations stall the CPU, including the control loops, so
+// they must only be started while this returns false.
+// Motors are armed from the axis threads, so the result stays valid while
+// the scheduler is suspended.
+bool is_any_motor_armed() {
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        if (axes[i]->motor_.armed_state_ != Motor::ARMED_STATE_DISARMED)
+            return true;
+    return false;
+}
+
 // @brief Updates the phase timings unless the motor is disarmed.
 //
 // If this is called at a rate higher than the motor's timer period,
@@ -426,11 +437,8 @@ void vbus_sense_adc_cb(ADC_HandleTypeDef* hadc, bool injected) {
     // Only one conversion in sequence, so only rank1
     uint32_t ADCValue = HAL_ADCEx_InjectedGetValue(hadc, ADC_INJECTED_RANK_1);
     vbus_voltage = ADCValue * voltage_scale;
-    if (axes[0] && !axes[0]->error_ && axes[1] && !axes[1]->error_) {
-        if (oscilloscope_pos >= OSCILLOSCOPE_SIZE)
-            oscilloscope_pos = 0;
-        oscilloscope[oscilloscope_pos++] = vbus_voltage;
-    }
+    oscilloscope.update();
+    telemetry.update();
 }
 
 static void decode_hall_samples(Encoder& enc, uint16_t GPIO_samples[num_GPIO]) {
@@ -485,10 +493,16 @@ void pwm_trig_adc_cb(ADC_HandleTypeDef* hadc, bool injected) {
     bool current_meas_not_DC_CAL = !counting_down;
 
     // Check the timing of the sequencing
-    if (current_meas_not_DC_CAL)
+    if (current_meas_not_DC_CAL) {
+        // TIM13 runs synchronously to the PWM timers and is converted to CPU cycles here
+        static const uint32_t clocks_per_cnt = (uint32_t)((float)TIM_1_8_CLOCK_HZ / (float)TIM_APB1_CLOCK_HZ);
+        axis.motor_.timing_ref_cycles_ = DWT->CYCCNT - clocks_per_cnt * htim13.Instance->CNT; // TODO: Use a hw_config
+        axis.motor_.timing_ref_loop_count_ = axis.loop_counter_;
+        axis.flight_recorder_.on_isr_entry(axis.loop_counter_);
         axis.motor_.log_timing(Motor::TIMING_LOG_ADC_CB_I);
-    else
+    } else {
         axis.motor_.log_timing(Motor::TIMING_LOG_ADC_CB_DC);
+    }
 
     bool update_timings = false;
     if (hadc == &hadc2) {
@@ -506,6 +520,7 @@ void pwm_trig_adc_cb(ADC_HandleTypeDef* hadc, bool injected) {
             bool was_armed = safety_critical_disarm_motor_pwm(other_axis.motor_);
             if (was_armed) {
                 other_axis.motor_.error_ |= Motor::ERROR_CONTROL_DEADLINE_MISSED;
+                other_axis.flight_recorder_.freeze();
             }
         } else {
             other_axis.motor_.next_timings_valid_ = false;
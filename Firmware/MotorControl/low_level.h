@@ -29,6 +29,7 @@ extern uint16_t adc_measurements_[ADC_CHANNEL_COUNT];
 
 void safety_critical_arm_motor_pwm(Motor& motor);
 bool safety_critical_disarm_motor_pwm(Motor& motor);
+bool is_any_motor_armed();
 void safety_critical_apply_motor_pwm_timings(Motor& motor, uint16_t timings[3]);
 void safety_critical_arm_brake_resistor();
 void safety_critical_disarm_brake_resistor();
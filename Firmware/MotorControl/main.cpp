@@ -7,6 +7,7 @@
 #include <communication/interface_usb.h>
 #include <communication/interface_uart.h>
 #include <communication/interface_i2c.h>
+#include <communication/interface_can.hpp>
 
 BoardConfig_t board_config;
 Encoder::Config_t encoder_configs[AXIS_COUNT];
@@ -101,22 +102,103 @@ int odrive_main(void);
 void vApplicationStackOverflowHook(xTaskHandle *pxTask, signed portCHAR *pcTaskName) {
     for (;;); // TODO: safe action
 }
+
+// Called when the FreeRTOS heap is exhausted. This includes starting a thread,
+// so a thread that doesn't fit stops the firmware here instead of silently
+// leaving a feature without its thread.
+void vApplicationMallocFailedHook(void) {
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        if (axes[i])
+            safety_critical_disarm_motor_pwm(axes[i]->motor_);
+    }
+    for (;;);
+}
+
+// A thread whose CPU load and stack usage are reported in system_stats_.
+// The handle is read through a pointer because most threads are started
+// after the table is defined.
+struct ThreadStats_t {
+    osThreadId* thread;
+    float* cpu_load;
+    uint32_t* min_stack_space; // nullptr if the stack usage isn't reported
+    uint32_t last_counter;
+};
+
+struct IsrStats_t {
+    volatile uint32_t* cycles;
+    float* cpu_load;
+    uint32_t last_counter;
+};
+
+// @brief Updates the stack usage in system_stats_ and the CPU load figures
+// once per second.
+// The run-time counters count DWT cycles (see FreeRTOSConfig.h) and wrap
+// around, so only their differences are used.
+static void update_thread_stats() {
+    static osThreadId idle_thread = xTaskGetIdleTaskHandle();
+    // Set up on the first call, which is after boot, when the axes exist.
+    // The startup task is not listed since it ends after boot and the
+    // communication task reports its own stack usage before it ends.
+    static ThreadStats_t threads[] = {
+        { &axes[0]->thread_id_, &system_stats_.cpu_load_axis0, &system_stats_.min_stack_space_axis0 },
+        { &axes[1]->thread_id_, &system_stats_.cpu_load_axis1, &system_stats_.min_stack_space_axis1 },
+        { &usb_cdc_thread, &system_stats_.cpu_load_usb_cdc, &system_stats_.min_stack_space_usb_cdc },
+        { &usb_native_thread, &system_stats_.cpu_load_usb_native, &system_stats_.min_stack_space_usb_native },
+        { &usb_telemetry_thread, &system_stats_.cpu_load_usb_telemetry, nullptr },
+        { &usb_notification_thread, &system_stats_.cpu_load_usb_notification, nullptr },
+        { &uart_thread, &system_stats_.cpu_load_uart, &system_stats_.min_stack_space_uart },
+        { &usb_irq_thread, &system_stats_.cpu_load_usb_irq, &system_stats_.min_stack_space_usb_irq },
+        { &can_thread, &system_stats_.cpu_load_can, &system_stats_.min_stack_space_can },
+        { &idle_thread, &system_stats_.cpu_load_idle, nullptr },
+    };
+    static IsrStats_t isrs[] = {
+        { &adc_isr_cycles, &system_stats_.cpu_load_adc_isr },
+        { &tim_update_isr_cycles, &system_stats_.cpu_load_tim_update_isr },
+    };
+    static uint32_t last_update = 0;
+    static uint32_t last_cycles = 0;
+
+    for (ThreadStats_t& stats : threads) {
+        // a thread that isn't started would make FreeRTOS report the idle task
+        if (*stats.thread && stats.min_stack_space)
+            *stats.min_stack_space = uxTaskGetStackHighWaterMark(*stats.thread) * sizeof(StackType_t);
+    }
+
+    uint32_t now = xTaskGetTickCount();
+    if (now - last_update < 1000)
+        return;
+    last_update = now;
+
+    uint32_t cycles = portGET_RUN_TIME_COUNTER_VALUE();
+    float scale = 100.0f / (float)(cycles - last_cycles);
+    last_cycles = cycles;
+
+    for (ThreadStats_t& stats : threads) {
+        TaskStatus_t status = { 0 };
+        if (*stats.thread)
+            vTaskGetInfo(*stats.thread, &status, pdFALSE, eInvalid);
+        *stats.cpu_load = scale * (float)(status.ulRunTimeCounter - stats.last_counter);
+        stats.last_counter = status.ulRunTimeCounter;
+    }
+    for (IsrStats_t& stats : isrs) {
+        uint32_t counter = *stats.cycles;
+        *stats.cpu_load = scale * (float)(counter - stats.last_counter);
+        stats.last_counter = counter;
+    }
+}
+
 void vApplicationIdleHook(void) {
     if (system_stats_.fully_booted) {
         system_stats_.uptime = xTaskGetTickCount();
         system_stats_.min_heap_space = xPortGetMinimumEverFreeHeapSize();
-        system_stats_.min_stack_space_comms = uxTaskGetStackHighWaterMark(comm_thread) * sizeof(StackType_t);
-        system_stats_.min_stack_space_axis0 = uxTaskGetStackHighWaterMark(axes[0]->thread_id_) * sizeof(StackType_t);
-        system_stats_.min_stack_space_axis1 = uxTaskGetStackHighWaterMark(axes[1]->thread_id_) * sizeof(StackType_t);
-        system_stats_.min_stack_space_usb = uxTaskGetStackHighWaterMark(usb_thread) * sizeof(StackType_t);
-        system_stats_.min_stack_space_uart = uxTaskGetStackHighWaterMark(uart_thread) * sizeof(StackType_t);
-        system_stats_.min_stack_space_usb_irq = uxTaskGetStackHighWaterMark(usb_irq_thread) * sizeof(StackType_t);
-        system_stats_.min_stack_space_startup = uxTaskGetStackHighWaterMark(defaultTaskHandle) * sizeof(StackType_t);
+        update_thread_stats();
+        event_log.flush();
     }
 }
 }
 
 int odrive_main(void) {
+    event_log.init();
 
 #if HW_VERSION_MAJOR == 3 && HW_VERSION_MINOR >= 3
     if (board_config.enable_i2c_instead_of_can) {
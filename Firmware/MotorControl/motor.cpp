@@ -191,15 +191,24 @@ float Motor::effective_current_lim() {
     return current_lim;
 }
 
+// @brief Records the CPU cycles elapsed since the start of the PWM period of
+// the last current measurement. Unlike the TIM13 count, this does not wrap
+// when the control loop overruns the PWM period.
+// The DWT cycle counter is enabled by the FreeRTOS run-time stats setup.
 void Motor::log_timing(TimingLog_t log_idx) {
-    static const uint16_t clocks_per_cnt = (uint16_t)((float)TIM_1_8_CLOCK_HZ / (float)TIM_APB1_CLOCK_HZ);
-    uint16_t timing = clocks_per_cnt * htim13.Instance->CNT; // TODO: Use a hw_config
+    uint32_t timing = DWT->CYCCNT - timing_ref_cycles_;
 
     if (log_idx < TIMING_LOG_NUM_SLOTS) {
-        timing_log_[log_idx] = timing;
+        timing_log_[log_idx] = timing < 0xffff ? timing : 0xffff;
+        timing_histograms_[log_idx].add(timing);
     }
 }
 
+void Motor::reset_timing_log() {
+    for (size_t i = 0; i < TIMING_LOG_NUM_SLOTS; ++i)
+        timing_histograms_[i].reset();
+}
+
 float Motor::phase_current_from_adcval(uint32_t ADCValue) {
     int adcval_bal = (int)ADCValue - (1 << 11);
     float amp_out_volt = (3.3f / (float)(1 << 12)) * (float)adcval_bal;
@@ -309,6 +318,15 @@ bool Motor::enqueue_modulation_timings(float mod_alpha, float mod_beta) {
     next_timings_[1] = (uint16_t)(tB * (float)TIM_1_8_PERIOD_CLOCKS);
     next_timings_[2] = (uint16_t)(tC * (float)TIM_1_8_PERIOD_CLOCKS);
     next_timings_valid_ = true;
+    if (FlightRecorder::Sample_t* sample = axis_->flight_recorder_.current()) {
+        sample->enqueue = DWT->CYCCNT;
+        sample->state = (uint8_t)axis_->current_state_;
+        sample->armed_state = (uint8_t)armed_state_;
+        sample->motor_error = (uint16_t)error_;
+        sample->pos_setpoint = axis_->controller_.pos_setpoint_;
+        sample->vel_setpoint = axis_->controller_.vel_setpoint_;
+        sample->current_setpoint = current_control_.Iq_setpoint;
+    }
     return true;
 }
 
@@ -117,6 +117,7 @@ public:
     bool update_thermal_limits();
     float effective_current_lim();
     void log_timing(TimingLog_t log_idx);
+    void reset_timing_log();
     float phase_current_from_adcval(uint32_t ADCValue);
     bool measure_phase_resistance(float test_current, float max_voltage);
     bool measure_phase_inductance(float voltage_low, float voltage_high);
@@ -142,8 +143,10 @@ public:
     };
     bool next_timings_valid_ = false;
     uint16_t last_cpu_time_ = 0;
-    int timing_log_index_ = 0;
-    uint16_t timing_log_[TIMING_LOG_NUM_SLOTS] = { 0 };
+    uint32_t timing_ref_cycles_ = 0; // [CPU cycles] start of the PWM period of the last current measurement
+    uint32_t timing_ref_loop_count_ = 0; // axis loop_counter_ of the control iteration that processes this measurement
+    uint16_t timing_log_[TIMING_LOG_NUM_SLOTS] = { 0 }; // [CPU cycles] last sample, saturates at 0xffff
+    TimingHistogram timing_histograms_[TIMING_LOG_NUM_SLOTS];
 
     // variables exposed on protocol
     Error_t error_ = ERROR_NONE;
@@ -217,7 +220,17 @@ public:
                 make_protocol_ro_property("TIMING_LOG_ENC_CALIB", &timing_log_[TIMING_LOG_ENC_CALIB]),
                 make_protocol_ro_property("TIMING_LOG_IDX_SEARCH", &timing_log_[TIMING_LOG_IDX_SEARCH]),
                 make_protocol_ro_property("TIMING_LOG_FOC_VOLTAGE", &timing_log_[TIMING_LOG_FOC_VOLTAGE]),
-                make_protocol_ro_property("TIMING_LOG_FOC_CURRENT", &timing_log_[TIMING_LOG_FOC_CURRENT])
+                make_protocol_ro_property("TIMING_LOG_FOC_CURRENT", &timing_log_[TIMING_LOG_FOC_CURRENT]),
+                make_protocol_object("general", timing_histograms_[TIMING_LOG_GENERAL].make_protocol_definitions()),
+                make_protocol_object("adc_cb_i", timing_histograms_[TIMING_LOG_ADC_CB_I].make_protocol_definitions()),
+                make_protocol_object("adc_cb_dc", timing_histograms_[TIMING_LOG_ADC_CB_DC].make_protocol_definitions()),
+                make_protocol_object("meas_r", timing_histograms_[TIMING_LOG_MEAS_R].make_protocol_definitions()),
+                make_protocol_object("meas_l", timing_histograms_[TIMING_LOG_MEAS_L].make_protocol_definitions()),
+                make_protocol_object("enc_calib", timing_histograms_[TIMING_LOG_ENC_CALIB].make_protocol_definitions()),
+                make_protocol_object("idx_search", timing_histograms_[TIMING_LOG_IDX_SEARCH].make_protocol_definitions()),
+                make_protocol_object("foc_voltage", timing_histograms_[TIMING_LOG_FOC_VOLTAGE].make_protocol_definitions()),
+                make_protocol_object("foc_current", timing_histograms_[TIMING_LOG_FOC_CURRENT].make_protocol_definitions()),
+                make_protocol_function("reset", *this, &Motor::reset_timing_log)
             ),
             make_protocol_object("config",
                 make_protocol_property("pre_calibrated", &config_.pre_calibrated),
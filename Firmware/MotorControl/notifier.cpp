@@ -0,0 +1,108 @@
+#include "odrive_main.h"
+
+// @brief Subscribes to changes of a property. The current value is sent
+// right away.
+// @returns The subscription index or -1 if the endpoint is invalid or all
+// subscriptions are in use.
+int32_t Notifier::subscribe(endpoint_ref_t endpoint_ref, uint32_t min_interval) {
+    Endpoint* endpoint = get_endpoint(endpoint_ref);
+    // Only properties can be sampled, reading a function endpoint would call it
+    if (!endpoint || !endpoint->get_name())
+        return -1;
+
+    for (size_t i = 0; i < NUM_SUBSCRIPTIONS; ++i) {
+        Subscription_t& subscription = subscriptions_[i];
+        uint32_t mask = cpu_enter_critical();
+        if (subscription.endpoint) {
+            cpu_exit_critical(mask);
+            continue;
+        }
+        subscription.endpoint = endpoint;
+        subscription.endpoint_id = endpoint_ref.endpoint_id;
+        subscription.min_interval = min_interval;
+        subscription.last_sent = HAL_GetTick() - min_interval;
+        subscription.pending = true;
+        subscription.length = 0;
+        ++num_subscriptions_;
+        cpu_exit_critical(mask);
+        return i;
+    }
+    return -1;
+}
+
+void Notifier::unsubscribe(int32_t index) {
+    if (index < 0 || (size_t)index >= NUM_SUBSCRIPTIONS)
+        return;
+    uint32_t mask = cpu_enter_critical();
+    if (subscriptions_[index].endpoint) {
+        subscriptions_[index].endpoint = nullptr;
+        --num_subscriptions_;
+    }
+    cpu_exit_critical(mask);
+}
+
+void Notifier::unsubscribe_all() {
+    for (size_t i = 0; i < NUM_SUBSCRIPTIONS; ++i)
+        unsubscribe(i);
+}
+
+// @brief Reads the current value of the endpoint and remembers it if it
+// changed. Must be called with interrupts disabled.
+// @returns True if the value must be sent now.
+bool Notifier::sample(Subscription_t& subscription, uint32_t now) {
+    uint8_t value[MAX_VALUE_SIZE];
+    MemoryStreamSink sink(value, sizeof(value));
+    subscription.endpoint->handle(nullptr, 0, &sink);
+    size_t length = sizeof(value) - sink.get_free_space();
+
+    if (length != subscription.length || memcmp(value, subscription.value, length)) {
+        memcpy(subscription.value, value, length);
+        subscription.length = length;
+        subscription.pending = true;
+    }
+    return subscription.pending && (now - subscription.last_sent >= subscription.min_interval);
+}
+
+// @brief Sends the changed values of all subscriptions whose interval has
+// elapsed. Called periodically by the sender thread.
+void Notifier::update(PacketSink& output) {
+    uint32_t now = HAL_GetTick();
+    uint8_t* packet = packets_[write_buf_];
+    size_t length = HEADER_SIZE;
+
+    for (size_t i = 0; i < NUM_SUBSCRIPTIONS; ++i) {
+        if (length + ENTRY_HEADER_SIZE + MAX_VALUE_SIZE > PACKET_SIZE) {
+            send(output, length);
+            packet = packets_[write_buf_];
+            length = HEADER_SIZE;
+        }
+
+        Subscription_t& subscription = subscriptions_[i];
+        uint32_t mask = cpu_enter_critical();
+        if (subscription.endpoint && sample(subscription, now)) {
+            length += write_le<uint16_t>(subscription.endpoint_id, packet + length);
+            length += write_le<uint8_t>(subscription.length, packet + length);
+            memcpy(packet + length, subscription.value, subscription.length);
+            length += subscription.length;
+            subscription.pending = false;
+            subscription.last_sent = now;
+        }
+        cpu_exit_critical(mask);
+    }
+
+    if (length > HEADER_SIZE)
+        send(output, length);
+}
+
+// @brief Sends the packet that was filled last and switches to the other
+// buffer. The USB sender returns while the packet is still being transmitted
+// and only waits for the previous transmission to complete before it starts
+// the next one, so the buffer that is filled next is never in flight.
+void Notifier::send(PacketSink& output, size_t length) {
+    uint8_t* packet = packets_[write_buf_];
+    write_le<uint16_t>(NOTIFICATION_STREAM_ID | 0x8000, packet);
+    write_le<uint16_t>(seq_no_++, packet + 2);
+    output.process_packet(packet, length);
+    write_buf_ ^= 1;
+    ++sent_cnt_;
+}
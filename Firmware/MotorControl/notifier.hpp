@@ -0,0 +1,72 @@
+#ifndef __NOTIFIER_HPP
+#define __NOTIFIER_HPP
+
+#ifndef __ODRIVE_MAIN_H
+#error "This file should not be included directly. Include odrive_main.h instead."
+#endif
+
+// @brief Device-initiated notifications about changed property values, so
+// that the host does not have to poll them.
+//
+// The sender thread calls update() once per millisecond, which compares the
+// raw value of each subscribed endpoint with the value that was sent last.
+// A subscription sends at most one notification per min_interval. If the
+// value changes again in the meantime, the latest value is sent as soon as
+// the interval has elapsed, so the host always ends up with the current value.
+// Changes that happen faster than the update rate can be missed.
+// Packets are filled alternately into two buffers, because the USB
+// transmission of a packet is still running when the next one is filled.
+//
+// Packet layout (little endian):
+//   uint16 stream id (NOTIFICATION_STREAM_ID | 0x8000, never used by responses)
+//   uint16 packet sequence number
+//   entries of: uint16 endpoint id, uint8 value length, value
+class Notifier {
+public:
+    static constexpr size_t NUM_SUBSCRIPTIONS = 16;
+    static constexpr size_t MAX_VALUE_SIZE = 8;
+    static constexpr size_t PACKET_SIZE = 64; // [bytes] one full speed USB packet
+    static constexpr size_t HEADER_SIZE = 4;
+    static constexpr size_t ENTRY_HEADER_SIZE = 3;
+    static constexpr uint16_t NOTIFICATION_STREAM_ID = 0x0002;
+
+    struct Subscription_t {
+        Endpoint* endpoint = nullptr; // nullptr if the slot is free
+        uint16_t endpoint_id = 0;
+        uint32_t min_interval = 0;    // [ms]
+        uint32_t last_sent = 0;       // [ms]
+        bool pending = false;         // the value must be sent when the interval has elapsed
+        uint8_t length = 0;
+        uint8_t value[MAX_VALUE_SIZE];
+    };
+
+    int32_t subscribe(endpoint_ref_t endpoint, uint32_t min_interval);
+    void unsubscribe(int32_t index);
+    void unsubscribe_all();
+    void update(PacketSink& output);
+
+    uint32_t num_subscriptions_ = 0;
+    uint32_t sent_cnt_ = 0;
+
+    // Communication protocol definitions
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_ro_property("num_subscriptions", &num_subscriptions_),
+            make_protocol_ro_property("sent_cnt", &sent_cnt_),
+            make_protocol_function("subscribe", *this, &Notifier::subscribe, "endpoint", "min_interval"),
+            make_protocol_function("unsubscribe", *this, &Notifier::unsubscribe, "index"),
+            make_protocol_function("unsubscribe_all", *this, &Notifier::unsubscribe_all)
+        );
+    }
+
+private:
+    bool sample(Subscription_t& subscription, uint32_t now);
+    void send(PacketSink& output, size_t length);
+
+    Subscription_t subscriptions_[NUM_SUBSCRIPTIONS];
+    uint16_t seq_no_ = 0;
+    uint32_t write_buf_ = 0; // packet buffer being filled, the other one may still be in flight
+    uint8_t packets_[2][PACKET_SIZE];
+};
+
+#endif // __NOTIFIER_HPP
@@ -50,13 +50,32 @@ typedef struct {
     uint32_t min_stack_space_axis0; // minimum remaining space since startup [Bytes]
     uint32_t min_stack_space_axis1;
     uint32_t min_stack_space_comms;
-    uint32_t min_stack_space_usb;
+    uint32_t min_stack_space_usb_cdc;
+    uint32_t min_stack_space_usb_native;
     uint32_t min_stack_space_uart;
     uint32_t min_stack_space_usb_irq;
-    uint32_t min_stack_space_startup;
+    uint32_t min_stack_space_can;
+    // Share of the CPU time over the last second [%]. The thread figures
+    // include the time of interrupts that preempted the thread.
+    float cpu_load_axis0;
+    float cpu_load_axis1;
+    float cpu_load_usb_cdc;
+    float cpu_load_usb_native;
+    float cpu_load_usb_telemetry;
+    float cpu_load_usb_notification;
+    float cpu_load_uart;
+    float cpu_load_usb_irq;
+    float cpu_load_can;
+    float cpu_load_idle;
+    float cpu_load_adc_isr;
+    float cpu_load_tim_update_isr;
 } SystemStats_t;
 extern SystemStats_t system_stats_;
 
+// defined in stm32f4xx_it.c
+extern volatile uint32_t adc_isr_cycles;
+extern volatile uint32_t tim_update_isr_cycles;
+
 #ifdef __cplusplus
 }
 
@@ -69,7 +88,13 @@ struct PWMMapping_t {
 // @brief general user configurable board configuration
 struct BoardConfig_t {
     bool enable_uart = true;
+    uint32_t uart_baudrate = 115200;
     bool enable_i2c_instead_of_can = false;
+    bool enable_can = false;            //<! start the CAN server (requires a reboot, ignored if enable_i2c_instead_of_can is set)
+    uint8_t can_node_id = 0;            //<! 1-127: fixed CAN node ID, 0: negotiate a free node ID on the bus
+    uint32_t can_feedback_period = 20;  //<! [ms] period of the cyclic CAN feedback frames, 0 disables them
+    uint32_t can_status_period = 100;   //<! [ms] period of the cyclic CAN status frames, 0 disables them
+    uint32_t can_sync_period = 0;       //<! [ms] period of the CAN SYNC frames if this node is the time master (1-500), 0: follow the master on the bus
     bool enable_ascii_protocol_on_usb = true;
 #if HW_VERSION_MAJOR == 3 && HW_VERSION_MINOR >= 5 && HW_VERSION_VOLTAGE >= 48
     float brake_resistance = 2.0f;     // [ohm]
@@ -93,10 +118,11 @@ class Motor;
 constexpr size_t AXIS_COUNT = 2;
 extern Axis *axes[AXIS_COUNT];
 
-// if you use the oscilloscope feature you can bump up this value
+// [floats] shared by all oscilloscope channels
+// Can be set with CONFIG_OSCILLOSCOPE_SIZE in tup.config, larger captures cost 4 bytes of RAM per float
+#ifndef OSCILLOSCOPE_SIZE
 #define OSCILLOSCOPE_SIZE 128
-extern float oscilloscope[OSCILLOSCOPE_SIZE];
-extern size_t oscilloscope_pos;
+#endif
 
 // TODO: move
 // this is technically not thread-safe but practically it might be
@@ -115,12 +141,24 @@ inline ENUMTYPE operator ~ (ENUMTYPE a) { return static_cast<ENUMTYPE>(~static_c
 #include <low_level.h>
 #include <encoder.hpp>
 #include <sensorless_estimator.hpp>
+#include <biquad.hpp>
+#include <timing_histogram.hpp>
+#include <flight_recorder.hpp>
+#include <oscilloscope.hpp>
+#include <telemetry.hpp>
+#include <event_log.hpp>
+#include <notifier.hpp>
 #include <controller.hpp>
 #include <motor.hpp>
 #include <trapTraj.hpp>
 #include <axis.hpp>
 #include <communication/communication.h>
 
+extern Oscilloscope oscilloscope;
+extern Telemetry telemetry;
+extern EventLog event_log;
+extern Notifier notifier;
+
 #endif // __cplusplus
 
 
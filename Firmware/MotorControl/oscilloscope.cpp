@@ -0,0 +1,101 @@
+
+#include "odrive_main.h"
+
+// @brief Starts a new capture with the current config.
+// @returns False if the config is invalid.
+bool Oscilloscope::start() {
+    state_ = STATE_IDLE; // stop sampling while the capture is set up
+
+    if (config_.num_channels < 1 || config_.num_channels > NUM_CHANNELS)
+        return false;
+    uint32_t capacity = OSCILLOSCOPE_SIZE / config_.num_channels;
+    uint32_t num_frames = config_.num_frames ? config_.num_frames : capacity;
+    if (num_frames > capacity || config_.pre_trigger_frames >= num_frames)
+        return false;
+    Endpoint* trigger_endpoint = get_endpoint(config_.trigger_endpoint);
+    if (config_.trigger_mode != TRIGGER_MODE_IMMEDIATE && !trigger_endpoint)
+        return false;
+    uint32_t error;
+    if (config_.trigger_mode == TRIGGER_MODE_ERROR_MASK && !trigger_endpoint->get_as_uint32(&error))
+        return false; // not an integer endpoint
+
+    for (size_t i = 0; i < NUM_CHANNELS; ++i)
+        channel_endpoints_[i] = get_endpoint(config_.channels[i]);
+    trigger_endpoint_ = trigger_endpoint;
+    num_channels_ = config_.num_channels;
+    num_frames_ = num_frames;
+    capacity_ = capacity;
+    start_index_ = 0;
+    trigger_index_ = 0;
+    write_index_ = 0;
+    frame_count_ = 0;
+    decimation_counter_ = 0;
+    last_trigger_value_ = NAN;
+    state_ = STATE_PRE_TRIGGER;
+    return true;
+}
+
+void Oscilloscope::stop() {
+    state_ = STATE_IDLE;
+}
+
+bool Oscilloscope::check_trigger() {
+    if (config_.trigger_mode == TRIGGER_MODE_ERROR_MASK) {
+        // Error words are compared as integers, a float only holds 24 bits
+        uint32_t error = 0;
+        return trigger_endpoint_->get_as_uint32(&error) && (error & config_.trigger_error_mask);
+    }
+
+    float value = NAN;
+    if (config_.trigger_mode != TRIGGER_MODE_IMMEDIATE)
+        trigger_endpoint_->get_as_float(&value);
+    float last_value = last_trigger_value_;
+    last_trigger_value_ = value;
+
+    bool rising = last_value < config_.trigger_level && value >= config_.trigger_level;
+    bool falling = last_value > config_.trigger_level && value <= config_.trigger_level;
+    switch (config_.trigger_mode) {
+        case TRIGGER_MODE_IMMEDIATE: return true;
+        case TRIGGER_MODE_RISING_EDGE: return rising;
+        case TRIGGER_MODE_FALLING_EDGE: return falling;
+        case TRIGGER_MODE_EITHER_EDGE: return rising || falling;
+        default: return false;
+    }
+}
+
+// @brief Captures one sample. Called from interrupt context.
+void Oscilloscope::update() {
+    if (state_ == STATE_IDLE || state_ == STATE_DONE)
+        return;
+    if (++decimation_counter_ < config_.decimation)
+        return;
+    decimation_counter_ = 0;
+
+    float* frame = &data_[write_index_ * num_channels_];
+    for (size_t i = 0; i < num_channels_; ++i) {
+        frame[i] = NAN;
+        if (channel_endpoints_[i])
+            channel_endpoints_[i]->get_as_float(&frame[i]);
+    }
+    uint32_t index = write_index_;
+    write_index_ = (write_index_ + 1) % capacity_;
+    ++frame_count_;
+
+    if (state_ == STATE_PRE_TRIGGER) {
+        if (frame_count_ < config_.pre_trigger_frames)
+            return;
+        state_ = STATE_ARMED;
+    }
+
+    if (state_ == STATE_ARMED) {
+        if (!check_trigger())
+            return;
+        trigger_index_ = index;
+        start_index_ = (index + capacity_ - config_.pre_trigger_frames) % capacity_;
+        frame_count_ = 1;
+        state_ = STATE_POST_TRIGGER;
+    }
+
+    if (frame_count_ >= num_frames_ - config_.pre_trigger_frames)
+        state_ = STATE_DONE;
+}
@@ -0,0 +1,105 @@
+#ifndef __OSCILLOSCOPE_HPP
+#define __OSCILLOSCOPE_HPP
+
+#ifndef __ODRIVE_MAIN_H
+#error "This file should not be included directly. Include odrive_main.h instead."
+#endif
+
+// @brief Triggered capture of up to NUM_CHANNELS endpoints into a RAM buffer.
+//
+// The channels are sampled from the DC bus voltage measurement interrupt,
+// which runs at the current measurement rate. Samples are stored as frames of
+// num_channels floats in a ring buffer, so that the frames before the trigger
+// are retained. Once the capture is done, the num_frames_ captured frames
+// start at frame start_index_ and wrap around at the end of the buffer.
+class Oscilloscope {
+public:
+    static constexpr size_t NUM_CHANNELS = 4;
+
+    enum TriggerMode_t {
+        TRIGGER_MODE_IMMEDIATE = 0,     //<! trigger as soon as the pre-trigger frames are captured
+        TRIGGER_MODE_RISING_EDGE = 1,   //<! trigger endpoint crosses trigger_level upwards
+        TRIGGER_MODE_FALLING_EDGE = 2,  //<! trigger endpoint crosses trigger_level downwards
+        TRIGGER_MODE_EITHER_EDGE = 3,
+        TRIGGER_MODE_ERROR_MASK = 4,    //<! any bit of trigger_error_mask is set in the trigger endpoint
+    };
+
+    enum State_t {
+        STATE_IDLE = 0,
+        STATE_PRE_TRIGGER = 1,   //<! capturing the pre-trigger frames
+        STATE_ARMED = 2,         //<! waiting for the trigger
+        STATE_POST_TRIGGER = 3,  //<! capturing the frames after the trigger
+        STATE_DONE = 4,
+    };
+
+    struct Config_t {
+        endpoint_ref_t channels[NUM_CHANNELS] = { { 0 } };
+        uint32_t num_channels = 1;
+        uint32_t decimation = 1;            // capture every n-th sample
+        TriggerMode_t trigger_mode = TRIGGER_MODE_IMMEDIATE;
+        endpoint_ref_t trigger_endpoint = { 0 };
+        float trigger_level = 0.0f;
+        uint32_t trigger_error_mask = 0xffffffff;
+        uint32_t pre_trigger_frames = 0;
+        uint32_t num_frames = 0;            // 0 to fill the whole buffer
+    };
+
+    bool start();
+    void stop();
+    void update();
+
+    float get_val(uint32_t index) {
+        return index < OSCILLOSCOPE_SIZE ? data_[index] : 0.0f;
+    }
+
+    Config_t config_;
+
+    State_t state_ = STATE_IDLE;
+    uint32_t num_channels_ = 1;    // latched from the config on start
+    uint32_t num_frames_ = 0;      // [frames] length of the capture
+    uint32_t start_index_ = 0;     // [frames] position of the first frame in the buffer
+    uint32_t trigger_index_ = 0;   // [frames] position of the trigger frame in the buffer
+    float data_[OSCILLOSCOPE_SIZE] = { 0.0f };
+
+private:
+    bool check_trigger();
+
+    Endpoint* channel_endpoints_[NUM_CHANNELS] = { nullptr };
+    Endpoint* trigger_endpoint_ = nullptr;
+    uint32_t capacity_ = 0;        // [frames] number of frames that fit into the buffer
+    uint32_t write_index_ = 0;     // [frames]
+    uint32_t frame_count_ = 0;     // [frames] frames captured in the current state
+    uint32_t decimation_counter_ = 0;
+    float last_trigger_value_ = 0.0f;
+
+public:
+    // Communication protocol definitions
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_ro_property("state", &state_),
+            make_protocol_ro_property("num_channels", &num_channels_),
+            make_protocol_ro_property("num_frames", &num_frames_),
+            make_protocol_ro_property("start_index", &start_index_),
+            make_protocol_ro_property("trigger_index", &trigger_index_),
+            make_protocol_buffer("data", data_, OSCILLOSCOPE_SIZE),
+            make_protocol_object("config",
+                make_protocol_property("channel0", &config_.channels[0]),
+                make_protocol_property("channel1", &config_.channels[1]),
+                make_protocol_property("channel2", &config_.channels[2]),
+                make_protocol_property("channel3", &config_.channels[3]),
+                make_protocol_property("num_channels", &config_.num_channels),
+                make_protocol_property("decimation", &config_.decimation),
+                make_protocol_property("trigger_mode", &config_.trigger_mode),
+                make_protocol_property("trigger_endpoint", &config_.trigger_endpoint),
+                make_protocol_property("trigger_level", &config_.trigger_level),
+                make_protocol_property("trigger_error_mask", &config_.trigger_error_mask),
+                make_protocol_property("pre_trigger_frames", &config_.pre_trigger_frames),
+                make_protocol_property("num_frames", &config_.num_frames)
+            ),
+            make_protocol_function("start", *this, &Oscilloscope::start),
+            make_protocol_function("stop", *this, &Oscilloscope::stop)
+        );
+    }
+};
+
+#endif // __OSCILLOSCOPE_HPP
@@ -0,0 +1,85 @@
+
+#include "odrive_main.h"
+
+// @brief Starts streaming with the current config.
+// @returns False if the config is invalid.
+bool Telemetry::start() {
+    active_ = false; // stop sampling while the stream is set up
+
+    if (config_.num_channels < 1 || config_.num_channels > NUM_CHANNELS)
+        return false;
+    if (!(config_.rate > 0.0f))
+        return false;
+
+    for (size_t i = 0; i < NUM_CHANNELS; ++i)
+        channel_endpoints_[i] = get_endpoint(config_.channels[i]);
+    num_channels_ = config_.num_channels;
+    samples_per_frame_ = (FRAME_SIZE - HEADER_SIZE) / (num_channels_ * sizeof(float));
+    decimation_ = std::max<uint32_t>(1, (uint32_t)((float)current_meas_hz / config_.rate + 0.5f));
+    decimation_counter_ = 0;
+    timestamp_ = 0;
+    seq_no_ = 0;
+    sample_index_ = 0;
+    write_buf_ = 0;
+    ready_[0] = false;
+    ready_[1] = false;
+    frame_cnt_ = 0;
+    overrun_cnt_ = 0;
+    active_ = true;
+    return true;
+}
+
+void Telemetry::stop() {
+    active_ = false;
+}
+
+// @brief Samples the channels. Called from interrupt context.
+void Telemetry::update() {
+    if (!active_)
+        return;
+    uint32_t timestamp = timestamp_++;
+    if (++decimation_counter_ < decimation_)
+        return;
+    decimation_counter_ = 0;
+
+    uint8_t* frame = frames_[write_buf_];
+    if (sample_index_ == 0) {
+        write_le<uint16_t>(TELEMETRY_STREAM_ID | 0x8000, frame);
+        write_le<uint16_t>(seq_no_, frame + 2);
+        write_le<uint32_t>(timestamp, frame + 4);
+    }
+    float* sample = reinterpret_cast<float*>(frame + HEADER_SIZE) + sample_index_ * num_channels_;
+    for (size_t i = 0; i < num_channels_; ++i) {
+        sample[i] = NAN;
+        if (channel_endpoints_[i])
+            channel_endpoints_[i]->get_as_float(&sample[i]);
+    }
+
+    if (++sample_index_ < samples_per_frame_)
+        return;
+    sample_index_ = 0;
+    ++seq_no_; // sequence gaps tell the host about dropped frames
+
+    if (ready_[write_buf_ ^ 1]) {
+        // The other frame is still being sent, overwrite this one
+        ++overrun_cnt_;
+        return;
+    }
+    ready_[write_buf_] = true;
+    write_buf_ ^= 1;
+    if (sender_thread_)
+        osSignalSet(sender_thread_, 1);
+}
+
+const uint8_t* Telemetry::get_frame(size_t* length) {
+    uint32_t send_buf = write_buf_ ^ 1;
+    if (!ready_[send_buf])
+        return nullptr;
+    *length = HEADER_SIZE + samples_per_frame_ * num_channels_ * sizeof(float);
+    return frames_[send_buf];
+}
+
+void Telemetry::release_frame() {
+    ready_[write_buf_ ^ 1] = false;
+    ++frame_cnt_;
+}
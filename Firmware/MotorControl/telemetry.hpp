@@ -0,0 +1,83 @@
+#ifndef __TELEMETRY_HPP
+#define __TELEMETRY_HPP
+
+#ifndef __ODRIVE_MAIN_H
+#error "This file should not be included directly. Include odrive_main.h instead."
+#endif
+
+// @brief Continuous streaming of up to NUM_CHANNELS endpoints to the host.
+//
+// The channels are sampled from the DC bus voltage measurement interrupt at
+// the configured rate and packed into frames that fit into one USB packet.
+// The interrupt fills one of two frame buffers while the other one is
+// transmitted by the sender thread. If the sender falls behind, the frame is
+// dropped and overrun_cnt_ incremented.
+//
+// Frame layout (little endian):
+//   uint16 stream id (TELEMETRY_STREAM_ID | 0x8000, never used by responses)
+//   uint16 frame sequence number
+//   uint32 timestamp of the first sample [control cycles since start]
+//   float  samples[samples_per_frame][num_channels]
+class Telemetry {
+public:
+    static constexpr size_t NUM_CHANNELS = 4;
+    static constexpr size_t FRAME_SIZE = 64; // [bytes] one full speed USB packet
+    static constexpr size_t HEADER_SIZE = 8;
+    static constexpr uint16_t TELEMETRY_STREAM_ID = 0x0001;
+
+    struct Config_t {
+        endpoint_ref_t channels[NUM_CHANNELS] = { { 0 } };
+        uint32_t num_channels = 1;
+        float rate = 1000.0f; // [Hz] rounded to a divider of the current measurement rate
+    };
+
+    bool start();
+    void stop();
+    void update();
+
+    // @brief Returns the next frame to be sent, or nullptr if none is ready.
+    // Called from the sender thread, which must call release_frame() after sending.
+    const uint8_t* get_frame(size_t* length);
+    void release_frame();
+
+    Config_t config_;
+    bool active_ = false;
+    uint32_t overrun_cnt_ = 0;
+    uint32_t frame_cnt_ = 0;
+    osThreadId sender_thread_ = nullptr; // signalled when a frame is ready
+
+private:
+    Endpoint* channel_endpoints_[NUM_CHANNELS] = { nullptr };
+    uint32_t num_channels_ = 1;
+    uint32_t samples_per_frame_ = 1;
+    uint32_t decimation_ = 1;
+    uint32_t decimation_counter_ = 0;
+    uint32_t timestamp_ = 0;       // [control cycles]
+    uint16_t seq_no_ = 0;
+    uint32_t sample_index_ = 0;    // position within the frame being filled
+    uint32_t write_buf_ = 0;       // frame buffer being filled by the interrupt
+    bool ready_[2] = { false, false };
+    uint8_t frames_[2][FRAME_SIZE] __attribute__((aligned(4)));
+
+public:
+    // Communication protocol definitions
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_ro_property("active", &active_),
+            make_protocol_ro_property("frame_cnt", &frame_cnt_),
+            make_protocol_ro_property("overrun_cnt", &overrun_cnt_),
+            make_protocol_object("config",
+                make_protocol_property("channel0", &config_.channels[0]),
+                make_protocol_property("channel1", &config_.channels[1]),
+                make_protocol_property("channel2", &config_.channels[2]),
+                make_protocol_property("channel3", &config_.channels[3]),
+                make_protocol_property("num_channels", &config_.num_channels),
+                make_protocol_property("rate", &config_.rate)
+            ),
+            make_protocol_function("start", *this, &Telemetry::start),
+            make_protocol_function("stop", *this, &Telemetry::stop)
+        );
+    }
+};
+
+#endif // __TELEMETRY_HPP
@@ -0,0 +1,68 @@
+#ifndef __TIMING_HISTOGRAM_HPP
+#define __TIMING_HISTOGRAM_HPP
+
+#ifndef __ODRIVE_MAIN_H
+#error "This file should not be included directly. Include odrive_main.h instead."
+#endif
+
+// @brief Distribution of a timing measurement in CPU cycles.
+// Keeps min, max, mean and a histogram with log2 spaced buckets, such that
+// rare worst-case latencies remain visible. add() is cheap enough to be
+// called from interrupt context.
+class TimingHistogram {
+public:
+    // Bucket i counts samples in [2^(i-1), 2^i) cycles, the last bucket
+    // collects everything above. 2^18 cycles are about 1.5ms at 168MHz.
+    static constexpr size_t NUM_BUCKETS = 20;
+
+    inline void add(uint32_t cycles) {
+        if (cycles < min_cycles_)
+            min_cycles_ = cycles;
+        if (cycles > max_cycles_)
+            max_cycles_ = cycles;
+        total_cycles_ += cycles;
+        ++count_;
+        size_t bucket = 32 - __CLZ(cycles);
+        if (bucket >= NUM_BUCKETS)
+            bucket = NUM_BUCKETS - 1;
+        ++buckets_[bucket];
+    }
+
+    void reset() {
+        uint32_t mask = cpu_enter_critical();
+        min_cycles_ = UINT32_MAX;
+        max_cycles_ = 0;
+        total_cycles_ = 0;
+        count_ = 0;
+        for (size_t i = 0; i < NUM_BUCKETS; ++i)
+            buckets_[i] = 0;
+        cpu_exit_critical(mask);
+    }
+
+    float get_mean() {
+        return count_ ? (float)total_cycles_ / (float)count_ : 0.0f;
+    }
+
+    uint32_t get_bucket(uint32_t index) {
+        return index < NUM_BUCKETS ? buckets_[index] : 0;
+    }
+
+    uint32_t min_cycles_ = UINT32_MAX;
+    uint32_t max_cycles_ = 0;
+    uint64_t total_cycles_ = 0;
+    uint32_t count_ = 0;
+    uint32_t buckets_[NUM_BUCKETS] = { 0 };
+
+    // Communication protocol definitions
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_ro_property("min_cycles", &min_cycles_),
+            make_protocol_ro_property("max_cycles", &max_cycles_),
+            make_protocol_ro_property("count", &count_),
+            make_protocol_function("get_mean", *this, &TimingHistogram::get_mean),
+            make_protocol_function("get_bucket", *this, &TimingHistogram::get_bucket, "index")
+        );
+    }
+};
+
+#endif // __TIMING_HISTOGRAM_HPP
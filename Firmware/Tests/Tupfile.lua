@@ -0,0 +1,43 @@
+
+tup.include('../fibre/tupfiles/build.lua')
+
+circular_buffer_test = define_package{
+    sources={'test_circular_buffer.cpp'},
+    libs={'pthread'},
+    headers={'..'}
+}
+
+-- The controller sources are compiled for the host against the firmware
+-- headers, the hardware dependent parts are stubbed out in the benchmark
+controller_benchmark = define_package{
+    sources={
+        'bench_controller_update.cpp',
+        '../MotorControl/controller.cpp',
+        '../MotorControl/biquad.cpp',
+        '../MotorControl/trapTraj.cpp',
+        '../MotorControl/utils.c'
+    },
+    headers={
+        '..',
+        '../MotorControl',
+        '../Drivers/DRV8301',
+        '../fibre/cpp/include',
+        '../Board/v3/Inc',
+        '../Board/v3/Drivers/STM32F4xx_HAL_Driver/Inc',
+        '../Board/v3/Drivers/CMSIS/Device/ST/STM32F4xx/Include',
+        '../Board/v3/Drivers/CMSIS/Include',
+        '../Board/v3/Middlewares/Third_Party/FreeRTOS/Source/include',
+        '../Board/v3/Middlewares/Third_Party/FreeRTOS/Source/CMSIS_RTOS',
+        '../Board/v3/Middlewares/Third_Party/FreeRTOS/Source/portable/GCC/ARM_CM4F'
+    },
+    c_flags={'-DSTM32F405xx', '-DUSE_HAL_DRIVER', '-DHW_VERSION_MAJOR=3', '-DHW_VERSION_MINOR=6', '-DHW_VERSION_VOLTAGE=56'},
+    -- arm_math.h casts pointers to 32-bit integers
+    cpp_flags={'-DSTM32F405xx', '-DUSE_HAL_DRIVER', '-DHW_VERSION_MAJOR=3', '-DHW_VERSION_MINOR=6', '-DHW_VERSION_VOLTAGE=56', '-fpermissive'}
+}
+
+toolchain=GCCToolchain('', 'build', {'-O3', '-g', '-Wall'}, {})
+
+if tup.getconfig("BUILD_TESTS") == "true" then
+	build_executable('test_circular_buffer', circular_buffer_test, toolchain)
+	build_executable('bench_controller_update', controller_benchmark, toolchain)
+end
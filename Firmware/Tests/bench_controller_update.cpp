@@ -0,0 +1,309 @@
+/*
+* Host micro-benchmark of the controller update.
+*
+* Controller::update runs the specialization of update_specialized that
+* select_update_fn picked for the current control mode and flags. This
+* compares it against generic_update below, which is the same loop with
+* the mode and flags tested at run time, as the controller did before the
+* specializations were introduced. For each scenario both versions run on
+* the same inputs and must produce the same current setpoints.
+*
+* The firmware sources are compiled for the host, so the numbers are only
+* a relative measure of the cost of the run time checks.
+*/
+
+#include <MotorControl/odrive_main.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+
+#define N_ITERATIONS 400000
+#define CPR 8192
+
+/* Stubs for the parts of the firmware that are not linked -------------------*/
+
+extern "C" {
+uint32_t HAL_GetTick(void) { return 0; }
+uint32_t osKernelSysTick(void) { return 0; }
+bool safety_critical_disarm_motor_pwm(Motor& motor) { return false; }
+void update_brake_current() {}
+// the firmware versions use the sine table of the ARM math library
+float our_arm_sin_f32(float x) { return sinf(x); }
+float our_arm_cos_f32(float x) { return cosf(x); }
+}
+
+Axis::Axis(int axis_num, const AxisHardwareConfig_t& hw_config, Config_t& config,
+           Encoder& encoder, SensorlessEstimator& sensorless_estimator,
+           Controller& controller, Motor& motor, TrapezoidalTrajectory& trap) :
+        axis_num_(axis_num), hw_config_(hw_config), config_(config),
+        encoder_(encoder), sensorless_estimator_(sensorless_estimator),
+        controller_(controller), motor_(motor), trap_(trap) {
+    controller_.axis_ = this;
+    trap_.axis_ = this;
+}
+Axis::LockinConfig_t Axis::default_calibration() { return {}; }
+Axis::LockinConfig_t Axis::default_sensorless() { return {}; }
+bool Axis::do_checks() { return true; }
+bool Axis::do_updates() { return true; }
+void Axis::apply_received_commands() {}
+bool Axis::watchdog_check() { return true; }
+bool Axis::wait_for_current_meas() { return true; }
+
+Encoder::Encoder(const EncoderHardwareConfig_t& hw_config, Config_t& config) :
+        hw_config_(hw_config), config_(config) {}
+
+SensorlessEstimator::SensorlessEstimator(Config_t& config) : config_(config) {}
+
+Motor::Motor(const MotorHardwareConfig_t& hw_config,
+             const GateDriverHardwareConfig_t& gate_driver_config, Config_t& config) :
+        hw_config_(hw_config), gate_driver_config_(gate_driver_config), config_(config) {}
+float Motor::effective_current_lim() { return config_.current_lim; }
+bool Motor::update(float current_setpoint, float phase, float phase_vel) { return true; }
+
+/* Reference implementation --------------------------------------------------*/
+
+// @brief The control loop with the mode and flags tested at run time.
+// Keep in sync with Controller::update_specialized.
+static bool generic_update(Controller& c, float pos_estimate, float vel_estimate, float* current_setpoint_output) {
+    Controller::ControlMode_t mode = c.config_.control_mode;
+    bool vel_ramp = c.vel_ramp_enable_;
+    bool setpoints_in_cpr = c.config_.setpoints_in_cpr;
+    bool anticogging = c.anticogging_.use_anticogging;
+    Axis* axis = c.axis_;
+
+    float anticogging_pos = pos_estimate;
+    float accel_des = 0.0f;
+
+    if (mode == Controller::CTRL_MODE_TRAJECTORY_CONTROL) {
+        int32_t loops = (int32_t)(axis->loop_counter_ - c.traj_start_loop_count_);
+        float t = std::max((float)loops * current_meas_period - c.traj_start_offset_, 0.0f);
+        if (t > axis->trap_.Tf_) {
+            c.config_.control_mode = Controller::CTRL_MODE_POSITION_CONTROL;
+            c.select_update_fn();
+            c.vel_setpoint_ = 0.0f;
+            c.current_setpoint_ = 0.0f;
+        } else {
+            TrapezoidalTrajectory::Step_t traj_step = axis->trap_.eval(t);
+            c.pos_setpoint_ = traj_step.Y;
+            c.vel_setpoint_ = traj_step.Yd;
+            c.current_setpoint_ = traj_step.Ydd * (axis->trap_.config_.A_per_css + c.config_.inertia);
+        }
+        anticogging_pos = c.pos_setpoint_;
+    }
+
+    if (mode == Controller::CTRL_MODE_VELOCITY_CONTROL && vel_ramp) {
+        float max_step_size = current_meas_period * c.config_.vel_ramp_rate;
+        float full_step = c.vel_ramp_target_ - c.vel_setpoint_;
+        float step;
+        if (fabsf(full_step) > max_step_size) {
+            step = std::copysignf(max_step_size, full_step);
+        } else {
+            step = full_step;
+        }
+        c.vel_setpoint_ += step;
+        accel_des = step * current_meas_hz;
+    }
+
+    Controller::InputShaperSample_t setpoint = { c.pos_setpoint_, c.vel_setpoint_, c.current_setpoint_ };
+    if (mode >= Controller::CTRL_MODE_POSITION_CONTROL && !setpoints_in_cpr && c.input_shaper_num_impulses_) {
+        setpoint = c.apply_input_shaper(setpoint);
+        if (mode == Controller::CTRL_MODE_TRAJECTORY_CONTROL)
+            anticogging_pos = setpoint.pos;
+    } else {
+        c.input_shaper_primed_ = false;
+    }
+
+    float vel_des = setpoint.vel;
+    if (mode >= Controller::CTRL_MODE_POSITION_CONTROL) {
+        float pos_err;
+        if (setpoints_in_cpr) {
+            float cpr = (float)(axis->encoder_.config_.cpr);
+            c.pos_setpoint_ = fmodf_pos(c.pos_setpoint_, cpr);
+            pos_err = c.pos_setpoint_ - axis->encoder_.pos_cpr_;
+            pos_err = wrap_pm(pos_err, 0.5f * cpr);
+        } else {
+            pos_err = setpoint.pos - pos_estimate;
+        }
+        vel_des += c.config_.pos_gain * pos_err;
+    }
+
+    float vel_lim = c.config_.vel_limit;
+    if (vel_des > vel_lim) vel_des = vel_lim;
+    if (vel_des < -vel_lim) vel_des = -vel_lim;
+
+    if (c.config_.vel_limit_tolerance > 0.0f) {
+        if (fabsf(vel_estimate) > c.config_.vel_limit_tolerance * vel_lim) {
+            c.set_error(Controller::ERROR_OVERSPEED);
+            return false;
+        }
+    }
+
+    float Iq = setpoint.current;
+
+    if (mode >= Controller::CTRL_MODE_VELOCITY_CONTROL) {
+        float vel_sign = (c.config_.friction_deadband > 0.0f)
+                ? std::max(-1.0f, std::min(setpoint.vel / c.config_.friction_deadband, 1.0f))
+                : (float)((setpoint.vel > 0.0f) - (setpoint.vel < 0.0f));
+        Iq += c.config_.inertia * accel_des
+            + c.config_.friction_coulomb * vel_sign
+            + c.config_.friction_viscous * setpoint.vel;
+    }
+
+    if (anticogging) {
+        Iq += c.anticogging_.cogging_map[mod(static_cast<int>(anticogging_pos), axis->encoder_.config_.cpr)];
+    }
+
+    float vel_feedback = vel_estimate;
+    for (size_t i = 0; i < Controller::NUM_FILTER_SECTIONS; ++i)
+        vel_feedback = c.vel_filters_[i].update(vel_feedback);
+
+    float v_err = vel_des - vel_feedback;
+    if (mode >= Controller::CTRL_MODE_VELOCITY_CONTROL) {
+        Iq += c.config_.vel_gain * v_err;
+    }
+
+    Iq += c.vel_integrator_current_;
+
+    for (size_t i = 0; i < Controller::NUM_FILTER_SECTIONS; ++i)
+        Iq = c.torque_filters_[i].update(Iq);
+
+    bool limited = false;
+    float Ilim = axis->motor_.effective_current_lim();
+    if (Iq > Ilim) {
+        limited = true;
+        Iq = Ilim;
+    }
+    if (Iq < -Ilim) {
+        limited = true;
+        Iq = -Ilim;
+    }
+
+    if (mode < Controller::CTRL_MODE_VELOCITY_CONTROL) {
+        c.vel_integrator_current_ = 0.0f;
+    } else {
+        if (limited) {
+            c.vel_integrator_current_ *= 0.99f;
+        } else {
+            c.vel_integrator_current_ += (c.config_.vel_integrator_gain * current_meas_period) * v_err;
+        }
+    }
+
+    if (current_setpoint_output) *current_setpoint_output = Iq;
+    return true;
+}
+
+/* Benchmark -----------------------------------------------------------------*/
+
+struct Scenario_t {
+    const char* name;
+    Controller::ControlMode_t mode;
+    bool vel_ramp;
+    bool setpoints_in_cpr;
+    bool anticogging;
+    Controller::InputShaper_t input_shaper;
+};
+
+static const Scenario_t scenarios[] = {
+    { "current",                 Controller::CTRL_MODE_CURRENT_CONTROL,    false, false, false, Controller::INPUT_SHAPER_NONE },
+    { "velocity",                Controller::CTRL_MODE_VELOCITY_CONTROL,   false, false, false, Controller::INPUT_SHAPER_NONE },
+    { "velocity, ramp",          Controller::CTRL_MODE_VELOCITY_CONTROL,   true,  false, false, Controller::INPUT_SHAPER_NONE },
+    { "position",                Controller::CTRL_MODE_POSITION_CONTROL,   false, false, false, Controller::INPUT_SHAPER_NONE },
+    { "position, cpr",           Controller::CTRL_MODE_POSITION_CONTROL,   false, true,  false, Controller::INPUT_SHAPER_NONE },
+    { "position, anticogging",   Controller::CTRL_MODE_POSITION_CONTROL,   false, false, true,  Controller::INPUT_SHAPER_NONE },
+    { "position, input shaper",  Controller::CTRL_MODE_POSITION_CONTROL,   false, false, false, Controller::INPUT_SHAPER_ZVD },
+    { "trajectory",              Controller::CTRL_MODE_TRAJECTORY_CONTROL, false, false, false, Controller::INPUT_SHAPER_NONE },
+};
+
+// One axis with everything the controller touches
+struct Rig {
+    Rig(const Scenario_t& scenario, float* cogging_map) {
+        encoder_config.cpr = CPR;
+        motor_config.current_lim = 20.0f;
+        controller_config.control_mode = scenario.mode;
+        controller_config.setpoints_in_cpr = scenario.setpoints_in_cpr;
+        controller_config.input_shaper = scenario.input_shaper;
+        controller_config.inertia = 1e-5f;
+        controller_config.friction_coulomb = 0.1f;
+        controller_config.vel_limit_tolerance = 0.0f;
+        controller.update_input_shaper();
+        controller.vel_ramp_enable_ = scenario.vel_ramp;
+        controller.vel_ramp_target_ = 10000.0f;
+        controller.vel_setpoint_ = 1000.0f;
+        controller.pos_setpoint_ = 5000.0f;
+        controller.anticogging_.cogging_map = cogging_map;
+        controller.anticogging_.use_anticogging = scenario.anticogging;
+        controller.select_update_fn();
+        if (scenario.mode == Controller::CTRL_MODE_TRAJECTORY_CONTROL)
+            controller.move_to_pos(2e6f); // lasts longer than the benchmark
+    }
+
+    AxisHardwareConfig_t axis_hw_config = {};
+    Axis::Config_t axis_config;
+    EncoderHardwareConfig_t encoder_hw_config = {};
+    Encoder::Config_t encoder_config;
+    SensorlessEstimator::Config_t sensorless_config;
+    Controller::Config_t controller_config;
+    MotorHardwareConfig_t motor_hw_config = {};
+    GateDriverHardwareConfig_t gate_driver_config = {};
+    Motor::Config_t motor_config;
+    TrapezoidalTrajectory::Config_t trap_config;
+
+    Encoder encoder{encoder_hw_config, encoder_config};
+    SensorlessEstimator sensorless_estimator{sensorless_config};
+    Controller controller{controller_config};
+    Motor motor{motor_hw_config, gate_driver_config, motor_config};
+    TrapezoidalTrajectory trap{trap_config};
+    Axis axis{0, axis_hw_config, axis_config, encoder, sensorless_estimator, controller, motor, trap};
+};
+
+template<typename TUpdate>
+static double run(Rig& rig, const std::vector<float>& pos, const std::vector<float>& vel,
+                  std::vector<float>& output, TUpdate update) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < N_ITERATIONS; ++i) {
+        rig.encoder.pos_cpr_ = pos[i];
+        update(rig.controller, pos[i], vel[i], &output[i]);
+        rig.axis.loop_counter_++;
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1e9 / N_ITERATIONS;
+}
+
+int main(int argc, const char** argv) {
+    std::vector<float> cogging_map(CPR);
+    std::vector<float> pos(N_ITERATIONS), vel(N_ITERATIONS);
+    for (size_t i = 0; i < CPR; ++i)
+        cogging_map[i] = 0.05f * sinf(i * 0.01f);
+    for (size_t i = 0; i < N_ITERATIONS; ++i) {
+        pos[i] = 5000.0f + 300.0f * sinf(i * 1e-3f);
+        vel[i] = 2000.0f * cosf(i * 1e-3f);
+    }
+
+    bool ok = true;
+    printf("%-24s %12s %12s %8s\n", "scenario", "specialized", "generic", "speedup");
+    for (const Scenario_t& scenario : scenarios) {
+        std::vector<float> specialized_output(N_ITERATIONS), generic_output(N_ITERATIONS);
+        Rig specialized_rig(scenario, cogging_map.data());
+        Rig generic_rig(scenario, cogging_map.data());
+
+        double specialized_ns = run(specialized_rig, pos, vel, specialized_output,
+            [](Controller& c, float p, float v, float* out) { return c.update(p, v, out); });
+        double generic_ns = run(generic_rig, pos, vel, generic_output, generic_update);
+
+        size_t mismatches = 0;
+        for (size_t i = 0; i < N_ITERATIONS; ++i)
+            mismatches += specialized_output[i] != generic_output[i];
+        printf("%-24s %9.1f ns %9.1f ns %7.2fx%s\n", scenario.name,
+               specialized_ns, generic_ns, generic_ns / specialized_ns,
+               mismatches ? "  OUTPUT MISMATCH" : "");
+        ok = ok && !mismatches;
+    }
+
+    if (!ok) {
+        printf("some tests failed\n");
+        return -1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}
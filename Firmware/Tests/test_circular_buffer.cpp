@@ -0,0 +1,111 @@
+/*
+* Host stress test for the lock-free single producer / single consumer mode
+* of CCBBuffer. A producer thread writes a known byte sequence in chunks of
+* random length and a consumer thread checks that it reads back exactly the
+* same sequence. Both the copying functions (write/read) and the spans
+* (writeSpan/commitWrite, readSpan/commitRead) are exercised.
+*/
+
+#include <communication/CircularBuffer.hpp>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <chrono>
+
+#define BUFFER_SIZE 256
+#define TOTAL_BYTES (16UL * 1024UL * 1024UL)
+
+static uint8_t array[BUFFER_SIZE];
+static CCBBuffer<uint8_t, CB_MODE_SPSC> buffer(array, BUFFER_SIZE);
+
+static uint8_t pattern(size_t i) {
+    return (uint8_t)((i * 7) ^ (i >> 8));
+}
+
+static void producer() {
+    uint8_t chunk[BUFFER_SIZE];
+    size_t written = 0;
+    unsigned int seed = 1;
+    while (written < TOTAL_BYTES) {
+        size_t length = rand_r(&seed) % BUFFER_SIZE + 1;
+        if (length > TOTAL_BYTES - written)
+            length = TOTAL_BYTES - written;
+
+        if (rand_r(&seed) & 1) {
+            for (size_t i = 0; i < length; ++i)
+                chunk[i] = pattern(written + i);
+            written += buffer.write(chunk, length);
+        } else {
+            uint8_t* span;
+            size_t n = buffer.writeSpan(&span);
+            if (n > length)
+                n = length;
+            for (size_t i = 0; i < n; ++i)
+                span[i] = pattern(written + i);
+            buffer.commitWrite(n);
+            written += n;
+        }
+        if (buffer.isFull())
+            std::this_thread::yield();
+    }
+}
+
+static bool consumer() {
+    uint8_t chunk[BUFFER_SIZE];
+    size_t read = 0;
+    unsigned int seed = 2;
+    while (read < TOTAL_BYTES) {
+        const uint8_t* data;
+        size_t length;
+        if (rand_r(&seed) & 1) {
+            length = buffer.read(chunk, rand_r(&seed) % BUFFER_SIZE + 1);
+            data = chunk;
+        } else {
+            length = buffer.readSpan(&data);
+        }
+        for (size_t i = 0; i < length; ++i) {
+            if (data[i] != pattern(read + i)) {
+                printf("mismatch at byte %zu\n", read + i);
+                return false;
+            }
+        }
+        if (data != chunk)
+            buffer.commitRead(length);
+        read += length;
+        if (!length)
+            std::this_thread::yield();
+    }
+    return buffer.isEmpty();
+}
+
+static bool test_capacity() {
+    uint8_t data[BUFFER_SIZE] = { 0 };
+    uint8_t odd_array[100];
+    CCBBuffer<uint8_t, CB_MODE_SPSC> odd_buffer(odd_array, sizeof(odd_array));
+    if (odd_buffer.write(data, 1) != 0)
+        return false;
+
+    CCBBuffer<uint8_t, CB_MODE_SPSC> full_buffer(array, BUFFER_SIZE);
+    if (full_buffer.write(data, BUFFER_SIZE + 1) != BUFFER_SIZE || !full_buffer.isFull())
+        return false;
+    full_buffer.flushBuffer();
+    return full_buffer.isEmpty() && full_buffer.remainingSpace() == BUFFER_SIZE;
+}
+
+int main(void) {
+    if (!test_capacity()) {
+        printf("capacity test failed\n");
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::thread producer_thread(producer);
+    bool ok = consumer();
+    producer_thread.join();
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+    printf("%s: %lu bytes in %.3f s (%.1f MB/s)\n", ok ? "passed" : "FAILED",
+            TOTAL_BYTES, duration.count(), TOTAL_BYTES / duration.count() / 1e6);
+    return ok ? 0 : 1;
+}
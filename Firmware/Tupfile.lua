@@ -81,6 +81,11 @@ if tup.getconfig("STEP_DIR") == "y" then
     end
 end
 
+-- Oscilloscope buffer size in floats
+if tup.getconfig("OSCILLOSCOPE_SIZE") ~= "" then
+    FLAGS += "-DOSCILLOSCOPE_SIZE="..tup.getconfig("OSCILLOSCOPE_SIZE")
+end
+
 -- Compiler settings
 if tup.getconfig("STRICT") == "true" then
     FLAGS += '-Werror'
@@ -166,6 +171,11 @@ build{
         'MotorControl/motor.cpp',
         'MotorControl/encoder.cpp',
         'MotorControl/controller.cpp',
+        'MotorControl/biquad.cpp',
+        'MotorControl/oscilloscope.cpp',
+        'MotorControl/telemetry.cpp',
+        'MotorControl/notifier.cpp',
+        'MotorControl/event_log.cpp',
         'MotorControl/sensorless_estimator.cpp',
         'MotorControl/trapTraj.cpp',
         'MotorControl/main.cpp',
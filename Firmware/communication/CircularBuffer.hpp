@@ -23,6 +23,7 @@ INCLUDES
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <atomic>
 
 /*******************************************************************************
 NAMESPACE
@@ -40,6 +41,12 @@ typedef enum
 	CB_POINTER_ERROR
 }CB_Status_t;
 
+typedef enum
+{
+	CB_MODE_DEFAULT = 0,                                                        /* general purpose buffer, not safe to use from an ISR and a thread */
+	CB_MODE_SPSC                                                                /* lock-free, one producer and one consumer that may run concurrently */
+}CB_Mode_t;
+
 /*******************************************************************************
 TYPES
 *******************************************************************************/
@@ -52,7 +59,7 @@ GLOBAL VARIABLES
 FUNCTION PROTOTYPES
 *******************************************************************************/
 
-template <class dataType_t>
+template <class dataType_t, CB_Mode_t mode = CB_MODE_DEFAULT>
 class CCBBuffer
 {
     typedef struct
@@ -103,6 +110,43 @@ private:
     }
 }; /* CCBBuffer */
 
+/**\brief   Lock-free single producer / single consumer ring buffer, e.g. to pass
+ *          data between an ISR and a thread.
+ *
+ *          The start and end counters run freely and are masked with the size
+ *          of the buffer, which therefore must be a power of 2. Each counter is
+ *          only modified by one side, so all elements of the array can be used.
+ *          All functions that modify the end counter (write, writeSpan,
+ *          commitWrite) must only be called by the producer, all functions that
+ *          modify the start counter (read, readSpan, commitRead, flushBuffer)
+ *          only by the consumer. If there are several producers or consumers,
+ *          the caller must serialize them.
+ */
+template <class dataType_t>
+class CCBBuffer<dataType_t, CB_MODE_SPSC>
+{
+public:
+    CCBBuffer(dataType_t * pArray = nullptr, const size_t numElements = 0);
+    ~CCBBuffer() = default;
+    bool isFull();
+    bool isEmpty();
+    size_t remainingSpace();
+    size_t usedSpace();
+    bool flushBuffer();
+    int32_t write(const dataType_t * const pData, size_t length);
+    int32_t read(dataType_t * pData, size_t length);
+    size_t writeSpan(dataType_t ** ppData);
+    void commitWrite(size_t length);
+    size_t readSpan(const dataType_t ** ppData);
+    void commitRead(size_t length);
+
+private:
+    dataType_t * m_pArray;                                                      /* pointer to array of elements */
+    size_t m_numElements;                                                       /* number of elements, 0 if the size was not a power of 2 */
+    std::atomic<uint32_t> m_start;                                              /* number of elements read so far */
+    std::atomic<uint32_t> m_end;                                                /* number of elements written so far */
+}; /* CCBBuffer<CB_MODE_SPSC> */
+
 /*******************************************************************************
 INLINE FUNCTIONS
 *******************************************************************************/
@@ -116,8 +160,8 @@ INLINE FUNCTIONS
  *
  * \return  None
  */
-template <class dataType_t>
-CCBBuffer<dataType_t>::CCBBuffer(dataType_t * pArray, const size_t numElements, const bool useMutex, const bool overwriteOldData)
+template <class dataType_t, CB_Mode_t mode>
+CCBBuffer<dataType_t, mode>::CCBBuffer(dataType_t * pArray, const size_t numElements, const bool useMutex, const bool overwriteOldData)
     : m_cb {{numElements, 0, 0}, pArray}
     , m_overwriteOldData(overwriteOldData)
 {
@@ -131,8 +175,8 @@ CCBBuffer<dataType_t>::CCBBuffer(dataType_t * pArray, const size_t numElements,
  *
  * \return  TRUE for full FALSE for not
  */
-template <class dataType_t>
-bool CCBBuffer<dataType_t>::isFull()
+template <class dataType_t, CB_Mode_t mode>
+bool CCBBuffer<dataType_t, mode>::isFull()
 {
     return (((m_cb.tracker.end + 1) % (int32_t)m_cb.tracker.numElements) == m_cb.tracker.start);
 }
@@ -143,8 +187,8 @@ bool CCBBuffer<dataType_t>::isFull()
  *
  * \return  FALSE for non-empty TRUE for not
  */
-template <class dataType_t>
-bool CCBBuffer<dataType_t>::isEmpty()
+template <class dataType_t, CB_Mode_t mode>
+bool CCBBuffer<dataType_t, mode>::isEmpty()
 {
     return (m_cb.tracker.end == m_cb.tracker.start);
 }
@@ -155,8 +199,8 @@ bool CCBBuffer<dataType_t>::isEmpty()
  *
  * \return  Unused space in buffer
  */
-template <class dataType_t>
-size_t CCBBuffer<dataType_t>::remainingSpace()
+template <class dataType_t, CB_Mode_t mode>
+size_t CCBBuffer<dataType_t, mode>::remainingSpace()
 {
     return (m_cb.tracker.numElements - usedSpace());
 }
@@ -168,8 +212,8 @@ size_t CCBBuffer<dataType_t>::remainingSpace()
  *
  * \return  Used space in buffer
  */
-template <class dataType_t>
-size_t CCBBuffer<dataType_t>::remainingSpaceLinear()
+template <class dataType_t, CB_Mode_t mode>
+size_t CCBBuffer<dataType_t, mode>::remainingSpaceLinear()
 {
 
 /* if end is less than start index then data goes from start pointer to size of
@@ -186,8 +230,8 @@ size_t CCBBuffer<dataType_t>::remainingSpaceLinear()
  *
  * \return  Used space in buffer
  */
-template <class dataType_t>
-size_t CCBBuffer<dataType_t>::usedSpace()
+template <class dataType_t, CB_Mode_t mode>
+size_t CCBBuffer<dataType_t, mode>::usedSpace()
 {
     return (size_t)(m_cb.tracker.end + ((m_cb.tracker.end < m_cb.tracker.start) ? (int32_t)m_cb.tracker.numElements : 0) - m_cb.tracker.start);
 }
@@ -199,8 +243,8 @@ size_t CCBBuffer<dataType_t>::usedSpace()
  *
  * \return  Used space in buffer
  */
-template <class dataType_t>
-size_t CCBBuffer<dataType_t>::usedSpaceLinear()
+template <class dataType_t, CB_Mode_t mode>
+size_t CCBBuffer<dataType_t, mode>::usedSpaceLinear()
 {
     return (size_t)(((m_cb.tracker.end < m_cb.tracker.start) ? (int32_t)m_cb.tracker.numElements : m_cb.tracker.end) - m_cb.tracker.start);
 }
@@ -211,8 +255,8 @@ size_t CCBBuffer<dataType_t>::usedSpaceLinear()
  *
  * \return  TRUE if successful FALSE if fail
  */
-template <class dataType_t>
-bool CCBBuffer<dataType_t>::flushBuffer()
+template <class dataType_t, CB_Mode_t mode>
+bool CCBBuffer<dataType_t, mode>::flushBuffer()
 {
     if(m_useMutex)
     {
@@ -233,8 +277,8 @@ bool CCBBuffer<dataType_t>::flushBuffer()
  *
  * \return  number of entries written
  */
-template <class dataType_t>
-int32_t CCBBuffer<dataType_t>::write(const dataType_t * const pData, size_t length)
+template <class dataType_t, CB_Mode_t mode>
+int32_t CCBBuffer<dataType_t, mode>::write(const dataType_t * const pData, size_t length)
 {
     int32_t writeCnt = 0;
     size_t toWrite = 0;
@@ -276,8 +320,8 @@ int32_t CCBBuffer<dataType_t>::write(const dataType_t * const pData, size_t leng
  *
  * \return  number of elements read
  */
-template <class dataType_t>
-int32_t CCBBuffer<dataType_t>::read(dataType_t * pData, size_t length)
+template <class dataType_t, CB_Mode_t mode>
+int32_t CCBBuffer<dataType_t, mode>::read(dataType_t * pData, size_t length)
 {
     int32_t readCnt = 0;
     size_t toRead = 0;
@@ -287,7 +331,7 @@ int32_t CCBBuffer<dataType_t>::read(dataType_t * pData, size_t length)
 
     }
 
-    for (readCnt = 0; (!isEmpty() && readCnt < (int32_t)length); readCnt =+ toRead)
+    for (readCnt = 0; (!isEmpty() && readCnt < (int32_t)length); readCnt += toRead)
     {
         size_t linearLength = usedSpaceLinear();
         size_t leftToRead = length - readCnt;
@@ -305,8 +349,8 @@ int32_t CCBBuffer<dataType_t>::read(dataType_t * pData, size_t length)
  *
  * \return  false for no data
  */
-template <class dataType_t>
-bool CCBBuffer<dataType_t>::readNewest(dataType_t * pData)
+template <class dataType_t, CB_Mode_t mode>
+bool CCBBuffer<dataType_t, mode>::readNewest(dataType_t * pData)
 {
     bool empty = this->isEmpty();
 
@@ -324,4 +368,203 @@ bool CCBBuffer<dataType_t>::readNewest(dataType_t * pData)
     return !empty;
 }
 
+/*******************************************************************************
+SINGLE PRODUCER / SINGLE CONSUMER
+*******************************************************************************/
+
+/**\brief   Constructor
+ *
+ * \param   pArray              - pointer to external memory
+ * \param   numElements         - number of dataType_t's in ring buffer, must be a value ^2.
+ *                                Otherwise the buffer has no capacity.
+ *
+ * \return  None
+ */
+template <class dataType_t>
+CCBBuffer<dataType_t, CB_MODE_SPSC>::CCBBuffer(dataType_t * pArray, const size_t numElements)
+    : m_pArray(pArray)
+    , m_numElements(((numElements & (numElements - 1u)) == 0u) ? numElements : 0u)
+    , m_start(0)
+    , m_end(0)
+{
+}
+
+/**\brief   Checks if the ring buffer is full
+ *
+ * \param   None
+ *
+ * \return  TRUE for full FALSE for not
+ */
+template <class dataType_t>
+bool CCBBuffer<dataType_t, CB_MODE_SPSC>::isFull()
+{
+    return (usedSpace() == m_numElements);
+}
+
+/**\brief   Checks if the ring buffer is empty
+ *
+ * \param   None
+ *
+ * \return  TRUE for empty FALSE for not
+ */
+template <class dataType_t>
+bool CCBBuffer<dataType_t, CB_MODE_SPSC>::isEmpty()
+{
+    return (usedSpace() == 0u);
+}
+
+/**\brief   Checks available space in the buffer
+ *
+ * \param   None
+ *
+ * \return  Unused space in buffer
+ */
+template <class dataType_t>
+size_t CCBBuffer<dataType_t, CB_MODE_SPSC>::remainingSpace()
+{
+    return (m_numElements - usedSpace());
+}
+
+/**\brief   Checks used space in the buffer
+ *
+ * \param   None
+ *
+ * \return  Used space in buffer
+ */
+template <class dataType_t>
+size_t CCBBuffer<dataType_t, CB_MODE_SPSC>::usedSpace()
+{
+    return (size_t)(m_end.load(std::memory_order_acquire) - m_start.load(std::memory_order_acquire));
+}
+
+/**\brief   Discards all elements in the buffer. Consumer only.
+ *
+ * \param   None
+ *
+ * \return  TRUE
+ */
+template <class dataType_t>
+bool CCBBuffer<dataType_t, CB_MODE_SPSC>::flushBuffer()
+{
+    m_start.store(m_end.load(std::memory_order_acquire), std::memory_order_release);
+    return true;
+}
+
+/**\brief   Writes as many elements as fit into the buffer. Producer only.
+ *
+ * \param   pData   - Pointer to data elements to be stored
+ * \param   length  - number of elements to write
+ *
+ * \return  number of elements written
+ */
+template <class dataType_t>
+int32_t CCBBuffer<dataType_t, CB_MODE_SPSC>::write(const dataType_t * const pData, size_t length)
+{
+    size_t written = 0;
+    dataType_t * pSpan;
+    size_t span;
+
+    /* at most two spans: up to the end of the array and from its start */
+    while ((written < length) && ((span = writeSpan(&pSpan)) != 0u))
+    {
+        size_t toWrite = ((length - written) < span) ? (length - written) : span;
+        memcpy(pSpan, &pData[written], toWrite * sizeof(dataType_t));
+        commitWrite(toWrite);
+        written += toWrite;
+    }
+
+    return (int32_t)written;
+}
+
+/**\brief   Reads up to length elements starting from the oldest one. Consumer only.
+ *
+ * \param   pData   - Pointer to place where data is to be returned
+ * \param   length  - maximum number of elements to read
+ *
+ * \return  number of elements read
+ */
+template <class dataType_t>
+int32_t CCBBuffer<dataType_t, CB_MODE_SPSC>::read(dataType_t * pData, size_t length)
+{
+    size_t readCnt = 0;
+    const dataType_t * pSpan;
+    size_t span;
+
+    while ((readCnt < length) && ((span = readSpan(&pSpan)) != 0u))
+    {
+        size_t toRead = ((length - readCnt) < span) ? (length - readCnt) : span;
+        memcpy(&pData[readCnt], pSpan, toRead * sizeof(dataType_t));
+        commitRead(toRead);
+        readCnt += toRead;
+    }
+
+    return (int32_t)readCnt;
+}
+
+/**\brief   Gets the contiguous free space behind the newest element, e.g. to
+ *          let a DMA fill it. The elements only become visible to the consumer
+ *          with commitWrite(). Producer only.
+ *
+ * \param   ppData  - returns a pointer to the first free element
+ *
+ * \return  number of contiguous free elements
+ */
+template <class dataType_t>
+size_t CCBBuffer<dataType_t, CB_MODE_SPSC>::writeSpan(dataType_t ** ppData)
+{
+    uint32_t end = m_end.load(std::memory_order_relaxed);
+    size_t free = m_numElements - (size_t)(end - m_start.load(std::memory_order_acquire));
+    size_t offset = end & (m_numElements - 1u);
+    size_t linear = m_numElements - offset;
+
+    *ppData = &m_pArray[offset];
+    return (free < linear) ? free : linear;
+}
+
+/**\brief   Publishes elements that were written into the span returned by
+ *          writeSpan(). Producer only.
+ *
+ * \param   length  - number of elements written, at most the size of the span
+ *
+ * \return  None
+ */
+template <class dataType_t>
+void CCBBuffer<dataType_t, CB_MODE_SPSC>::commitWrite(size_t length)
+{
+    m_end.store(m_end.load(std::memory_order_relaxed) + (uint32_t)length, std::memory_order_release);
+}
+
+/**\brief   Gets the contiguous elements starting from the oldest one, e.g. to
+ *          pass them to a DMA. They are only released with commitRead().
+ *          Consumer only.
+ *
+ * \param   ppData  - returns a pointer to the oldest element
+ *
+ * \return  number of contiguous elements
+ */
+template <class dataType_t>
+size_t CCBBuffer<dataType_t, CB_MODE_SPSC>::readSpan(const dataType_t ** ppData)
+{
+    uint32_t start = m_start.load(std::memory_order_relaxed);
+    size_t used = (size_t)(m_end.load(std::memory_order_acquire) - start);
+    size_t offset = start & (m_numElements - 1u);
+    size_t linear = m_numElements - offset;
+
+    *ppData = &m_pArray[offset];
+    return (used < linear) ? used : linear;
+}
+
+/**\brief   Releases elements that were consumed from the span returned by
+ *          readSpan(). Consumer only.
+ *
+ * \param   length  - number of elements consumed, at most the size of the span
+ *
+ * \return  None
+ */
+template <class dataType_t>
+void CCBBuffer<dataType_t, CB_MODE_SPSC>::commitRead(size_t length)
+{
+    m_start.store(m_start.load(std::memory_order_relaxed) + (uint32_t)length, std::memory_order_release);
+}
+
 #endif /* CIRCULAR_BUFFER_H --------------------------------------------------*/
\ No newline at end of file
@@ -308,7 +308,7 @@ void readProperty(char * pStr, StreamSink& response_channel, bool use_checksum)
     if (sscanf(pStr, "r %" TO_STR(MAX_LINE_LENGTH) "s", name) < 1) {
         respond(response_channel, use_checksum, "invalid command format");
     } else {
-        Endpoint* endpoint = application_endpoints_->get_by_name(name, sizeof(name));
+        Endpoint* endpoint = get_endpoint_by_name(name, sizeof(name));
         if (!endpoint) {
             respond(response_channel, use_checksum, "invalid property");
         } else {
@@ -329,7 +329,7 @@ void writeProperty(char * pStr, StreamSink& response_channel, bool use_checksum)
     if (sscanf(pStr, "w %" TO_STR(MAX_LINE_LENGTH) "s %" TO_STR(MAX_LINE_LENGTH) "s", name, value) < 1) {
         respond(response_channel, use_checksum, "invalid command format");
     } else {
-        Endpoint* endpoint = application_endpoints_->get_by_name(name, sizeof(name));
+        Endpoint* endpoint = get_endpoint_by_name(name, sizeof(name));
         if (!endpoint) {
             respond(response_channel, use_checksum, "invalid property");
         } else {
@@ -369,10 +369,11 @@ void unknownCMD(char * pStr, StreamSink& response_channel, bool use_checksum) {
 // @param buffer buffer of ASCII encoded values
 // @param response_channel reference to the stream to respond on
 // @param use_checksum bool to indicate whether a checksum is required on response
+static uint8_t parse_buffer[MAX_LINE_LENGTH];
+static bool read_active = true;
+static uint32_t parse_buffer_idx = 0;
+
 void ASCII_protocol_parse_stream(const uint8_t* buffer, size_t len, StreamSink& response_channel) {
-    static uint8_t parse_buffer[MAX_LINE_LENGTH];
-    static bool read_active = true;
-    static uint32_t parse_buffer_idx = 0;
 
     while (len--) {
         // if the line becomes too long, reset buffer and wait for the next line
@@ -396,3 +397,10 @@ void ASCII_protocol_parse_stream(const uint8_t* buffer, size_t len, StreamSink&
         }
     }
 }
+
+// @brief Discards the line that is being received, e.g. after bytes were
+// lost. Parsing resumes after the next end of line.
+void ASCII_protocol_reset_stream() {
+    read_active = false;
+    parse_buffer_idx = 0;
+}
@@ -17,6 +17,7 @@
 
 /* Exported functions --------------------------------------------------------*/
 void ASCII_protocol_parse_stream(const uint8_t* buffer, size_t len, StreamSink& response_channel);
+void ASCII_protocol_reset_stream();
 
 
 #endif /* __ASCII_PROTOCOL_H */
@@ -24,8 +24,71 @@
 #include <type_traits>
 
 /* Private defines -----------------------------------------------------------*/
+
+// Flash sector reserved for the cached JSON descriptor (see STM32F405RGTx_FLASH.ld)
+#define JSON_CACHE_FLASH_SECTOR FLASH_SECTOR_8
+#define JSON_CACHE_FLASH_BASE   0x08080000UL
+#define JSON_CACHE_FLASH_SIZE   0x20000UL
+#define JSON_CACHE_MAGIC        0x4E4F534AUL // "JSON"
+
+#define HAL_FLASH_ClearError() __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGSERR | FLASH_FLAG_PGPERR)
+
 /* Private macros ------------------------------------------------------------*/
 /* Private typedef -----------------------------------------------------------*/
+
+// Layout of the JSON cache sector. The header is written after the
+// descriptor, so an interrupted write leaves the cache invalid.
+struct JsonCache_t {
+    uint32_t magic;
+    uint32_t length;
+    uint8_t json[JSON_CACHE_FLASH_SIZE - 8];
+};
+
+// @brief Programs a continuous stream of bytes into flash.
+// The flash must be erased and unlocked.
+class FlashStreamSink : public StreamSink {
+public:
+    FlashStreamSink(uintptr_t addr, size_t length) : addr_(addr), free_space_(length) {}
+
+    int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) final {
+        for (size_t i = 0; i < length; ++i) {
+            if (!free_space_ || error_)
+                return error_ = true, -1;
+            word_ |= (uint32_t)buffer[i] << (8 * (pos_++ & 3));
+            --free_space_;
+            if (!(pos_ & 3) && !flush())
+                return -1;
+            if (processed_bytes)
+                ++*processed_bytes;
+        }
+        return 0;
+    }
+
+    size_t get_free_space() final { return free_space_; }
+
+    // @brief Programs the last incomplete word (padded with 0xff)
+    bool flush() {
+        if (pos_ & 3)
+            word_ |= 0xffffffffUL << (8 * (pos_ & 3));
+        else if (pos_ == written_)
+            return !error_;
+        if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, addr_ + (written_ & ~3), word_) != HAL_OK)
+            error_ = true;
+        pos_ = written_ = (pos_ + 3) & ~3;
+        word_ = 0;
+        return !error_;
+    }
+
+    bool error_ = false;
+
+private:
+    uintptr_t addr_;
+    size_t free_space_;
+    size_t pos_ = 0;     // bytes received
+    size_t written_ = 0; // bytes programmed
+    uint32_t word_ = 0;
+};
+
 /* Global constant data ------------------------------------------------------*/
 /* Global variables ----------------------------------------------------------*/
 
@@ -63,7 +126,8 @@ const uint8_t fw_version_minor = FW_VERSION_MINOR;
 const uint8_t fw_version_revision = FW_VERSION_REVISION;
 const uint8_t fw_version_unreleased = FW_VERSION_UNRELEASED; // 0 for official releases, 1 otherwise
 
-osThreadId comm_thread;
+// Only valid while the communication task runs, which is until start-up is done
+osThreadId volatile comm_thread = nullptr;
 volatile bool endpoint_list_valid = false;
 
 static uint32_t test_property = 0;
@@ -83,17 +147,19 @@ auto make_protocol_definitions(PWMMapping_t& mapping) {
 void init_communication(void) {
     printf("hi!\r\n");
 
-    // Start command handling thread
+    // Start command handling thread. Its large stack goes back to the heap
+    // when the thread ends, before the axis threads are started.
     osThreadDef(task_cmd_parse, communication_task, osPriorityNormal, 0, 8000 /* in 32-bit words */); // TODO: fix stack issues
-    comm_thread = osThreadCreate(osThread(task_cmd_parse), NULL);
+    osThreadCreate(osThread(task_cmd_parse), NULL);
 
     while (!endpoint_list_valid)
         osDelay(1);
 }
 
 
-float oscilloscope[OSCILLOSCOPE_SIZE] = {0};
-size_t oscilloscope_pos = 0;
+Oscilloscope oscilloscope;
+Telemetry telemetry;
+Notifier notifier;
 
 
 static CAN_context can1_ctx;
@@ -107,11 +173,21 @@ public:
     void erase_configuration_helper() { erase_configuration(); }
     void NVIC_SystemReset_helper() { NVIC_SystemReset(); }
     void enter_dfu_mode_helper() { enter_dfu_mode(); }
-    float get_oscilloscope_val(uint32_t index) { return oscilloscope[index]; }
+    float get_oscilloscope_val(uint32_t index) { return oscilloscope.get_val(index); }
     float get_adc_voltage_(uint32_t gpio) { return get_adc_voltage(get_gpio_port_by_pin(gpio), get_gpio_pin_by_pin(gpio)); }
     int32_t test_function(int32_t delta) { static int cnt = 0; return cnt += delta; }
 } static_functions;
 
+// The operations of a batch request are atomic with respect to the control
+// loop, which runs in interrupts and on the axis threads
+uint32_t fibre_enter_critical() {
+    return cpu_enter_critical();
+}
+
+void fibre_exit_critical(uint32_t mask) {
+    cpu_exit_critical(mask);
+}
+
 // When adding new functions/variables to the protocol, be careful not to
 // blow the communication stack. You can check comm_stack_info to see
 // how much headroom you have.
@@ -134,15 +210,32 @@ static inline auto make_obj_tree() {
             make_protocol_ro_property("min_stack_space_axis0", &system_stats_.min_stack_space_axis0),
             make_protocol_ro_property("min_stack_space_axis1", &system_stats_.min_stack_space_axis1),
             make_protocol_ro_property("min_stack_space_comms", &system_stats_.min_stack_space_comms),
-            make_protocol_ro_property("min_stack_space_usb", &system_stats_.min_stack_space_usb),
+            make_protocol_ro_property("min_stack_space_usb_cdc", &system_stats_.min_stack_space_usb_cdc),
+            make_protocol_ro_property("min_stack_space_usb_native", &system_stats_.min_stack_space_usb_native),
             make_protocol_ro_property("min_stack_space_uart", &system_stats_.min_stack_space_uart),
             make_protocol_ro_property("min_stack_space_usb_irq", &system_stats_.min_stack_space_usb_irq),
-            make_protocol_ro_property("min_stack_space_startup", &system_stats_.min_stack_space_startup),
+            make_protocol_ro_property("min_stack_space_can", &system_stats_.min_stack_space_can),
+            make_protocol_ro_property("cpu_load_axis0", &system_stats_.cpu_load_axis0),
+            make_protocol_ro_property("cpu_load_axis1", &system_stats_.cpu_load_axis1),
+            make_protocol_ro_property("cpu_load_usb_cdc", &system_stats_.cpu_load_usb_cdc),
+            make_protocol_ro_property("cpu_load_usb_native", &system_stats_.cpu_load_usb_native),
+            make_protocol_ro_property("cpu_load_usb_telemetry", &system_stats_.cpu_load_usb_telemetry),
+            make_protocol_ro_property("cpu_load_usb_notification", &system_stats_.cpu_load_usb_notification),
+            make_protocol_ro_property("cpu_load_uart", &system_stats_.cpu_load_uart),
+            make_protocol_ro_property("cpu_load_usb_irq", &system_stats_.cpu_load_usb_irq),
+            make_protocol_ro_property("cpu_load_can", &system_stats_.cpu_load_can),
+            make_protocol_ro_property("cpu_load_idle", &system_stats_.cpu_load_idle),
+            make_protocol_ro_property("cpu_load_adc_isr", &system_stats_.cpu_load_adc_isr),
+            make_protocol_ro_property("cpu_load_tim_update_isr", &system_stats_.cpu_load_tim_update_isr),
             make_protocol_object("usb",
                 make_protocol_ro_property("rx_cnt", &usb_stats_.rx_cnt),
                 make_protocol_ro_property("tx_cnt", &usb_stats_.tx_cnt),
                 make_protocol_ro_property("tx_overrun_cnt", &usb_stats_.tx_overrun_cnt)
             ),
+            make_protocol_object("uart",
+                make_protocol_ro_property("rx_overrun_cnt", &uart_stats_.rx_overrun_cnt),
+                make_protocol_ro_property("tx_timeout_cnt", &uart_stats_.tx_timeout_cnt)
+            ),
             make_protocol_object("i2c",
                 make_protocol_ro_property("addr", &i2c_stats_.addr),
                 make_protocol_ro_property("addr_match_cnt", &i2c_stats_.addr_match_cnt),
@@ -154,7 +247,13 @@ static inline auto make_obj_tree() {
             make_protocol_property("brake_resistance", &board_config.brake_resistance),
             // TODO: changing this currently requires a reboot - fix this
             make_protocol_property("enable_uart", &board_config.enable_uart),
+            make_protocol_property("uart_baudrate", &board_config.uart_baudrate), // requires a reboot
             make_protocol_property("enable_i2c_instead_of_can" , &board_config.enable_i2c_instead_of_can), // requires a reboot
+            make_protocol_property("enable_can", &board_config.enable_can), // requires a reboot
+            make_protocol_property("can_node_id", &board_config.can_node_id), // requires a reboot
+            make_protocol_property("can_feedback_period", &board_config.can_feedback_period),
+            make_protocol_property("can_status_period", &board_config.can_status_period),
+            make_protocol_property("can_sync_period", &board_config.can_sync_period),
             make_protocol_property("enable_ascii_protocol_on_usb", &board_config.enable_ascii_protocol_on_usb),
             make_protocol_property("dc_bus_undervoltage_trip_level", &board_config.dc_bus_undervoltage_trip_level),
             make_protocol_property("dc_bus_overvoltage_trip_level", &board_config.dc_bus_overvoltage_trip_level),
@@ -171,6 +270,10 @@ static inline auto make_obj_tree() {
         make_protocol_object("axis0", axes[0]->make_protocol_definitions()),
         make_protocol_object("axis1", axes[1]->make_protocol_definitions()),
         make_protocol_object("can", can1_ctx.make_protocol_definitions()),
+        make_protocol_object("oscilloscope", oscilloscope.make_protocol_definitions()),
+        make_protocol_object("telemetry", telemetry.make_protocol_definitions()),
+        make_protocol_object("event_log", event_log.make_protocol_definitions()),
+        make_protocol_object("notifications", notifier.make_protocol_definitions()),
         make_protocol_property("test_property", &test_property),
         make_protocol_function("test_function", static_functions, &StaticFunctions::test_function, "delta"),
         make_protocol_function("get_oscilloscope_val", static_functions, &StaticFunctions::get_oscilloscope_val, "index"),
@@ -185,17 +288,68 @@ static inline auto make_obj_tree() {
 using tree_type = decltype(make_obj_tree());
 uint8_t tree_buffer[sizeof(tree_type)];
 
+// @brief Writes the JSON descriptor to flash and tells fibre to serve it
+// from there. Called by fibre when a client starts reading the descriptor
+// and the cache in flash is missing or outdated, i.e. once after a
+// firmware update.
+// Erasing the sector stalls the CPU for one to two seconds, so this is
+// skipped while a motor is armed and tried again at the next read. Until
+// then the descriptor is generated on demand.
+void fibre_json_cache_miss() {
+    static bool failed = false;
+    const JsonCache_t* cache = reinterpret_cast<const JsonCache_t*>(JSON_CACHE_FLASH_BASE);
+    if (failed || json_length_ > sizeof(cache->json))
+        return; // keep generating the descriptor on demand
+
+    FLASH_EraseInitTypeDef erase_struct = {
+        .TypeErase = FLASH_TYPEERASE_SECTORS,
+        .Banks = 0, // only used for mass erase
+        .Sector = JSON_CACHE_FLASH_SECTOR,
+        .NbSectors = 1,
+        .VoltageRange = FLASH_VOLTAGE_RANGE_3
+    };
+    uint32_t sector_error;
+
+    // Several communication threads can get here at the same time, the
+    // first one writes the cache and the others find it valid
+    vTaskSuspendAll();
+    if (is_any_motor_armed()
+            || (cache->magic == JSON_CACHE_MAGIC && fibre_set_json_cache(cache->json, cache->length))) {
+        xTaskResumeAll();
+        return;
+    }
+    HAL_FLASH_Unlock();
+    HAL_FLASH_ClearError();
+    bool success = HAL_FLASHEx_Erase(&erase_struct, &sector_error) == HAL_OK;
+    if (success) {
+        FlashStreamSink json_sink((uintptr_t)cache->json, sizeof(cache->json));
+        json_file_endpoint_.write_descriptor(&json_sink);
+        success = json_sink.flush()
+               && HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, (uintptr_t)&cache->length, json_length_) == HAL_OK
+               && HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, (uintptr_t)&cache->magic, JSON_CACHE_MAGIC) == HAL_OK;
+    }
+    HAL_FLASH_Lock();
+    failed = !success || !fibre_set_json_cache(cache->json, cache->length);
+    xTaskResumeAll();
+}
 
-// Thread to handle deffered processing of USB interrupt, and
-// read commands out of the UART DMA circular buffer
+
+// Thread that publishes the object tree and starts the communication
+// servers, which run on their own threads. It ends once that is done.
 void communication_task(void const * ctx) {
     (void) ctx; // unused parameter
+    comm_thread = osThreadGetId();
 
     // TODO: this is supposed to use the move constructor, but currently
     // the compiler uses the copy-constructor instead. Thus the make_obj_tree
     // ends up with a stupid stack size of around 8000 bytes. Fix this.
     auto tree_ptr = new (tree_buffer) tree_type(make_obj_tree());
     fibre_publish(*tree_ptr);
+    // Use the cache if it is still valid. It is only rewritten later, when
+    // a client reads the descriptor (see fibre_json_cache_miss()).
+    const JsonCache_t* json_cache = reinterpret_cast<const JsonCache_t*>(JSON_CACHE_FLASH_BASE);
+    if (json_cache->magic == JSON_CACHE_MAGIC)
+        fibre_set_json_cache(json_cache->json, json_cache->length);
 
     // Allow main init to continue
     endpoint_list_valid = true;
@@ -204,14 +358,15 @@ void communication_task(void const * ctx) {
     start_usb_server();
     if (board_config.enable_i2c_instead_of_can) {
         start_i2c_server();
-    } else {
-        // TODO: finish implementing CAN
-        // start_can_server(can1_ctx, CAN1, serial_number);
+    } else if (board_config.enable_can) {
+        start_can_server(can1_ctx, CAN1, serial_number);
     }
 
-    for (;;) {
-        osDelay(1000); // nothing to do
-    }
+    // Keep the stack usage of the start-up for system_stats, then hand the
+    // ~32kB stack back to the FreeRTOS heap
+    system_stats_.min_stack_space_comms = uxTaskGetStackHighWaterMark(nullptr) * sizeof(StackType_t);
+    comm_thread = nullptr;
+    vTaskDelete(nullptr);
 }
 
 extern "C" {
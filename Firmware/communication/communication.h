@@ -14,7 +14,7 @@ extern "C" {
 
 #include <cmsis_os.h>
 
-extern osThreadId comm_thread;
+extern osThreadId volatile comm_thread;
 
 extern const uint8_t hw_version_major;
 extern const uint8_t hw_version_minor;
@@ -25,22 +25,127 @@
 * d) At a given point in time, a node MUST NOT send any regular message with
 *   a node ID that is not self-assigned.
 *
+* If config.can_node_id is set (1-127), that node ID is used instead and the
+* negotiation is skipped.
+*
+* Application protocol
+* --------------------
+* All frames use standard (11 bit) IDs that consist of a function code and
+* the node ID (ID = function code + node ID), similar to CANopen. All values
+* are little endian and all frames have 8 data bytes.
+*
+*   ID            Direction   Content
+*   0x180 + node  ODrive->    axis0 feedback: pos_estimate [counts] float32, vel_estimate [counts/s] float32
+*   0x280 + node  ODrive->    axis0 status: Iq_measured [A] float32, axis error uint16,
+*                             current state uint8, component errors uint8 (see below)
+*   0x380 + node  ODrive->    axis1 feedback
+*   0x480 + node  ODrive->    axis1 status
+*   0x200 + node  ->ODrive    axis0 setpoint: setpoint float32, vel_ff [0.01 turns/s] int16,
+*                             current_ff [0.01 A] int16
+*   0x300 + node  ->ODrive    axis1 setpoint
+*   0x400 + node  ->ODrive    command: axis uint8, opcode uint8, argument uint8, unused uint8,
+*                             time uint32 (only used by opcode 0x04)
+*   0x080         master->    SYNC: sync time [us] uint32 and sequence number uint8 of the
+*                             previous SYNC frame, sequence number uint8 of this frame
+*   0x700 + node  ODrive->    heartbeat (see above)
+*
+* The feedback and status frames of both axes are sent every
+* config.can_feedback_period milliseconds.
+*
+* The setpoint is interpreted according to the control mode of the axis:
+* position [counts] (with feed-forward terms), velocity [counts/s] (with
+* current feed-forward), current [A] or trajectory goal [counts].
+*
+* The component error bits of the status frame are set if the motor (0x01),
+* encoder (0x02), controller (0x04) or sensorless estimator (0x08) has an error.
+*
+* Command opcodes:
+*   0x01  set requested state, argument: state
+*   0x02  clear the errors of the axis and its components
+*   0x03  set control mode, argument: mode
+*   0x04  start the next trajectory of the axis at the given sync time [us]
+*         (see below), instead of immediately
+*
+* SYNC time base
+* --------------
+* One node on the bus is the time master (config.can_sync_period != 0). It
+* sends a SYNC frame every can_sync_period milliseconds. The sync time is the
+* time of the master in microseconds.
+*
+* The time at which a frame is sent is only known after it went out, so each
+* SYNC frame carries the time at which the previous one was sent, along with
+* the sequence numbers of both (like the follow-up messages of PTP). The TX
+* complete interrupt of the master and the RX interrupt of the followers fire
+* at the end of the same frame, so every follower can pair the local time at
+* which it received the previous SYNC frame with the master time at which it
+* was sent.
+*
+* Each follower disciplines a mapping from its DWT cycle counter to the sync
+* time with a PI loop on these pairs: the offset is corrected by
+* CAN_SYNC_KP of the error and the rate by CAN_SYNC_KI of the error per
+* interval. Errors above CAN_SYNC_MAX_ERROR (e.g. at the first SYNC frame)
+* step the mapping instead. The mapping is valid for CAN_SYNC_TIMEOUT after
+* the last update, so the SYNC period must be at most half of it.
+*
+* Setpoint and command frames are received in the RX FIFO1 interrupt, but
+* only queued there (CAN_RX_QUEUE_SIZE frames per axis). The axis thread
+* applies them at the top of its next control loop iteration
+* (can_apply_received), so that they never change the controller, trajectory
+* or error state in the middle of an iteration. Only the SYNC frames are
+* handled in the interrupt, since they need the exact time of reception.
+*
+* A trajectory that is scheduled at a sync time starts in the control loop
+* iteration that contains the corresponding local time, offset by the
+* remaining fraction of the iteration, so that all drives start within the
+* residual sync error (typically a few microseconds of interrupt latency)
+* rather than within one control period.
+*
 * Hardware allocation
 * -------------------
 *   RX FIFO0:
 *       - filter bank 0: heartbeat messages
+*   RX FIFO1:
+*       - filter bank 1: setpoint and command messages addressed to this node, SYNC
+*
+* The CAN server only runs if config.enable_can is set.
 */
 
 #include "interface_can.hpp"
 #include "fibre/crc.hpp"
 #include "utils.h"
 
+#include <odrive_main.h>
+
 #include <can.h>
 #include <stm32f4xx_hal.h>
 #include <cmsis_os.h>
 
 #define CAN_HEARTBEAT_INTERVAL  1000 // [ms]
 #define CAN_HEARTBEAT_MARGIN    10 // maximum time that a heartbeat message can be delayed until we stop sending other messages [ms]
+#define CAN_TX_TIMEOUT          5 // maximum time to wait for a free TX mailbox [ms]
+
+#define CAN_SYNC_KP             0.5f
+#define CAN_SYNC_KI             0.125f
+#define CAN_SYNC_MAX_ERROR      1000 // [us] larger errors step the sync time instead of slewing it
+#define CAN_SYNC_TIMEOUT        1000 // [ms] the sync time is invalid without a SYNC frame for this long
+#define CAN_SYNC_MAX_LEAD       10000 // [ms] maximum time between a trajectory command and its start
+#define CAN_SYNC_CYCLES_PER_US  (TIM_1_8_CLOCK_HZ / 1000000) // the DWT cycle counter runs at the timer clock
+#define CAN_SYNC_LOOP_CYCLES    (2 * TIM_1_8_PERIOD_CLOCKS * (TIM_1_8_RCR + 1)) // [CPU cycles] per control loop iteration
+
+#define CAN_RX_QUEUE_SIZE       4 // setpoint and command frames per axis that wait for the control loop
+
+// Function codes
+#define CAN_FEEDBACK(axis)      (0x180u + 0x200u * (axis))
+#define CAN_STATUS(axis)        (0x280u + 0x200u * (axis))
+#define CAN_SETPOINT(axis)      (0x200u + 0x100u * (axis))
+#define CAN_COMMAND             0x400u
+#define CAN_SYNC                0x080u
+#define CAN_HEARTBEAT           0x700u
+
+#define CAN_CMD_SET_REQUESTED_STATE 0x01
+#define CAN_CMD_CLEAR_ERRORS        0x02
+#define CAN_CMD_SET_CONTROL_MODE    0x03
+#define CAN_CMD_SET_TRAJ_START_TIME 0x04
 
 // defined in can.c
 extern CAN_HandleTypeDef hcan1;
@@ -49,6 +154,28 @@ extern CAN_HandleTypeDef hcan3;
 
 static CAN_context* ctxs[3] = { nullptr, nullptr, nullptr };
 
+// Pending start times of the next trajectory of each axis (CAN_CMD_SET_TRAJ_START_TIME)
+static bool traj_start_armed[AXIS_COUNT] = { false };
+static uint32_t traj_start_time[AXIS_COUNT] = { 0 };
+
+// Setpoint and command frames of each axis, written by the RX interrupt and
+// read by the axis thread
+struct CAN_RxFrame_t {
+    CAN_context* ctx;
+    uint32_t function;
+    uint8_t data[8];
+};
+
+struct CAN_RxQueue_t {
+    CAN_RxFrame_t frames[CAN_RX_QUEUE_SIZE];
+    uint32_t head = 0; // frames queued by the interrupt
+    uint32_t tail = 0; // frames applied by the axis thread
+};
+
+static CAN_RxQueue_t rx_queues[AXIS_COUNT];
+
+osThreadId can_thread;
+
 struct CAN_context* get_can_ctx(CAN_HandleTypeDef *hcan) {
 #if defined(CAN1)
     if (hcan->Instance == CAN1) return ctxs[0];
@@ -81,10 +208,10 @@ bool select_another_node_id(CAN_context* ctx) {
     for (uint8_t i = 0; i < 32; i++) {
         // Each time we select a new node ID, we use the next byte from the serial
         // number to get advance the node ID.
-        uint8_t poor_mans_random_byte = ((uint8_t*)ctx->serial_number)[ctx->node_id_rng_state];
+        uint8_t poor_mans_random_byte = ((uint8_t*)&ctx->serial_number)[ctx->node_id_rng_state];
         if (++(ctx->node_id_rng_state) >= sizeof(ctx->serial_number))
             ctx->node_id_rng_state = 0;
-        ctx->node_id = calc_crc<uint8_t, 1>(ctx->node_id, poor_mans_random_byte);
+        ctx->node_id = calc_crc<uint8_t, 1>(ctx->node_id, poor_mans_random_byte) & 0x7f;
         if (!is_node_id_in_use(ctx, ctx->node_id))
             return true;
     }
@@ -92,21 +219,216 @@ bool select_another_node_id(CAN_context* ctx) {
 }
 
 
+// @brief Sets up the filter bank that passes the messages addressed to this
+// node (setpoints and commands) and the SYNC frames into RX FIFO1
+bool configure_rx_filters(CAN_context* ctx) {
+    uint8_t node_id = ctx->node_id;
+    CAN_FilterTypeDef sFilterConfig = {
+        .FilterIdHigh = (CAN_SETPOINT(0) + node_id) << 5,
+        .FilterIdLow = (CAN_SETPOINT(1) + node_id) << 5,
+        .FilterMaskIdHigh = (CAN_COMMAND + node_id) << 5,
+        .FilterMaskIdLow = CAN_SYNC << 5,
+        .FilterFIFOAssignment = CAN_RX_FIFO1,
+        .FilterBank = 1,
+        .FilterMode = CAN_FILTERMODE_IDLIST,
+        .FilterScale = CAN_FILTERSCALE_16BIT, // four 16-bit IDs
+        .FilterActivation = ENABLE,
+        .SlaveStartFilterBank = 0
+    };
+    if (HAL_CAN_ConfigFilter(ctx->handle, &sFilterConfig) != HAL_OK)
+        return false;
+    ctx->filter_node_id = node_id;
+    return true;
+}
+
+// @brief Regular messages may only be sent with a self-assigned node ID
+static bool may_send_regular(CAN_context* ctx) {
+    return ctx->fixed_node_id || is_in_the_future(ctx->node_id_expiry);
+}
+
+static bool send_message(CAN_context* ctx, uint32_t std_id, const uint8_t data[8], uint32_t* mailbox) {
+    CAN_TxHeaderTypeDef header = {
+        .StdId = std_id,
+        .ExtId = 0,
+        .IDE = CAN_ID_STD,
+        .RTR = CAN_RTR_DATA,
+        .DLC = 8,
+        .TransmitGlobalTime = DISABLE
+    };
+    uint32_t deadline = osKernelSysTick() + CAN_TX_TIMEOUT;
+    while (HAL_CAN_GetTxMailboxesFreeLevel(ctx->handle) == 0) {
+        if (!is_in_the_future(deadline)) {
+            ctx->tx_dropped_cnt++;
+            return false;
+        }
+        osSemaphoreWait(ctx->sem_tx_mailbox, 1);
+    }
+    uint32_t unused_mailbox;
+    return HAL_CAN_AddTxMessage(ctx->handle, &header, const_cast<uint8_t*>(data),
+            mailbox ? mailbox : &unused_mailbox) == HAL_OK;
+}
+
+// @brief Returns the sync time [us] at the specified local time [CPU cycles].
+// The local time must be within about 12s of the reference point.
+static uint32_t local_to_sync_time(CAN_context* ctx, uint32_t cycles) {
+    float dt = (float)(int32_t)(cycles - ctx->sync_ref_cycles) * (1.0f / CAN_SYNC_CYCLES_PER_US);
+    return ctx->sync_ref_time + (int32_t)roundf(dt * (1.0f + ctx->sync_drift));
+}
+
+// @brief Returns the local time [CPU cycles] at the specified sync time [us].
+static uint32_t sync_to_local_time(CAN_context* ctx, uint32_t sync_time) {
+    float dt = (float)(int32_t)(sync_time - ctx->sync_ref_time) / (1.0f + ctx->sync_drift);
+    return ctx->sync_ref_cycles + (int32_t)roundf(dt * CAN_SYNC_CYCLES_PER_US);
+}
+
+static bool is_sync_valid(CAN_context* ctx) {
+    return ctx->sync_valid && (ctx->sync_master
+        || DWT->CYCCNT - ctx->sync_ref_cycles < CAN_SYNC_TIMEOUT * 1000u * CAN_SYNC_CYCLES_PER_US);
+}
+
+// @brief Disciplines the sync time of a follower with the time at which the
+// master sent a SYNC frame and the local time at which it was received.
+static void update_sync_time(CAN_context* ctx, uint32_t rx_cycles, uint32_t master_time) {
+    if (is_sync_valid(ctx)) {
+        uint32_t predicted = local_to_sync_time(ctx, rx_cycles);
+        int32_t error = (int32_t)(master_time - predicted);
+        if (error > -CAN_SYNC_MAX_ERROR && error < CAN_SYNC_MAX_ERROR) {
+            float dt = (float)(rx_cycles - ctx->sync_ref_cycles) * (1.0f / CAN_SYNC_CYCLES_PER_US);
+            ctx->sync_drift += CAN_SYNC_KI * (float)error / dt;
+            ctx->sync_ref_time = predicted + (int32_t)roundf(CAN_SYNC_KP * (float)error);
+            ctx->sync_ref_cycles = rx_cycles;
+            ctx->sync_error = error;
+            ctx->sync_cnt++;
+            return;
+        }
+        ctx->sync_error = error;
+    }
+
+    // (Re)acquire the master time
+    ctx->sync_ref_time = master_time;
+    ctx->sync_ref_cycles = rx_cycles;
+    ctx->sync_drift = 0.0f;
+    ctx->sync_valid = true;
+    ctx->sync_cnt++;
+}
+
+// @brief Sends the next SYNC frame (master only). The sync time of the master
+// is its local time, the reference point is only advanced to keep the
+// cycle count delta in range.
+static void send_sync(CAN_context* ctx) {
+    uint32_t mask = cpu_enter_critical();
+    if (!ctx->sync_master) {
+        ctx->sync_master = true;
+        ctx->sync_valid = true;
+        ctx->sync_tx_valid = false;
+        ctx->sync_drift = 0.0f;
+        ctx->sync_ref_cycles = DWT->CYCCNT;
+    }
+    uint32_t elapsed_us = (DWT->CYCCNT - ctx->sync_ref_cycles) / CAN_SYNC_CYCLES_PER_US;
+    ctx->sync_ref_cycles += elapsed_us * CAN_SYNC_CYCLES_PER_US;
+    ctx->sync_ref_time += elapsed_us;
+
+    uint8_t data[8] = { 0 };
+    memcpy(&data[0], &ctx->sync_tx_time, sizeof(ctx->sync_tx_time));
+    data[4] = ctx->sync_tx_seq;
+    data[5] = ++ctx->sync_seq;
+    if (!ctx->sync_tx_valid)
+        data[4] = data[5]; // never matches the sequence number of a previous frame
+    cpu_exit_critical(mask);
+
+    send_message(ctx, CAN_SYNC, data, &ctx->sync_mailbox);
+}
+
+static void send_feedback(CAN_context* ctx) {
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        Axis& axis = *axes[i];
+        uint8_t data[8];
+        memcpy(&data[0], &axis.encoder_.pos_estimate_, sizeof(float));
+        memcpy(&data[4], &axis.encoder_.vel_estimate_, sizeof(float));
+        send_message(ctx, CAN_FEEDBACK(i) + ctx->node_id, data, nullptr);
+    }
+}
+
+static void send_status(CAN_context* ctx) {
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        Axis& axis = *axes[i];
+        uint8_t data[8];
+        uint16_t error = axis.error_;
+        memcpy(&data[0], &axis.motor_.current_control_.Iq_measured, sizeof(float));
+        memcpy(&data[4], &error, sizeof(error));
+        data[6] = axis.current_state_;
+        data[7] = (axis.motor_.error_ != Motor::ERROR_NONE ? 0x01 : 0)
+                | (axis.encoder_.error_ != Encoder::ERROR_NONE ? 0x02 : 0)
+                | (axis.controller_.error_ != Controller::ERROR_NONE ? 0x04 : 0)
+                | (axis.sensorless_estimator_.error_ != SensorlessEstimator::ERROR_NONE ? 0x08 : 0);
+        send_message(ctx, CAN_STATUS(i) + ctx->node_id, data, nullptr);
+    }
+}
+
 void server_thread(CAN_context* ctx) {
-    uint32_t next_1s_tick = osKernelSysTick() + 1000;
+    uint32_t next_1s_tick = osKernelSysTick();
+    uint32_t next_feedback_tick = osKernelSysTick();
+    uint32_t next_status_tick = osKernelSysTick();
+    uint32_t next_sync_tick = osKernelSysTick();
     for (;;) {
-        if (deadline_to_timeout(next_1s_tick) == 0)
-            
-        // wait until either the next heartbeat is due or a hearbeat was requested
-        // by releasing the semaphore
-        osSemaphoreWait(ctx->sem_send_heartbeat, deadline_to_timeout(next_1s_tick));
-        if (!is_in_the_future(next_1s_tick))
+        uint32_t feedback_period = board_config.can_feedback_period;
+        uint32_t status_period = board_config.can_status_period;
+        uint32_t sync_period = std::min(board_config.can_sync_period, (uint32_t)CAN_SYNC_TIMEOUT / 2);
+
+        // wait until either the next heartbeat, feedback or status is due or a
+        // hearbeat was requested by releasing the semaphore
+        uint32_t timeout = deadline_to_timeout(next_1s_tick);
+        if (feedback_period)
+            timeout = std::min(timeout, deadline_to_timeout(next_feedback_tick));
+        if (status_period)
+            timeout = std::min(timeout, deadline_to_timeout(next_status_tick));
+        if (sync_period)
+            timeout = std::min(timeout, deadline_to_timeout(next_sync_tick));
+        bool heartbeat_requested = osSemaphoreWait(ctx->sem_send_heartbeat, timeout) == osOK;
+
+        if (ctx->filter_node_id != ctx->node_id)
+            configure_rx_filters(ctx);
+
+        if (sync_period && !is_in_the_future(next_sync_tick)) {
+            next_sync_tick += sync_period;
+            if (!is_in_the_future(next_sync_tick))
+                next_sync_tick = osKernelSysTick() + sync_period;
+            send_sync(ctx);
+        } else if (!sync_period && ctx->sync_master) {
+            uint32_t mask = cpu_enter_critical();
+            ctx->sync_master = false;
+            ctx->sync_valid = false;
+            cpu_exit_critical(mask);
+        }
+
+        if (feedback_period && !is_in_the_future(next_feedback_tick)) {
+            next_feedback_tick += feedback_period;
+            if (!is_in_the_future(next_feedback_tick))
+                next_feedback_tick = osKernelSysTick() + feedback_period; // fast-forward if we missed several periods
+            if (may_send_regular(ctx))
+                send_feedback(ctx);
+        }
+
+        if (status_period && !is_in_the_future(next_status_tick)) {
+            next_status_tick += status_period;
+            if (!is_in_the_future(next_status_tick))
+                next_status_tick = osKernelSysTick() + status_period;
+            if (may_send_regular(ctx))
+                send_status(ctx);
+        }
+
+        if (!heartbeat_requested && is_in_the_future(next_1s_tick))
+            continue;
+
+        if (!is_in_the_future(next_1s_tick)) {
             memcpy(ctx->node_ids_in_use_1, ctx->node_ids_in_use_0, sizeof(ctx->node_ids_in_use_1));
-        next_1s_tick += 1000;
-        if (!is_in_the_future(next_1s_tick))
-            next_1s_tick = osKernelSysTick(); // fast-forward if we missed several 1 second ticks
+            memset(ctx->node_ids_in_use_0, 0, sizeof(ctx->node_ids_in_use_0));
+            next_1s_tick += CAN_HEARTBEAT_INTERVAL;
+            if (!is_in_the_future(next_1s_tick))
+                next_1s_tick = osKernelSysTick(); // fast-forward if we missed several 1 second ticks
+        }
 
-        if (is_node_id_in_use(ctx, ctx->node_id)) {
+        if (!ctx->fixed_node_id && is_node_id_in_use(ctx, ctx->node_id)) {
             if (!select_another_node_id(ctx))
                 continue;
             else
@@ -115,20 +437,15 @@ void server_thread(CAN_context* ctx) {
 
         uint8_t data[8];
         //uint8_t data[] = { ctx->node_id }; // this would be the correct data for CANopen - TODO: make it compatible
-        *(uint64_t*)data = ctx->serial_number;
-
-        CAN_TxHeaderTypeDef header = {
-            .StdId = 0x700u + ctx->node_id,
-            .ExtId = 0,
-            .IDE = CAN_ID_STD,
-            .RTR = CAN_RTR_DATA,
-            .DLC = sizeof(data),
-            .TransmitGlobalTime = DISABLE
-        };
-        HAL_CAN_AddTxMessage(ctx->handle, &header, data, &ctx->last_heartbeat_mailbox);
+        memcpy(data, &ctx->serial_number, sizeof(data));
+        send_message(ctx, CAN_HEARTBEAT + ctx->node_id, data, &ctx->last_heartbeat_mailbox);
     }
 }
 
+static void can_server_thread(void const * ctx) {
+    server_thread((CAN_context*)ctx);
+}
+
 bool start_can_server(CAN_context& ctx, CAN_TypeDef *port, uint64_t serial_number) {
     //MX_CAN1_Init(); // TODO: flatten
 #if defined(CAN1)
@@ -145,17 +462,23 @@ bool start_can_server(CAN_context& ctx, CAN_TypeDef *port, uint64_t serial_numbe
 
     HAL_StatusTypeDef status;
 
-    ctx.node_id = calc_crc<uint8_t, 1>(0, (const uint8_t*)UID_BASE, 12);
+    ctx.fixed_node_id = board_config.can_node_id >= 1 && board_config.can_node_id <= 0x7f;
+    if (ctx.fixed_node_id)
+        ctx.node_id = board_config.can_node_id;
+    else
+        ctx.node_id = calc_crc<uint8_t, 1>(0, (const uint8_t*)UID_BASE, 12) & 0x7f;
     ctx.serial_number = serial_number;
     osSemaphoreDef(sem_send_heartbeat);
     ctx.sem_send_heartbeat = osSemaphoreCreate(osSemaphore(sem_send_heartbeat), 1);
     osSemaphoreWait(ctx.sem_send_heartbeat, 0);
+    osSemaphoreDef(sem_tx_mailbox);
+    ctx.sem_tx_mailbox = osSemaphoreCreate(osSemaphore(sem_tx_mailbox), 1);
 
     //// Set up heartbeat filter
     CAN_FilterTypeDef sFilterConfig = {
-        .FilterIdHigh = ((0x700u + ctx.node_id) << 5) | (0x0 << 2), // own heartbeat (standard ID, no RTR)
-        .FilterIdLow = (0x700u << 5) | (0x0 << 2), // any heartbeat (standard ID, no RTR)
-        .FilterMaskIdHigh = (0x7ffu << 5) | (0x3 << 2),
+        .FilterIdHigh = (CAN_HEARTBEAT << 5) | (0x0 << 2), // any heartbeat (standard ID, no RTR)
+        .FilterIdLow = (CAN_HEARTBEAT << 5) | (0x0 << 2), // any heartbeat (standard ID, no RTR)
+        .FilterMaskIdHigh = (0x780u << 5) | (0x3 << 2),
         .FilterMaskIdLow = (0x780u << 5) | (0x3 << 2),
         .FilterFIFOAssignment = CAN_RX_FIFO0,
         .FilterBank = 0,
@@ -168,6 +491,9 @@ bool start_can_server(CAN_context& ctx, CAN_TypeDef *port, uint64_t serial_numbe
     if (status != HAL_OK)
         return false;
 
+    if (!configure_rx_filters(&ctx))
+        return false;
+
     status = HAL_CAN_Start(ctx.handle);
     if (status != HAL_OK)
         return false;
@@ -184,7 +510,8 @@ bool start_can_server(CAN_context& ctx, CAN_TypeDef *port, uint64_t serial_numbe
     if (status != HAL_OK)
         return false;
     
-    server_thread(&ctx);
+    osThreadDef(can_server_thread_def, can_server_thread, osPriorityNormal, 0, 512);
+    can_thread = osThreadCreate(osThread(can_server_thread_def), &ctx);
     return true;
 }
 
@@ -192,7 +519,15 @@ void tx_complete_callback(CAN_HandleTypeDef *hcan, uint8_t mailbox_idx) {
     CAN_context *ctx = get_can_ctx(hcan);
     if (!ctx) return;
     ctx->tx_msg_cnt++;
-    if (mailbox_idx == ctx->last_heartbeat_mailbox) {
+    osSemaphoreRelease(ctx->sem_tx_mailbox);
+    if ((1u << mailbox_idx) == ctx->sync_mailbox) {
+        // The SYNC frame went out just now, its time is sent with the next one
+        ctx->sync_mailbox = 0;
+        ctx->sync_tx_time = local_to_sync_time(ctx, DWT->CYCCNT);
+        ctx->sync_tx_seq = ctx->sync_seq;
+        ctx->sync_tx_valid = true;
+    }
+    if ((1u << mailbox_idx) == ctx->last_heartbeat_mailbox) {
         // we succeeded in sending a heartbeat
         // now we're allowed to send messages for the next second plus a small margin
         ctx->node_id_expiry = osKernelSysTick() + CAN_HEARTBEAT_INTERVAL + CAN_HEARTBEAT_MARGIN;
@@ -204,10 +539,16 @@ void tx_aborted_callback(CAN_HandleTypeDef *hcan, uint8_t mailbox_idx) {
     if (!get_can_ctx(hcan))
         return;
     get_can_ctx(hcan)->TxMailboxAbortCallbackCnt++;
+    osSemaphoreRelease(get_can_ctx(hcan)->sem_tx_mailbox);
 }
 
 void tx_error(CAN_context *ctx, uint8_t mailbox_idx) {
-    if (mailbox_idx == ctx->last_heartbeat_mailbox) {
+    osSemaphoreRelease(ctx->sem_tx_mailbox);
+    if ((1u << mailbox_idx) == ctx->sync_mailbox) {
+        ctx->sync_mailbox = 0;
+        ctx->sync_tx_valid = false;
+    }
+    if ((1u << mailbox_idx) == ctx->last_heartbeat_mailbox && !ctx->fixed_node_id) {
         // Consider the node ID in use
         consider_node_id_in_use(ctx, ctx->node_id);
         // Try to find a new node ID that is not in use and immediately
@@ -238,7 +579,7 @@ void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef *hcan) {
     }
 
     uint8_t node_id = header.StdId & 0x07fu;
-    if ((header.StdId & 0x780u) == 0x700u) {
+    if ((header.StdId & 0x780u) == CAN_HEARTBEAT) {
         ctx->received_ack++;
         consider_node_id_in_use(ctx, node_id);
     } else {
@@ -248,7 +589,200 @@ void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef *hcan) {
 
 void HAL_CAN_RxFifo0FullCallback(CAN_HandleTypeDef *hcan) { if (get_can_ctx(hcan)) get_can_ctx(hcan)->RxFifo0FullCallbackCnt++; }
 
-void HAL_CAN_RxFifo1MsgPendingCallback(CAN_HandleTypeDef *hcan) { if (get_can_ctx(hcan)) get_can_ctx(hcan)->RxFifo1MsgPendingCallbackCnt++; }
+// @brief Finds the control loop iteration of the axis that contains the
+// specified sync time, and the offset [s] of the sync time into it.
+// Times in the past resolve to the current iteration.
+static bool sync_time_to_loop_count(CAN_context* ctx, Axis& axis, uint32_t sync_time,
+                                    uint32_t* loop_count, float* offset) {
+    // The SYNC interrupt updates the mapping to the local time. The start of
+    // the PWM period of the last current measurement is the time base of the
+    // iteration that processes this measurement.
+    uint32_t mask = cpu_enter_critical();
+    bool sync_valid = is_sync_valid(ctx);
+    uint32_t start_cycles = sync_to_local_time(ctx, sync_time);
+    uint32_t ref_cycles = axis.motor_.timing_ref_cycles_;
+    uint32_t ref_loop_count = axis.motor_.timing_ref_loop_count_;
+    cpu_exit_critical(mask);
+
+    if (!sync_valid)
+        return false;
+    if ((int32_t)(start_cycles - DWT->CYCCNT) > CAN_SYNC_MAX_LEAD * 1000 * CAN_SYNC_CYCLES_PER_US)
+        return false;
+
+    int32_t delta = std::max((int32_t)(start_cycles - ref_cycles), (int32_t)0);
+    uint32_t loops = (uint32_t)delta / CAN_SYNC_LOOP_CYCLES;
+    *loop_count = ref_loop_count + loops;
+    *offset = (float)((uint32_t)delta - loops * CAN_SYNC_LOOP_CYCLES) * (1.0f / TIM_1_8_CLOCK_HZ);
+    return true;
+}
+
+static bool handle_setpoint(CAN_context* ctx, size_t axis_idx, const uint8_t data[8]) {
+    Axis& axis = *axes[axis_idx];
+    float setpoint;
+    int16_t vel_ff, current_ff;
+    memcpy(&setpoint, &data[0], sizeof(setpoint));
+    memcpy(&vel_ff, &data[4], sizeof(vel_ff));
+    memcpy(&current_ff, &data[6], sizeof(current_ff));
+
+    Controller& controller = axis.controller_;
+    switch (controller.config_.control_mode) {
+        case Controller::CTRL_MODE_POSITION_CONTROL:
+            controller.set_pos_setpoint(setpoint,
+                    (float)vel_ff * 0.01f * (float)axis.encoder_.config_.cpr,
+                    (float)current_ff * 0.01f);
+            return true;
+        case Controller::CTRL_MODE_VELOCITY_CONTROL:
+            controller.set_vel_setpoint(setpoint, (float)current_ff * 0.01f);
+            return true;
+        case Controller::CTRL_MODE_CURRENT_CONTROL:
+            controller.set_current_setpoint(setpoint);
+            return true;
+        case Controller::CTRL_MODE_TRAJECTORY_CONTROL:
+            if (traj_start_armed[axis_idx]) {
+                // Don't move at all if the start time can't be honored
+                traj_start_armed[axis_idx] = false;
+                uint32_t loop_count;
+                float offset;
+                if (!sync_time_to_loop_count(ctx, axis, traj_start_time[axis_idx], &loop_count, &offset))
+                    return false;
+                controller.move_to_pos_at(setpoint, loop_count, offset);
+            } else {
+                controller.move_to_pos(setpoint);
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool handle_command(const uint8_t data[8]) {
+    Axis& axis = *axes[data[0]];
+    switch (data[1]) {
+        case CAN_CMD_SET_REQUESTED_STATE:
+            axis.requested_state_ = (Axis::State_t)data[2];
+            return true;
+        case CAN_CMD_CLEAR_ERRORS:
+            axis.error_ = Axis::ERROR_NONE;
+            axis.motor_.error_ = Motor::ERROR_NONE;
+            axis.encoder_.error_ = Encoder::ERROR_NONE;
+            axis.controller_.error_ = Controller::ERROR_NONE;
+            axis.sensorless_estimator_.error_ = SensorlessEstimator::ERROR_NONE;
+            return true;
+        case CAN_CMD_SET_CONTROL_MODE:
+            if (data[2] > Controller::CTRL_MODE_TRAJECTORY_CONTROL)
+                return false;
+            axis.controller_.config_.control_mode = (Controller::ControlMode_t)data[2];
+            axis.controller_.select_update_fn();
+            return true;
+        case CAN_CMD_SET_TRAJ_START_TIME:
+            memcpy(&traj_start_time[data[0]], &data[4], sizeof(uint32_t));
+            traj_start_armed[data[0]] = true;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// @brief Handles a SYNC frame on a follower. rx_cycles is the local time at
+// which it was received.
+static bool handle_sync(CAN_context* ctx, uint32_t rx_cycles, const uint8_t data[8]) {
+    if (ctx->sync_master)
+        return false; // there's another master on the bus
+    uint32_t prev_time;
+    memcpy(&prev_time, &data[0], sizeof(prev_time));
+    if (ctx->sync_rx_valid && data[4] == ctx->sync_seq)
+        update_sync_time(ctx, ctx->sync_rx_cycles, prev_time);
+    ctx->sync_seq = data[5];
+    ctx->sync_rx_cycles = rx_cycles;
+    ctx->sync_rx_valid = true;
+    return true;
+}
+
+// @brief Queues a setpoint or command frame for the control loop of the axis
+static bool queue_frame(CAN_context* ctx, size_t axis_idx, uint32_t function, const uint8_t data[8]) {
+    CAN_RxQueue_t& queue = rx_queues[axis_idx];
+    if (queue.head - queue.tail >= CAN_RX_QUEUE_SIZE) {
+        ctx->rx_dropped_cnt++;
+        return false;
+    }
+    CAN_RxFrame_t& frame = queue.frames[queue.head % CAN_RX_QUEUE_SIZE];
+    frame.ctx = ctx;
+    frame.function = function;
+    memcpy(frame.data, data, sizeof(frame.data));
+    queue.head++;
+    return true;
+}
+
+// @brief Applies the setpoint and command frames that were received for the
+// axis since the last call. Called by the axis thread at the top of each
+// control loop iteration.
+void can_apply_received(Axis& axis) {
+    CAN_RxQueue_t& queue = rx_queues[axis.axis_num_];
+    for (;;) {
+        // The interrupt may queue a frame at any time
+        uint32_t mask = cpu_enter_critical();
+        bool empty = queue.head == queue.tail;
+        CAN_RxFrame_t frame;
+        if (!empty)
+            frame = queue.frames[queue.tail++ % CAN_RX_QUEUE_SIZE];
+        cpu_exit_critical(mask);
+        if (empty)
+            return;
+
+        bool handled = (frame.function == CAN_COMMAND)
+                ? handle_command(frame.data)
+                : handle_setpoint(frame.ctx, axis.axis_num_, frame.data);
+
+        mask = cpu_enter_critical();
+        if (handled)
+            frame.ctx->received_cmd_cnt++;
+        else
+            frame.ctx->unhandled_messages++;
+        cpu_exit_critical(mask);
+    }
+}
+
+// SYNC frames are handled directly in the interrupt to get the time of
+// reception, setpoints and commands are queued for the control loop.
+void HAL_CAN_RxFifo1MsgPendingCallback(CAN_HandleTypeDef *hcan) {
+    uint32_t rx_cycles = DWT->CYCCNT;
+    CAN_context *ctx = get_can_ctx(hcan);
+    if (!ctx) return;
+    ctx->RxFifo1MsgPendingCallbackCnt++;
+
+    CAN_RxHeaderTypeDef header;
+    uint8_t data[8];
+    HAL_StatusTypeDef status = HAL_CAN_GetRxMessage(hcan, CAN_RX_FIFO1, &header, data);
+    if (status != HAL_OK) {
+        ctx->unexpected_errors++;
+        return;
+    }
+
+    if (header.StdId == CAN_SYNC && header.DLC == 8) {
+        if (!handle_sync(ctx, rx_cycles, data))
+            ctx->unhandled_messages++;
+        return;
+    }
+
+    // The filter may still be set up for the previous node ID
+    if ((header.StdId & 0x07fu) != ctx->node_id || header.DLC != 8) {
+        ctx->unhandled_messages++;
+        return;
+    }
+
+    uint32_t function = header.StdId & 0x780u;
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        if (function == CAN_SETPOINT(i)) {
+            queue_frame(ctx, i, function, data);
+            return;
+        }
+    }
+    if (function == CAN_COMMAND && data[0] < AXIS_COUNT) {
+        queue_frame(ctx, data[0], function, data);
+        return;
+    }
+    ctx->unhandled_messages++;
+}
 void HAL_CAN_RxFifo1FullCallback(CAN_HandleTypeDef *hcan) { if (get_can_ctx(hcan)) get_can_ctx(hcan)->RxFifo1FullCallbackCnt++; }
 void HAL_CAN_SleepCallback(CAN_HandleTypeDef *hcan) { if (get_can_ctx(hcan)) get_can_ctx(hcan)->SleepCallbackCnt++; }
 void HAL_CAN_WakeUpFromRxMsgCallback(CAN_HandleTypeDef *hcan) { if (get_can_ctx(hcan)) get_can_ctx(hcan)->WakeUpFromRxMsgCallbackCnt++; }
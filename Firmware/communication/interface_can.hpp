@@ -5,9 +5,13 @@
 #include <stm32f4xx_hal.h>
 #include <cmsis_os.h>
 
+class Axis;
+
 struct CAN_context {
     CAN_HandleTypeDef *handle = nullptr;
     uint8_t node_id = 0;
+    uint8_t filter_node_id = 0; // node ID for which the RX filters are configured
+    bool fixed_node_id = false;
     uint64_t serial_number = 0;
 
     uint32_t node_ids_in_use_0[4]; // 128 bits (indicate if a node ID was in use up to 1 second ago)
@@ -20,6 +24,7 @@ struct CAN_context {
     uint8_t node_id_rng_state = 0;
 
     osSemaphoreId sem_send_heartbeat;
+    osSemaphoreId sem_tx_mailbox; // released whenever a TX mailbox becomes free
 
     // count occurrence various callbacks
     uint32_t TxMailboxCompleteCallbackCnt = 0;
@@ -36,6 +41,25 @@ struct CAN_context {
     uint32_t received_ack = 0;
     uint32_t unexpected_errors = 0;
     uint32_t unhandled_messages = 0;
+    uint32_t received_cmd_cnt = 0;
+    uint32_t tx_dropped_cnt = 0;
+    uint32_t rx_dropped_cnt = 0; // setpoints and commands dropped because the control loop fell behind
+
+    // SYNC time base (see interface_can.cpp)
+    bool sync_master = false;
+    uint8_t sync_seq = 0;               // sequence number of the last SYNC frame sent (master) or received
+    uint32_t sync_mailbox = 0;          // TX mailbox (bit mask) of the SYNC frame in flight, 0 if none
+    bool sync_tx_valid = false;
+    uint8_t sync_tx_seq = 0;            // master: sequence number of the last SYNC frame that was sent successfully...
+    uint32_t sync_tx_time = 0;          // ...and the sync time [us] at which it was sent
+    bool sync_rx_valid = false;
+    uint32_t sync_rx_cycles = 0;        // follower: [CPU cycles] reception of the SYNC frame sync_seq
+    bool sync_valid = false;            // the reference below is valid
+    uint32_t sync_ref_cycles = 0;       // [CPU cycles] local time of the reference point...
+    uint32_t sync_ref_time = 0;         // ...and the sync time [us] at that point
+    float sync_drift = 0.0f;            // rate error of the local clock relative to the master
+    int32_t sync_error = 0;             // [us] offset to the master measured by the last SYNC frame
+    uint32_t sync_cnt = 0;
 
     auto make_protocol_definitions() {
         return make_protocol_member_list(
@@ -45,11 +69,21 @@ struct CAN_context {
             make_protocol_ro_property("received_msg_cnt", &received_msg_cnt),
             make_protocol_ro_property("received_ack", &received_ack),
             make_protocol_ro_property("unexpected_errors", &unexpected_errors),
-            make_protocol_ro_property("unhandled_messages", &unhandled_messages)
+            make_protocol_ro_property("unhandled_messages", &unhandled_messages),
+            make_protocol_ro_property("received_cmd_cnt", &received_cmd_cnt),
+            make_protocol_ro_property("tx_dropped_cnt", &tx_dropped_cnt),
+            make_protocol_ro_property("rx_dropped_cnt", &rx_dropped_cnt),
+            make_protocol_ro_property("sync_valid", &sync_valid),
+            make_protocol_ro_property("sync_error", &sync_error),
+            make_protocol_ro_property("sync_drift", &sync_drift),
+            make_protocol_ro_property("sync_cnt", &sync_cnt)
         );
     }
 };
 
+extern osThreadId can_thread;
+
 bool start_can_server(CAN_context& ctx, CAN_TypeDef *hcan, uint64_t serial_number);
+void can_apply_received(Axis& axis);
 
 #endif // __INTERFACE_CAN_HPP
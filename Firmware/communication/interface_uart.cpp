@@ -8,53 +8,106 @@
 #include <cmsis_os.h>
 #include <freertos_vars.h>
 
-#define UART_TX_BUFFER_SIZE 64
-#define UART_RX_BUFFER_SIZE 64
-
-// DMA open loop continous circular buffer
-static uint8_t dma_rx_buffer[2];
-
-static uint8_t RXBuffer[UART_RX_BUFFER_SIZE];
-CCBBuffer<uint8_t> CRXCircularBuffer(RXBuffer, sizeof(RXBuffer), false, false);
+#include <odrive_main.h>
+
+// Both buffer sizes must be powers of 2. The RX buffer must hold all bytes
+// that arrive while the UART thread is busy (about 90 bytes per ms at 921600 baud).
+#ifndef UART_TX_BUFFER_SIZE
+#define UART_TX_BUFFER_SIZE 512
+#endif
+#ifndef UART_RX_BUFFER_SIZE
+#define UART_RX_BUFFER_SIZE 512
+#endif
+
+static_assert((UART_TX_BUFFER_SIZE & (UART_TX_BUFFER_SIZE - 1)) == 0, "UART_TX_BUFFER_SIZE must be a power of 2");
+static_assert((UART_RX_BUFFER_SIZE & (UART_RX_BUFFER_SIZE - 1)) == 0, "UART_RX_BUFFER_SIZE must be a power of 2");
+
+// The RX DMA runs in circular mode forever. The UART thread is woken up on
+// half and full transfer and when the line goes idle after a burst of bytes,
+// and processes everything between its read position and the DMA position.
+// The half and full transfer interrupts count the halves of the buffer that
+// were filled, so the thread can tell if the DMA has overwritten bytes that
+// it hasn't read yet.
+static uint8_t dma_rx_buffer[UART_RX_BUFFER_SIZE];
+static volatile bool dma_rx_restarted = false;
+static volatile uint32_t dma_rx_halves = 0;
 
 // FIXME: the stdlib doesn't know about CMSIS threads, so this is just a global variable
 // static thread_local uint32_t deadline_ms = 0;
 
 osThreadId uart_thread;
+UARTStats_t uart_stats_ = {0};
 
+// @brief Returns how long it may take until the DMA has sent the given number
+// of bytes at the configured baud rate (10 bits per byte) [ms]
+static uint32_t uart_tx_timeout_ms(size_t length) {
+    uint32_t baudrate = std::max<uint32_t>(huart4.Init.BaudRate, 1);
+    return PROTOCOL_SERVER_TIMEOUT_MS + (uint32_t)(((uint64_t)length * 10 * 1000 + baudrate - 1) / baudrate);
+}
+
+// Bytes are queued in a ring buffer and sent by a chain of DMA transfers,
+// each of which covers the contiguous part of the queued bytes. The caller
+// only blocks if the ring buffer is full. Writers are serialized by disabling
+// interrupts, so the ring buffer sees a single producer (the writing threads)
+// and a single consumer (the TX complete interrupt).
 class UART4Sender 
     : public StreamSink
 {
 public:
     UART4Sender()
-        : CTXCircularBuffer(TXBuffer, sizeof(TXBuffer), false, false){}
+        : tx_ring_(tx_buf_, sizeof(tx_buf_)) {}
+
     int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes)
     {
-        // Loop to ensure all bytes get sent
         while (length)
         {
-            size_t chunk = (length < UART_TX_BUFFER_SIZE) ? length : UART_TX_BUFFER_SIZE;
-            // wait for USB interface to become ready
-            // TODO: implement ring buffer to get a more continuous stream of data
-            // if (osSemaphoreWait(sem_uart_dma, deadline_to_timeout(deadline_ms)) != osOK)
-            if (osSemaphoreWait(sem_uart_dma, PROTOCOL_SERVER_TIMEOUT_MS) != osOK)
-                return -1;
-			// transmit chunk
-            if (HAL_UART_Transmit_DMA(&huart4, (uint8_t *)memcpy(tx_buf_, buffer, chunk), chunk) != HAL_OK)
-                return -1;
+            uint32_t mask = cpu_enter_critical();
+            size_t chunk = tx_ring_.write(buffer, length);
+            start_transfer();
+            size_t in_flight = transfer_length_;
+            cpu_exit_critical(mask);
+
             buffer += chunk;
             length -= chunk;
             if (processed_bytes)
                 *processed_bytes += chunk;
+
+            // Wait for the DMA to make space. A transfer can cover the whole
+            // ring buffer, which takes about 44ms at 115200 baud.
+            // if (osSemaphoreWait(sem_uart_dma, deadline_to_timeout(deadline_ms)) != osOK)
+            if (length && osSemaphoreWait(sem_uart_dma, uart_tx_timeout_ms(in_flight)) != osOK) {
+                uart_stats_.tx_timeout_cnt++;
+                return -1;
+            }
         }
         return 0;
     }
 
     size_t get_free_space() { return SIZE_MAX; }
+
+    // Called from the TX complete interrupt
+    void on_transfer_complete() {
+        tx_ring_.commitRead(transfer_length_);
+        transfer_length_ = 0;
+        start_transfer();
+        osSemaphoreRelease(sem_uart_dma);
+    }
+
 private:
+    // Must be called from the UART interrupt or with interrupts disabled
+    void start_transfer() {
+        const uint8_t* data;
+        size_t length = tx_ring_.readSpan(&data);
+        if (transfer_length_ || !length)
+            return;
+        // If the UART is busy the transfer is started again on the next write
+        if (HAL_UART_Transmit_DMA(&huart4, const_cast<uint8_t*>(data), length) == HAL_OK)
+            transfer_length_ = length;
+    }
+
     uint8_t tx_buf_[UART_TX_BUFFER_SIZE];
-    uint8_t TXBuffer[UART_TX_BUFFER_SIZE];
-    CCBBuffer<uint8_t> CTXCircularBuffer;
+    CCBBuffer<uint8_t, CB_MODE_SPSC> tx_ring_;
+    volatile size_t transfer_length_ = 0; // length of the ongoing DMA transfer
 } uart4_stream_output;
 
 StreamSink * uart4_stream_output_ptr = &uart4_stream_output;
@@ -62,26 +115,66 @@ StreamBasedPacketSink uart4_packet_output(uart4_stream_output);
 BidirectionalPacketBasedChannel uart4_channel(uart4_packet_output);
 StreamToPacketSegmenter uart4_stream_input(uart4_channel);
 
+// @brief Returns the number of bytes that the RX DMA has written since it was
+// (re)started, i.e. the DMA position without wrapping around.
+// restarted is set if the DMA was restarted since the last call.
+static uint32_t get_dma_rx_count(bool* restarted) {
+    uint32_t mask = cpu_enter_critical();
+    *restarted = dma_rx_restarted;
+    dma_rx_restarted = false;
+    uint32_t halves = dma_rx_halves;
+    uint32_t pos = UART_RX_BUFFER_SIZE - __HAL_DMA_GET_COUNTER(huart4.hdmarx);
+    cpu_exit_critical(mask);
+    // If the DMA crossed a half of the buffer just now, the interrupt that
+    // counts it is still pending
+    uint32_t base = halves * (UART_RX_BUFFER_SIZE / 2);
+    return base + ((pos - base) & (UART_RX_BUFFER_SIZE - 1));
+}
+
+// @brief Drops the partially received packet or line after bytes were lost
+static void resync_rx() {
+    uart4_stream_input.reset();
+    ASCII_protocol_reset_stream();
+}
+
 static void uart_server_thread(void const * ctx) {
     (void) ctx;
 
+    uint32_t read_cnt = 0;
     for (;;) {
-        uint8_t RXData[UART_RX_BUFFER_SIZE] = {0};
-        size_t length = CRXCircularBuffer.read(RXData, sizeof(RXData));
+        osSignalWait(1, osWaitForever);
+        bool restarted;
+        uint32_t write_cnt = get_dma_rx_count(&restarted);
+        if (restarted) {
+            read_cnt = 0;
+            resync_rx();
+        }
+
+        if (write_cnt - read_cnt > UART_RX_BUFFER_SIZE) {
+            // The DMA has lapped the read position, the unread bytes are gone
+            uart_stats_.rx_overrun_cnt++;
+            read_cnt = write_cnt;
+            resync_rx();
+        }
+
+        while (read_cnt != write_cnt) {
+            size_t read_pos = read_cnt & (UART_RX_BUFFER_SIZE - 1);
+            size_t length = std::min<size_t>(write_cnt - read_cnt, UART_RX_BUFFER_SIZE - read_pos);
+            const uint8_t* data = &dma_rx_buffer[read_pos];
 
-        uart4_stream_input.process_bytes(RXData, length, nullptr); // TODO: use process_all
-        ASCII_protocol_parse_stream(RXData, length, uart4_stream_output);
+            uart4_stream_input.process_bytes(data, length, nullptr); // TODO: use process_all
+            ASCII_protocol_parse_stream(data, length, uart4_stream_output);
 
-        osThreadSuspend(uart_thread);
+            read_cnt += length;
+        }
     };
 }
 
 void start_uart_server() {
-    // DMA is set up to recieve in a circular buffer forever.
-    // We dont use interrupts to fetch the data directly, DMA transfers the data into a 
-	// circular buffer and signals the uart task to deal with the data. Data is then 
-	// taken out of the circular buffer into a parse buffer, controlled by a state machine
-    HAL_UART_Receive_DMA(&huart4, dma_rx_buffer, sizeof(dma_rx_buffer));
+    if (huart4.Init.BaudRate != board_config.uart_baudrate) {
+        huart4.Init.BaudRate = board_config.uart_baudrate;
+        HAL_UART_Init(&huart4);
+    }
 
     // Start UART communication thread
     osThreadDef(uart_server_thread_def,
@@ -90,6 +183,17 @@ void start_uart_server() {
                 0,
                 1024 /* the ascii protocol needs considerable stack space */);
     uart_thread = osThreadCreate(osThread(uart_server_thread_def), NULL);
+
+    // DMA is set up to recieve in a circular buffer forever.
+    // We dont use interrupts to fetch the data directly, DMA transfers the data into a 
+    // circular buffer and signals the uart task to deal with the data.
+    HAL_UART_Receive_DMA(&huart4, dma_rx_buffer, sizeof(dma_rx_buffer));
+    __HAL_UART_ENABLE_IT(&huart4, UART_IT_IDLE);
+}
+
+// Called from the UART4 interrupt when the RX line went idle
+void uart4_idle_line_callback() {
+    osSignalSet(uart_thread, 1);
 }
 
 /**
@@ -101,7 +205,10 @@ void start_uart_server() {
  void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart) {
     if(&huart4 == huart) {
         HAL_UART_AbortReceive(&huart4);
+        dma_rx_restarted = true;
+        dma_rx_halves = 0;
         HAL_UART_Receive_DMA(&huart4, dma_rx_buffer, sizeof(dma_rx_buffer));
+        osSignalSet(uart_thread, 1);
     }
 }
 
@@ -113,7 +220,7 @@ void start_uart_server() {
   */
 void HAL_UART_TxCpltCallback(UART_HandleTypeDef* huart) {
     if(&huart4 == huart) {
-        osSemaphoreRelease(sem_uart_dma);
+        uart4_stream_output.on_transfer_complete();
     }
 }
 
@@ -125,8 +232,8 @@ void HAL_UART_TxCpltCallback(UART_HandleTypeDef* huart) {
   */
 void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart) {
     if(&huart4 == huart) {
-        CRXCircularBuffer.write(&huart->pRxBuffPtr[0], 1);
-        osThreadResume(uart_thread);
+        dma_rx_halves++;
+        osSignalSet(uart_thread, 1);
     }
 }
 
@@ -138,7 +245,7 @@ void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart) {
   */
 void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) {
     if(&huart4 == huart) {
-        CRXCircularBuffer.write(&huart->pRxBuffPtr[1], 1);
-        osThreadResume(uart_thread);
+        dma_rx_halves++;
+        osSignalSet(uart_thread, 1);
     }
 }
@@ -9,10 +9,19 @@ extern "C" {
 #endif
 
 #include <cmsis_os.h>
+#include <stdint.h>
 
 extern osThreadId uart_thread;
 
+typedef struct {
+    uint32_t rx_overrun_cnt; // the thread fell behind by more than the RX buffer
+    uint32_t tx_timeout_cnt;
+} UARTStats_t;
+
+extern UARTStats_t uart_stats_;
+
 void start_uart_server(void);
+void uart4_idle_line_callback(void);
 
 #ifdef __cplusplus
 }
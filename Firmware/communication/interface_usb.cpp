@@ -13,7 +13,10 @@
 
 #include <odrive_main.h>
 
-osThreadId usb_thread;
+osThreadId usb_cdc_thread;
+osThreadId usb_native_thread;
+osThreadId usb_telemetry_thread;
+osThreadId usb_notification_thread;
 USBStats_t usb_stats_ = {0};
 
 class USBSender : public PacketSink {
@@ -49,9 +52,9 @@ private:
     const osSemaphoreId& sem_usb_tx_;
 };
 
-// Note we could have independent semaphores here to allow concurrent transmission
-USBSender usb_packet_output_cdc(CDC_OUT_EP, sem_usb_tx);
-USBSender usb_packet_output_native(ODRIVE_OUT_EP, sem_usb_tx);
+// Each interface has its own TX semaphore, such that they can transmit concurrently
+USBSender usb_packet_output_cdc(CDC_OUT_EP, sem_usb_tx_cdc);
+USBSender usb_packet_output_native(ODRIVE_OUT_EP, sem_usb_tx_native);
 
 class TreatPacketSinkAsStreamSink : public StreamSink {
 public:
@@ -86,71 +89,101 @@ BidirectionalPacketBasedChannel usb_channel(usb_packetized_output);
 StreamToPacketSegmenter usb_native_stream_input(usb_channel);
 #endif
 
+// The native protocol can be spoken on both interfaces (on CDC only if the
+// ASCII protocol is disabled). The interface threads take turns on the
+// channel, ASCII traffic doesn't need to wait for it.
+static osMutexId usb_channel_mutex;
+
+static void usb_process_native(const uint8_t* buf, uint32_t len) {
+    osMutexWait(usb_channel_mutex, osWaitForever);
+#if defined(USB_PROTOCOL_NATIVE)
+    usb_channel.process_packet(buf, len);
+#elif defined(USB_PROTOCOL_NATIVE_STREAM_BASED)
+    usb_native_stream_input.process_bytes(buf, len, nullptr);
+#endif
+    osMutexRelease(usb_channel_mutex);
+}
+
+static void usb_process_cdc(const uint8_t* buf, uint32_t len) {
+    if (board_config.enable_ascii_protocol_on_usb) {
+        ASCII_protocol_parse_stream(buf, len, usb_stream_output);
+    } else {
+        usb_process_native(buf, len);
+    }
+}
+
+// Each OUT endpoint receives alternately into one of two buffers. While the
+// interface thread processes one buffer, the endpoint is already armed to
+// receive the next packet into the other one. Only when both buffers are full
+// the endpoint NAKs until the thread has caught up.
 struct USBInterface {
-    uint8_t* rx_buf = nullptr;
-    uint32_t rx_len = 0;
-    bool data_pending = false;
+    uint8_t (*rx_buf)[USB_RX_DATA_SIZE];
+    volatile uint32_t rx_len[2];
+    volatile bool rx_full[2];
+    volatile bool rx_stalled; // endpoint is not armed because both buffers are full
+    uint8_t rx_next; // buffer that is processed next
     uint8_t out_ep;
     uint8_t in_ep;
-    USBSender& usb_sender;
+    const osSemaphoreId& sem_rx;
+    void (*process)(const uint8_t* buf, uint32_t len);
 };
 
 // Note: statics make this less modular.
-// Note: we use a single rx semaphore and loop over data_pending to allow a single pump loop thread
 static USBInterface CDC_interface = {
-    .rx_buf = nullptr,
-    .rx_len = 0,
-    .data_pending = false,
+    .rx_buf = CDCRxBufferFS,
+    .rx_len = { 0, 0 },
+    .rx_full = { false, false },
+    .rx_stalled = false,
+    .rx_next = 0,
     .out_ep = CDC_OUT_EP,
     .in_ep = CDC_IN_EP,
-    .usb_sender = usb_packet_output_cdc,
+    .sem_rx = sem_usb_rx_cdc,
+    .process = usb_process_cdc,
 };
 static USBInterface ODrive_interface = {
-    .rx_buf = nullptr,
-    .rx_len = 0,
-    .data_pending = false,
+    .rx_buf = ODRIVERxBufferFS,
+    .rx_len = { 0, 0 },
+    .rx_full = { false, false },
+    .rx_stalled = false,
+    .rx_next = 0,
     .out_ep = ODRIVE_OUT_EP,
     .in_ep = ODRIVE_IN_EP,
-    .usb_sender = usb_packet_output_native,
+    .sem_rx = sem_usb_rx_native,
+    .process = usb_process_native,
 };
 
+static void usb_arm_rx(USBInterface* usb_iface, uint8_t index) {
+    USBD_CDC_SetRxBuffer(&hUsbDeviceFS, usb_iface->rx_buf[index], usb_iface->out_ep);
+    USBD_CDC_ReceivePacket(&hUsbDeviceFS, usb_iface->out_ep);
+}
+
 static void usb_server_thread(void const * ctx) {
-    (void) ctx;
-    
+    USBInterface* usb_iface = (USBInterface*)ctx;
+
     for (;;) {
-        // const uint32_t usb_check_timeout = 1; // ms
-        int32_t sem_stat = osSemaphoreWait(sem_usb_rx, osWaitForever);
-        if (sem_stat == osOK) {
+        int32_t sem_stat = osSemaphoreWait(usb_iface->sem_rx, osWaitForever);
+        if (sem_stat != osOK)
+            continue;
+
+        // Packets arrive alternately in the two buffers, so processing them
+        // alternately preserves their order.
+        uint8_t i = usb_iface->rx_next;
+        while (usb_iface->rx_full[i]) {
             usb_stats_.rx_cnt++;
+            usb_iface->process(usb_iface->rx_buf[i], usb_iface->rx_len[i]);
 
-            // CDC Interface
-            if (CDC_interface.data_pending) {
-                CDC_interface.data_pending = false;
-                if (board_config.enable_ascii_protocol_on_usb) {
-                    ASCII_protocol_parse_stream(CDC_interface.rx_buf,
-                            CDC_interface.rx_len, usb_stream_output);
-                } else {
-#if defined(USB_PROTOCOL_NATIVE)
-                    usb_channel.process_packet(CDC_interface.rx_buf, CDC_interface.rx_len);
-#elif defined(USB_PROTOCOL_NATIVE_STREAM_BASED)
-                    usb_native_stream_input.process_bytes(
-                            CDC_interface.rx_buf, CDC_interface.rx_len, nullptr);
-#endif
-                }
-                USBD_CDC_ReceivePacket(&hUsbDeviceFS, CDC_interface.out_ep);  // Allow next packet
+            // The USB callbacks run in the USB IRQ thread, which can't
+            // preempt this critical section.
+            uint32_t mask = cpu_enter_critical();
+            usb_iface->rx_full[i] = false;
+            if (usb_iface->rx_stalled) {
+                usb_iface->rx_stalled = false;
+                usb_arm_rx(usb_iface, i);  // Allow next packet
             }
+            cpu_exit_critical(mask);
 
-            // Native Interface
-            if (ODrive_interface.data_pending) {
-                ODrive_interface.data_pending = false;
-#if defined(USB_PROTOCOL_NATIVE)
-                usb_channel.process_packet(ODrive_interface.rx_buf, ODrive_interface.rx_len);
-#elif defined(USB_PROTOCOL_NATIVE_STREAM_BASED)
-                usb_native_stream_input.process_bytes(
-                        ODrive_interface.rx_buf, ODrive_interface.rx_len, nullptr);
-#endif
-                USBD_CDC_ReceivePacket(&hUsbDeviceFS, ODrive_interface.out_ep);  // Allow next packet
-            }
+            i ^= 1;
+            usb_iface->rx_next = i;
         }
     }
 }
@@ -167,16 +200,67 @@ void usb_rx_process_packet(uint8_t *buf, uint32_t len, uint8_t endpoint_pair) {
         return;
     }
 
-    // We don't allow the next USB packet until the previous one has been processed completely.
-    // Therefore it's safe to write to these vars directly since we know previous processing is complete.
-    usb_iface->rx_buf = buf;
-    usb_iface->rx_len = len;
-    usb_iface->data_pending = true;
-    osSemaphoreRelease(sem_usb_rx);
+    uint8_t i = (buf == usb_iface->rx_buf[0]) ? 0 : 1;
+    usb_iface->rx_len[i] = len;
+
+    // Receive the next packet into the other buffer unless that one is still
+    // waiting to be processed. In that case the thread re-arms the endpoint.
+    uint32_t mask = cpu_enter_critical();
+    usb_iface->rx_full[i] = true;
+    if (!usb_iface->rx_full[i ^ 1])
+        usb_arm_rx(usb_iface, i ^ 1);
+    else
+        usb_iface->rx_stalled = true;
+    cpu_exit_critical(mask);
+
+    osSemaphoreRelease(usb_iface->sem_rx);
+}
+
+#if defined(USB_PROTOCOL_NATIVE)
+// Sends the telemetry frames on the native interface as soon as the
+// control loop interrupt has filled them
+static void usb_telemetry_thread_fn(void const * ctx) {
+    (void) ctx;
+
+    telemetry.sender_thread_ = osThreadGetId();
+    for (;;) {
+        osSignalWait(1, osWaitForever);
+        size_t length;
+        while (const uint8_t* frame = telemetry.get_frame(&length)) {
+            usb_packet_output_native.process_packet(frame, length);
+            telemetry.release_frame();
+        }
+    }
+}
+
+// Polls the subscribed properties and sends notifications about changed
+// values on the native interface
+static void usb_notification_thread_fn(void const * ctx) {
+    (void) ctx;
+
+    for (;;) {
+        notifier.update(usb_packet_output_native);
+        osDelay(1);
+    }
 }
+#endif
 
 void start_usb_server() {
-    // Start USB communication thread
-    osThreadDef(usb_server_thread_def, usb_server_thread, osPriorityNormal, 0, 1024);
-    usb_thread = osThreadCreate(osThread(usb_server_thread_def), NULL);
+    osMutexDef(usb_channel_mutex_def);
+    usb_channel_mutex = osMutexCreate(osMutex(usb_channel_mutex_def));
+
+    // Start one USB communication thread per interface
+    osThreadDef(usb_cdc_thread_def, usb_server_thread, osPriorityNormal, 0, 1024);
+    usb_cdc_thread = osThreadCreate(osThread(usb_cdc_thread_def), &CDC_interface);
+
+    osThreadDef(usb_native_thread_def, usb_server_thread, osPriorityNormal, 0, 1024);
+    usb_native_thread = osThreadCreate(osThread(usb_native_thread_def), &ODrive_interface);
+
+#if defined(USB_PROTOCOL_NATIVE)
+    osThreadDef(usb_telemetry_thread_def, usb_telemetry_thread_fn, osPriorityNormal, 0, 256);
+    usb_telemetry_thread = osThreadCreate(osThread(usb_telemetry_thread_def), NULL);
+
+    osThreadDef(usb_notification_thread_def, usb_notification_thread_fn, osPriorityNormal, 0, 256);
+    usb_notification_thread = osThreadCreate(osThread(usb_notification_thread_def), NULL);
+#endif
 }
@@ -11,7 +11,10 @@ extern "C" {
 #include <cmsis_os.h>
 #include <stdint.h>
 
-extern osThreadId usb_thread;
+extern osThreadId usb_cdc_thread;
+extern osThreadId usb_native_thread;
+extern osThreadId usb_telemetry_thread;
+extern osThreadId usb_notification_thread;
 
 typedef struct {
     uint32_t rx_cnt;
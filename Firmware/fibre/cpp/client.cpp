@@ -0,0 +1,618 @@
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <algorithm>
+
+#include <fibre/client.hpp>
+
+/* Private defines -----------------------------------------------------------*/
+
+#define JSON_MAX_DEPTH  32
+
+/* Private typedef -----------------------------------------------------------*/
+
+// Minimal JSON document model, just enough for the descriptors
+struct JsonValue {
+    enum Type { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT } type = NUL;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<JsonValue> items;
+    std::vector<std::pair<std::string, JsonValue>> members;
+
+    const JsonValue* get(const char* key) const {
+        for (auto& member : members)
+            if (member.first == key)
+                return &member.second;
+        return nullptr;
+    }
+
+    std::string get_string(const char* key) const {
+        const JsonValue* value = get(key);
+        return (value && value->type == STRING) ? value->string : "";
+    }
+};
+
+class JsonParser {
+public:
+    JsonParser(const char* json, size_t length) : pos_(json), end_(json + length) {}
+
+    bool parse(JsonValue* value) {
+        if (!parse_value(value, 0))
+            return false;
+        skip_whitespace();
+        return pos_ == end_;
+    }
+
+private:
+    void skip_whitespace() {
+        while (pos_ < end_ && (*pos_ == ' ' || *pos_ == '\t' || *pos_ == '\r' || *pos_ == '\n'))
+            pos_++;
+    }
+
+    bool consume(char c) {
+        skip_whitespace();
+        if (pos_ < end_ && *pos_ == c) {
+            pos_++;
+            return true;
+        }
+        return false;
+    }
+
+    bool consume_literal(const char* literal) {
+        size_t length = strlen(literal);
+        if ((size_t)(end_ - pos_) < length || strncmp(pos_, literal, length))
+            return false;
+        pos_ += length;
+        return true;
+    }
+
+    bool parse_string(std::string* str) {
+        if (!consume('"'))
+            return false;
+        while (pos_ < end_ && *pos_ != '"') {
+            char c = *pos_++;
+            if (c != '\\') {
+                *str += c;
+                continue;
+            }
+            if (pos_ >= end_)
+                return false;
+            switch (c = *pos_++) {
+                case 'b': *str += '\b'; break;
+                case 'f': *str += '\f'; break;
+                case 'n': *str += '\n'; break;
+                case 'r': *str += '\r'; break;
+                case 't': *str += '\t'; break;
+                case 'u': {
+                    // Only the basic multilingual plane, encoded as UTF-8
+                    if (end_ - pos_ < 4)
+                        return false;
+                    char hex[5] = { pos_[0], pos_[1], pos_[2], pos_[3], 0 };
+                    char* hex_end;
+                    unsigned long cp = strtoul(hex, &hex_end, 16);
+                    if (hex_end != hex + 4)
+                        return false;
+                    pos_ += 4;
+                    if (cp < 0x80) {
+                        *str += (char)cp;
+                    } else if (cp < 0x800) {
+                        *str += (char)(0xc0 | (cp >> 6));
+                        *str += (char)(0x80 | (cp & 0x3f));
+                    } else {
+                        *str += (char)(0xe0 | (cp >> 12));
+                        *str += (char)(0x80 | ((cp >> 6) & 0x3f));
+                        *str += (char)(0x80 | (cp & 0x3f));
+                    }
+                    break;
+                }
+                default: *str += c; break; // '"', '\\' and '/'
+            }
+        }
+        return consume('"');
+    }
+
+    bool parse_value(JsonValue* value, unsigned depth) {
+        if (depth > JSON_MAX_DEPTH)
+            return false;
+        skip_whitespace();
+        if (pos_ >= end_)
+            return false;
+
+        if (*pos_ == '{') {
+            pos_++;
+            value->type = JsonValue::OBJECT;
+            if (consume('}'))
+                return true;
+            do {
+                value->members.emplace_back();
+                if (!parse_string(&value->members.back().first) || !consume(':')
+                    || !parse_value(&value->members.back().second, depth + 1))
+                    return false;
+            } while (consume(','));
+            return consume('}');
+        } else if (*pos_ == '[') {
+            pos_++;
+            value->type = JsonValue::ARRAY;
+            if (consume(']'))
+                return true;
+            do {
+                value->items.emplace_back();
+                if (!parse_value(&value->items.back(), depth + 1))
+                    return false;
+            } while (consume(','));
+            return consume(']');
+        } else if (*pos_ == '"') {
+            value->type = JsonValue::STRING;
+            return parse_string(&value->string);
+        } else if (consume_literal("true")) {
+            value->type = JsonValue::BOOLEAN;
+            value->boolean = true;
+            return true;
+        } else if (consume_literal("false")) {
+            value->type = JsonValue::BOOLEAN;
+            return true;
+        } else if (consume_literal("null")) {
+            return true;
+        } else {
+            // strtod needs a terminated string
+            char buf[32];
+            size_t length = std::min((size_t)(end_ - pos_), sizeof(buf) - 1);
+            memcpy(buf, pos_, length);
+            buf[length] = 0;
+            char* num_end;
+            value->type = JsonValue::NUMBER;
+            value->number = strtod(buf, &num_end);
+            if (num_end == buf)
+                return false;
+            pos_ += num_end - buf;
+            return true;
+        }
+    }
+
+    const char* pos_;
+    const char* end_;
+};
+
+/* Private function prototypes -----------------------------------------------*/
+
+static size_t get_type_size(const std::string& type);
+
+/* Function implementations --------------------------------------------------*/
+
+static size_t get_type_size(const std::string& type) {
+    if (type == "bool" || type == "int8" || type == "uint8") return 1;
+    if (type == "int16" || type == "uint16") return 2;
+    if (type == "float" || type == "int32" || type == "uint32" || type == "endpoint_ref") return 4;
+    if (type == "int64" || type == "uint64") return 8;
+    return 0;
+}
+
+int ClientChannel::start_operation(uint16_t endpoint_id, const uint8_t* input, size_t input_length,
+                                   size_t output_length, bool expect_response, OperationCallback callback) {
+    if (input_length + 8 > CLIENT_MAX_PACKET_SIZE || output_length > 0xffff || endpoint_id > 0x7fff)
+        return CLIENT_ERROR_INVALID_ARGUMENT;
+
+    uint8_t packet[CLIENT_MAX_PACKET_SIZE];
+    size_t packet_length = 2;
+    packet_length += write_le<uint16_t>(endpoint_id | (expect_response ? 0x8000 : 0), packet + packet_length);
+    packet_length += write_le<uint16_t>(output_length, packet + packet_length);
+    if (input_length)
+        memcpy(packet + packet_length, input, input_length);
+    packet_length += input_length;
+    packet_length += write_le<uint16_t>(endpoint_id ? json_crc_ : PROTOCOL_VERSION, packet + packet_length);
+
+    PendingRequest* request = nullptr;
+    uint16_t seq_no;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (expect_response)
+            slot_freed_.wait(lock, [this]() { return closed_ || n_outstanding_ < max_outstanding_; });
+        if (closed_)
+            return CLIENT_ERROR_CLOSED;
+
+        // Bit 7 of the sequence number is always set, such that requests
+        // can't be mistaken for ASCII commands and responses can be told
+        // apart from device-initiated packets.
+        bool in_use;
+        do {
+            outbound_seq_no_ = (outbound_seq_no_ + 1) & 0x7fff;
+            outbound_seq_no_ |= 0x80;
+            seq_no = outbound_seq_no_;
+            in_use = false;
+            for (PendingRequest& r : requests_)
+                in_use |= r.in_use && r.seq_no == seq_no;
+        } while (in_use);
+        write_le<uint16_t>(seq_no, packet);
+
+        if (expect_response) {
+            for (PendingRequest& r : requests_) {
+                if (!r.in_use) {
+                    request = &r;
+                    break;
+                }
+            }
+            request->in_use = true;
+            request->seq_no = seq_no;
+            request->attempts = 1;
+            request->deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(resend_timeout_ms_);
+            request->packet.assign(packet, packet + packet_length);
+            request->callback = std::move(callback);
+            n_outstanding_++;
+        }
+    }
+
+    int status;
+    {
+        std::lock_guard<std::mutex> send_lock(send_mutex_);
+        status = output_.process_packet(packet, packet_length);
+    }
+
+    if (status && request) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (request->in_use && request->seq_no == seq_no) {
+            request->in_use = false;
+            request->callback = nullptr;
+            n_outstanding_--;
+            slot_freed_.notify_one();
+        }
+    }
+    if (status)
+        return CLIENT_ERROR_CLOSED;
+
+    if (!expect_response && callback)
+        callback(0, nullptr, 0);
+    return 0;
+}
+
+int ClientChannel::run_operation(uint16_t endpoint_id, const uint8_t* input, size_t input_length,
+                                 uint8_t* output, size_t output_length, size_t* received_length) {
+    struct {
+        std::mutex mutex;
+        std::condition_variable done_cv;
+        bool done = false;
+        int status = 0;
+        uint8_t* output;
+        size_t output_length;
+        size_t received_length = 0;
+    } sync;
+    sync.output = output;
+    sync.output_length = output_length;
+    auto sync_ptr = &sync;
+
+    int status = start_operation(endpoint_id, input, input_length, output_length, true,
+        [sync_ptr](int status, const uint8_t* response, size_t length) {
+            std::lock_guard<std::mutex> lock(sync_ptr->mutex);
+            if (!status && sync_ptr->output)
+                memcpy(sync_ptr->output, response, std::min(length, sync_ptr->output_length));
+            sync_ptr->status = status;
+            sync_ptr->received_length = length;
+            sync_ptr->done = true;
+            sync_ptr->done_cv.notify_one();
+        });
+    if (status)
+        return status;
+
+    std::unique_lock<std::mutex> lock(sync.mutex);
+    sync.done_cv.wait(lock, [&sync]() { return sync.done; });
+    if (received_length)
+        *received_length = std::min(sync.received_length, output_length);
+    return sync.status;
+}
+
+int ClientChannel::read_long_endpoint(uint16_t endpoint_id, std::vector<uint8_t>* data, size_t max_length) {
+    data->clear();
+    uint8_t chunk[CLIENT_MAX_PACKET_SIZE];
+    while (data->size() < max_length) {
+        uint8_t offset[4];
+        write_le<uint32_t>(data->size(), offset);
+        size_t length = 0;
+        int status = run_operation(endpoint_id, offset, sizeof(offset), chunk, sizeof(chunk), &length);
+        if (status)
+            return status;
+        if (!length)
+            break;
+        data->insert(data->end(), chunk, chunk + std::min(length, max_length - data->size()));
+    }
+    return 0;
+}
+
+int ClientChannel::process_packet(const uint8_t* buffer, size_t length) {
+    if (length < 2)
+        return CLIENT_ERROR_PROTOCOL;
+    uint16_t seq_no = read_le<uint16_t>(&buffer, &length);
+
+    // Requests from the device and device-initiated streams are not handled
+    if (!(seq_no & 0x8000) || !(seq_no & 0x80))
+        return 0;
+    seq_no &= 0x7fff;
+
+    OperationCallback callback;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        PendingRequest* request = nullptr;
+        for (PendingRequest& r : requests_) {
+            if (r.in_use && r.seq_no == seq_no) {
+                request = &r;
+                break;
+            }
+        }
+        if (!request) {
+            // e.g. the response to a request that was sent twice
+            unexpected_response_cnt_++;
+            return 0;
+        }
+        callback = std::move(request->callback);
+        request->callback = nullptr;
+        request->in_use = false;
+        n_outstanding_--;
+        slot_freed_.notify_one();
+    }
+
+    if (callback)
+        callback(0, buffer, length);
+    return 0;
+}
+
+void ClientChannel::check_timeouts() {
+    std::vector<std::vector<uint8_t>> resend;
+    std::vector<OperationCallback> failed;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = std::chrono::steady_clock::now();
+        for (PendingRequest& r : requests_) {
+            if (!r.in_use || r.deadline > now)
+                continue;
+            if (r.attempts >= send_attempts_) {
+                failed.push_back(std::move(r.callback));
+                r.callback = nullptr;
+                r.in_use = false;
+                n_outstanding_--;
+                slot_freed_.notify_one();
+            } else {
+                r.attempts++;
+                r.deadline = now + std::chrono::milliseconds(resend_timeout_ms_);
+                resend.push_back(r.packet);
+                resent_cnt_++;
+            }
+        }
+    }
+
+    for (auto& packet : resend) {
+        std::lock_guard<std::mutex> send_lock(send_mutex_);
+        output_.process_packet(packet.data(), packet.size());
+    }
+    for (auto& callback : failed)
+        if (callback)
+            callback(CLIENT_ERROR_TIMEOUT, nullptr, 0);
+}
+
+void ClientChannel::close() {
+    std::vector<OperationCallback> failed;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        for (PendingRequest& r : requests_) {
+            if (r.in_use) {
+                failed.push_back(std::move(r.callback));
+                r.callback = nullptr;
+                r.in_use = false;
+            }
+        }
+        n_outstanding_ = 0;
+        slot_freed_.notify_all();
+    }
+    for (auto& callback : failed)
+        if (callback)
+            callback(CLIENT_ERROR_CLOSED, nullptr, 0);
+}
+
+
+// Adds the endpoints of a member list of the descriptor to the table
+static bool add_members(const JsonValue& members, const std::string& prefix,
+                        std::vector<RemoteEndpoint>* endpoints, int* batch_endpoint_id) {
+    if (members.type != JsonValue::ARRAY)
+        return false;
+    for (const JsonValue& member : members.items) {
+        if (member.type != JsonValue::OBJECT)
+            return false;
+        std::string name = member.get_string("name");
+        std::string type = member.get_string("type");
+        std::string path = prefix.empty() || name.empty() ? prefix + name : prefix + "." + name;
+
+        if (type == "object") {
+            const JsonValue* sub_members = member.get("members");
+            if (!sub_members || !add_members(*sub_members, path, endpoints, batch_endpoint_id))
+                return false;
+            continue;
+        }
+
+        const JsonValue* id = member.get("id");
+        if (!id || id->type != JsonValue::NUMBER || id->number < 0 || id->number > 0x7fff)
+            return false;
+
+        RemoteEndpoint endpoint;
+        endpoint.path = path;
+        endpoint.id = (uint16_t)id->number;
+        endpoint.type = type;
+        endpoint.size = get_type_size(type);
+        endpoint.writable = member.get_string("access").find('w') != std::string::npos;
+        if (type == "function") {
+            endpoint.kind = REMOTE_ENDPOINT_FUNCTION;
+            size_t function_index = endpoints->size();
+            endpoints->push_back(endpoint);
+            size_t first_arg = endpoints->size();
+            const JsonValue* inputs = member.get("inputs");
+            const JsonValue* outputs = member.get("outputs");
+            if ((inputs && !add_members(*inputs, path, endpoints, batch_endpoint_id)))
+                return false;
+            size_t first_output = endpoints->size();
+            if ((outputs && !add_members(*outputs, path, endpoints, batch_endpoint_id)))
+                return false;
+            for (size_t i = first_arg; i < endpoints->size(); ++i)
+                (i < first_output ? (*endpoints)[function_index].inputs : (*endpoints)[function_index].outputs)
+                    .push_back((*endpoints)[i].id);
+            continue;
+        } else if (type == "buffer") {
+            endpoint.kind = REMOTE_ENDPOINT_BUFFER;
+        } else if (type == "json" || type == "batch") {
+            endpoint.kind = REMOTE_ENDPOINT_OTHER;
+            if (type == "batch")
+                *batch_endpoint_id = endpoint.id;
+        } else {
+            endpoint.kind = REMOTE_ENDPOINT_PROPERTY;
+        }
+        endpoints->push_back(endpoint);
+    }
+    return true;
+}
+
+int EndpointTable::parse(const char* json, size_t length) {
+    JsonValue root;
+    JsonParser parser(json, length);
+    endpoints_.clear();
+    by_path_.clear();
+    by_id_.clear();
+    batch_endpoint_id_ = -1;
+    if (!parser.parse(&root) || !add_members(root, "", &endpoints_, &batch_endpoint_id_)) {
+        endpoints_.clear();
+        return CLIENT_ERROR_PROTOCOL;
+    }
+
+    for (size_t i = 0; i < endpoints_.size(); ++i) {
+        if (!endpoints_[i].path.empty())
+            by_path_[endpoints_[i].path] = i;
+        by_id_[endpoints_[i].id] = i;
+    }
+    return 0;
+}
+
+const RemoteEndpoint* EndpointTable::find(const std::string& path) const {
+    auto it = by_path_.find(path);
+    return it == by_path_.end() ? nullptr : &endpoints_[it->second];
+}
+
+const RemoteEndpoint* EndpointTable::get(uint16_t id) const {
+    auto it = by_id_.find(id);
+    return it == by_id_.end() ? nullptr : &endpoints_[it->second];
+}
+
+
+void BatchRequest::add_operation(uint16_t endpoint_id, const uint8_t* input, size_t input_length,
+                                 size_t output_length, std::function<void(const uint8_t*)> on_output) {
+    operations_.push_back({endpoint_id, input_data_.size(), input_length, output_length, std::move(on_output)});
+    if (input_length)
+        input_data_.insert(input_data_.end(), input, input + input_length);
+}
+
+int BatchRequest::run_single_operations() {
+    // The operations are run one after another, because their order matters
+    // (e.g. for function calls) and is not guaranteed on all transports.
+    for (Operation& op : operations_) {
+        uint8_t output[CLIENT_MAX_PACKET_SIZE];
+        size_t length = 0;
+        if (op.output_length > sizeof(output))
+            return CLIENT_ERROR_INVALID_ARGUMENT;
+        int status = channel_.run_operation(op.endpoint_id, input_data_.data() + op.input_offset,
+                                            op.input_length, output, op.output_length, &length);
+        if (!status && length < op.output_length)
+            status = CLIENT_ERROR_PROTOCOL;
+        if (status)
+            return status;
+        if (op.on_output)
+            op.on_output(output);
+    }
+    return 0;
+}
+
+int BatchRequest::run() {
+    if (batch_endpoint_id_ < 0)
+        return run_single_operations();
+
+    struct {
+        std::mutex mutex;
+        std::condition_variable done_cv;
+        size_t pending = 0;
+        int status = 0;
+    } state;
+    auto state_ptr = &state;
+    int status = 0;
+
+    // Pack as many operations into each request as fit, and send all requests
+    // before waiting for the responses
+    size_t next = 0;
+    while (next < operations_.size()) {
+        uint8_t request[CLIENT_MAX_PACKET_SIZE];
+        size_t request_length = 0;
+        size_t response_length = 0;
+        size_t first = next;
+        for (; next < operations_.size(); ++next) {
+            Operation& op = operations_[next];
+            size_t item_length = 4 + op.input_length;
+            if (request_length + item_length > std::min(max_request_size_, sizeof(request))
+                || response_length + op.output_length > channel_.max_response_size_)
+                break;
+            request_length += write_le<uint16_t>(op.endpoint_id, request + request_length);
+            request_length += write_le<uint8_t>(op.input_length, request + request_length);
+            request_length += write_le<uint8_t>(op.output_length, request + request_length);
+            memcpy(request + request_length, input_data_.data() + op.input_offset, op.input_length);
+            request_length += op.input_length;
+            response_length += op.output_length;
+        }
+        if (next == first) {
+            status = CLIENT_ERROR_INVALID_ARGUMENT; // operation too large for a batch
+            break;
+        }
+
+        size_t last = next;
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.pending++;
+        }
+        status = channel_.start_operation(batch_endpoint_id_, request, request_length, response_length, true,
+            [this, state_ptr, first, last, response_length](int status, const uint8_t* output, size_t length) {
+                if (!status && length < response_length)
+                    status = CLIENT_ERROR_PROTOCOL;
+                for (size_t i = first; !status && i < last; ++i) {
+                    if (operations_[i].on_output)
+                        operations_[i].on_output(output);
+                    output += operations_[i].output_length;
+                }
+                std::lock_guard<std::mutex> lock(state_ptr->mutex);
+                if (status)
+                    state_ptr->status = status;
+                state_ptr->pending--;
+                state_ptr->done_cv.notify_one();
+            });
+        if (status) {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.pending--;
+            break;
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(state.mutex);
+    state.done_cv.wait(lock, [&state]() { return state.pending == 0; });
+    return status ? status : state.status;
+}
+
+
+int RemoteDevice::connect() {
+    std::vector<uint8_t> json;
+    int status = channel_.read_long_endpoint(0, &json);
+    if (status)
+        return status;
+
+    json_crc_ = calc_crc16<CANONICAL_CRC16_POLYNOMIAL>(PROTOCOL_VERSION, json.data(), json.size());
+    json_.assign(json.begin(), json.end());
+    channel_.set_json_crc(json_crc_);
+    return endpoint_table_.parse(json_.data(), json_.size());
+}
+
+int RemoteDevice::read_buffer(const std::string& path, std::vector<uint8_t>* data, size_t max_length) {
+    const RemoteEndpoint* endpoint = endpoint_table_.find(path);
+    if (!endpoint || endpoint->kind != REMOTE_ENDPOINT_BUFFER)
+        return CLIENT_ERROR_INVALID_ARGUMENT;
+    return channel_.read_long_endpoint(endpoint->id, data, max_length);
+}
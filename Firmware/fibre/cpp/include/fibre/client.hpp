@@ -0,0 +1,407 @@
+/*
+* Client side of the Fibre protocol (i.e. using remote objects) for hosts.
+*
+* A ClientChannel sends endpoint operations over a PacketSink and matches the
+* responses that are passed to its process_packet() to the requests. Up to
+* max_outstanding requests are in flight at a time, requests that are not
+* answered within resend_timeout_ms are sent again.
+*
+* A RemoteDevice downloads the JSON descriptor over a channel and provides
+* typed access to the endpoints by their dotted path:
+*
+*     TCPClientTransport transport;
+*     transport.connect("localhost", 9910);
+*     RemoteDevice device(transport.channel());
+*     device.connect();
+*     RemoteProperty<float> pos = device.get_property<float>("axis0.encoder.pos_estimate");
+*     float value;
+*     pos.get(&value);
+*
+* Several operations can be combined into batch requests with BatchRequest,
+* which uses the batch endpoint of the device if it has one.
+*
+* All functions return 0 on success or one of the negative CLIENT_ERROR_*
+* codes. The transports are in posix_client.hpp.
+*/
+
+#ifndef __FIBRE_CLIENT_HPP
+#define __FIBRE_CLIENT_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include "protocol.hpp"
+
+constexpr int CLIENT_ERROR_TIMEOUT = -1; // no response after all send attempts
+constexpr int CLIENT_ERROR_CLOSED = -2; // the channel was closed
+constexpr int CLIENT_ERROR_INVALID_ARGUMENT = -3; // unknown endpoint, type mismatch or oversized request
+constexpr int CLIENT_ERROR_PROTOCOL = -4; // malformed JSON descriptor or response
+
+// Size of the largest request that any of the transports can carry
+constexpr size_t CLIENT_MAX_PACKET_SIZE = 512;
+
+// Batch requests are kept small enough for a single USB packet, like the
+// python tools do. The response of a request is limited by the TX buffer of
+// the device.
+constexpr size_t CLIENT_DEFAULT_MAX_BATCH_REQUEST_SIZE = 64 - 8;
+constexpr size_t CLIENT_DEFAULT_MAX_RESPONSE_SIZE = TX_BUF_SIZE - 2;
+
+
+// @brief Completion handler of an asynchronous endpoint operation.
+// Called from the receiving thread of the transport, unless the operation did
+// not expect a response. Not called at all if start_operation() fails.
+// status is 0 on success, output and length describe the response payload,
+// which is only valid during the call.
+typedef std::function<void(int status, const uint8_t* output, size_t length)> OperationCallback;
+
+class ClientChannel : public PacketSink {
+public:
+    static constexpr size_t MAX_OUTSTANDING_REQUESTS = 64;
+
+    ClientChannel(PacketSink& output, size_t max_outstanding = 8) :
+        output_(output),
+        max_outstanding_(max_outstanding < MAX_OUTSTANDING_REQUESTS ? max_outstanding : MAX_OUTSTANDING_REQUESTS)
+    {}
+
+    // @brief Queues an endpoint operation and returns as soon as the request
+    // was sent. Blocks while max_outstanding requests are waiting for their
+    // response. If expect_response is false, the callback (if any) is called
+    // once the request was sent.
+    int start_operation(uint16_t endpoint_id, const uint8_t* input, size_t input_length,
+                        size_t output_length, bool expect_response, OperationCallback callback);
+
+    // @brief Runs an endpoint operation and blocks until the response arrives.
+    // @param output: buffer for the response, can be null if output_length is 0
+    // @param received_length: if not null, set to the length of the response
+    int run_operation(uint16_t endpoint_id, const uint8_t* input, size_t input_length,
+                      uint8_t* output, size_t output_length, size_t* received_length = nullptr);
+
+    // @brief Reads an endpoint that returns a block of data from a given
+    // offset (such as the JSON descriptor or buffer endpoints) until it
+    // returns no more data or max_length bytes were read.
+    int read_long_endpoint(uint16_t endpoint_id, std::vector<uint8_t>* data, size_t max_length = SIZE_MAX);
+
+    // @brief Handles a response packet. Called by the transport.
+    int process_packet(const uint8_t* buffer, size_t length) final;
+
+    // @brief Resends requests whose response is overdue and fails the ones
+    // that ran out of attempts. Called periodically by the transport.
+    void check_timeouts();
+
+    // @brief Fails all pending requests with CLIENT_ERROR_CLOSED and rejects
+    // new ones. Called by the transport when the connection is lost.
+    void close();
+
+    // The trailer of requests to all endpoints except endpoint 0
+    void set_json_crc(uint16_t json_crc) { json_crc_ = json_crc; }
+
+    uint32_t resend_timeout_ms_ = 100;
+    uint32_t send_attempts_ = 5;
+    size_t max_response_size_ = CLIENT_DEFAULT_MAX_RESPONSE_SIZE;
+
+    // statistics
+    uint32_t resent_cnt_ = 0;
+    uint32_t unexpected_response_cnt_ = 0;
+
+private:
+    struct PendingRequest {
+        bool in_use = false;
+        uint16_t seq_no = 0;
+        uint32_t attempts = 0;
+        std::chrono::steady_clock::time_point deadline;
+        std::vector<uint8_t> packet; // kept for resending, reuses its capacity
+        OperationCallback callback;
+    };
+
+    PacketSink& output_;
+    size_t max_outstanding_;
+    std::mutex mutex_;
+    std::mutex send_mutex_; // keeps packets of concurrent senders from interleaving on streams
+    std::condition_variable slot_freed_;
+    PendingRequest requests_[MAX_OUTSTANDING_REQUESTS];
+    size_t n_outstanding_ = 0;
+    uint16_t outbound_seq_no_ = 0;
+    uint16_t json_crc_ = 0;
+    bool closed_ = false;
+};
+
+
+enum RemoteEndpointKind {
+    REMOTE_ENDPOINT_PROPERTY,
+    REMOTE_ENDPOINT_FUNCTION,
+    REMOTE_ENDPOINT_BUFFER,
+    REMOTE_ENDPOINT_OTHER, // json, batch, ...
+};
+
+struct RemoteEndpoint {
+    std::string path; // dotted path, e.g. "axis0.controller.pos_setpoint"
+    uint16_t id;
+    RemoteEndpointKind kind;
+    std::string type; // type name from the descriptor, e.g. "float" or "uint32"
+    size_t size; // [bytes] size of the value of a property
+    bool writable;
+    std::vector<uint16_t> inputs; // functions: endpoint IDs of the arguments
+    std::vector<uint16_t> outputs; // functions: endpoint IDs of the return values
+};
+
+// @brief Table of the endpoints of a device, built from its JSON descriptor.
+// The arguments of a function named "f" are listed as "f.argname".
+class EndpointTable {
+public:
+    int parse(const char* json, size_t length);
+
+    const RemoteEndpoint* find(const std::string& path) const;
+    const RemoteEndpoint* get(uint16_t id) const;
+    const std::vector<RemoteEndpoint>& endpoints() const { return endpoints_; }
+
+    int batch_endpoint_id_ = -1; // -1 if the device has no batch endpoint
+
+private:
+    std::vector<RemoteEndpoint> endpoints_;
+    std::unordered_map<std::string, size_t> by_path_;
+    std::unordered_map<uint16_t, size_t> by_id_;
+};
+
+template<typename T> struct remote_type_name;
+template<> struct remote_type_name<float> { static constexpr const char* value = "float"; };
+template<> struct remote_type_name<bool> { static constexpr const char* value = "bool"; };
+template<> struct remote_type_name<int8_t> { static constexpr const char* value = "int8"; };
+template<> struct remote_type_name<uint8_t> { static constexpr const char* value = "uint8"; };
+template<> struct remote_type_name<int16_t> { static constexpr const char* value = "int16"; };
+template<> struct remote_type_name<uint16_t> { static constexpr const char* value = "uint16"; };
+template<> struct remote_type_name<int32_t> { static constexpr const char* value = "int32"; };
+template<> struct remote_type_name<uint32_t> { static constexpr const char* value = "uint32"; };
+template<> struct remote_type_name<int64_t> { static constexpr const char* value = "int64"; };
+template<> struct remote_type_name<uint64_t> { static constexpr const char* value = "uint64"; };
+
+
+// @brief Typed handle to a property of a remote device. Operations on an
+// invalid handle (unknown path or type mismatch) fail with
+// CLIENT_ERROR_INVALID_ARGUMENT.
+template<typename T>
+class RemoteProperty {
+public:
+    RemoteProperty() = default;
+    RemoteProperty(ClientChannel* channel, const RemoteEndpoint* endpoint) :
+        channel_(channel), endpoint_(endpoint) {}
+
+    bool valid() const { return channel_ && endpoint_; }
+    uint16_t id() const { return endpoint_ ? endpoint_->id : 0; }
+
+    int get(T* value) {
+        if (!valid())
+            return CLIENT_ERROR_INVALID_ARGUMENT;
+        uint8_t buffer[sizeof(T)];
+        size_t length = 0;
+        int status = channel_->run_operation(endpoint_->id, nullptr, 0, buffer, sizeof(buffer), &length);
+        if (!status && length != sizeof(T))
+            status = CLIENT_ERROR_PROTOCOL;
+        if (!status)
+            read_le<T>(value, buffer);
+        return status;
+    }
+
+    int set(T value) {
+        if (!valid() || !endpoint_->writable)
+            return CLIENT_ERROR_INVALID_ARGUMENT;
+        uint8_t buffer[sizeof(T)];
+        write_le<T>(value, buffer);
+        return channel_->run_operation(endpoint_->id, buffer, sizeof(buffer), nullptr, 0);
+    }
+
+    // @brief Reads the value without waiting for the response.
+    // callback(status, value) is called when the response arrives.
+    int get_async(std::function<void(int, T)> callback) {
+        if (!valid())
+            return CLIENT_ERROR_INVALID_ARGUMENT;
+        return channel_->start_operation(endpoint_->id, nullptr, 0, sizeof(T), true,
+            [callback](int status, const uint8_t* output, size_t length) {
+                T value = T();
+                if (!status && length != sizeof(T))
+                    status = CLIENT_ERROR_PROTOCOL;
+                if (!status)
+                    read_le<T>(&value, output);
+                if (callback)
+                    callback(status, value);
+            });
+    }
+
+    // @brief Writes the value without waiting for the response.
+    // If a callback is given, it is called with the status once the write
+    // was acknowledged.
+    int set_async(T value, std::function<void(int)> callback = nullptr) {
+        if (!valid() || !endpoint_->writable)
+            return CLIENT_ERROR_INVALID_ARGUMENT;
+        uint8_t buffer[sizeof(T)];
+        write_le<T>(value, buffer);
+        if (!callback)
+            return channel_->start_operation(endpoint_->id, buffer, sizeof(buffer), 0, false, nullptr);
+        return channel_->start_operation(endpoint_->id, buffer, sizeof(buffer), 0, true,
+            [callback](int status, const uint8_t*, size_t) { callback(status); });
+    }
+
+private:
+    ClientChannel* channel_ = nullptr;
+    const RemoteEndpoint* endpoint_ = nullptr;
+};
+
+
+// @brief Collects endpoint operations and runs them with as few requests as
+// possible. Requests are packed up to max_request_size_ input bytes and
+// max_response_size output bytes and all of them are sent before the first
+// response is awaited. Falls back to running the operations one by one if the
+// device has no batch endpoint.
+class BatchRequest {
+public:
+    BatchRequest(ClientChannel& channel, int batch_endpoint_id) :
+        channel_(channel), batch_endpoint_id_(batch_endpoint_id) {}
+
+    template<typename T>
+    int read(const RemoteProperty<T>& property, T* value) {
+        if (!property.valid())
+            return CLIENT_ERROR_INVALID_ARGUMENT;
+        add_operation(property.id(), nullptr, 0, sizeof(T), [value](const uint8_t* output) {
+            read_le<T>(value, output);
+        });
+        return 0;
+    }
+
+    template<typename T>
+    int write(const RemoteProperty<T>& property, T value) {
+        if (!property.valid())
+            return CLIENT_ERROR_INVALID_ARGUMENT;
+        uint8_t buffer[sizeof(T)];
+        write_le<T>(value, buffer);
+        add_operation(property.id(), buffer, sizeof(buffer), 0, nullptr);
+        return 0;
+    }
+
+    // @brief Adds a raw operation. on_output is called with output_length
+    // bytes of output when the batch was run successfully.
+    void add_operation(uint16_t endpoint_id, const uint8_t* input, size_t input_length,
+                       size_t output_length, std::function<void(const uint8_t*)> on_output);
+
+    // @brief Runs all operations that were added and blocks until they are
+    // done. The operations are kept, so the same batch can be run again.
+    int run();
+
+    void clear() { operations_.clear(); input_data_.clear(); }
+    size_t size() const { return operations_.size(); }
+
+    size_t max_request_size_ = CLIENT_DEFAULT_MAX_BATCH_REQUEST_SIZE;
+
+private:
+    struct Operation {
+        uint16_t endpoint_id;
+        size_t input_offset; // into input_data_
+        size_t input_length;
+        size_t output_length;
+        std::function<void(const uint8_t*)> on_output;
+    };
+
+    int run_single_operations();
+
+    ClientChannel& channel_;
+    int batch_endpoint_id_;
+    std::vector<Operation> operations_;
+    std::vector<uint8_t> input_data_;
+};
+
+
+// @brief A device on the other end of a channel. connect() must succeed
+// before any of the other functions are used.
+class RemoteDevice {
+public:
+    RemoteDevice(ClientChannel& channel) : channel_(channel) {}
+
+    // @brief Downloads and parses the JSON descriptor.
+    int connect();
+
+    template<typename T>
+    RemoteProperty<T> get_property(const std::string& path) {
+        const RemoteEndpoint* endpoint = endpoint_table_.find(path);
+        if (!endpoint || endpoint->kind != REMOTE_ENDPOINT_PROPERTY
+            || endpoint->type != remote_type_name<T>::value)
+            return RemoteProperty<T>();
+        return RemoteProperty<T>(&channel_, endpoint);
+    }
+
+    // @brief Calls a function with the given arguments, whose types must match
+    // the declaration. Arguments, call and return value are sent in one batch
+    // request if the device supports it.
+    template<typename ... TArgs>
+    int call(const std::string& path, TArgs ... args) {
+        return call_ex<void>(path, nullptr, args...);
+    }
+
+    // @brief Calls a function that returns a value.
+    template<typename TRet, typename ... TArgs>
+    int call_with_result(const std::string& path, TRet* result, TArgs ... args) {
+        return call_ex<TRet>(path, result, args...);
+    }
+
+    // @brief Reads a buffer endpoint.
+    int read_buffer(const std::string& path, std::vector<uint8_t>* data, size_t max_length = SIZE_MAX);
+
+    BatchRequest make_batch() { return BatchRequest(channel_, endpoint_table_.batch_endpoint_id_); }
+
+    const EndpointTable& endpoint_table() const { return endpoint_table_; }
+    uint16_t json_crc() const { return json_crc_; }
+    const std::string& json() const { return json_; }
+
+private:
+    template<typename T>
+    bool add_argument(BatchRequest& batch, const RemoteEndpoint* function, size_t index, T value) {
+        const RemoteEndpoint* arg = index < function->inputs.size() ? endpoint_table_.get(function->inputs[index]) : nullptr;
+        if (!arg || arg->type != remote_type_name<T>::value)
+            return false;
+        batch.write(RemoteProperty<T>(&channel_, arg), value);
+        return true;
+    }
+
+    template<typename TRet>
+    std::enable_if_t<std::is_void<TRet>::value, bool>
+    add_result(BatchRequest& batch, const RemoteEndpoint* function, TRet* result) {
+        return true;
+    }
+
+    template<typename TRet>
+    std::enable_if_t<!std::is_void<TRet>::value, bool>
+    add_result(BatchRequest& batch, const RemoteEndpoint* function, TRet* result) {
+        const RemoteEndpoint* output = function->outputs.empty() ? nullptr : endpoint_table_.get(function->outputs[0]);
+        if (!output || output->type != remote_type_name<TRet>::value)
+            return false;
+        batch.read(RemoteProperty<TRet>(&channel_, output), result);
+        return true;
+    }
+
+    template<typename TRet, typename ... TArgs>
+    int call_ex(const std::string& path, TRet* result, TArgs ... args) {
+        const RemoteEndpoint* function = endpoint_table_.find(path);
+        if (!function || function->kind != REMOTE_ENDPOINT_FUNCTION || function->inputs.size() != sizeof...(TArgs))
+            return CLIENT_ERROR_INVALID_ARGUMENT;
+        BatchRequest batch = make_batch();
+        size_t index = 0;
+        bool ok[] = { true, add_argument(batch, function, index++, args)... };
+        for (bool arg_ok : ok)
+            if (!arg_ok)
+                return CLIENT_ERROR_INVALID_ARGUMENT;
+        batch.add_operation(function->id, nullptr, 0, 0, nullptr);
+        if (!add_result(batch, function, result))
+            return CLIENT_ERROR_INVALID_ARGUMENT;
+        return batch.run();
+    }
+
+    ClientChannel& channel_;
+    EndpointTable endpoint_table_;
+    std::string json_;
+    uint16_t json_crc_ = 0;
+};
+
+#endif // __FIBRE_CLIENT_HPP
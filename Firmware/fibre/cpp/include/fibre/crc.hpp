@@ -2,15 +2,17 @@
 #define __CRC_HPP
 
 #include <stdint.h>
+#include <stddef.h>
 #include <limits.h>
 
-// Calculates an arbitrary CRC for one byte.
+// Calculates an arbitrary CRC for one byte, a bit at a time.
+// This is only used to generate the lookup tables below.
 // Adapted from https://barrgroup.com/Embedded-Systems/How-To/CRC-Calculation-C-Code
 template<typename T, unsigned POLYNOMIAL>
-static T calc_crc(T remainder, uint8_t value) {
+constexpr T calc_crc_bitwise(T remainder, uint8_t value) {
     constexpr T BIT_WIDTH = (CHAR_BIT * sizeof(T));
     constexpr T TOPBIT = ((T)1 << (BIT_WIDTH - 1));
-    
+
     // Bring the next byte into the remainder.
     remainder ^= (value << (BIT_WIDTH - 8));
 
@@ -26,10 +28,37 @@ static T calc_crc(T remainder, uint8_t value) {
     return remainder;
 }
 
+// Lookup table with the CRC of every possible byte, generated at compile
+// time. Tables are only emitted for the polynomials that are actually used.
+template<typename T, unsigned POLYNOMIAL>
+struct CRCTable {
+    T values[256];
+
+    constexpr CRCTable() : values{} {
+        for (unsigned i = 0; i < 256; ++i)
+            values[i] = calc_crc_bitwise<T, POLYNOMIAL>(0, i);
+    }
+
+    static const CRCTable<T, POLYNOMIAL> table;
+};
+
+template<typename T, unsigned POLYNOMIAL>
+const CRCTable<T, POLYNOMIAL> CRCTable<T, POLYNOMIAL>::table = CRCTable<T, POLYNOMIAL>();
+
+// Calculates an arbitrary CRC for one byte.
+template<typename T, unsigned POLYNOMIAL>
+static T calc_crc(T remainder, uint8_t value) {
+    constexpr T BIT_WIDTH = (CHAR_BIT * sizeof(T));
+    uint8_t index = (uint8_t)(remainder >> (BIT_WIDTH - 8)) ^ value;
+    return (T)(remainder << 8) ^ CRCTable<T, POLYNOMIAL>::table.values[index];
+}
+
 template<typename T, unsigned POLYNOMIAL>
 static T calc_crc(T remainder, const uint8_t* buffer, size_t length) {
+    constexpr T BIT_WIDTH = (CHAR_BIT * sizeof(T));
+    const T* table = CRCTable<T, POLYNOMIAL>::table.values;
     while (length--)
-        remainder = calc_crc<T, POLYNOMIAL>(remainder, *(buffer++));
+        remainder = (T)(remainder << 8) ^ table[(uint8_t)(remainder >> (BIT_WIDTH - 8)) ^ *(buffer++)];
     return remainder;
 }
 
@@ -0,0 +1,112 @@
+/*
+* Transports for the fibre client on POSIX hosts.
+*
+* Each transport owns a ClientChannel and a receiver thread, which feeds the
+* incoming packets to the channel and periodically resends overdue requests.
+* When the connection is lost, the pending operations fail with
+* CLIENT_ERROR_CLOSED. A transport object can only be connected once.
+*/
+
+#ifndef __FIBRE_POSIX_CLIENT_HPP
+#define __FIBRE_POSIX_CLIENT_HPP
+
+#include <atomic>
+#include <thread>
+
+#include "client.hpp"
+
+class PosixClientTransport {
+public:
+    virtual ~PosixClientTransport() {}
+
+    ClientChannel& channel() { return channel_; }
+    bool is_connected() const { return fd_ >= 0 && !stop_; }
+
+    // @brief Closes the connection and stops the receiver thread.
+    void disconnect();
+
+protected:
+    PosixClientTransport(PacketSink& output) : channel_(output) {}
+
+    // @brief Takes ownership of the file descriptor and starts the receiver thread
+    void start(int fd);
+
+    virtual void handle_received_bytes(const uint8_t* buffer, size_t length) = 0;
+
+    int fd_ = -1;
+    ClientChannel channel_;
+
+private:
+    void receiver_loop();
+
+    std::thread thread_;
+    std::atomic<bool> stop_{false};
+};
+
+
+// Packets are framed with StreamBasedPacketSink on the way out and segmented
+// with StreamToPacketSegmenter on the way in
+class StreamClientTransport : public PosixClientTransport {
+protected:
+    StreamClientTransport() :
+        PosixClientTransport(packet_sink_),
+        fd_sink_(fd_),
+        packet_sink_(fd_sink_),
+        segmenter_(channel_)
+    {}
+
+    void handle_received_bytes(const uint8_t* buffer, size_t length) final {
+        segmenter_.process_bytes(buffer, length, nullptr);
+    }
+
+private:
+    class FdStreamSink : public StreamSink {
+    public:
+        FdStreamSink(const int& fd) : fd_(fd) {}
+        int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) final;
+        size_t get_free_space() final { return SIZE_MAX; }
+    private:
+        const int& fd_;
+    };
+
+    FdStreamSink fd_sink_;
+    StreamBasedPacketSink packet_sink_;
+    StreamToPacketSegmenter segmenter_;
+};
+
+class TCPClientTransport : public StreamClientTransport {
+public:
+    ~TCPClientTransport() { disconnect(); }
+
+    // @brief Connects to a fibre server, e.g. the one started by serve_on_tcp().
+    // Returns 0 on success or -1 on failure (see errno).
+    int connect(const char* host, unsigned int port);
+};
+
+class SerialClientTransport : public StreamClientTransport {
+public:
+    ~SerialClientTransport() { disconnect(); }
+
+    // @brief Opens a serial port (e.g. "/dev/ttyACM0") in raw mode.
+    // Returns 0 on success or -1 on failure (see errno).
+    int open(const char* path, unsigned int baudrate = 115200);
+};
+
+// Packets are sent as single datagrams
+class UDPClientTransport : private PacketSink, public PosixClientTransport {
+public:
+    UDPClientTransport() : PosixClientTransport(static_cast<PacketSink&>(*this)) {}
+    ~UDPClientTransport() { disconnect(); }
+
+    // @brief Connects to a fibre server, e.g. the one started by serve_on_udp().
+    // Returns 0 on success or -1 on failure (see errno).
+    int connect(const char* host, unsigned int port);
+
+private:
+    int process_packet(const uint8_t* buffer, size_t length) final;
+    void handle_received_bytes(const uint8_t* buffer, size_t length) final {
+        channel_.process_packet(buffer, length);
+    }
+};
+
+#endif // __FIBRE_POSIX_CLIENT_HPP
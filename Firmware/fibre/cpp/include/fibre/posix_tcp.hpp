@@ -1,4 +1,11 @@
 
 #include "protocol.hpp"
 
+// Clients beyond this limit are disconnected right after they connect
+#ifndef TCP_MAX_CONNECTIONS
+#define TCP_MAX_CONNECTIONS	512
+#endif
+
+// @brief Serves the published objects to TCP clients on the given port.
+// Runs an epoll event loop on the calling thread and only returns on error.
 int serve_on_tcp(unsigned int port);
@@ -8,10 +8,12 @@ see protocol.md for the protocol specification
 // TODO: resolve assert
 #define assert(expr)
 
+#include <array>
 #include <functional>
 #include <limits>
 #include <cmath>
 //#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include "crc.hpp"
 #include "cpp_utils.hpp"
@@ -42,6 +44,10 @@ constexpr uint16_t CANONICAL_CRC16_INIT = 0x1337;
 
 constexpr uint8_t CANONICAL_PREFIX = 0xAA;
 
+// Packet lengths of 128 and above are encoded in two bytes on stream based
+// channels (7 bits each, least significant first, MSB set in the first byte)
+constexpr size_t MAX_STREAM_PACKET_SIZE = 0x3fff;
+
 
 
 
@@ -70,7 +76,7 @@ constexpr uint16_t PROTOCOL_VERSION = 1;
 
 // This value must not be larger than USB_TX_DATA_SIZE defined in usbd_cdc_if.h
 constexpr uint16_t TX_BUF_SIZE = 32; // does not work with 64 for some reason
-constexpr uint16_t RX_BUF_SIZE = 128; // larger values than 128 have currently no effect because of protocol limitations
+constexpr uint16_t RX_BUF_SIZE = 1024; // larger packets received on a stream based channel are discarded
 
 // Maximum time we allocate for processing and responding to a request
 constexpr uint32_t PROTOCOL_SERVER_TIMEOUT_MS = 10;
@@ -192,10 +198,15 @@ public:
     
     size_t get_free_space() { return SIZE_MAX; }
 
+    // @brief Discards a partially received packet, e.g. after bytes were lost.
+    // The next packet is found by its header.
+    void reset() { header_index_ = packet_index_ = packet_length_ = 0; }
+
 private:
-    uint8_t header_buffer_[3];
+    uint8_t header_buffer_[4];
     size_t header_index_ = 0;
-    uint8_t packet_buffer_[RX_BUF_SIZE];
+    size_t header_length_ = 3; // 4 if the packet length is encoded in two bytes
+    uint8_t packet_buffer_[RX_BUF_SIZE + 2]; // packet and CRC16
     size_t packet_index_ = 0;
     size_t packet_length_ = 0;
     PacketSink& output_;
@@ -270,6 +281,36 @@ private:
     size_t buffer_length_;
 };
 
+// Implements the StreamSink interface by comparing the stream with the
+// content of a buffer. Fails as soon as a byte differs or the stream is longer
+// than the buffer.
+class MemoryCompareStreamSink : public StreamSink {
+public:
+    MemoryCompareStreamSink(const uint8_t *buffer, size_t length) :
+        buffer_(buffer),
+        buffer_length_(length) {}
+
+    int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) {
+        if (!equal_ || length > buffer_length_ || memcmp(buffer_, buffer, length))
+            return equal_ = false, -1;
+        buffer_ += length;
+        buffer_length_ -= length;
+        if (processed_bytes)
+            *processed_bytes += length;
+        return 0;
+    }
+
+    size_t get_free_space() { return buffer_length_; }
+
+    // @brief True if the stream so far matches the buffer and covers all of it
+    bool matches() { return equal_ && !buffer_length_; }
+
+private:
+    const uint8_t * buffer_;
+    size_t buffer_length_;
+    bool equal_ = true;
+};
+
 // Implements the StreamSink interface by discarding the first couple of bytes
 // and then forwarding the rest to another stream.
 class NullStreamSink : public StreamSink {
@@ -313,6 +354,7 @@ public:
 
     int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) {
         crc16_ = calc_crc16<CANONICAL_CRC16_POLYNOMIAL>(crc16_, buffer, length);
+        length_ += length;
         if (processed_bytes)
             *processed_bytes += length;
         return 0;
@@ -321,8 +363,10 @@ public:
     size_t get_free_space() { return SIZE_MAX; }
 
     uint16_t get_crc16() { return crc16_; }
+    size_t get_length() { return length_; }
 private:
     uint16_t crc16_;
+    size_t length_ = 0;
 };
 
 
@@ -476,6 +520,20 @@ public:
     virtual bool get_string(char * output, size_t length) { return false; }
     virtual bool set_string(char * buffer, size_t length) { return false; }
     virtual bool set_from_float(float value) { return false; }
+    virtual bool get_as_float(float* value) { return false; }
+    virtual bool get_as_uint32(uint32_t* value) { return false; }
+    virtual const char* get_name() { return nullptr; }
+    // @brief Returns true if handle() only copies data from or to memory,
+    // such that it may run with interrupts disabled (e.g. in a batch).
+    virtual bool is_plain_data() { return false; }
+    // @brief Same as handle(), except that a written hook is not run but
+    // left to the caller, who may first leave a critical section.
+    // @returns true if run_written_hook() must be called
+    virtual bool handle_without_hook(const uint8_t* input, size_t input_length, StreamSink* output) {
+        handle(input, input_length, output);
+        return false;
+    }
+    virtual void run_written_hook() {}
 };
 
 static inline int write_string(const char* str, StreamSink* output) {
@@ -599,6 +657,49 @@ static bool from_string(const char * buffer, size_t length, T* property, ...) {
 }
 
 
+/* Name lookup ---------------------------------------------------------------*/
+
+/* @brief Hash table from the full dotted path of each named endpoint
+* (e.g. "axis0.controller.config.vel_gain") to its endpoint ID.
+*
+* The table is filled once by fibre_publish(), such that lookups by name
+* (as used by the ASCII protocol) take constant time regardless of the size
+* of the object tree. Only the FNV-1a hash of the path is stored. A match is
+* confirmed by comparing the last path segment to the name of the endpoint.
+* Collisions are resolved by linear probing and the table is kept at most
+* 2/3 full.
+*/
+class EndpointNameTable {
+public:
+    static constexpr uint32_t FNV_OFFSET_BASIS = 2166136261UL;
+    static constexpr uint32_t FNV_PRIME = 16777619UL;
+
+    static constexpr size_t get_size(size_t n_endpoints) {
+        size_t size = 1;
+        while (size < n_endpoints + n_endpoints / 2)
+            size <<= 1;
+        return size;
+    }
+
+    static inline uint32_t hash(uint32_t hash, char c) {
+        return (hash ^ static_cast<uint8_t>(c)) * FNV_PRIME;
+    }
+    static inline uint32_t hash(uint32_t hash, const char* str) {
+        while (*str)
+            hash = EndpointNameTable::hash(hash, *str++);
+        return hash;
+    }
+
+    void init(uint32_t* hashes, uint16_t* ids, size_t size);
+    void insert(uint32_t hash, size_t id);
+    Endpoint* find(const char* path);
+
+    uint32_t* hashes_ = nullptr;
+    uint16_t* ids_ = nullptr; // 0 marks a free slot (ID 0 is the JSON descriptor)
+    size_t mask_ = 0;
+    bool valid_ = false; // false if two paths can't be told apart
+};
+
 /* Object tree ---------------------------------------------------------------*/
 
 template<typename ... TMembers>
@@ -618,6 +719,9 @@ public:
     Endpoint* get_by_name(const char * name, size_t length) {
         return nullptr;
     }
+    void register_names(uint32_t hash, size_t id, EndpointNameTable* table) {
+        // no action
+    }
     std::tuple<> get_names_as_tuple() const { return std::tuple<>(); }
 };
 
@@ -658,6 +762,11 @@ public:
         subsequent_members_.register_endpoints(list, id + TMember::endpoint_count, length);
     }
 
+    void register_names(uint32_t hash, size_t id, EndpointNameTable* table) {
+        this_member_.register_names(hash, id, table);
+        subsequent_members_.register_names(hash, id + TMember::endpoint_count, table);
+    }
+
     TMember this_member_;
     MemberList<TMembers...> subsequent_members_;
 };
@@ -695,6 +804,11 @@ public:
     void register_endpoints(Endpoint** list, size_t id, size_t length) {
         member_list_.register_endpoints(list, id, length);
     }
+
+    void register_names(uint32_t hash, size_t id, EndpointNameTable* table) {
+        hash = EndpointNameTable::hash(EndpointNameTable::hash(hash, name_), '.');
+        member_list_.register_names(hash, id, table);
+    }
     
     const char * name_;
     MemberList<TMembers...> member_list_;
@@ -732,6 +846,32 @@ template<typename T>
 bool set_from_float(float value, T* property) {
     return set_from_float_ex<T>(value, property, 0);
 }
+template<typename T, typename = std::enable_if_t<std::is_arithmetic<std::remove_const_t<T>>::value>>
+bool get_as_float_ex(float* value, T* property, int) {
+    return *value = static_cast<float>(*property), true;
+}
+template<typename T>
+bool get_as_float_ex(float* value, T* property, ...) {
+    return false;
+}
+template<typename T>
+bool get_as_float(float* value, T* property) {
+    return get_as_float_ex<T>(value, property, 0);
+}
+// Integers are converted without the detour through float, so that bit
+// masks keep all 32 bits
+template<typename T, typename = std::enable_if_t<std::is_integral<std::remove_const_t<T>>::value>>
+bool get_as_uint32_ex(uint32_t* value, T* property, int) {
+    return *value = static_cast<uint32_t>(*property), true;
+}
+template<typename T>
+bool get_as_uint32_ex(uint32_t* value, T* property, ...) {
+    return false;
+}
+template<typename T>
+bool get_as_uint32(uint32_t* value, T* property) {
+    return get_as_uint32_ex<T>(value, property, 0);
+}
 }
 
 //template<typename T>
@@ -812,22 +952,52 @@ public:
 
     // special-purpose function - to be moved
     bool set_string(char * buffer, size_t length) final {
-        return from_string(buffer, length, property_, 0);
+        bool wrote = from_string(buffer, length, property_, 0);
+        if (wrote && written_hook_ != nullptr) {
+            written_hook_(ctx_);
+        }
+        return wrote;
     }
 
     bool set_from_float(float value) final {
-        return conversion::set_from_float(value, property_);
+        bool wrote = conversion::set_from_float(value, property_);
+        if (wrote && written_hook_ != nullptr) {
+            written_hook_(ctx_);
+        }
+        return wrote;
+    }
+
+    bool get_as_float(float* value) final {
+        return conversion::get_as_float(value, property_);
+    }
+
+    bool get_as_uint32(uint32_t* value) final {
+        return conversion::get_as_uint32(value, property_);
+    }
+
+    const char* get_name() final {
+        return name_;
     }
 
+    bool is_plain_data() final { return true; }
+
     void register_endpoints(Endpoint** list, size_t id, size_t length) {
         if (id < length)
             list[id] = this;
     }
+    void register_names(uint32_t hash, size_t id, EndpointNameTable* table) {
+        table->insert(EndpointNameTable::hash(hash, name_), id);
+    }
     void handle(const uint8_t* input, size_t input_length, StreamSink* output) final {
+        if (handle_without_hook(input, input_length, output))
+            run_written_hook();
+    }
+    bool handle_without_hook(const uint8_t* input, size_t input_length, StreamSink* output) final {
         bool wrote = default_readwrite_endpoint_handler<TProperty>(property_, input, input_length, output);
-        if (wrote && written_hook_ != nullptr) {
-            written_hook_(ctx_);
-        }
+        return wrote && written_hook_ != nullptr;
+    }
+    void run_written_hook() final {
+        written_hook_(ctx_);
     }
     /*void handle(const uint8_t* input, size_t input_length, StreamSink* output) {
         handle(input, input_length, output);
@@ -870,6 +1040,76 @@ ProtocolProperty<const std::underlying_type_t<TProperty>> make_protocol_ro_prope
 };
 
 
+/* @brief Read-only endpoint that exposes a block of memory as raw bytes.
+*
+* Like the JSON descriptor endpoint, a request must contain a 32 bit offset
+* and the response contains as many bytes from that offset on as were
+* requested. A short response indicates the end of the buffer, so the client
+* can download the whole block with remote_endpoint_read_buffer().
+*/
+class ProtocolBuffer : public Endpoint {
+public:
+    static constexpr size_t endpoint_count = 1;
+
+    ProtocolBuffer(const char * name, const void* buffer, size_t length)
+        : name_(name), buffer_(reinterpret_cast<const uint8_t*>(buffer)), length_(length)
+    {}
+
+    void write_json(size_t id, StreamSink* output) {
+        // write name
+        write_string("{\"name\":\"", output);
+        write_string(name_, output);
+
+        // write endpoint ID
+        write_string("\",\"id\":", output);
+        char id_buf[10];
+        snprintf(id_buf, sizeof(id_buf), "%u", (unsigned)id); // TODO: get rid of printf
+        write_string(id_buf, output);
+
+        write_string(",\"type\":\"buffer\",\"access\":\"r\"}", output);
+    }
+
+    // special-purpose function - to be moved
+    Endpoint* get_by_name(const char * name, size_t length) {
+        if (!strncmp(name, name_, length))
+            return this;
+        else
+            return nullptr;
+    }
+
+    const char* get_name() final {
+        return name_;
+    }
+
+    bool is_plain_data() final { return true; }
+
+    void register_endpoints(Endpoint** list, size_t id, size_t length) {
+        if (id < length)
+            list[id] = this;
+    }
+    void register_names(uint32_t hash, size_t id, EndpointNameTable* table) {
+        table->insert(EndpointNameTable::hash(hash, name_), id);
+    }
+    void handle(const uint8_t* input, size_t input_length, StreamSink* output) final {
+        // The request must contain a 32 bit integer to specify an offset
+        if (input_length < 4)
+            return;
+        uint32_t offset = 0;
+        read_le<uint32_t>(&offset, input);
+        if (offset < length_)
+            output->process_bytes(buffer_ + offset, length_ - offset, nullptr);
+    }
+
+    const char* name_;
+    const uint8_t* buffer_;
+    size_t length_;
+};
+
+template<typename T>
+ProtocolBuffer make_protocol_buffer(const char * name, T* buffer, size_t count = 1) {
+    return ProtocolBuffer(name, buffer, count * sizeof(T));
+};
+
 template<typename ... TArgs>
 struct PropertyListFactory;
 
@@ -968,6 +1208,9 @@ public:
     Endpoint* get_by_name(const char * name, size_t length) {
         return nullptr; // can't address functions by name
     }
+    void register_names(uint32_t hash, size_t id, EndpointNameTable* table) {
+        // can't address functions by name
+    }
 
     void register_endpoints(Endpoint** list, size_t id, size_t length) {
         if (id < length)
@@ -1077,6 +1320,39 @@ class JSONDescriptorEndpoint : Endpoint {
 public:
     static constexpr size_t endpoint_count = 1;
     void write_json(size_t id, StreamSink* output);
+    void write_descriptor(StreamSink* output);
+    void register_endpoints(Endpoint** list, size_t id, size_t length);
+    void handle(const uint8_t* input, size_t input_length, StreamSink* output);
+
+    // If set, chunks are served from this copy of the descriptor instead of
+    // regenerating the descriptor up to the requested offset.
+    const uint8_t* cache_ = nullptr;
+};
+
+/* @brief Runs several endpoint operations that are carried in one packet.
+*
+* Each operation in the request consists of:
+*   uint16 endpoint ID
+*   uint8  input length
+*   uint8  output length
+*   input bytes
+* The operations are handled in order and their outputs are concatenated in
+* the response, each padded with zeros to the requested output length.
+* Handling stops at the first operation whose output doesn't fit into the
+* response anymore, so the client can tell from the response length which
+* operations were handled.
+* The response can be as long as the response buffer of the channel.
+* The property and buffer operations of one request are handled inside
+* fibre_enter_critical()/fibre_exit_critical(), so they see and leave a
+* consistent state. Functions may block and run outside of it, and so do the
+* written hooks of properties, which run before the next function and at the
+* end of the batch.
+*/
+class BatchEndpoint : Endpoint {
+public:
+    static constexpr size_t endpoint_count = 1;
+    static constexpr size_t MAX_PENDING_HOOKS = 8; // more written hooks are run in between
+    void write_json(size_t id, StreamSink* output);
     void register_endpoints(Endpoint** list, size_t id, size_t length);
     void handle(const uint8_t* input, size_t input_length, StreamSink* output);
 };
@@ -1085,35 +1361,59 @@ public:
 extern Endpoint** endpoint_list_;
 extern size_t n_endpoints_;
 extern uint16_t json_crc_;
+extern size_t json_length_;
 extern JSONDescriptorEndpoint json_file_endpoint_;
+extern BatchEndpoint batch_endpoint_;
 extern EndpointProvider* application_endpoints_;
+extern EndpointNameTable endpoint_name_table_;
 
 bool is_endpoint_ref_valid(endpoint_ref_t endpoint_ref);
 Endpoint* get_endpoint(endpoint_ref_t endpoint_ref);
+Endpoint* get_endpoint_by_name(char* name, size_t length);
+bool fibre_set_json_cache(const uint8_t* json, size_t length);
+
+// @brief Disables and restores the interrupts around the operations of a batch.
+// The default implementations do nothing, the application overrides them if
+// endpoints are also accessed from interrupts or other threads.
+uint32_t fibre_enter_critical();
+void fibre_exit_critical(uint32_t mask);
+
+// @brief Called when a client starts reading the JSON descriptor while no
+// cache is set. The application can use this to write the cache lazily and
+// pass it to fibre_set_json_cache(). The default implementation does nothing.
+void fibre_json_cache_miss();
 
 // @brief Registers the specified application object list using the provided endpoint table.
 // This function should only be called once during the lifetime of the application. TODO: fix this.
 // @param application_objects The application objects to be registred.
 template<typename T>
 int fibre_publish(T& application_objects) {
-    static constexpr size_t endpoint_list_size = 1 + T::endpoint_count;
+    static constexpr size_t endpoint_list_size = 1 + T::endpoint_count + 1;
     static Endpoint* endpoint_list[endpoint_list_size];
     static auto endpoint_provider = EndpointProvider_from_MemberList<T>(application_objects);
+    static constexpr size_t name_table_size = EndpointNameTable::get_size(T::endpoint_count);
+    static uint32_t name_table_hashes[name_table_size];
+    static uint16_t name_table_ids[name_table_size];
 
     json_file_endpoint_.register_endpoints(endpoint_list, 0, endpoint_list_size);
     application_objects.register_endpoints(endpoint_list, 1, endpoint_list_size);
+    batch_endpoint_.register_endpoints(endpoint_list, 1 + T::endpoint_count, endpoint_list_size);
 
     // Update the global endpoint table
     endpoint_list_ = endpoint_list;
     n_endpoints_ = endpoint_list_size;
     application_endpoints_ = &endpoint_provider;
+
+    // Build the name lookup table (this requires the endpoint table)
+    endpoint_name_table_.init(name_table_hashes, name_table_ids, name_table_size);
+    application_objects.register_names(EndpointNameTable::FNV_OFFSET_BASIS, 1, &endpoint_name_table_);
     
-    // Calculate the CRC16 of the JSON file.
+    // Calculate the CRC16 and the length of the JSON file.
     // The init value is the protocol version.
     CRC16Calculator crc16_calculator(PROTOCOL_VERSION);
-    uint8_t offset[4] = { 0 };
-    json_file_endpoint_.handle(offset, sizeof(offset), &crc16_calculator);
+    json_file_endpoint_.write_descriptor(&crc16_calculator);
     json_crc_ = crc16_calculator.get_crc16();
+    json_length_ = crc16_calculator.get_length();
 
     return 0;
 }
@@ -2,7 +2,7 @@
 tup.include('../tupfiles/build.lua')
 
 fibre_package = define_package{
-    sources={'protocol.cpp', 'posix_tcp.cpp', 'posix_udp.cpp'},
+    sources={'protocol.cpp', 'posix_tcp.cpp', 'posix_udp.cpp', 'client.cpp', 'posix_client.cpp'},
     libs={'pthread'},
     headers={'include'}
 }
@@ -0,0 +1,179 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <fibre/posix_client.hpp>
+
+#define CLIENT_RX_BUF_LEN       1024
+#define CLIENT_POLL_PERIOD_MS   10      // granularity of the resend timeouts
+
+/* Private function prototypes -----------------------------------------------*/
+
+static int connect_socket(const char* host, unsigned int port, int socktype);
+static speed_t get_baudrate_constant(unsigned int baudrate);
+
+/* Function implementations --------------------------------------------------*/
+
+static int connect_socket(const char* host, unsigned int port, int socktype) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = socktype;
+
+    char port_str[8];
+    snprintf(port_str, sizeof(port_str), "%u", port);
+    struct addrinfo* results;
+    if (getaddrinfo(host, port_str, &hints, &results))
+        return -1;
+
+    int fd = -1;
+    for (struct addrinfo* ai = results; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(results);
+    return fd;
+}
+
+static speed_t get_baudrate_constant(unsigned int baudrate) {
+    switch (baudrate) {
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+        case 460800: return B460800;
+        case 921600: return B921600;
+        default: return B0;
+    }
+}
+
+
+void PosixClientTransport::start(int fd) {
+    fd_ = fd;
+    stop_ = false;
+    thread_ = std::thread(&PosixClientTransport::receiver_loop, this);
+}
+
+void PosixClientTransport::disconnect() {
+    stop_ = true;
+    if (thread_.joinable())
+        thread_.join();
+    if (fd_ >= 0)
+        close(fd_);
+    fd_ = -1;
+    channel_.close();
+}
+
+void PosixClientTransport::receiver_loop() {
+    uint8_t buf[CLIENT_RX_BUF_LEN];
+    struct pollfd pfd = { fd_, POLLIN, 0 };
+
+    while (!stop_) {
+        int n_ready = poll(&pfd, 1, CLIENT_POLL_PERIOD_MS);
+        if (n_ready == -1 && errno != EINTR)
+            break;
+        if (n_ready > 0) {
+            ssize_t n_received = read(fd_, buf, sizeof(buf));
+            // 0 means that the server closed the connection. ECONNREFUSED only
+            // means that a datagram was not delivered.
+            if (n_received == 0 || (n_received == -1 && errno != EINTR && errno != EAGAIN && errno != ECONNREFUSED))
+                break;
+            if (n_received > 0)
+                handle_received_bytes(buf, n_received);
+        }
+        channel_.check_timeouts();
+    }
+
+    stop_ = true;
+    channel_.close();
+}
+
+
+int StreamClientTransport::FdStreamSink::process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) {
+    size_t sent = 0;
+    while (sent < length) {
+        ssize_t n_sent = write(fd_, buffer + sent, length - sent);
+        if (n_sent == -1 && errno == EINTR)
+            continue;
+        if (n_sent == -1)
+            break;
+        sent += n_sent;
+    }
+    if (processed_bytes)
+        *processed_bytes = sent;
+    return (sent == length) ? 0 : -1;
+}
+
+int TCPClientTransport::connect(const char* host, unsigned int port) {
+    int fd = connect_socket(host, port, SOCK_STREAM);
+    if (fd == -1)
+        return -1;
+
+    // Requests are small and latency matters more than throughput
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    start(fd);
+    return 0;
+}
+
+int SerialClientTransport::open(const char* path, unsigned int baudrate) {
+    speed_t speed = get_baudrate_constant(baudrate);
+    if (speed == B0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = ::open(path, O_RDWR | O_NOCTTY);
+    if (fd == -1)
+        return -1;
+
+    struct termios tty;
+    if (tcgetattr(fd, &tty)) {
+        close(fd);
+        return -1;
+    }
+    cfmakeraw(&tty);
+    cfsetispeed(&tty, speed);
+    cfsetospeed(&tty, speed);
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cc[VMIN] = 0;
+    tty.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, TCSANOW, &tty)) {
+        close(fd);
+        return -1;
+    }
+    tcflush(fd, TCIOFLUSH);
+
+    start(fd);
+    return 0;
+}
+
+int UDPClientTransport::connect(const char* host, unsigned int port) {
+    int fd = connect_socket(host, port, SOCK_DGRAM);
+    if (fd == -1)
+        return -1;
+    start(fd);
+    return 0;
+}
+
+int UDPClientTransport::process_packet(const uint8_t* buffer, size_t length) {
+    // cannot send partial packets
+    if (length > CLIENT_MAX_PACKET_SIZE)
+        return -1;
+    return (send(fd_, buffer, length, 0) == -1) ? -1 : 0;
+}
@@ -1,108 +1,215 @@
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
-#include <thread>
-#include <future>
+#include <memory>
+#include <unordered_map>
 #include <vector>
 
 #include <fibre/protocol.hpp>
+#include <fibre/posix_tcp.hpp>
 
 
-#define TCP_RX_BUF_LEN	512
+#define TCP_RX_BUF_LEN	4096
+// Reading from a client is paused while more than this many bytes of
+// responses are waiting to be sent to it
+#define TCP_TX_HIGH_WATER	16384
+#define TCP_MAX_EVENTS	64
 
+// Queues the output of a connection until the socket accepts it, so that
+// a slow client never blocks the other ones. The responses to all packets
+// of one read are sent with a single send().
 class TCPStreamSink : public StreamSink {
 public:
-    TCPStreamSink(int socket_fd) :
-        socket_fd_(socket_fd)
-    {}
-
     int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) {
-        int bytes_sent = send(socket_fd_, buffer, length, 0);
+        queue_.insert(queue_.end(), buffer, buffer + length);
         if (processed_bytes)
-            *processed_bytes = (bytes_sent == -1) ? 0 : bytes_sent;
-        return (bytes_sent == -1) ? -1 : 0;
+            *processed_bytes = length;
+        return 0;
     }
 
     size_t get_free_space() { return SIZE_MAX; }
 
+    // @brief Sends as much of the queue as the socket takes without blocking.
+    // Returns -1 if the connection is broken.
+    int flush(int socket_fd) {
+        while (sent_ < queue_.size()) {
+            ssize_t n_sent = send(socket_fd, queue_.data() + sent_, queue_.size() - sent_, MSG_NOSIGNAL);
+            if (n_sent == -1 && errno == EINTR)
+                continue;
+            if (n_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (n_sent == -1)
+                return -1;
+            sent_ += n_sent;
+        }
+        queue_.erase(queue_.begin(), queue_.begin() + sent_); // keeps the capacity
+        sent_ = 0;
+        return 0;
+    }
+
+    size_t get_pending() const { return queue_.size() - sent_; }
+
 private:
-    int socket_fd_;
+    std::vector<uint8_t> queue_;
+    size_t sent_ = 0;
+};
+
+// Input and output stack of one client
+struct TCPConnection {
+    TCPConnection(int fd) :
+        socket_fd(fd),
+        packet2stream(output),
+        channel(packet2stream),
+        stream2packet(channel)
+    {}
+
+    int socket_fd;
+    uint32_t events = 0; // currently registered epoll events
+    TCPStreamSink output;
+    StreamBasedPacketSink packet2stream;
+    BidirectionalPacketBasedChannel channel;
+    StreamToPacketSegmenter stream2packet;
 };
 
 
-int serve_client(int sock_fd) {
-    uint8_t buf[TCP_RX_BUF_LEN];
+// @brief Reads once from the client and handles the packets in it.
+// Returns -1 if the connection was closed.
+static int handle_input(TCPConnection* conn, uint8_t* buf, size_t length) {
+    ssize_t n_received = recv(conn->socket_fd, buf, length, 0);
 
-    // initialize output stack for this client
-    TCPStreamSink tcp_packet_output(sock_fd);
-    StreamBasedPacketSink packet2stream(tcp_packet_output);
-    BidirectionalPacketBasedChannel channel(packet2stream);
+    // -1 indicates error and 0 means that the client gracefully terminated
+    if (n_received == -1)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    if (n_received == 0)
+        return -1;
 
-    StreamToPacketSegmenter stream2packet(channel);
+    // input processing stack
+    conn->stream2packet.process_bytes(buf, n_received, nullptr);
+    return 0;
+}
 
-    // now listen for it
+// @brief Waits for output space while responses are pending and stops
+// reading while too many of them are.
+static int update_events(int epoll_fd, TCPConnection* conn) {
+    size_t pending = conn->output.get_pending();
+    uint32_t events = (pending > TCP_TX_HIGH_WATER ? 0 : EPOLLIN) | (pending ? EPOLLOUT : 0);
+    if (events == conn->events)
+        return 0;
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.ptr = conn;
+    conn->events = events;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->socket_fd, &ev);
+}
+
+static void accept_connections(int listen_fd, int epoll_fd,
+        std::unordered_map<int, std::unique_ptr<TCPConnection>>& connections) {
     for (;;) {
-        memset(buf, 0, sizeof(buf));
-        // returns as soon as there is some data
-        ssize_t n_received = recv(sock_fd, buf, sizeof(buf), 0);
-
-        // -1 indicates error and 0 means that the client gracefully terminated
-        if (n_received == -1 || n_received == 0) {
-            close(sock_fd);
-            return n_received;
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1)
+            return; // no more pending connections (or a transient error)
+
+        // Excess clients are disconnected right away instead of waiting in the backlog
+        if (connections.size() >= TCP_MAX_CONNECTIONS) {
+            close(fd);
+            continue;
         }
 
-        // input processing stack
-        size_t processed = 0;
-        stream2packet.process_bytes(buf, n_received, &processed);
+        // Requests are small and latency matters more than throughput
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        std::unique_ptr<TCPConnection> conn(new TCPConnection(fd));
+        struct epoll_event ev = {};
+        ev.events = conn->events = EPOLLIN;
+        ev.data.ptr = conn.get();
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            close(fd);
+            continue;
+        }
+        connections[fd] = std::move(conn);
     }
 }
 
-// function to check if a worker thread handling a single client is done
-template<typename T>
-bool future_is_ready(std::future<T>& t){
-    return t.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
-}
-
 int serve_on_tcp(unsigned int port) {
-    struct sockaddr_in6 si_me, si_other;
+    struct sockaddr_in6 si_me;
     int s;
 
-
-    if ((s=socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP)) == -1) {
+    if ((s=socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP)) == -1) {
         return -1;
     }
 
+    int one = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
     memset((char *) &si_me, 0, sizeof(si_me));
     si_me.sin6_family = AF_INET6;
     si_me.sin6_port = htons(port);
     si_me.sin6_flowinfo = 0;
     si_me.sin6_addr = in6addr_any;
-    if (bind(s, reinterpret_cast<struct sockaddr *>(&si_me), sizeof(si_me)) == -1) {
+    if (bind(s, reinterpret_cast<struct sockaddr *>(&si_me), sizeof(si_me)) == -1
+        || listen(s, 128) == -1) { // make this socket a passive socket
+        close(s);
         return -1;
     }
 
-    listen(s, 128); // make this socket a passive socket
-    std::vector<std::future<int>> serv_pool;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event listen_ev = {};
+    listen_ev.events = EPOLLIN;
+    listen_ev.data.ptr = nullptr; // the listening socket has no connection
+    if (epoll_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s, &listen_ev) == -1) {
+        if (epoll_fd != -1)
+            close(epoll_fd);
+        close(s);
+        return -1;
+    }
+
+    // All clients are served on this thread, so the endpoint handlers are
+    // never called concurrently
+    std::unordered_map<int, std::unique_ptr<TCPConnection>> connections;
+    uint8_t buf[TCP_RX_BUF_LEN];
+    struct epoll_event events[TCP_MAX_EVENTS];
     for (;;) {
-        memset(&si_other, 0, sizeof(si_other));
-
-        socklen_t silen = sizeof(si_other);
-        // TODO: Add a limit on accepting connections
-        int client_portal_fd = accept(s, reinterpret_cast<sockaddr *>(&si_other), &silen); // blocking call
-        serv_pool.push_back(std::async(std::launch::async, serve_client, client_portal_fd));
-        // do a little clean up on the pool
-        for (std::vector<std::future<int>>::iterator it = serv_pool.end()-1; it >= serv_pool.begin(); --it) {
-            if (future_is_ready(*it)) {
-                // we can erase this thread
-                serv_pool.erase(it);
+        int n_events = epoll_wait(epoll_fd, events, TCP_MAX_EVENTS, -1);
+        if (n_events == -1 && errno == EINTR)
+            continue;
+        if (n_events == -1)
+            break;
+
+        for (int i = 0; i < n_events; ++i) {
+            TCPConnection* conn = static_cast<TCPConnection*>(events[i].data.ptr);
+            if (!conn) {
+                accept_connections(s, epoll_fd, connections);
+                continue;
+            }
+
+            // Reading is level triggered, so each ready client gets one
+            // read per iteration and no client can starve the others
+            int status = 0;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                status = handle_input(conn, buf, sizeof(buf));
+            if (!status)
+                status = conn->output.flush(conn->socket_fd);
+            if (!status)
+                status = update_events(epoll_fd, conn);
+
+            if (status) {
+                // closing the socket also removes it from the epoll set
+                close(conn->socket_fd);
+                connections.erase(conn->socket_fd);
             }
         }
     }
 
+    for (auto& connection : connections)
+        close(connection.first);
+    close(epoll_fd);
     close(s);
+    return -1;
 }
-
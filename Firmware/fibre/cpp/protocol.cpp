@@ -10,14 +10,46 @@
 /* Private defines -----------------------------------------------------------*/
 /* Private macros ------------------------------------------------------------*/
 /* Private typedef -----------------------------------------------------------*/
+
+// @brief Passes at most length bytes on to the output. pad() fills up the
+// rest with zeros, so that exactly length bytes reach the output.
+class PaddedStreamSink : public StreamSink {
+public:
+    PaddedStreamSink(StreamSink& output, size_t length) :
+        output_(output),
+        free_space_(length) {}
+
+    int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) {
+        size_t chunk = length < free_space_ ? length : free_space_;
+        output_.process_bytes(buffer, chunk, processed_bytes);
+        free_space_ -= chunk;
+        return chunk == length ? 0 : -1;
+    }
+
+    size_t get_free_space() { return free_space_; }
+
+    void pad() {
+        static const uint8_t zeros[8] = { 0 };
+        while (free_space_)
+            process_bytes(zeros, free_space_ < sizeof(zeros) ? free_space_ : sizeof(zeros), nullptr);
+    }
+
+private:
+    StreamSink& output_;
+    size_t free_space_;
+};
+
 /* Global constant data ------------------------------------------------------*/
 /* Global variables ----------------------------------------------------------*/
 
 Endpoint** endpoint_list_ = nullptr; // initialized by calling fibre_publish
 size_t n_endpoints_ = 0; // initialized by calling fibre_publish
 uint16_t json_crc_; // initialized by calling fibre_publish
+size_t json_length_; // initialized by calling fibre_publish
 JSONDescriptorEndpoint json_file_endpoint_ = JSONDescriptorEndpoint();
+BatchEndpoint batch_endpoint_ = BatchEndpoint();
 EndpointProvider* application_endpoints_;
+EndpointNameTable endpoint_name_table_; // initialized by calling fibre_publish
 
 /* Private constant data -----------------------------------------------------*/
 /* Private variables ---------------------------------------------------------*/
@@ -50,26 +82,35 @@ int StreamToPacketSegmenter::process_bytes(const uint8_t *buffer, size_t length,
     int result = 0;
 
     while (length--) {
-        if (header_index_ < sizeof(header_buffer_)) {
+        if (header_index_ < header_length_) {
             // Process header byte
             header_buffer_[header_index_++] = *buffer;
             if (header_index_ == 1 && header_buffer_[0] != CANONICAL_PREFIX) {
                 header_index_ = 0;
-            } else if (header_index_ == 2 && (header_buffer_[1] & 0x80)) {
-                header_index_ = 0; // TODO: support packets larger than 128 bytes
-            } else if (header_index_ == 3 && calc_crc8<CANONICAL_CRC8_POLYNOMIAL>(CANONICAL_CRC8_INIT, header_buffer_, 3)) {
+            } else if (header_index_ == 2) {
+                header_length_ = (header_buffer_[1] & 0x80) ? 4 : 3;
+            } else if (header_index_ == 3 && header_length_ == 4 && (header_buffer_[2] & 0x80)) {
+                header_index_ = 0; // length exceeds MAX_STREAM_PACKET_SIZE
+            } else if (header_index_ == header_length_ && calc_crc8<CANONICAL_CRC8_POLYNOMIAL>(CANONICAL_CRC8_INIT, header_buffer_, header_length_)) {
                 header_index_ = 0;
-            } else if (header_index_ == 3) {
-                packet_length_ = header_buffer_[1] + 2;
+            } else if (header_index_ == header_length_) {
+                packet_length_ = (header_buffer_[1] & 0x7f) + 2;
+                if (header_length_ == 4)
+                    packet_length_ += header_buffer_[2] << 7;
             }
-        } else if (packet_index_ < sizeof(packet_buffer_)) {
-            // Process payload byte
-            packet_buffer_[packet_index_++] = *buffer;
+        } else {
+            // Process payload byte. Packets that don't fit into the buffer
+            // are received and then discarded, so that the payload isn't
+            // mistaken for a header.
+            if (packet_index_ < sizeof(packet_buffer_))
+                packet_buffer_[packet_index_] = *buffer;
+            packet_index_++;
         }
 
         // If both header and packet are fully received, hand it on to the packet processor
-        if (header_index_ == 3 && packet_index_ == packet_length_) {
-            if (calc_crc16<CANONICAL_CRC16_POLYNOMIAL>(CANONICAL_CRC16_INIT, packet_buffer_, packet_length_) == 0) {
+        if (header_index_ == header_length_ && packet_index_ == packet_length_) {
+            if (packet_length_ <= sizeof(packet_buffer_)
+                && calc_crc16<CANONICAL_CRC16_POLYNOMIAL>(CANONICAL_CRC16_INIT, packet_buffer_, packet_length_) == 0) {
                 result |= output_.process_packet(packet_buffer_, packet_length_ - 2);
             }
             header_index_ = packet_index_ = packet_length_ = 0;
@@ -83,19 +124,22 @@ int StreamToPacketSegmenter::process_bytes(const uint8_t *buffer, size_t length,
 }
 
 int StreamBasedPacketSink::process_packet(const uint8_t *buffer, size_t length) {
-    // TODO: support buffer size >= 128
-    if (length >= 128)
+    if (length > MAX_STREAM_PACKET_SIZE)
         return -1;
 
     LOG_FIBRE("send header\r\n");
-    uint8_t header[] = {
-        CANONICAL_PREFIX,
-        static_cast<uint8_t>(length),
-        0
-    };
-    header[2] = calc_crc8<CANONICAL_CRC8_POLYNOMIAL>(CANONICAL_CRC8_INIT, header, 2);
+    uint8_t header[4] = { CANONICAL_PREFIX };
+    size_t header_length = 1;
+    if (length < 0x80) {
+        header[header_length++] = static_cast<uint8_t>(length);
+    } else {
+        header[header_length++] = static_cast<uint8_t>(length | 0x80);
+        header[header_length++] = static_cast<uint8_t>(length >> 7);
+    }
+    header[header_length] = calc_crc8<CANONICAL_CRC8_POLYNOMIAL>(CANONICAL_CRC8_INIT, header, header_length);
+    header_length++;
 
-    if (output_.process_bytes(header, sizeof(header), nullptr))
+    if (output_.process_bytes(header, header_length, nullptr))
         return -1;
     LOG_FIBRE("send payload:\r\n");
     hexdump(buffer, length);
@@ -133,6 +177,20 @@ void JSONDescriptorEndpoint::register_endpoints(Endpoint** list, size_t id, size
         list[id] = this;
 }
 
+// Generates the entire JSON interface definition.
+void JSONDescriptorEndpoint::write_descriptor(StreamSink* output) {
+    size_t id = 0;
+    write_string("[", output);
+    json_file_endpoint_.write_json(id, output);
+    id += decltype(json_file_endpoint_)::endpoint_count;
+    write_string(",", output);
+    application_endpoints_->write_json(id, output);
+    id += application_endpoints_->get_endpoint_count();
+    write_string(",", output);
+    batch_endpoint_.write_json(id, output);
+    write_string("]", output);
+}
+
 // Returns part of the JSON interface definition.
 void JSONDescriptorEndpoint::handle(const uint8_t* input, size_t input_length, StreamSink* output) {
     // The request must contain a 32 bit integer to specify an offset
@@ -140,15 +198,106 @@ void JSONDescriptorEndpoint::handle(const uint8_t* input, size_t input_length, S
         return;
     uint32_t offset = 0;
     read_le<uint32_t>(&offset, input);
+
+    // A client starts reading the descriptor at offset 0
+    if (!cache_ && !offset)
+        fibre_json_cache_miss();
+
+    if (cache_) {
+        if (offset < json_length_)
+            output->process_bytes(cache_ + offset, json_length_ - offset, nullptr);
+        return;
+    }
+
     NullStreamSink output_with_offset = NullStreamSink(offset, *output);
+    write_descriptor(&output_with_offset);
+}
 
-    size_t id = 0;
-    write_string("[", &output_with_offset);
-    json_file_endpoint_.write_json(id, &output_with_offset);
-    id += decltype(json_file_endpoint_)::endpoint_count;
-    write_string(",", &output_with_offset);
-    application_endpoints_->write_json(id, &output_with_offset);
-    write_string("]", &output_with_offset);
+void BatchEndpoint::write_json(size_t id, StreamSink* output) {
+    write_string("{\"name\":\"\",", output);
+
+    // write endpoint ID
+    write_string("\"id\":", output);
+    char id_buf[10];
+    snprintf(id_buf, sizeof(id_buf), "%u", (unsigned)id); // TODO: get rid of printf
+    write_string(id_buf, output);
+
+    write_string(",\"type\":\"batch\",\"access\":\"rw\"}", output);
+}
+
+void BatchEndpoint::register_endpoints(Endpoint** list, size_t id, size_t length) {
+    if (id < length)
+        list[id] = this;
+}
+
+void BatchEndpoint::handle(const uint8_t* input, size_t input_length, StreamSink* output) {
+    // The written hooks can do more than copy data, so they are collected
+    // and run outside of the critical section
+    Endpoint* pending_hooks[MAX_PENDING_HOOKS];
+    size_t n_pending_hooks = 0;
+    auto run_pending_hooks = [&]() {
+        for (size_t i = 0; i < n_pending_hooks; ++i)
+            pending_hooks[i]->run_written_hook();
+        n_pending_hooks = 0;
+    };
+
+    uint32_t mask = fibre_enter_critical();
+    while (input_length >= 4) {
+        uint16_t endpoint_id = read_le<uint16_t>(&input, &input_length);
+        uint8_t operation_input_length = read_le<uint8_t>(&input, &input_length);
+        uint8_t operation_output_length = read_le<uint8_t>(&input, &input_length);
+        if (operation_input_length > input_length
+            || operation_output_length > output->get_free_space())
+            break;
+
+        // The output goes straight into the response
+        PaddedStreamSink operation_sink(*output, operation_output_length);
+        Endpoint* endpoint = endpoint_id < n_endpoints_ ? endpoint_list_[endpoint_id] : nullptr;
+        if (endpoint && endpoint != this) {
+            if (endpoint->is_plain_data() && n_pending_hooks < MAX_PENDING_HOOKS) {
+                if (endpoint->handle_without_hook(input, operation_input_length, &operation_sink))
+                    pending_hooks[n_pending_hooks++] = endpoint;
+            } else {
+                fibre_exit_critical(mask);
+                run_pending_hooks();
+                endpoint->handle(input, operation_input_length, &operation_sink);
+                mask = fibre_enter_critical();
+            }
+        }
+        operation_sink.pad();
+
+        input += operation_input_length;
+        input_length -= operation_input_length;
+    }
+    fibre_exit_critical(mask);
+    run_pending_hooks();
+}
+
+__attribute__((weak)) uint32_t fibre_enter_critical() {
+    return 0;
+}
+
+__attribute__((weak)) void fibre_exit_critical(uint32_t mask) {
+    (void) mask;
+}
+
+__attribute__((weak)) void fibre_json_cache_miss() {
+}
+
+// @brief Makes the JSON endpoint serve the descriptor from the given copy,
+// which must remain valid for the lifetime of the application, e.g. a copy
+// in flash that was written by the application after fibre_publish.
+// @returns false (and leaves the cache unused) if the copy doesn't match
+// the current descriptor byte for byte.
+bool fibre_set_json_cache(const uint8_t* json, size_t length) {
+    bool valid = (length == json_length_);
+    if (valid) {
+        MemoryCompareStreamSink compare_sink(json, length);
+        json_file_endpoint_.write_descriptor(&compare_sink);
+        valid = compare_sink.matches();
+    }
+    json_file_endpoint_.cache_ = valid ? json : nullptr;
+    return valid;
 }
 
 int BidirectionalPacketBasedChannel::process_packet(const uint8_t* buffer, size_t length) {
@@ -214,6 +363,58 @@ int BidirectionalPacketBasedChannel::process_packet(const uint8_t* buffer, size_
     return 0;
 }
 
+void EndpointNameTable::init(uint32_t* hashes, uint16_t* ids, size_t size) {
+    hashes_ = hashes;
+    ids_ = ids;
+    mask_ = size - 1;
+    valid_ = true;
+    for (size_t i = 0; i < size; ++i)
+        ids_[i] = 0;
+}
+
+void EndpointNameTable::insert(uint32_t hash, size_t id) {
+    const char* name = endpoint_list_[id]->get_name();
+    size_t i = hash & mask_;
+    while (ids_[i]) {
+        // Two paths with the same hash and the same last segment can't be
+        // told apart. This is very unlikely, but fall back to a tree walk.
+        if (hashes_[i] == hash && !strcmp(endpoint_list_[ids_[i]]->get_name(), name))
+            valid_ = false;
+        i = (i + 1) & mask_;
+    }
+    hashes_[i] = hash;
+    ids_[i] = id;
+}
+
+Endpoint* EndpointNameTable::find(const char* path) {
+    uint32_t hash = FNV_OFFSET_BASIS;
+    const char* name = path;
+    for (const char* c = path; *c; ++c) {
+        hash = EndpointNameTable::hash(hash, *c);
+        if (*c == '.')
+            name = c + 1;
+    }
+
+    for (size_t i = hash & mask_; ids_[i]; i = (i + 1) & mask_) {
+        Endpoint* endpoint = endpoint_list_[ids_[i]];
+        if (hashes_[i] == hash && !strcmp(endpoint->get_name(), name))
+            return endpoint;
+    }
+    return nullptr;
+}
+
+// @brief Returns the endpoint with the specified dotted path or nullptr if
+// there is none. The name must be null-terminated within length and may be
+// modified.
+Endpoint* get_endpoint_by_name(char* name, size_t length) {
+    if (endpoint_name_table_.valid_)
+        return endpoint_name_table_.find(name);
+    else if (application_endpoints_)
+        return application_endpoints_->get_by_name(name, length);
+    else
+        return nullptr;
+}
+
 bool is_endpoint_ref_valid(endpoint_ref_t endpoint_ref) {
     return (endpoint_ref.json_crc == json_crc_)
         && (endpoint_ref.endpoint_id < n_endpoints_);
@@ -5,6 +5,8 @@ import struct
 import sys
 import threading
 import traceback
+import collections
+from concurrent.futures import Future
 #import fibre.utils
 from fibre.utils import Event, wait_any, TimeoutError
 
@@ -26,7 +28,17 @@ PROTOCOL_VERSION = 1
 CRC8_DEFAULT = 0x37 # this must match the polynomial in the C++ implementation
 CRC16_DEFAULT = 0x3d65 # this must match the polynomial in the C++ implementation
 
-MAX_PACKET_SIZE = 128
+# Packet lengths of 128 and above are encoded in two bytes on stream based
+# channels (7 bits each, least significant first, MSB set in the first byte)
+MAX_PACKET_SIZE = 0x3fff
+
+# The requests of a batch operation are kept within one full speed USB packet
+# (6 bytes header + payload + 2 bytes trailer)
+MAX_BATCH_REQUEST_SIZE = 64 - 8
+
+# The device answers each request with at most this many payload bytes
+# (TX_BUF_SIZE - 2 in the C++ implementation)
+MAX_RESPONSE_SIZE = 32 - 2
 
 def calc_crc(remainder, value, polynomial, bitwidth):
     topbit = (1 << (bitwidth - 1))
@@ -41,24 +53,32 @@ def calc_crc(remainder, value, polynomial, bitwidth):
 
     return remainder & ((1 << bitwidth) - 1)
 
-def calc_crc8(remainder, value):
-    if isinstance(value, bytearray) or isinstance(value, bytes) or isinstance(value, list):
-        for byte in value:
-            if not isinstance(byte,int):
-                byte = ord(byte)
-            remainder = calc_crc(remainder, byte, CRC8_DEFAULT, 8)
+def _make_crc_table(polynomial, bitwidth):
+    return [calc_crc(0, value, polynomial, bitwidth) for value in range(256)]
+
+# The CRC of every possible byte, such that a CRC can be calculated with one
+# table lookup per byte instead of 8 iterations of calc_crc()
+CRC8_TABLE = _make_crc_table(CRC8_DEFAULT, 8)
+CRC16_TABLE = _make_crc_table(CRC16_DEFAULT, 16)
+
+def _to_byte_values(value):
+    if isinstance(value, bytearray) or isinstance(value, bytes):
+        return bytearray(value) # iterates over ints in both Python 2 and 3
+    elif isinstance(value, list):
+        return [byte if isinstance(byte, int) else ord(byte) for byte in value]
     else:
-        remainder = calc_crc(remainder, byte, CRC8_DEFAULT, 8)
+        return [value]
+
+def calc_crc8(remainder, value):
+    table = CRC8_TABLE
+    for byte in _to_byte_values(value):
+        remainder = table[remainder ^ byte]
     return remainder
 
 def calc_crc16(remainder, value):
-    if isinstance(value, bytearray) or isinstance(value, bytes) or isinstance(value, list):
-        for byte in value:
-            if not isinstance(byte, int):
-                byte = ord(byte)
-            remainder = calc_crc(remainder, byte, CRC16_DEFAULT, 16)
-    else:
-        remainder = calc_crc(remainder, value, CRC16_DEFAULT, 16)
+    table = CRC16_TABLE
+    for byte in _to_byte_values(value):
+        remainder = ((remainder << 8) & 0xffff) ^ table[(remainder >> 8) ^ byte]
     return remainder
 
 # Can be verified with http://www.sunshine2k.de/coding/javascript/crc/crc_js.html:
@@ -103,9 +123,19 @@ class PacketSink(ABC):
         pass
 
 
+def decode_packet_length(header):
+    """
+    Returns the packet length encoded in the header of a stream based packet
+    """
+    length = header[1] & 0x7f
+    if header[1] & 0x80:
+        length |= header[2] << 7
+    return length
+
 class StreamToPacketSegmenter(StreamSink):
     def __init__(self, output):
         self._header = []
+        self._header_length = 3 # 4 if the packet length is encoded in two bytes
         self._packet = []
         self._packet_length = 0
         self._output = output
@@ -118,23 +148,25 @@ class StreamToPacketSegmenter(StreamSink):
         """
 
         for byte in bytes:
-            if (len(self._header) < 3):
+            if (len(self._header) < self._header_length):
                 # Process header byte
                 self._header.append(byte)
                 if (len(self._header) == 1) and (self._header[0] != SYNC_BYTE):
                     self._header = []
-                elif (len(self._header) == 2) and (self._header[1] & 0x80):
-                    self._header = [] # TODO: support packets larger than 128 bytes
-                elif (len(self._header) == 3) and calc_crc8(CRC8_INIT, self._header):
+                elif (len(self._header) == 2):
+                    self._header_length = 4 if (self._header[1] & 0x80) else 3
+                elif (len(self._header) == 3) and (self._header_length == 4) and (self._header[2] & 0x80):
+                    self._header = [] # length exceeds MAX_PACKET_SIZE
+                elif (len(self._header) == self._header_length) and calc_crc8(CRC8_INIT, self._header):
                     self._header = []
-                elif (len(self._header) == 3):
-                    self._packet_length = self._header[1] + 2
+                elif (len(self._header) == self._header_length):
+                    self._packet_length = decode_packet_length(self._header) + 2
             else:
                 # Process payload byte
                 self._packet.append(byte)
 
             # If both header and packet are fully received, hand it on to the packet processor
-            if (len(self._header) == 3) and (len(self._packet) == self._packet_length):
+            if (len(self._header) == self._header_length) and (len(self._packet) == self._packet_length):
                 if calc_crc16(CRC16_INIT, self._packet) == 0:
                     self._output.process_packet(self._packet[:-2])
                 self._header = []
@@ -147,12 +179,16 @@ class StreamBasedPacketSink(PacketSink):
         self._output = output
 
     def process_packet(self, packet):
-        if (len(packet) >= MAX_PACKET_SIZE):
-            raise NotImplementedError("packet larger than 127 currently not supported")
+        if (len(packet) > MAX_PACKET_SIZE):
+            raise NotImplementedError("packets larger than {} bytes are not supported".format(MAX_PACKET_SIZE))
 
         header = bytearray()
         header.append(SYNC_BYTE)
-        header.append(len(packet))
+        if len(packet) < 0x80:
+            header.append(len(packet))
+        else:
+            header.append((len(packet) & 0x7f) | 0x80)
+            header.append(len(packet) >> 7)
         header.append(calc_crc8(CRC8_INIT, header))
 
         self._output.process_bytes(header)
@@ -183,15 +219,17 @@ class PacketFromStreamConverter(PacketSource):
 
             header = header + self._input.get_bytes_or_fail(1, deadline)
             if (header[1] & 0x80):
-                #print("packet too large")
-                continue # TODO: support packets larger than 128 bytes
+                header = header + self._input.get_bytes_or_fail(1, deadline)
+                if (header[2] & 0x80):
+                    #print("packet too large")
+                    continue
 
             header = header + self._input.get_bytes_or_fail(1, deadline)
             if calc_crc8(CRC8_INIT, header) != 0:
                 #print("crc8 mismatch")
                 continue
 
-            packet_length = header[1] + 2
+            packet_length = decode_packet_length(header) + 2
             #print("wait for {} bytes".format(packet_length))
             packet = self._input.get_bytes_or_fail(packet_length, deadline)
             if calc_crc16(CRC16_INIT, packet) != 0:
@@ -200,10 +238,23 @@ class PacketFromStreamConverter(PacketSource):
             return packet[:-2]
 
 
+class _PendingRequest(object):
+    """
+    A request that was submitted to a channel and has not been answered yet
+    """
+    def __init__(self, seq_no, packet, expect_ack):
+        self.seq_no = seq_no
+        self.packet = packet
+        self.expect_ack = expect_ack
+        self.future = Future()
+        self.attempts = 0
+        self.deadline = None
+
 class Channel(PacketSink):
     # Choose these parameters to be sensible for a specific transport layer
     _resend_timeout = 5.0     # [s]
     _send_attempts = 5
+    _max_outstanding_requests = 8 # requests that are sent before the first one is answered
 
     def __init__(self, name, input, output, cancellation_token, logger):
         """
@@ -219,11 +270,16 @@ class Channel(PacketSink):
         self._logger = logger
         self._outbound_seq_no = 0
         self._interface_definition_crc = 0
-        self._expected_acks = {}
-        self._responses = {}
+        self._batch_endpoint_id = None # set during object discovery if the device supports batches
+        self._send_queue = collections.deque()
+        self._outstanding_requests = {} # by sequence number
+        self._sender_wakeup = threading.Condition()
+        self._stream_handlers = {}
         self._my_lock = threading.Lock()
         self._channel_broken = Event(cancellation_token)
+        self._channel_broken.subscribe(self._wake_sender)
         self.start_receiver_thread(Event(self._channel_broken))
+        self.start_sender_thread()
 
     def start_receiver_thread(self, cancellation_token):
         """
@@ -259,7 +315,88 @@ class Channel(PacketSink):
         t.daemon = True
         t.start()
 
-    def remote_endpoint_operation(self, endpoint_id, input, expect_ack, output_length):
+    def start_sender_thread(self):
+        """
+        Starts the sender thread that sends queued requests as long as fewer
+        than _max_outstanding_requests are waiting for a response, and resends
+        requests whose response timed out.
+        The thread quits as soon as the channel enters a broken state.
+        """
+        def sender_thread():
+            try:
+                while not self._channel_broken.is_set():
+                    request = None
+                    with self._sender_wakeup:
+                        now = time.monotonic()
+                        expired = [r for r in self._outstanding_requests.values() if r.deadline <= now]
+                        if expired:
+                            request = expired[0]
+                        elif self._send_queue and len(self._outstanding_requests) < self._max_outstanding_requests:
+                            request = self._send_queue.popleft()
+                            if request.expect_ack:
+                                self._outstanding_requests[request.seq_no] = request
+                        else:
+                            deadlines = [r.deadline for r in self._outstanding_requests.values()]
+                            self._sender_wakeup.wait(min(deadlines) - now if deadlines else None)
+                            continue
+
+                        if request.attempts >= self._send_attempts:
+                            self._outstanding_requests.pop(request.seq_no, None)
+                            request.future.set_exception(ChannelBrokenException()) # Too many resend attempts
+                            continue
+                        request.attempts += 1
+                        request.deadline = now + self._resend_timeout
+
+                    self._my_lock.acquire()
+                    try:
+                        self._output.process_packet(request.packet)
+                    except (ChannelDamagedException, TimeoutError):
+                        # resend right away
+                        with self._sender_wakeup:
+                            if request.expect_ack:
+                                request.deadline = time.monotonic()
+                            else:
+                                self._send_queue.appendleft(request)
+                        continue
+                    except Exception as ex:
+                        with self._sender_wakeup:
+                            self._outstanding_requests.pop(request.seq_no, None)
+                        request.future.set_exception(ex)
+                        continue
+                    finally:
+                        self._my_lock.release()
+                    # TODO: record channel statistics
+
+                    if not request.expect_ack:
+                        request.future.set_result(None) # fire and forget
+            except Exception:
+                self._logger.debug("sender thread is exiting: " + traceback.format_exc())
+                self._channel_broken.set()
+            finally:
+                # Fail all requests that were not answered
+                with self._sender_wakeup:
+                    requests = list(self._outstanding_requests.values()) + list(self._send_queue)
+                    self._outstanding_requests.clear()
+                    self._send_queue.clear()
+                for request in requests:
+                    if not request.future.done():
+                        request.future.set_exception(ChannelBrokenException())
+        t = threading.Thread(target=sender_thread)
+        t.daemon = True
+        t.start()
+
+    def _wake_sender(self):
+        with self._sender_wakeup:
+            self._sender_wakeup.notify()
+
+    def remote_endpoint_operation_async(self, endpoint_id, input, expect_ack, output_length):
+        """
+        Queues an endpoint operation and returns immediately.
+        Up to _max_outstanding_requests operations are sent before the
+        first one is answered, which hides the round trip latency of the link.
+        Returns a concurrent.futures.Future that resolves to the response
+        payload (or None if expect_ack is False).
+        """
         if input is None:
             input = bytearray(0)
         if (len(input) >= 128):
@@ -286,54 +423,106 @@ class Channel(PacketSink):
         #print("append trailer " + trailer)
         packet = packet + struct.pack('<H', trailer)
 
-        if (expect_ack):
-            ack_event = Event()
-            self._expected_acks[seq_no] = ack_event
-            try:
-                attempt = 0
-                while (attempt < self._send_attempts):
-                    self._my_lock.acquire()
-                    try:
-                        self._output.process_packet(packet)
-                    except ChannelDamagedException:
-                        attempt += 1
-                        continue # resend
-                    except TimeoutError:
-                        attempt += 1
-                        continue # resend
-                    finally:
-                        self._my_lock.release()
-                    # Wait for ACK until the resend timeout is exceeded
-                    try:
-                        if wait_any(self._resend_timeout, ack_event, self._channel_broken) != 0:
-                            raise ChannelBrokenException()
-                    except TimeoutError:
-                        attempt += 1
-                        continue # resend
-                    return self._responses.pop(seq_no)
-                    # TODO: record channel statistics
-                raise ChannelBrokenException() # Too many resend attempts
-            finally:
-                self._expected_acks.pop(seq_no)
-                self._responses.pop(seq_no, None)
-        else:
-            # fire and forget
-            self._output.process_packet(packet)
-            return None
-    
-    def remote_endpoint_read_buffer(self, endpoint_id):
+        request = _PendingRequest(seq_no, packet, expect_ack)
+        with self._sender_wakeup:
+            if self._channel_broken.is_set():
+                raise ChannelBrokenException()
+            self._send_queue.append(request)
+            self._sender_wakeup.notify()
+        return request.future
+
+    def remote_endpoint_operation(self, endpoint_id, input, expect_ack, output_length):
+        """
+        Runs an endpoint operation and blocks until the response arrives.
+        See remote_endpoint_operation_async().
+        """
+        return self.remote_endpoint_operation_async(endpoint_id, input, expect_ack, output_length).result()
+
+    def remote_endpoint_operation_asyncio(self, endpoint_id, input, expect_ack, output_length):
+        """
+        Same as remote_endpoint_operation_async() but returns an asyncio
+        future that can be awaited in the current event loop.
+        """
+        import asyncio
+        return asyncio.wrap_future(self.remote_endpoint_operation_async(endpoint_id, input, expect_ack, output_length))
+
+    def remote_endpoint_read_buffer(self, endpoint_id, length=None):
         """
-        Handles reads from long endpoints
+        Handles reads from long endpoints.
+        If length is given, the read stops after at least this many bytes.
+        The buffer is read in chunks of MAX_RESPONSE_SIZE bytes, which are
+        requested pipelined (see remote_endpoint_operation_async). Without a
+        length, _max_outstanding_requests chunks are requested at a time until
+        the device returns a short chunk.
         """
         # TODO: handle device that could (maliciously) send infinite stream
         buffer = bytes()
-        while True:
-            chunk_length = 512
-            chunk = self.remote_endpoint_operation(endpoint_id, struct.pack("<I", len(buffer)), True, chunk_length)
-            if (len(chunk) == 0):
-                break
-            buffer += chunk
-        return buffer
+        while length is None or len(buffer) < length:
+            if length is None:
+                n_chunks = self._max_outstanding_requests
+            else:
+                n_chunks = (length - len(buffer) + MAX_RESPONSE_SIZE - 1) // MAX_RESPONSE_SIZE
+            futures = [self.remote_endpoint_operation_async(endpoint_id, struct.pack("<I", len(buffer) + i * MAX_RESPONSE_SIZE), True, MAX_RESPONSE_SIZE)
+                       for i in range(n_chunks)]
+            chunks = [future.result() for future in futures]
+            for chunk in chunks:
+                buffer += chunk
+                if len(chunk) < MAX_RESPONSE_SIZE:
+                    return buffer if length is None else buffer[:length]
+        return buffer if length is None else buffer[:length]
+
+    def remote_endpoint_batch(self, operations):
+        """
+        Runs several endpoint operations with as few round trips as possible.
+        operations: list of (endpoint_id, input, output_length) tuples
+        Returns a list with the output of each operation.
+        Falls back to pipelined single operations if the device has no batch
+        endpoint.
+        """
+        if self._batch_endpoint_id is None:
+            futures = [self.remote_endpoint_operation_async(endpoint_id, input, True, output_length)
+                       for (endpoint_id, input, output_length) in operations]
+            return [future.result() for future in futures]
+
+        results = []
+        while len(results) < len(operations):
+            # Pack as many operations as fit into one request
+            request = bytes()
+            output_lengths = []
+            for (endpoint_id, input, output_length) in operations[len(results):]:
+                input = bytes(input or b'')
+                item = struct.pack('<HBB', endpoint_id, len(input), output_length) + input
+                if len(request) + len(item) > MAX_BATCH_REQUEST_SIZE:
+                    break
+                request += item
+                output_lengths.append(output_length)
+            if not output_lengths:
+                raise Exception("operation too large for a batch")
+
+            response = self.remote_endpoint_operation(self._batch_endpoint_id, request, True, sum(output_lengths))
+
+            # The device stops at the first operation whose output does not
+            # fit into its response. The remaining ones are sent again.
+            handled = 0
+            for output_length in output_lengths:
+                if len(response) < output_length:
+                    break
+                results.append(response[:output_length])
+                response = response[output_length:]
+                handled += 1
+            if handled == 0:
+                raise Exception("device did not handle any operation of the batch")
+        return results
+
+    def register_stream_handler(self, stream_id, handler):
+        """
+        Registers a function that is called with the payload of every
+        device-initiated packet of the specified stream. Pass None to unregister.
+        """
+        if handler is None:
+            self._stream_handlers.pop(stream_id, None)
+        else:
+            self._stream_handlers[stream_id] = handler
 
     def process_packet(self, packet):
         #print("process packet")
@@ -343,12 +532,20 @@ class Channel(PacketSink):
 
         seq_no = struct.unpack('<H', packet[0:2])[0]
 
-        if (seq_no & 0x8000):
+        if (seq_no & 0x8000) and not (seq_no & 0x80):
+            # Device-initiated packet. Requests always have bit 7 set so
+            # these never collide with responses.
+            handler = self._stream_handlers.get(seq_no & 0x7fff, None)
+            if handler:
+                handler(packet[2:])
+
+        elif (seq_no & 0x8000):
             seq_no &= 0x7fff
-            ack_signal = self._expected_acks.get(seq_no, None)
-            if (ack_signal):
-                self._responses[seq_no] = packet[2:]
-                ack_signal.set()
+            with self._sender_wakeup:
+                request = self._outstanding_requests.pop(seq_no, None)
+                self._sender_wakeup.notify() # the window has space for another request
+            if request:
+                request.future.set_result(packet[2:])
                 #print("received ack for packet " + str(seq_no))
             else:
                 print("received unexpected ACK: " + str(seq_no))
@@ -6,6 +6,7 @@ import sys
 import json
 import struct
 import threading
+import concurrent.futures
 import fibre.protocol
 
 class ObjectDefinitionError(Exception):
@@ -30,6 +31,20 @@ class StructCodec():
         value = value[0] if len(value) == 1 else value
         return self._target_type(value)
 
+def _map_future(future, func):
+    """
+    Returns a concurrent.futures.Future that resolves to func(result) of the
+    specified future
+    """
+    mapped = concurrent.futures.Future()
+    def on_done(future):
+        try:
+            mapped.set_result(func(future.result()))
+        except Exception as ex:
+            mapped.set_exception(ex)
+    future.add_done_callback(on_done)
+    return mapped
+
 class RemoteProperty():
     """
     Used internally by dynamically created objects to translate
@@ -77,6 +92,37 @@ class RemoteProperty():
         # TODO: Currenly we wait for an ack here. Settle on the default guarantee.
         self._parent.__channel__.remote_endpoint_operation(self._id, buffer, True, 0)
 
+    def get_value_async(self):
+        """
+        Starts reading the value without waiting for the response.
+        Returns a concurrent.futures.Future of the value.
+        """
+        future = self._parent.__channel__.remote_endpoint_operation_async(self._id, None, True, self._codec.get_length())
+        return _map_future(future, self._codec.deserialize)
+
+    def set_value_async(self, value):
+        """
+        Starts writing the value without waiting for the acknowledgement.
+        Returns a concurrent.futures.Future that resolves once the device acknowledged the write.
+        """
+        buffer = self._codec.serialize(value)
+        future = self._parent.__channel__.remote_endpoint_operation_async(self._id, buffer, True, 0)
+        return _map_future(future, lambda _: None)
+
+    def get_value_asyncio(self):
+        """
+        Same as get_value_async() but returns an asyncio future of the value
+        """
+        import asyncio
+        return asyncio.wrap_future(self.get_value_async())
+
+    def set_value_asyncio(self, value):
+        """
+        Same as set_value_async() but returns an asyncio future
+        """
+        import asyncio
+        return asyncio.wrap_future(self.set_value_async(value))
+
     def _dump(self):
         if self._name == "serial_number":
             # special case: serial number should be displayed in hex (TODO: generalize)
@@ -166,6 +212,30 @@ class RemoteFunction(object):
     def _dump(self):
         return "{}({})".format(self._name, ", ".join("{}: {}".format(x._name, x._property_type.__name__) for x in self._inputs))
 
+class RemoteBuffer(object):
+    """
+    Represents a read-only block of remote memory that is downloaded in one go
+    """
+    def __init__(self, json_data, parent):
+        self._parent = parent
+        id_str = json_data.get("id", None)
+        if id_str is None:
+            raise ObjectDefinitionError("unspecified endpoint ID")
+        self._id = int(id_str)
+
+        self._name = json_data.get("name", None)
+        if self._name is None:
+            self._name = "[anonymous]"
+
+    def read(self, length=None):
+        """
+        Reads the whole buffer, or only the first length bytes
+        """
+        return self._parent.__channel__.remote_endpoint_read_buffer(self._id, length)
+
+    def _dump(self):
+        return "{} (buffer)".format(self._name)
+
 class RemoteObject(object):
     """
     Object with functions and properties that map to remote endpoints
@@ -198,6 +268,11 @@ class RemoteObject(object):
                     attribute = RemoteObject(member_json, self, channel, logger)
                 elif type_str == "function":
                     attribute = RemoteFunction(member_json, self)
+                elif type_str == "buffer":
+                    attribute = RemoteBuffer(member_json, self)
+                elif type_str == "batch":
+                    channel._batch_endpoint_id = int(member_json["id"])
+                    continue
                 elif type_str != None:
                     attribute = RemoteProperty(member_json, self)
                 else:
@@ -262,3 +337,56 @@ class RemoteObject(object):
         for k in self._remote_attributes.keys():
             self.__dict__.pop(k)
         self._remote_attributes = {}
+
+
+def read_properties(properties):
+    """
+    Reads the values of several properties (RemoteProperty objects, e.g.
+    obj._remote_attributes['pos_estimate']) in as few round trips as possible.
+    All properties must belong to the same device.
+    The values that arrive in the same response packet are read atomically
+    on the device (about 30 bytes of values per packet), the packets of a
+    larger request are not atomic with respect to each other.
+    """
+    if not properties:
+        return []
+    channel = properties[0].__channel__
+    buffers = channel.remote_endpoint_batch([(p._id, None, p._codec.get_length()) for p in properties])
+    return [p._codec.deserialize(buffer) for (p, buffer) in zip(properties, buffers)]
+
+def write_properties(properties_and_values):
+    """
+    Writes several properties in as few round trips as possible.
+    properties_and_values: list of (RemoteProperty, value) tuples of the same device
+    """
+    if not properties_and_values:
+        return
+    channel = properties_and_values[0][0].__channel__
+    channel.remote_endpoint_batch([(p._id, p._codec.serialize(value), 0) for (p, value) in properties_and_values])
+
+def snapshot(obj):
+    """
+    Reads all readable properties of a remote object and its sub-objects in
+    as few round trips as possible.
+    Returns a nested dict that mirrors the object tree.
+    The snapshot is not taken at a single point in time: it spans many batch
+    packets and only the values within one packet are consistent with each
+    other (see read_properties).
+    """
+    properties = []
+    def collect(obj, path):
+        for (name, attr) in obj._remote_attributes.items():
+            if isinstance(attr, RemoteObject):
+                collect(attr, path + [name])
+            elif isinstance(attr, RemoteProperty) and attr._can_read:
+                properties.append((path + [name], attr))
+    collect(obj, [])
+
+    result = {}
+    values = read_properties([p for (_, p) in properties])
+    for ((path, _), value) in zip(properties, values):
+        node = result
+        for name in path[:-1]:
+            node = node.setdefault(name, {})
+        node[path[-1]] = value
+    return result
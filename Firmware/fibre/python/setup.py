@@ -76,7 +76,9 @@ setup(
   license='MIT',
   url = 'https://github.com/samuelsadok/fibre',
   keywords = ['communication', 'transport-layer', 'rpc'],
-  install_requires = [],
+  install_requires = [
+    'futures; python_version < "3"', # Backport of concurrent.futures
+  ],
   #package_data={'': ['version.txt']},
   classifiers = [],
 )
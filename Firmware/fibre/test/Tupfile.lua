@@ -13,6 +13,21 @@ unit_tests = define_package{
     sources={'run_tests.cpp'}
 }
 
+crc_benchmark = define_package{
+    packages={fibre_package},
+    sources={'crc_benchmark.cpp'}
+}
+
+client_benchmark = define_package{
+    packages={fibre_package},
+    sources={'client_benchmark.cpp'}
+}
+
+tcp_load_benchmark = define_package{
+    packages={fibre_package},
+    sources={'tcp_load_benchmark.cpp'}
+}
+
 
 toolchain=GCCToolchain('', 'build', {'-O3', '-fvisibility=hidden', '-frename-registers', '-funroll-loops'}, {})
 toolchain=GCCToolchain('', 'build', {'-O3', '-g', '-Wall'}, {})
@@ -23,5 +38,8 @@ toolchain=GCCToolchain('', 'build', {'-O3', '-g', '-Wall'}, {})
 
 if tup.getconfig("BUILD_FIBRE_TESTS") == "true" then
 	build_executable('test_server', test_server, toolchain)
+	build_executable('crc_benchmark', crc_benchmark, toolchain)
+	build_executable('client_benchmark', client_benchmark, toolchain)
+	build_executable('tcp_load_benchmark', tcp_load_benchmark, toolchain)
 	--build_executable('run_tests', unit_tests, toolchain)
 end
@@ -0,0 +1,138 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include <fibre/client.hpp>
+#include <fibre/posix_client.hpp>
+
+// Tests the client library against test_server and measures the latency and
+// throughput of the different kinds of requests.
+// Usage: client_benchmark [host] [port]
+
+#define N_LATENCY_SAMPLES   2000
+#define N_ASYNC_OPERATIONS  20000
+#define N_BATCH_RUNS        2000
+#define BATCH_SIZE          12
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static bool check(bool condition, const char* what) {
+    if (!condition)
+        printf("  FAILED: %s\n", what);
+    return condition;
+}
+
+static bool test_device(RemoteDevice& device) {
+    RemoteProperty<float> property1 = device.get_property<float>("property1");
+    RemoteProperty<float> property2 = device.get_property<float>("property2");
+    float value1 = 0, value2 = 0, result = 0;
+
+    bool ok = check(property1.valid() && property2.valid(), "find properties")
+           && check(!device.get_property<uint32_t>("property1").valid(), "reject type mismatch")
+           && check(property1.set(1.5f) == 0 && property1.get(&value1) == 0 && value1 == 1.5f, "set/get property1")
+           && check(device.call_with_result<float>("set_both", &result, 1.0f, 2.0f) == 0 && result == 3.0f, "call set_both")
+           && check(device.call("set_both", 1.0f) == CLIENT_ERROR_INVALID_ARGUMENT, "reject wrong argument count");
+    if (!ok)
+        return false;
+
+    BatchRequest batch = device.make_batch();
+    batch.read(property1, &value1);
+    batch.read(property2, &value2);
+    ok = check(batch.run() == 0 && value1 == 1.0f && value2 == 2.0f, "batch read");
+
+    std::atomic<int> n_done{0};
+    std::atomic<bool> async_ok{true};
+    property2.set_async(4.0f);
+    property2.get_async([&](int status, float value) {
+        async_ok = async_ok && status == 0 && value == 4.0f;
+        n_done++;
+    });
+    auto start = std::chrono::steady_clock::now();
+    while (n_done < 1 && seconds_since(start) < 1.0)
+        std::this_thread::yield();
+    return ok && check(n_done == 1 && async_ok, "async write then read");
+}
+
+static void benchmark_device(RemoteDevice& device, ClientChannel& channel) {
+    RemoteProperty<float> property1 = device.get_property<float>("property1");
+    RemoteProperty<float> property2 = device.get_property<float>("property2");
+    float value;
+
+    // blocking requests, one at a time
+    std::vector<double> latencies;
+    for (unsigned i = 0; i < N_LATENCY_SAMPLES; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        property1.get(&value);
+        latencies.push_back(seconds_since(start) * 1e6);
+    }
+    std::sort(latencies.begin(), latencies.end());
+    double mean = 0;
+    for (double latency : latencies)
+        mean += latency / latencies.size();
+    printf("  blocking:  %8.1f us mean, %8.1f us p50, %8.1f us p99\n",
+           mean, latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100]);
+
+    // pipelined requests, limited by the window of outstanding requests
+    std::atomic<unsigned> n_done{0};
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < N_ASYNC_OPERATIONS; ++i)
+        property1.get_async([&n_done](int, float) { n_done++; });
+    while (n_done < N_ASYNC_OPERATIONS && seconds_since(start) < 10.0)
+        std::this_thread::yield();
+    printf("  pipelined: %8.0f ops/s\n", n_done / seconds_since(start));
+
+    // batches of reads
+    BatchRequest batch = device.make_batch();
+    for (unsigned i = 0; i < BATCH_SIZE; ++i)
+        batch.read(i & 1 ? property2 : property1, &value);
+    start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < N_BATCH_RUNS; ++i)
+        batch.run();
+    printf("  batched:   %8.0f ops/s (%u reads per batch)\n",
+           N_BATCH_RUNS * BATCH_SIZE / seconds_since(start), BATCH_SIZE);
+    printf("  %u requests resent, %u unexpected responses\n",
+           channel.resent_cnt_, channel.unexpected_response_cnt_);
+}
+
+static bool run(const char* name, PosixClientTransport& transport) {
+    printf("%s:\n", name);
+    RemoteDevice device(transport.channel());
+    if (!check(device.connect() == 0, "download JSON descriptor"))
+        return false;
+    printf("  %zu endpoints, JSON CRC 0x%04x, %s\n", device.endpoint_table().endpoints().size(),
+           device.json_crc(), device.endpoint_table().batch_endpoint_id_ >= 0 ? "batch endpoint" : "no batch endpoint");
+    if (!test_device(device))
+        return false;
+    benchmark_device(device, transport.channel());
+    return true;
+}
+
+int main(int argc, const char** argv) {
+    const char* host = argc > 1 ? argv[1] : "localhost";
+    unsigned int port = argc > 2 ? atoi(argv[2]) : 9910;
+
+    TCPClientTransport tcp;
+    if (tcp.connect(host, port)) {
+        printf("could not connect to %s:%u, is test_server running?\n", host, port);
+        return -1;
+    }
+    UDPClientTransport udp;
+    if (udp.connect(host, port)) {
+        printf("could not connect to %s:%u\n", host, port);
+        return -1;
+    }
+
+    if (!run("TCP", tcp) || !run("UDP", udp)) {
+        printf("some tests failed\n");
+        return -1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,95 @@
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <chrono>
+#include <initializer_list>
+
+#include <fibre/crc.hpp>
+
+// Same polynomials and init values as the canonical framing in protocol.hpp
+constexpr unsigned CRC8_POLYNOMIAL = 0x37;
+constexpr unsigned CRC16_POLYNOMIAL = 0x3d65;
+constexpr uint8_t CRC8_INIT = 0x42;
+constexpr uint16_t CRC16_INIT = 0x1337;
+
+template<typename T, unsigned POLYNOMIAL>
+T calc_crc_reference(T remainder, const uint8_t* buffer, size_t length) {
+    while (length--)
+        remainder = calc_crc_bitwise<T, POLYNOMIAL>(remainder, *(buffer++));
+    return remainder;
+}
+
+// Checks the table driven implementation against the bitwise algorithm
+// for every possible remainder and byte.
+template<typename T, unsigned POLYNOMIAL>
+bool crc_test(const char* name) {
+    for (unsigned remainder = 0; remainder < (1u << (CHAR_BIT * sizeof(T))); ++remainder) {
+        for (unsigned value = 0; value < 256; ++value) {
+            T expected = calc_crc_bitwise<T, POLYNOMIAL>(remainder, value);
+            T actual = calc_crc<T, POLYNOMIAL>(remainder, value);
+            if (expected != actual) {
+                printf("%s: remainder 0x%x, byte 0x%02x: expected 0x%x but got 0x%x\n",
+                        name, remainder, value, (unsigned)expected, (unsigned)actual);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+template<typename TFunc>
+double benchmark(TFunc func, const uint8_t* buffer, size_t length, size_t packet_size) {
+    auto start = std::chrono::steady_clock::now();
+    unsigned sum = 0;
+    for (size_t offset = 0; offset + packet_size <= length; offset += packet_size)
+        sum += func(buffer + offset, packet_size);
+    auto end = std::chrono::steady_clock::now();
+    volatile unsigned sink = sum; // keep the calculation from being optimized away
+    (void) sink;
+    double seconds = std::chrono::duration<double>(end - start).count();
+    return (double)length / seconds / 1e6;
+}
+
+int main(void) {
+    bool test_result = crc_test<uint8_t, CRC8_POLYNOMIAL>("crc8")
+                    && crc_test<uint16_t, CRC16_POLYNOMIAL>("crc16");
+    if (!test_result) {
+        printf("some tests failed\n");
+        return -1;
+    }
+
+    const size_t length = 16 * 1024 * 1024;
+    uint8_t* buffer = (uint8_t*)malloc(length);
+    for (size_t i = 0; i < length; ++i)
+        buffer[i] = rand();
+
+    if (calc_crc16<CRC16_POLYNOMIAL>(CRC16_INIT, buffer, length)
+            != calc_crc_reference<uint16_t, CRC16_POLYNOMIAL>(CRC16_INIT, buffer, length)) {
+        printf("crc16 mismatch\n");
+        return -1;
+    }
+
+    printf("%-10s %12s %16s %16s\n", "crc", "packet size", "bitwise [MB/s]", "table [MB/s]");
+    for (size_t packet_size : { 3, 64, 1024 }) {
+        double crc8_bitwise = benchmark([](const uint8_t* buf, size_t len) {
+            return calc_crc_reference<uint8_t, CRC8_POLYNOMIAL>(CRC8_INIT, buf, len);
+        }, buffer, length, packet_size);
+        double crc8_table = benchmark([](const uint8_t* buf, size_t len) {
+            return calc_crc8<CRC8_POLYNOMIAL>(CRC8_INIT, buf, len);
+        }, buffer, length, packet_size);
+        printf("%-10s %12zu %16.1f %16.1f\n", "crc8", packet_size, crc8_bitwise, crc8_table);
+
+        double crc16_bitwise = benchmark([](const uint8_t* buf, size_t len) {
+            return calc_crc_reference<uint16_t, CRC16_POLYNOMIAL>(CRC16_INIT, buf, len);
+        }, buffer, length, packet_size);
+        double crc16_table = benchmark([](const uint8_t* buf, size_t len) {
+            return calc_crc16<CRC16_POLYNOMIAL>(CRC16_INIT, buf, len);
+        }, buffer, length, packet_size);
+        printf("%-10s %12zu %16.1f %16.1f\n", "crc16", packet_size, crc16_bitwise, crc16_table);
+    }
+
+    free(buffer);
+    printf("all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,210 @@
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include <fibre/client.hpp>
+#include <fibre/posix_client.hpp>
+
+// Simulates many clients of serve_on_tcp (e.g. test_server) on a single
+// thread. Each client keeps a few reads of property1 in flight and the
+// throughput and latency over all clients are measured.
+// Usage: tcp_load_benchmark [clients] [seconds] [host] [port]
+
+#define REQUESTS_IN_FLIGHT  4
+
+class SocketStreamSink : public StreamSink {
+public:
+    SocketStreamSink(int socket_fd) : socket_fd_(socket_fd) {}
+
+    int process_bytes(const uint8_t* buffer, size_t length, size_t* processed_bytes) final {
+        size_t sent = 0;
+        while (sent < length) {
+            ssize_t n_sent = send(socket_fd_, buffer + sent, length - sent, MSG_NOSIGNAL);
+            if (n_sent == -1 && errno == EINTR)
+                continue;
+            if (n_sent == -1)
+                break;
+            sent += n_sent;
+        }
+        if (processed_bytes)
+            *processed_bytes = sent;
+        return (sent == length) ? 0 : -1;
+    }
+
+    size_t get_free_space() final { return SIZE_MAX; }
+
+private:
+    int socket_fd_;
+};
+
+struct SimulatedClient {
+    SimulatedClient(int fd) :
+        socket_fd(fd),
+        socket_sink(fd),
+        packet_sink(socket_sink),
+        channel(packet_sink, REQUESTS_IN_FLIGHT),
+        segmenter(channel)
+    {}
+
+    int socket_fd;
+    SocketStreamSink socket_sink;
+    StreamBasedPacketSink packet_sink;
+    ClientChannel channel;
+    StreamToPacketSegmenter segmenter;
+    unsigned n_done = 0;
+    bool closed = false;
+};
+
+static uint16_t endpoint_id;
+static bool running = true;
+static std::vector<float> latencies;
+
+static int connect_to_server(const char* host, unsigned int port) {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    char port_str[8];
+    snprintf(port_str, sizeof(port_str), "%u", port);
+    struct addrinfo* results;
+    if (getaddrinfo(host, port_str, &hints, &results))
+        return -1;
+    int fd = -1;
+    for (struct addrinfo* ai = results; ai && fd == -1; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd != -1 && connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(results);
+    if (fd != -1) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+// Called again from the completion handler, so the channel never blocks
+static void start_request(SimulatedClient* client) {
+    auto start = std::chrono::steady_clock::now();
+    int status = client->channel.start_operation(endpoint_id, nullptr, 0, sizeof(float), true,
+        [client, start](int status, const uint8_t*, size_t) {
+            if (status)
+                return;
+            latencies.push_back(std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count() * 1e6f);
+            client->n_done++;
+            if (running)
+                start_request(client);
+        });
+    if (status)
+        client->closed = true;
+}
+
+int main(int argc, const char** argv) {
+    unsigned n_clients = argc > 1 ? atoi(argv[1]) : 200;
+    double duration = argc > 2 ? atof(argv[2]) : 3.0;
+    const char* host = argc > 3 ? argv[3] : "localhost";
+    unsigned int port = argc > 4 ? atoi(argv[4]) : 9910;
+
+    // Get the endpoint ID and JSON CRC once with a regular client
+    uint16_t json_crc;
+    {
+        TCPClientTransport transport;
+        RemoteDevice device(transport.channel());
+        if (transport.connect(host, port) || device.connect()) {
+            printf("could not connect to %s:%u, is test_server running?\n", host, port);
+            return -1;
+        }
+        RemoteProperty<float> property1 = device.get_property<float>("property1");
+        if (!property1.valid()) {
+            printf("test_server has no property1\n");
+            return -1;
+        }
+        endpoint_id = property1.id();
+        json_crc = device.json_crc();
+    }
+
+    std::vector<std::unique_ptr<SimulatedClient>> clients;
+    std::vector<struct pollfd> pfds;
+    for (unsigned i = 0; i < n_clients; ++i) {
+        int fd = connect_to_server(host, port);
+        if (fd == -1) {
+            printf("connection %u failed: %s\n", i, strerror(errno));
+            return -1;
+        }
+        clients.emplace_back(new SimulatedClient(fd));
+        clients.back()->channel.set_json_crc(json_crc);
+        clients.back()->channel.resend_timeout_ms_ = 2000; // TCP doesn't lose packets
+        pfds.push_back({ fd, POLLIN, 0 });
+    }
+
+    latencies.reserve(1 << 22);
+    auto start = std::chrono::steady_clock::now();
+    for (auto& client : clients)
+        for (unsigned i = 0; i < REQUESTS_IN_FLIGHT; ++i)
+            start_request(client.get());
+
+    uint8_t buf[4096];
+    while (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < duration) {
+        int n_ready = poll(pfds.data(), pfds.size(), 10);
+        if (n_ready == -1 && errno != EINTR)
+            break;
+        for (size_t i = 0; i < clients.size() && n_ready > 0; ++i) {
+            if (!pfds[i].revents)
+                continue;
+            n_ready--;
+            ssize_t n_received = recv(pfds[i].fd, buf, sizeof(buf), 0);
+            if (n_received > 0) {
+                clients[i]->segmenter.process_bytes(buf, n_received, nullptr);
+            } else if (n_received == 0 || (errno != EINTR && errno != EAGAIN)) {
+                clients[i]->closed = true;
+                pfds[i].fd = -1; // ignored by poll from now on
+            }
+        }
+    }
+    running = false;
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    unsigned n_served = 0, n_rejected = 0, n_starved = 0;
+    size_t n_done = 0;
+    for (auto& client : clients) {
+        n_done += client->n_done;
+        if (client->n_done)
+            n_served++;
+        else if (client->closed)
+            n_rejected++;
+        else
+            n_starved++;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    printf("%u clients, %u requests in flight each, %.1f s\n", n_clients, REQUESTS_IN_FLIGHT, elapsed);
+    printf("  throughput: %10.0f ops/s\n", n_done / elapsed);
+    if (!latencies.empty())
+        printf("  latency:    %10.1f us p50, %10.1f us p99, %10.1f us max\n",
+               latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100], latencies.back());
+    printf("  %u clients served, %u connections rejected, %u clients starved\n",
+           n_served, n_rejected, n_starved);
+
+    for (auto& client : clients)
+        close(client->socket_fd);
+
+    if (!n_served || n_starved) {
+        printf("some tests failed\n");
+        return -1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}
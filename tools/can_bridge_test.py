@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+#
+# Tests the ODrive CAN protocol over Linux SocketCAN.
+#
+# Usage:
+# On a virtual bus, against a simulated ODrive (no hardware needed):
+#   sudo modprobe vcan
+#   sudo ip link add dev vcan0 type vcan && sudo ip link set up vcan0
+#   ./can_bridge_test.py --interface vcan0 --simulate
+#
+# Against a real ODrive with <odrv>.config.enable_can = True and
+# <odrv>.config.can_node_id = 5 (axes idle):
+#   ./can_bridge_test.py --interface can0 --node-id 5
+# Add --sync-period 0.01 if the ODrive is the time master with
+# <odrv>.config.can_sync_period = 10.
+
+import sys
+import time
+import argparse
+
+from odrive.enums import *
+from odrive.can import SocketCanBus, CanNode, SimulatedNode, SyncClock
+
+def test_assert_eq(observed, expected, accuracy=0, name="value"):
+    if abs(observed - expected) > accuracy:
+        raise Exception("{} is {}, expected {} +/- {}".format(name, observed, expected, accuracy))
+
+def wait_for(node, predicate, timeout=1.0):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        node.update(timeout=0.01)
+        if predicate():
+            return
+    raise Exception("timed out")
+
+def run_tests(bus, node_id, feedback_period, sync_period, simulated):
+    print("scanning for heartbeats...")
+    nodes = bus.scan()
+    print("nodes on the bus: " + ", ".join("{} (serial {:012X})".format(n, s) for n, s in nodes.items()))
+    if node_id not in nodes:
+        raise Exception("node {} did not send a heartbeat".format(node_id))
+
+    node = CanNode(bus, node_id)
+
+    print("checking the feedback rate...")
+    count = 0
+    start = time.monotonic()
+    while time.monotonic() - start < 1.0:
+        frame = bus.recv(0.1)
+        if frame and node.process_frame(*frame) and frame[0] == 0x180 + node_id:
+            count += 1
+    test_assert_eq(count, 1.0 / feedback_period, accuracy=0.2 / feedback_period, name="axis0 feedback frames per second")
+    if 'pos_estimate' not in node.feedback[1] or 'current_state' not in node.feedback[1]:
+        raise Exception("no feedback from axis1")
+
+    print("checking commands...")
+    for axis in range(2):
+        node.clear_errors(axis)
+        node.set_requested_state(axis, AXIS_STATE_IDLE)
+        wait_for(node, lambda: node.feedback[axis].get('current_state') == AXIS_STATE_IDLE
+                               and node.feedback[axis].get('error') == 0)
+
+    if simulated:
+        print("checking setpoints...")
+        node.set_control_mode(1, CTRL_MODE_POSITION_CONTROL)
+        node.set_setpoint(1, 12345.0, vel_ff=1.5, current_ff=-2.25)
+        # the status frame with Iq_measured comes less often than the feedback
+        wait_for(node, lambda: node.feedback[1].get('pos_estimate') == 12345.0
+                               and node.feedback[1].get('Iq_measured') == -2.25)
+        test_assert_eq(node.feedback[1]['vel_estimate'], 1.5, accuracy=0.01, name="vel_ff")
+        test_assert_eq(node.feedback[1]['Iq_measured'], -2.25, accuracy=0.01, name="current_ff")
+        node.set_control_mode(0, CTRL_MODE_VELOCITY_CONTROL)
+        node.set_setpoint(0, -500.0)
+        wait_for(node, lambda: node.feedback[0].get('vel_estimate') == -500.0)
+
+    if sync_period:
+        print("checking SYNC frames...")
+        clock = SyncClock(bus)
+        clock.update(timeout=1.0)
+        if len(clock.intervals) < 0.5 / sync_period:
+            raise Exception("received only {} SYNC intervals".format(len(clock.intervals)))
+        mean_interval = sum(clock.intervals) / len(clock.intervals)
+        test_assert_eq(mean_interval, sync_period * 1e6, accuracy=0.2 * sync_period * 1e6, name="mean SYNC interval [us]")
+        start = clock.now() + 200000
+        node.set_traj_start_time(0, start)
+        if simulated:
+            deadline = time.monotonic() + 1.0
+            while simulated.traj_start_time[0] != start:
+                if time.monotonic() > deadline:
+                    raise Exception("trajectory start time was not received")
+                time.sleep(0.01)
+
+    print("all tests passed")
+
+
+parser = argparse.ArgumentParser(description='Tests the ODrive CAN protocol over SocketCAN.')
+parser.add_argument('--interface', default='vcan0', help='SocketCAN interface')
+parser.add_argument('--node-id', type=int, default=5, help='node ID of the ODrive under test')
+parser.add_argument('--feedback-period', type=float, default=0.02,
+                    help='expected period of the feedback frames [s] (<odrv>.config.can_feedback_period)')
+parser.add_argument('--sync-period', type=float, default=None,
+                    help='expected period of the SYNC frames [s] (<odrv>.config.can_sync_period) if the ODrive is the time master')
+parser.add_argument('--simulate', action='store_true', help='simulate the ODrive on the same interface')
+args = parser.parse_args()
+
+simulated_node = None
+if args.simulate:
+    simulated_node = SimulatedNode(SocketCanBus(args.interface), args.node_id,
+                                   feedback_period=args.feedback_period,
+                                   sync_period=args.sync_period or 0)
+    simulated_node.start()
+
+bus = SocketCanBus(args.interface)
+try:
+    run_tests(bus, args.node_id, args.feedback_period, args.sync_period, simulated_node)
+except Exception as ex:
+    print("test failed: " + str(ex))
+    sys.exit(1)
+finally:
+    if simulated_node:
+        simulated_node.stop()
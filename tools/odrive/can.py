@@ -0,0 +1,352 @@
+"""
+Host side of the ODrive CAN protocol (see the description at the top of
+Firmware/communication/interface_can.cpp), based on Linux SocketCAN.
+
+Example:
+
+    bus = SocketCanBus('can0')
+    print(bus.scan())  # {node_id: serial_number}
+    node = CanNode(bus, 5)
+    node.set_requested_state(0, AXIS_STATE_CLOSED_LOOP_CONTROL)
+    node.set_setpoint(0, 10000.0)
+    node.update(timeout=0.1)
+    print(node.feedback[0])
+
+Coordinated start of trajectories on several nodes, with one ODrive as the
+time master (<odrv>.config.can_sync_period = 10):
+
+    clock = SyncClock(bus)
+    clock.update(timeout=0.5)
+    start = clock.now() + 200000  # [us]
+    for node in nodes:
+        node.set_traj_start_time(0, start)
+        node.set_setpoint(0, goal)  # in CTRL_MODE_TRAJECTORY_CONTROL
+"""
+
+from __future__ import print_function
+
+import socket
+import struct
+import select
+import time
+import threading
+
+from odrive.enums import *
+
+CAN_FEEDBACK = (0x180, 0x380)
+CAN_STATUS = (0x280, 0x480)
+CAN_SETPOINT = (0x200, 0x300)
+CAN_COMMAND = 0x400
+CAN_HEARTBEAT = 0x700
+CAN_SYNC = 0x080
+
+CAN_CMD_SET_REQUESTED_STATE = 0x01
+CAN_CMD_CLEAR_ERRORS = 0x02
+CAN_CMD_SET_CONTROL_MODE = 0x03
+CAN_CMD_SET_TRAJ_START_TIME = 0x04
+
+COMPONENT_ERROR_MOTOR = 0x01
+COMPONENT_ERROR_ENCODER = 0x02
+COMPONENT_ERROR_CONTROLLER = 0x04
+COMPONENT_ERROR_SENSORLESS_ESTIMATOR = 0x08
+
+_FEEDBACK = struct.Struct('<ff')
+_STATUS = struct.Struct('<fHBB')
+_SETPOINT = struct.Struct('<fhh')
+_COMMAND = struct.Struct('<BBBxI')
+_HEARTBEAT = struct.Struct('<Q')
+_SYNC = struct.Struct('<IBB2x')
+
+def _clamp_int16(value):
+    return max(-0x8000, min(0x7fff, int(round(value))))
+
+def encode_setpoint(setpoint, vel_ff=0.0, current_ff=0.0):
+    """
+    Encodes a setpoint frame. vel_ff is in turns/s, current_ff in A.
+    The meaning of setpoint depends on the control mode of the axis.
+    """
+    return _SETPOINT.pack(setpoint, _clamp_int16(vel_ff * 100), _clamp_int16(current_ff * 100))
+
+def decode_setpoint(data):
+    setpoint, vel_ff, current_ff = _SETPOINT.unpack(data)
+    return setpoint, vel_ff * 0.01, current_ff * 0.01
+
+def encode_command(axis, opcode, argument=0, time=0):
+    """
+    Encodes a command frame. time [us] is only used by CAN_CMD_SET_TRAJ_START_TIME.
+    """
+    return _COMMAND.pack(axis, opcode, argument, time & 0xffffffff)
+
+def decode_command(data):
+    return _COMMAND.unpack(data)
+
+def encode_sync(prev_time, prev_seq, seq):
+    """
+    Encodes a SYNC frame: the sync time [us] at which the previous SYNC frame
+    was sent, its sequence number and the sequence number of this frame.
+    """
+    return _SYNC.pack(prev_time & 0xffffffff, prev_seq & 0xff, seq & 0xff)
+
+def decode_sync(data):
+    return _SYNC.unpack(data)
+
+def encode_feedback(pos_estimate, vel_estimate):
+    return _FEEDBACK.pack(pos_estimate, vel_estimate)
+
+def decode_feedback(data):
+    pos_estimate, vel_estimate = _FEEDBACK.unpack(data)
+    return {'pos_estimate': pos_estimate, 'vel_estimate': vel_estimate}
+
+def encode_status(Iq_measured, error, current_state, component_errors):
+    return _STATUS.pack(Iq_measured, error, current_state, component_errors)
+
+def decode_status(data):
+    Iq_measured, error, current_state, component_errors = _STATUS.unpack(data)
+    return {'Iq_measured': Iq_measured, 'error': error,
+            'current_state': current_state, 'component_errors': component_errors}
+
+
+class SocketCanBus(object):
+    """
+    Raw CAN socket on a SocketCAN interface (e.g. "can0" or "vcan0").
+    Only standard (11 bit) IDs are used.
+    """
+    _FRAME = struct.Struct('=IB3x8s')
+
+    def __init__(self, interface):
+        self._socket = socket.socket(socket.AF_CAN, socket.SOCK_RAW, socket.CAN_RAW)
+        self._socket.bind((interface,))
+
+    def send(self, can_id, data):
+        data = bytes(data)
+        self._socket.send(self._FRAME.pack(can_id, len(data), data.ljust(8, b'\x00')))
+
+    def recv(self, timeout=None):
+        """
+        Returns the next frame as (can_id, data) or None if no frame
+        arrives within the timeout [s].
+        """
+        readable, _, _ = select.select([self._socket], [], [], timeout)
+        if not readable:
+            return None
+        can_id, length, data = self._FRAME.unpack(self._socket.recv(self._FRAME.size))
+        return can_id & socket.CAN_SFF_MASK, data[:length]
+
+    def scan(self, duration=1.5):
+        """
+        Listens for heartbeats for the specified duration [s] and returns
+        a dict that maps the node IDs on the bus to their serial numbers.
+        """
+        nodes = {}
+        deadline = time.monotonic() + duration
+        while True:
+            remaining = deadline - time.monotonic()
+            if remaining <= 0:
+                return nodes
+            frame = self.recv(remaining)
+            if frame and (frame[0] & 0x780) == CAN_HEARTBEAT and len(frame[1]) == 8:
+                nodes[frame[0] & 0x7f] = _HEARTBEAT.unpack(frame[1])[0]
+
+    def close(self):
+        self._socket.close()
+
+
+class CanNode(object):
+    """
+    Client for one ODrive on the bus. Received feedback is kept in
+    feedback[axis] and updated by update().
+    """
+    def __init__(self, bus, node_id):
+        self._bus = bus
+        self.node_id = node_id
+        self.feedback = [{}, {}]
+        self.last_heartbeat = None
+
+    def set_setpoint(self, axis, setpoint, vel_ff=0.0, current_ff=0.0):
+        self._bus.send(CAN_SETPOINT[axis] + self.node_id, encode_setpoint(setpoint, vel_ff, current_ff))
+
+    def set_requested_state(self, axis, state):
+        self._bus.send(CAN_COMMAND + self.node_id, encode_command(axis, CAN_CMD_SET_REQUESTED_STATE, state))
+
+    def clear_errors(self, axis):
+        self._bus.send(CAN_COMMAND + self.node_id, encode_command(axis, CAN_CMD_CLEAR_ERRORS))
+
+    def set_control_mode(self, axis, mode):
+        self._bus.send(CAN_COMMAND + self.node_id, encode_command(axis, CAN_CMD_SET_CONTROL_MODE, mode))
+
+    def set_traj_start_time(self, axis, sync_time):
+        """
+        Makes the next trajectory setpoint of the axis start at the specified
+        sync time [us] instead of immediately (see SyncClock).
+        """
+        self._bus.send(CAN_COMMAND + self.node_id,
+                       encode_command(axis, CAN_CMD_SET_TRAJ_START_TIME, time=sync_time))
+
+    def process_frame(self, can_id, data):
+        """
+        Updates the feedback from a received frame. Returns False if the frame
+        is not from this node.
+        """
+        if (can_id & 0x7f) != self.node_id:
+            return False
+        function = can_id & 0x780
+        for axis in range(2):
+            if function == CAN_FEEDBACK[axis]:
+                self.feedback[axis].update(decode_feedback(data))
+            elif function == CAN_STATUS[axis]:
+                self.feedback[axis].update(decode_status(data))
+        if function == CAN_HEARTBEAT:
+            self.last_heartbeat = time.monotonic()
+        return True
+
+    def update(self, timeout=0.0):
+        """
+        Processes all frames that arrive within the timeout [s].
+        """
+        deadline = time.monotonic() + timeout
+        while True:
+            frame = self._bus.recv(max(0.0, deadline - time.monotonic()))
+            if frame is None:
+                return
+            self.process_frame(*frame)
+
+
+class SyncClock(object):
+    """
+    Follows the sync time of the time master on the bus. The host only
+    timestamps the SYNC frames in software, so now() is good to about a
+    millisecond, which is enough to schedule coordinated starts. The
+    ODrives themselves follow the master much more closely.
+    """
+    def __init__(self, bus):
+        self._bus = bus
+        self._last_rx = None  # (sequence number, host time [s]) of the last SYNC frame
+        self._ref = None  # (sync time [us], host time [s]) of a SYNC frame
+        self.intervals = []  # [us] between the SYNC frames, as sent by the master
+
+    def process_frame(self, can_id, data):
+        if can_id != CAN_SYNC or len(data) != 8:
+            return False
+        prev_time, prev_seq, seq = decode_sync(data)
+        if self._last_rx and self._last_rx[0] == prev_seq:
+            if self._ref:
+                self.intervals.append((prev_time - self._ref[0]) & 0xffffffff)
+            self._ref = (prev_time, self._last_rx[1])
+        self._last_rx = (seq, time.monotonic())
+        return True
+
+    def update(self, timeout=0.0):
+        deadline = time.monotonic() + timeout
+        while True:
+            frame = self._bus.recv(max(0.0, deadline - time.monotonic()))
+            if frame is None:
+                return
+            self.process_frame(*frame)
+
+    def now(self):
+        """
+        Returns the current sync time [us] or None if no SYNC frames were received.
+        """
+        if not self._ref:
+            return None
+        return (self._ref[0] + int((time.monotonic() - self._ref[1]) * 1e6)) & 0xffffffff
+
+
+class SimulatedNode(object):
+    """
+    Device side of the protocol for tests without hardware, e.g. on a
+    virtual SocketCAN bus (vcan). Setpoints are applied immediately to the
+    simulated position/velocity/current. With a sync_period [s] the node is
+    the time master and sends SYNC frames.
+    """
+    def __init__(self, bus, node_id, serial_number=0x123456789abc, feedback_period=0.02, status_period=0.1, sync_period=0):
+        self._bus = bus
+        self.node_id = node_id
+        self.serial_number = serial_number
+        self.feedback_period = feedback_period
+        self.status_period = status_period
+        self.sync_period = sync_period
+        self._sync_seq = 0
+        self._sync_tx_time = None
+        self.traj_start_time = [None, None]
+        self.axes = [{'pos_estimate': 0.0, 'vel_estimate': 0.0, 'Iq_measured': 0.0,
+                      'error': 0, 'current_state': AXIS_STATE_IDLE, 'component_errors': 0,
+                      'control_mode': CTRL_MODE_POSITION_CONTROL} for _ in range(2)]
+        self._stop = threading.Event()
+        self._thread = None
+
+    def handle_frame(self, can_id, data):
+        if (can_id & 0x7f) != self.node_id or len(data) != 8:
+            return
+        function = can_id & 0x780
+        for i, axis in enumerate(self.axes):
+            if function == CAN_SETPOINT[i]:
+                setpoint, vel_ff, current_ff = decode_setpoint(data)
+                if axis['control_mode'] in (CTRL_MODE_POSITION_CONTROL, CTRL_MODE_TRAJECTORY_CONTROL):
+                    axis['pos_estimate'], axis['vel_estimate'], axis['Iq_measured'] = setpoint, vel_ff, current_ff
+                elif axis['control_mode'] == CTRL_MODE_VELOCITY_CONTROL:
+                    axis['vel_estimate'], axis['Iq_measured'] = setpoint, current_ff
+                elif axis['control_mode'] == CTRL_MODE_CURRENT_CONTROL:
+                    axis['Iq_measured'] = setpoint
+        if function == CAN_COMMAND:
+            axis_idx, opcode, argument, cmd_time = decode_command(data)
+            if axis_idx >= len(self.axes):
+                return
+            axis = self.axes[axis_idx]
+            if opcode == CAN_CMD_SET_REQUESTED_STATE:
+                axis['current_state'] = argument
+            elif opcode == CAN_CMD_CLEAR_ERRORS:
+                axis['error'] = axis['component_errors'] = 0
+            elif opcode == CAN_CMD_SET_CONTROL_MODE:
+                axis['control_mode'] = argument
+            elif opcode == CAN_CMD_SET_TRAJ_START_TIME:
+                self.traj_start_time[axis_idx] = cmd_time
+
+    def send_feedback(self):
+        for i, axis in enumerate(self.axes):
+            self._bus.send(CAN_FEEDBACK[i] + self.node_id,
+                           encode_feedback(axis['pos_estimate'], axis['vel_estimate']))
+
+    def send_status(self):
+        for i, axis in enumerate(self.axes):
+            self._bus.send(CAN_STATUS[i] + self.node_id,
+                           encode_status(axis['Iq_measured'], axis['error'],
+                                         axis['current_state'], axis['component_errors']))
+
+    def send_sync(self):
+        # The time at which a frame went out is taken right after sending it
+        # and sent with the next frame, like the firmware does.
+        prev_seq = self._sync_seq if self._sync_tx_time is not None else self._sync_seq + 1
+        self._sync_seq = (self._sync_seq + 1) & 0xff
+        self._bus.send(CAN_SYNC, encode_sync(self._sync_tx_time or 0, prev_seq, self._sync_seq))
+        self._sync_tx_time = int(time.monotonic() * 1e6) & 0xffffffff
+
+    def _run(self):
+        next_heartbeat = next_feedback = next_status = next_sync = time.monotonic()
+        while not self._stop.is_set():
+            now = time.monotonic()
+            if now >= next_heartbeat:
+                self._bus.send(CAN_HEARTBEAT + self.node_id, _HEARTBEAT.pack(self.serial_number))
+                next_heartbeat += 1.0
+            if now >= next_feedback:
+                self.send_feedback()
+                next_feedback += self.feedback_period
+            if now >= next_status:
+                self.send_status()
+                next_status += self.status_period
+            if self.sync_period and now >= next_sync:
+                self.send_sync()
+                next_sync += self.sync_period
+            next_event = min(next_heartbeat, next_feedback, next_status, next_sync if self.sync_period else next_heartbeat)
+            frame = self._bus.recv(max(0.0, next_event - time.monotonic()))
+            if frame:
+                self.handle_frame(*frame)
+
+    def start(self):
+        self._thread = threading.Thread(target=self._run)
+        self._thread.daemon = True
+        self._thread.start()
+
+    def stop(self):
+        self._stop.set()
+        self._thread.join()
@@ -12,6 +12,8 @@ AXIS_STATE_ENCODER_OFFSET_CALIBRATION = 7
 AXIS_STATE_CLOSED_LOOP_CONTROL = 8
 AXIS_STATE_LOCKIN_SPIN = 9
 AXIS_STATE_ENCODER_DIR_FIND = 10
+AXIS_STATE_AUTOTUNE = 11
+AXIS_STATE_MECHANICAL_IDENTIFICATION = 12
 
 class errors:
     class axis:
@@ -56,6 +58,8 @@ class errors:
     class controller:
         ERROR_NONE = 0
         ERROR_OVERSPEED = 0x01
+        ERROR_AUTOTUNE_FAILED = 0x02
+        ERROR_IDENTIFICATION_FAILED = 0x04
 
 MOTOR_TYPE_HIGH_CURRENT = 0
 #MOTOR_TYPE_LOW_CURRENT = 1
@@ -67,5 +71,33 @@ CTRL_MODE_VELOCITY_CONTROL = 2
 CTRL_MODE_POSITION_CONTROL = 3
 CTRL_MODE_TRAJECTORY_CONTROL = 4
 
+FILTER_TYPE_NONE = 0
+FILTER_TYPE_LOWPASS = 1
+FILTER_TYPE_NOTCH = 2
+
+INPUT_SHAPER_NONE = 0
+INPUT_SHAPER_ZV = 1
+INPUT_SHAPER_ZVD = 2
+INPUT_SHAPER_EI = 3
+
+OSCILLOSCOPE_TRIGGER_MODE_IMMEDIATE = 0
+OSCILLOSCOPE_TRIGGER_MODE_RISING_EDGE = 1
+OSCILLOSCOPE_TRIGGER_MODE_FALLING_EDGE = 2
+OSCILLOSCOPE_TRIGGER_MODE_EITHER_EDGE = 3
+OSCILLOSCOPE_TRIGGER_MODE_ERROR_MASK = 4
+
+OSCILLOSCOPE_STATE_IDLE = 0
+OSCILLOSCOPE_STATE_PRE_TRIGGER = 1
+OSCILLOSCOPE_STATE_ARMED = 2
+OSCILLOSCOPE_STATE_POST_TRIGGER = 3
+OSCILLOSCOPE_STATE_DONE = 4
+
+EVENT_BOOT = 0
+EVENT_STATE_CHANGE = 1
+EVENT_AXIS_ERROR = 2
+EVENT_ENCODER_ERROR = 3
+EVENT_CONTROLLER_ERROR = 4
+EVENT_NONE = 0xff
+
 ENCODER_MODE_INCREMENTAL = 0
 ENCODER_MODE_HALL = 1
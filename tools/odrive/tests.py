@@ -96,6 +96,16 @@ def clear_errors(axis_ctx: AxisTestContext):
     axis_ctx.handle.motor.error = 0
     axis_ctx.handle.sensorless_estimator.error = 0
 
+def watch_errors(axis_ctx: AxisTestContext):
+    """
+    Subscribes to the axis error, which is also set when one of the submodules
+    fails. Returns a list that receives every reported value and a function
+    that stops watching.
+    """
+    axis_errors = []
+    stop = odrive.utils.subscribe(axis_ctx.handle._remote_attributes['error'], axis_errors.append)
+    return axis_errors, stop
+
 def test_assert_no_error(axis_ctx: AxisTestContext):
     errors = get_errors(axis_ctx)
     if len(errors) > 0:
@@ -114,6 +124,14 @@ def run(command_line, logger, timeout=None):
         logger.error(result.stdout.decode(sys.stdout.encoding))
         raise TestFailed("command {} failed".format(command_line))
 
+def wait_for_state(axis_ctx: AxisTestContext, state, timeout):
+    """
+    Waits for the axis to enter the specified state without polling it
+    """
+    current_state = axis_ctx.handle._remote_attributes['current_state']
+    if not odrive.utils.wait_for_value(current_state, lambda value: value == state, timeout):
+        raise TestFailed("axis did not enter state {} within {} s".format(state, timeout))
+
 def request_state(axis_ctx: AxisTestContext, state, expect_success=True):
     axis_ctx.handle.requested_state = state
     time.sleep(0.001)
@@ -321,8 +339,7 @@ class TestMotorCalibration(AxisTest):
         logger.debug("motor calibration (takes about 4.5 seconds)")
         axis_ctx.handle.motor.config.pole_pairs = axis_ctx.yaml['motor-pole-pairs']
         request_state(axis_ctx, AXIS_STATE_MOTOR_CALIBRATION)
-        time.sleep(6)
-        test_assert_eq(axis_ctx.handle.current_state, AXIS_STATE_IDLE)
+        wait_for_state(axis_ctx, AXIS_STATE_IDLE, timeout=6)
         test_assert_no_error(axis_ctx)
         test_assert_eq(axis_ctx.handle.motor.config.phase_resistance, axis_ctx.yaml['motor-phase-resistance'], accuracy=0.2)
         test_assert_eq(axis_ctx.handle.motor.config.phase_inductance, axis_ctx.yaml['motor-phase-inductance'], accuracy=0.5)
@@ -355,8 +372,7 @@ class TestEncoderOffsetCalibration(AxisTest):
         axis_ctx.handle.encoder.config.cpr = axis_ctx.yaml['encoder-cpr'] # TODO: test setting a wrong CPR
         request_state(axis_ctx, AXIS_STATE_ENCODER_OFFSET_CALIBRATION)
         # TODO: ensure the encoder calibration doesn't do crap
-        time.sleep(11)
-        test_assert_eq(axis_ctx.handle.current_state, AXIS_STATE_IDLE)
+        wait_for_state(axis_ctx, AXIS_STATE_IDLE, timeout=11)
         test_assert_no_error(axis_ctx)
         test_assert_eq(axis_ctx.handle.motor.config.direction, axis_ctx.yaml['motor-direction'])
         axis_ctx.handle.encoder.config.pre_calibrated = True
@@ -473,6 +489,9 @@ class TestHighVelocity(AxisTest):
         ramp_up_time = 15.0
         max_measured_vel = 0.0
         logger.debug("ramping to {} over {} s".format(rated_limit, ramp_up_time))
+        # The device reports errors as they occur, so the loop does not need
+        # to read all error properties on every iteration
+        axis_errors, stop_watching = watch_errors(axis_ctx)
         t_0 = time.monotonic()
         last_print = t_0
         while True:
@@ -497,7 +516,9 @@ class TestHighVelocity(AxisTest):
             measured_vel = axis_ctx.handle.encoder.vel_estimate
             max_measured_vel = max(measured_vel, max_measured_vel)
             test_assert_eq(measured_vel, expected_velocity, range=vel_range)
-            test_assert_no_error(axis_ctx)
+            if any(axis_errors):
+                stop_watching()
+                test_assert_no_error(axis_ctx)
 
             # log progress
             if time.monotonic() - last_print > 1:
@@ -506,6 +527,7 @@ class TestHighVelocity(AxisTest):
 
             time.sleep(0.001)
 
+        stop_watching()
         logger.debug("reached top speed of {} counts/sec".format(max_measured_vel))
 
         if self._brake:
@@ -600,6 +622,8 @@ class TestSelfLoadedPosVelDistribution(DualAxisTest):
         test_duration = 20.0 #s
         num_cycles = 3.0 # number of spiral "rotations"
 
+        driver_errors, stop_watching_driver = watch_errors(driver_ctx)
+        load_errors, stop_watching_load = watch_errors(load_ctx)
         t_0 = time.monotonic()
         t_ratio = 0
         last_print = t_0
@@ -616,8 +640,8 @@ class TestSelfLoadedPosVelDistribution(DualAxisTest):
             load_ctx.handle.motor.config.current_lim = Iload_mag
             load_ctx.handle.controller.set_vel_setpoint(Iload_sign * load_max_speed, 0)
 
-            test_assert_no_error(driver_ctx)
-            test_assert_no_error(load_ctx)
+            if any(driver_errors) or any(load_errors):
+                break
 
             # log progress
             if time.monotonic() - last_print > 1:
@@ -626,6 +650,8 @@ class TestSelfLoadedPosVelDistribution(DualAxisTest):
 
             time.sleep(1/command_rate)
 
+        stop_watching_driver()
+        stop_watching_load()
         request_state(load_ctx, AXIS_STATE_IDLE)
         request_state(driver_ctx, AXIS_STATE_IDLE)
         test_assert_no_error(driver_ctx)
@@ -139,16 +139,235 @@ def print_drv_regs(name, motor):
     print("Control Reg 1: " + str(ctrl_reg_1) + " (" + format(ctrl_reg_1, '#013b') + ")")
     print("Control Reg 2: " + str(ctrl_reg_2) + " (" + format(ctrl_reg_2, '#09b') + ")")
 
+def read_oscilloscope(odrv):
+    """
+    Downloads the last oscilloscope capture and returns one list of values
+    per channel, in chronological order.
+    """
+    import struct
+    num_channels = odrv.oscilloscope.num_channels
+    num_frames = odrv.oscilloscope.num_frames
+    start_index = odrv.oscilloscope.start_index
+    buffer = odrv.oscilloscope.data.read()
+    values = struct.unpack('<{}f'.format(len(buffer) // 4), buffer[:len(buffer) // 4 * 4])
+    capacity = len(values) // num_channels
+    channels = [[] for _ in range(num_channels)]
+    for i in range(num_frames):
+        frame = ((start_index + i) % capacity) * num_channels
+        for c in range(num_channels):
+            channels[c].append(values[frame + c])
+    return channels
+
 def show_oscilloscope(odrv):
-    size = 18000
-    values = []
-    for i in range(size):
-        values.append(odrv.get_oscilloscope_val(i))
+    """
+    Plots the last oscilloscope capture. Configure the capture in
+    odrv.oscilloscope.config and start it with odrv.oscilloscope.start().
+    """
+    from odrive.enums import OSCILLOSCOPE_STATE_DONE
+    if odrv.oscilloscope.state != OSCILLOSCOPE_STATE_DONE:
+        print("the oscilloscope capture has not completed yet")
+        return
+    channels = read_oscilloscope(odrv)
+    pre_trigger_frames = odrv.oscilloscope.config.pre_trigger_frames
 
     import matplotlib.pyplot as plt
-    plt.plot(values)
+    for i, values in enumerate(channels):
+        plt.plot([x - pre_trigger_frames for x in range(len(values))], values, label="channel{}".format(i))
+    plt.axvline(0, color='gray', linestyle='--')
+    plt.legend()
     plt.show()
 
+def read_flight_recorder(axis):
+    """
+    Downloads the flight recorder of the specified axis and returns the
+    recorded control cycles, oldest first.
+    The timestamps are in CPU cycles relative to the interrupt entry.
+    """
+    import struct
+    sample_format = '<IIIIBBHfff'
+    sample_size = struct.calcsize(sample_format)
+    head = axis.flight_recorder.head
+    buffer = axis.flight_recorder.samples.read()
+    samples = [struct.unpack_from(sample_format, buffer, i) for i in range(0, len(buffer) - sample_size + 1, sample_size)]
+    samples = samples[head+1:] + samples[:head+1]
+    result = []
+    for (loop_counter, isr_entry, thread_wake, enqueue, state, armed_state, motor_error, pos_setpoint, vel_setpoint, current_setpoint) in samples:
+        if isr_entry == 0:
+            continue # never recorded
+        result.append({
+            'loop_counter': loop_counter,
+            'thread_wake': (thread_wake - isr_entry) & 0xffffffff if thread_wake else None,
+            'enqueue': (enqueue - isr_entry) & 0xffffffff if enqueue else None,
+            'state': state,
+            'armed_state': armed_state,
+            'motor_error': motor_error,
+            'pos_setpoint': pos_setpoint,
+            'vel_setpoint': vel_setpoint,
+            'current_setpoint': current_setpoint
+        })
+    return result
+
+def read_event_log(odrv):
+    """
+    Downloads the event log, oldest first. This includes the events that
+    were not written to flash yet.
+    Each event is a dict with the boot count, the timestamp in ms since
+    that boot, the axis number (None for system events), the event code
+    (EVENT_* in odrive.enums) and two data words.
+    """
+    import struct
+    from odrive.enums import EVENT_NONE
+    event_format = '<IHBBII'
+    event_size = struct.calcsize(event_format)
+    ram_size = 32 # EventLog::RAM_SIZE
+
+    log = odrv.event_log
+    head = log.head
+    flushed = log.flushed
+    num_flushed = log.num_flushed
+    buffer = log.flash.read(num_flushed * event_size)
+    ram = log.ram.read()
+    for i in range(flushed, head):
+        slot = i % ram_size
+        buffer += ram[slot*event_size:(slot+1)*event_size]
+
+    result = []
+    for offset in range(0, len(buffer) - event_size + 1, event_size):
+        (timestamp, boot_count, axis, code, data0, data1) = struct.unpack_from(event_format, buffer, offset)
+        if code == EVENT_NONE:
+            continue # incompletely written
+        result.append({
+            'boot_count': boot_count,
+            'timestamp': timestamp,
+            'axis': None if axis == 0xff else axis,
+            'code': code,
+            'data': (data0, data1)
+        })
+    return result
+
+TELEMETRY_STREAM_ID = 0x0001
+
+def start_telemetry(odrv, callback):
+    """
+    Starts streaming the endpoints configured in odrv.telemetry.config over
+    the native USB interface. For every received frame, callback is invoked
+    with the frame sequence number, the timestamp of the first sample in
+    control cycles and a list of samples, each a list with one value per channel.
+    Gaps in the sequence number indicate dropped frames.
+    Returns a function that stops the stream.
+    """
+    import struct
+    num_channels = odrv.telemetry.config.num_channels
+    channel = odrv.__channel__
+
+    def handle_frame(payload):
+        seq_no, timestamp = struct.unpack_from('<HI', payload, 0)
+        values = struct.unpack_from('<{}f'.format((len(payload) - 6) // 4), payload, 6)
+        samples = [list(values[i:i+num_channels]) for i in range(0, len(values), num_channels)]
+        callback(seq_no, timestamp, samples)
+
+    channel.register_stream_handler(TELEMETRY_STREAM_ID, handle_frame)
+    if not odrv.telemetry.start():
+        channel.register_stream_handler(TELEMETRY_STREAM_ID, None)
+        raise Exception("invalid telemetry config")
+
+    def stop():
+        odrv.telemetry.stop()
+        channel.register_stream_handler(TELEMETRY_STREAM_ID, None)
+    return stop
+
+NOTIFICATION_STREAM_ID = 0x0002
+
+def subscribe(prop, callback, min_interval=0):
+    """
+    Invokes callback with the new value whenever the value of a property
+    changes, without polling it. The current value is reported right away.
+    Values are sent at most once every min_interval milliseconds, the latest
+    value is always delivered. Only works over the native USB interface.
+    prop: a RemoteProperty, e.g. odrv0.axis0._remote_attributes['current_state']
+    Returns a function that cancels the subscription.
+    """
+    import struct
+    channel = prop.__channel__
+    root = prop._parent
+    while root.__parent__ is not None:
+        root = root.__parent__
+
+    handlers = getattr(channel, '_notification_handlers', None)
+    if handlers is None:
+        handlers = channel._notification_handlers = {}
+        def handle_packet(payload):
+            offset = 2 # skip sequence number
+            while offset + 3 <= len(payload):
+                endpoint_id, length = struct.unpack_from('<HB', payload, offset)
+                offset += 3
+                for handler in list(handlers.get(endpoint_id, [])):
+                    handler(payload[offset:offset+length])
+                offset += length
+        channel.register_stream_handler(NOTIFICATION_STREAM_ID, handle_packet)
+
+    handler = lambda buffer: callback(prop._codec.deserialize(buffer))
+    handlers.setdefault(prop._id, []).append(handler)
+    index = root.notifications.subscribe(prop, min_interval)
+    if index < 0:
+        handlers[prop._id].remove(handler)
+        raise Exception("cannot subscribe to {}: not a property or no free subscription".format(prop._name))
+
+    def unsubscribe():
+        root.notifications.unsubscribe(index)
+        handlers[prop._id].remove(handler)
+    return unsubscribe
+
+def wait_for_value(prop, predicate, timeout=None):
+    """
+    Blocks until predicate(value) is true for the value of a property or the
+    timeout [s] elapses. See subscribe().
+    Returns True if the condition was met.
+    """
+    condition_met = threading.Event()
+    def on_change(value):
+        if predicate(value):
+            condition_met.set()
+    unsubscribe = subscribe(prop, on_change)
+    try:
+        return condition_met.wait(timeout)
+    finally:
+        unsubscribe()
+
+def watch_errors(odrv, callback=None):
+    """
+    Reports errors of the axes and their submodules as soon as they occur.
+    By default the errors are printed like in dump_errors.
+    callback: invoked with the module name, e.g. 'axis0.motor', and the error code
+    Returns a function that stops watching.
+    """
+    module_decode_map = {'axis': errors.axis, 'motor': errors.motor,
+        'encoder': errors.encoder, 'controller': errors.controller}
+
+    def print_error(name, error):
+        errorcodes = module_decode_map[name.split('.')[-1].rstrip('0123456789')]
+        print(name + ": " + _VT100Colors['red'] + "Error(s):" + _VT100Colors['default'])
+        for codename, codeval in errorcodes.__dict__.items():
+            if 'ERROR_' in codename and error & codeval != 0:
+                print("    " + codename)
+
+    callback = callback or print_error
+    unsubscribers = []
+    for axis_name, axis in odrv._remote_attributes.items():
+        if 'axis' not in axis_name:
+            continue
+        modules = [(axis_name, axis)] + [(axis_name + '.' + name, getattr(axis, name)) for name in ['motor', 'encoder', 'controller']]
+        for name, remote_obj in modules:
+            def on_change(value, name=name):
+                if value != 0:
+                    callback(name, value)
+            unsubscribers.append(subscribe(remote_obj._remote_attributes['error'], on_change, min_interval=10))
+
+    def stop():
+        for unsubscribe in unsubscribers:
+            unsubscribe()
+    return stop
+
 def rate_test(device):
     """
     Tests how many integers per second can be transmitted
@@ -168,6 +387,16 @@ def rate_test(device):
     FramePerSec = loopsPerSec/loopsPerFrame
     print("Frames per second: " + str(FramePerSec))
 
+    # Same with several requests in flight at a time
+    print("reading 10000 values (pipelined)...")
+    loop_counter = device.axis0._remote_attributes['loop_counter']
+    futures = [loop_counter.get_value_async() for _ in range(numFrames)]
+    vals = [future.result() for future in futures]
+
+    loopsPerFrame = (vals[-1] - vals[0])/numFrames
+    FramePerSec = loopsPerSec/loopsPerFrame
+    print("Frames per second: " + str(FramePerSec))
+
     # plt.plot(vals)
     # plt.show(block=True)
 
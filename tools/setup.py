@@ -117,6 +117,7 @@ try:
       'IntelHex', # Used to by DFU to download firmware from github
       'matplotlib', # Required to run the liveplotter
       'monotonic', # For compatibility with older python versions
+      'futures; python_version < "3"', # Backport of concurrent.futures, used by fibre
       'pywin32 >= 222; platform_system == "Windows"' # Required for fancy terminal features on Windows
     ],
     package_data={'': ['version.txt']},